@@ -0,0 +1,235 @@
+/*!
+ * \file mdc2250/aggregate.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides rolling statistics of decoded telemetry over fixed windows.
+ */
+
+#ifndef MDC2250_AGGREGATE_H
+#define MDC2250_AGGREGATE_H
+
+// Standard Library Headers
+#include <cstddef>
+#include <stdint.h>
+
+// Boost Headers
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+
+// MDC2250 Headers
+#include "mdc2250/decode.h"
+#include "mdc2250/seqlock.h"
+#include "mdc2250/telemetry.h"
+
+namespace mdc2250 {
+
+namespace aggregate_windows {
+  /*!
+   * The windows every signal is aggregated over.
+   */
+  typedef enum {
+    milliseconds_100,
+    seconds_1,
+    seconds_10
+  } AggregateWindow;
+} // aggregate_windows namespace
+
+// Number of windows, see mdc2250::aggregate_windows
+const size_t aggregate_window_count = 3;
+// Number of buckets each window is divided into
+const size_t aggregate_buckets = 10;
+// Largest number of signals which can be aggregated at once
+const size_t max_aggregate_signals = 8;
+
+/*!
+ * Returns the length of a window in microseconds.
+ */
+uint64_t aggregate_window_us(aggregate_windows::AggregateWindow window);
+
+/*!
+ * Statistics of one signal over one window.
+ */
+struct WindowStatistics {
+  // Number of samples in the window, the rest is 0 if there are none
+  uint64_t samples;
+  double min;
+  double max;
+  double mean;
+  // Root mean square
+  double rms;
+  // Change per second from the oldest to the newest sample of the window
+  double rate;
+};
+
+/*!
+ * The rolling statistics of one signal.
+ */
+struct AggregateSnapshot {
+  queries::QueryType type;
+  uint32_t channel;
+  // Indexed by mdc2250::aggregate_windows::AggregateWindow, as of now_us
+  WindowStatistics windows[aggregate_window_count];
+  // Newest sample and its receive time, see mdc2250::monotonic_usec, when
+  // the telemetry stops these stay while the windows empty
+  double latest;
+  uint64_t stamp_us;
+  // The time the windows end at, stamp_us is that far behind
+  uint64_t now_us;
+  // Number of samples since the signal was added
+  uint64_t samples;
+};
+
+/*!
+ * Keeps the min, max, mean, RMS and rate of change of selected channels of
+ * the decoded telemetry over 100 ms, 1 s and 10 s windows.
+ * 
+ * Each window is split into ten buckets by receive time.  A sample only 
+ * updates the newest bucket, so the cost per sample is constant and no 
+ * samples are kept.  A window covers its length of full buckets and the one
+ * being filled, so up to a tenth more than its length.
+ * 
+ * Samples are expected from a single thread, normally the listener thread,
+ * and each signal's buckets are published through a SeqLock so any thread
+ * can read them with getSnapshot without blocking the listener.  The reader
+ * totals the buckets still inside each window at the time it asks, so when
+ * the telemetry stops or is reconfigured the windows empty out instead of 
+ * holding their last figures.
+ */
+class TelemetryAggregator {
+public:
+  TelemetryAggregator();
+
+  /*!
+   * Starts aggregating one channel of a type of response.
+   * 
+   * Signals may be added while samples are being fed.
+   * 
+   * \param type QueryType of the responses, e.g. queries::motor_amps.
+   * \param channel size_t index of the value in the response, from 0.
+   * 
+   * \return size_t the index of the signal, for getSnapshot.
+   * 
+   * \throws std::invalid_argument if the type has no values, the channel 
+   * is out of range or max_aggregate_signals are already aggregated.
+   */
+  size_t addSignal(queries::QueryType type, size_t channel);
+
+  /*!
+   * Removes every signal, this must not be called while samples are fed.
+   */
+  void clear();
+
+  /*!
+   * Returns the number of signals being aggregated.
+   */
+  size_t size() const {
+    return this->size_.load(boost::memory_order_acquire);
+  }
+
+  /*!
+   * Aggregates the decoded values of a response.
+   * 
+   * \param type QueryType of the response.
+   * \param values The decoded values of the response, one per channel.
+   * \param count The number of values.
+   * \param stamp_us The time the response was received in microseconds.
+   */
+  void update(queries::QueryType type, const long *values, size_t count,
+              uint64_t stamp_us);
+
+  /*!
+   * Returns the statistics of a signal over the windows ending now.
+   * 
+   * Samples older than a window are left out of it, so a window with no 
+   * samples means nothing was received for that long.
+   * 
+   * \throws std::invalid_argument if there is no such signal.
+   */
+  AggregateSnapshot getSnapshot(size_t signal) const;
+
+  /*!
+   * Returns the statistics of a signal over the windows ending at now_us,
+   * in microseconds like the receive times of the samples.
+   * 
+   * \throws std::invalid_argument if there is no such signal.
+   */
+  AggregateSnapshot getSnapshot(size_t signal, uint64_t now_us) const;
+
+private:
+  struct Bucket {
+    // Receive time divided by the bucket length, plus one, 0 if unused
+    uint64_t id;
+    uint64_t samples;
+    double sum;
+    double sum_squares;
+    double min;
+    double max;
+    double first;
+    uint64_t first_us;
+  };
+
+  struct Window {
+    uint64_t bucket_us;
+    // The newest bucket is at current
+    Bucket buckets[aggregate_buckets + 1];
+    size_t current;
+  };
+
+  // What the listener publishes, the statistics are computed by readers
+  struct State {
+    Window windows[aggregate_window_count];
+    double latest;
+    uint64_t stamp_us;
+    uint64_t samples;
+  };
+
+  struct Signal {
+    queries::QueryType type;
+    size_t channel;
+    State state;
+    SeqLock<State> published;
+  };
+
+  static void add_sample_(Window &window, double value, uint64_t stamp_us);
+  static void statistics_(const Window &window, double latest,
+                          uint64_t stamp_us, uint64_t now_us,
+                          WindowStatistics &result);
+
+  // Serializes addSignal and clear, update does not take it
+  boost::mutex mutex_;
+  Signal signals_[max_aggregate_signals];
+  boost::atomic<size_t> size_;
+  // Bit per QueryType with at least one signal
+  boost::atomic<uint64_t> type_mask_;
+};
+
+} // mdc2250 namespace
+
+#endif
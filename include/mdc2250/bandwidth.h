@@ -0,0 +1,106 @@
+/*!
+ * \file mdc2250/bandwidth.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides estimates of the serial link bandwidth used by telemetry and
+ * commands, so configurations can be checked against the link capacity.
+ */
+
+#ifndef MDC2250_BANDWIDTH_H
+#define MDC2250_BANDWIDTH_H
+
+// Standard Library Headers
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// MDC2250 Headers
+#include "mdc2250/decode.h"
+
+namespace mdc2250 {
+
+/*!
+ * Utilization of the serial link, rates are in bytes per second.
+ * 
+ * Each direction of the link is full duplex, so they are budgeted 
+ * separately.  The receive direction carries the telemetry as well as the 
+ * echo and acknowledgement of every command, so it saturates first.
+ */
+struct LinkUtilization {
+  // Capacity of each direction, the baud rate over 10 bits per byte (8N1)
+  double capacity;
+  // Expected receive rate of the active telemetry, see setTelemetry
+  double telemetry;
+  // Measured rate of commands and queries written, urgent ones included
+  double commands;
+  // Expected receive rate of the echoes and acknowledgements of commands
+  double command_replies;
+  // Measured rates
+  double sent;
+  double received;
+  // Fraction of the capacity used in each direction, the receive side is 
+  // the expected telemetry plus the replies to the measured commands
+  double transmit_utilization;
+  double receive_utilization;
+};
+
+/*!
+ * Returns the longest response expected for a query, including the 
+ * terminating carriage return.
+ * 
+ * This is based on the number of channels of each query on the MDC2250 and 
+ * the widest value documented in the manual.
+ * 
+ * \param query mdc2250::queries::QueryType of the response.
+ * 
+ * \returns size_t length in bytes, a conservative guess for unknown queries.
+ */
+size_t response_length(queries::QueryType query);
+
+/*!
+ * Returns the expected receive rate of a telemetry configuration.
+ * 
+ * The motor controller sends one response of the list every period, so the 
+ * rate is the mean response length times the number of periods per second.
+ * 
+ * \param queries std::vector of query names as given to setTelemetry, 
+ * like "CR" or "V".
+ * \param period size_t period in milliseconds between responses.
+ * 
+ * \returns double bytes per second, 0 if there are no queries or the period 
+ * is 0.
+ */
+double telemetry_bandwidth(const std::vector<std::string> &queries,
+                           size_t period);
+
+} // mdc2250 namespace
+
+#endif
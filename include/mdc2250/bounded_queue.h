@@ -0,0 +1,179 @@
+/*!
+ * \file mdc2250/bounded_queue.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides a bounded, lock free, multiple producer queue of fixed size
+ * elements, used to hand data to the library's background threads without
+ * allocating memory.
+ */
+
+#ifndef MDC2250_BOUNDED_QUEUE_H
+#define MDC2250_BOUNDED_QUEUE_H
+
+// Standard Library Headers
+#include <cstddef>
+
+// Boost Headers
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
+
+namespace mdc2250 {
+
+/*!
+ * A bounded lock free queue, see Dmitry Vyukov's bounded MPMC queue.
+ * 
+ * Elements are filled and read in place: a producer claims a slot, fills 
+ * it and publishes it, and the consumer looks at the front slot and 
+ * releases it once done.  Any number of threads can produce, but only one 
+ * thread may consume.
+ * 
+ * Example:
+ * <pre>
+ *    size_t ticket;
+ *    Message *message = queue.claim(ticket);
+ *    if (message != NULL) {
+ *      message->... = ...;
+ *      queue.publish(ticket);
+ *    }
+ * </pre>
+ */
+template<typename T>
+class BoundedQueue {
+public:
+  /*!
+   * Constructs the queue.
+   * 
+   * \param capacity size_t number of elements, rounded up to a power of two.
+   */
+  explicit BoundedQueue(size_t capacity)
+  : enqueue_position_(0), dequeue_position_(0)
+  {
+    size_t size = 2;
+    while (size < capacity) {
+      size *= 2;
+    }
+    this->slots_.reset(new Slot[size]);
+    for (size_t i = 0; i < size; ++i) {
+      this->slots_[i].sequence.store(i, boost::memory_order_relaxed);
+    }
+    this->mask_ = size - 1;
+  }
+
+  /*!
+   * Claims the next slot for writing.
+   * 
+   * \param ticket size_t set to the ticket to pass to publish.
+   * 
+   * \returns T pointer to fill in, NULL if the queue is full.
+   */
+  T * claim(size_t &ticket) {
+    size_t position = this->enqueue_position_.load(boost::memory_order_relaxed);
+    while (true) {
+      Slot &slot = this->slots_[position & this->mask_];
+      size_t sequence = slot.sequence.load(boost::memory_order_acquire);
+      ptrdiff_t difference = (ptrdiff_t)sequence - (ptrdiff_t)position;
+      if (difference == 0) {
+        if (this->enqueue_position_.compare_exchange_weak(
+              position, position + 1, boost::memory_order_relaxed)) {
+          ticket = position;
+          return &slot.value;
+        }
+      } else if (difference < 0) {
+        return NULL;
+      } else {
+        position = this->enqueue_position_.load(boost::memory_order_relaxed);
+      }
+    }
+  }
+
+  /*!
+   * Makes a claimed slot visible to the consumer.
+   */
+  void publish(size_t ticket) {
+    this->slots_[ticket & this->mask_].sequence.store(
+      ticket + 1, boost::memory_order_release);
+  }
+
+  /*!
+   * Returns the oldest published element, only for the consumer.
+   * 
+   * \returns T pointer, NULL if the queue is empty or the oldest element is 
+   * still being filled.
+   */
+  T * front() {
+    size_t position = this->dequeue_position_.load(boost::memory_order_relaxed);
+    Slot &slot = this->slots_[position & this->mask_];
+    if (slot.sequence.load(boost::memory_order_acquire) != position + 1) {
+      return NULL;
+    }
+    return &slot.value;
+  }
+
+  /*!
+   * Releases the element returned by front, only for the consumer.
+   */
+  void pop() {
+    size_t position = this->dequeue_position_.load(boost::memory_order_relaxed);
+    this->slots_[position & this->mask_].sequence.store(
+      position + this->mask_ + 1, boost::memory_order_release);
+    this->dequeue_position_.store(position + 1, boost::memory_order_relaxed);
+  }
+
+  /*!
+   * Returns the number of claimed elements which have not been popped.
+   */
+  size_t size() const {
+    // Read the dequeue position first, since the consumer may pop between
+    // the two reads, and clamp as other threads may still see them race
+    size_t dequeued =
+      this->dequeue_position_.load(boost::memory_order_acquire);
+    size_t enqueued =
+      this->enqueue_position_.load(boost::memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+  }
+
+private:
+  BoundedQueue(const BoundedQueue &);
+  void operator=(const BoundedQueue &);
+
+  struct Slot {
+    boost::atomic<size_t> sequence;
+    T value;
+  };
+
+  boost::scoped_array<Slot> slots_;
+  size_t mask_;
+  boost::atomic<size_t> enqueue_position_;
+  boost::atomic<size_t> dequeue_position_;
+};
+
+} // mdc2250 namespace
+
+#endif
@@ -0,0 +1,111 @@
+/*!
+ * \file mdc2250/clock.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides a monotonic clock used to timestamp data received from
+ * the motor controller.
+ */
+
+#ifndef MDC2250_CLOCK_H
+#define MDC2250_CLOCK_H
+
+// Standard Library Headers
+#include <stdint.h>
+
+#if defined(_WIN32)
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+
+#if defined(__linux__)
+# include <cerrno>
+#else
+# include <boost/thread.hpp>
+#endif
+
+namespace mdc2250 {
+
+/*!
+ * Returns the current time of a monotonic clock in nanoseconds.
+ * 
+ * The epoch is unspecified, so the result is only useful for measuring
+ * durations and for comparing timestamps taken in the same process.
+ */
+inline uint64_t monotonic_nsec() {
+#if defined(_WIN32)
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (uint64_t)((double)counter.QuadPart * 1e9 /
+                    (double)frequency.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/*!
+ * Returns the current time of a monotonic clock in microseconds.
+ * 
+ * \see mdc2250::monotonic_nsec
+ */
+inline uint64_t monotonic_usec() {
+  return monotonic_nsec() / 1000ULL;
+}
+
+/*!
+ * Sleeps until the monotonic clock reaches the given time.
+ * 
+ * On Linux this sleeps until the absolute deadline with clock_nanosleep, so
+ * periodic loops do not drift with the time spent between sleeps.
+ * 
+ * \param deadline_ns uint64_t deadline in monotonic_nsec time.
+ */
+inline void sleep_until_nsec(uint64_t deadline_ns) {
+#if defined(__linux__)
+  struct timespec ts;
+  ts.tv_sec = (time_t)(deadline_ns / 1000000000ULL);
+  ts.tv_nsec = (long)(deadline_ns % 1000000000ULL);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+  {}
+#else
+  uint64_t now = monotonic_nsec();
+  if (deadline_ns > now) {
+    boost::this_thread::sleep(
+      boost::posix_time::microseconds((deadline_ns - now) / 1000));
+  }
+#endif
+}
+
+} // mdc2250 namespace
+
+#endif
@@ -0,0 +1,169 @@
+/*!
+ * \file mdc2250/config.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides pipelined reading and writing of configuration parameters,
+ * snapshots of them and the difference between two snapshots.
+ */
+
+#ifndef MDC2250_CONFIG_H
+#define MDC2250_CONFIG_H
+
+// Standard Library Headers
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+// MDC2250 Headers
+#include "mdc2250/decode.h"
+#include "mdc2250/mdc2250.h"
+#include "mdc2250/result.h"
+
+namespace mdc2250 {
+
+/*!
+ * Values of a set of configuration parameters, as read with "~NAME".
+ * 
+ * Each parameter maps to the ':' separated values of its response, one per 
+ * channel, so "~ALIM" answered with "ALIM=750:750" is stored as {750, 750}.
+ */
+struct ConfigSnapshot {
+  std::map<std::string, std::vector<long> > parameters;
+
+  /*!
+   * Returns true if the named parameter is in the snapshot.
+   */
+  bool has(const std::string &name) const {
+    return this->parameters.find(name) != this->parameters.end();
+  }
+};
+
+/*!
+ * One configuration value to be written.
+ */
+struct ConfigChange {
+  // Parameter name, without the '^'
+  std::string name;
+  // Channel starting at 1, or 0 for parameters with a single value
+  size_t channel;
+  long value;
+};
+
+/*!
+ * Returns the changes which turn current into desired.
+ * 
+ * Only parameters present in desired are considered, and only the channels 
+ * whose values differ, or which current is missing, are returned.
+ */
+std::vector<ConfigChange>
+diff_configuration(const ConfigSnapshot &current,
+                   const ConfigSnapshot &desired);
+
+/*!
+ * Formats the command which writes a change, like "^ALIM 1 750".
+ */
+std::string format_config_command(const ConfigChange &change);
+
+/*!
+ * Reads and writes configuration parameters with a window of requests in 
+ * flight, instead of waiting for each response before sending the next.
+ * 
+ * Requests go through the asynchronous interface of the MDC2250 class, so 
+ * the round trip is paid roughly once per window rather than once per 
+ * parameter.  The motor controller still answers in order.
+ * 
+ * Example:
+ * <pre>
+ *    mdc2250::Configurator configurator(my_mdc2250);
+ *    std::vector<std::string> names;
+ *    names.push_back("ALIM");
+ *    names.push_back("MXRPM");
+ *    mdc2250::ConfigSnapshot saved = configurator.read(names);
+ *    ...
+ *    configurator.restore(saved); // Writes only what changed since
+ * </pre>
+ */
+class Configurator {
+public:
+  /*!
+   * \param window size_t maximum number of requests in flight, limited to 
+   * mdc2250::max_async_requests.
+   */
+  Configurator(MDC2250 &mdc2250, size_t window = 8);
+
+  /*!
+   * Reads the named parameters into a snapshot.
+   * 
+   * \throws CommandFailedException if a parameter could not be read.
+   */
+  ConfigSnapshot read(const std::vector<std::string> &names);
+
+  /*!
+   * Like read, but returns the first failure instead of throwing.
+   */
+  Result tryRead(const std::vector<std::string> &names,
+                 ConfigSnapshot &snapshot);
+
+  /*!
+   * Writes the given changes.
+   * 
+   * \throws CommandFailedException if a change was not acknowledged.
+   */
+  void apply(const std::vector<ConfigChange> &changes);
+
+  /*!
+   * Like apply, but returns the first failure instead of throwing.
+   */
+  Result tryApply(const std::vector<ConfigChange> &changes);
+
+  /*!
+   * Reads the parameters of desired from the motor controller and writes 
+   * only the ones which differ.
+   * 
+   * \returns size_t the number of values written.
+   * 
+   * \throws CommandFailedException if reading or writing failed.
+   */
+  size_t restore(const ConfigSnapshot &desired);
+
+private:
+  // Issues the requests with at most window_ in flight, responses receives
+  // the response of each query in order
+  Result pipeline_(const std::vector<std::string> &requests, bool queries,
+                   std::vector<std::string> *responses);
+
+  MDC2250 &mdc2250_;
+  size_t window_;
+};
+
+} // mdc2250 namespace
+
+#endif
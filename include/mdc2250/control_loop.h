@@ -0,0 +1,181 @@
+/*!
+ * \file mdc2250/control_loop.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides a fixed period control loop executor which feeds the latest
+ * telemetry to a user step function and sends the resulting motor command.
+ */
+
+#ifndef MDC2250_CONTROL_LOOP_H
+#define MDC2250_CONTROL_LOOP_H
+
+// Standard Library Headers
+#include <string>
+#include <stdint.h>
+
+// Boost Headers
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+// MDC2250 Headers
+#include "mdc2250/mdc2250.h"
+#include "mdc2250/realtime.h"
+#include "mdc2250/seqlock.h"
+#include "mdc2250/telemetry.h"
+
+namespace mdc2250 {
+
+/*!
+ * The motor command produced by a control step.
+ */
+struct MotorCommand {
+  // Set to true by the step function to send the efforts below
+  bool send;
+  // Efforts between -1000 and 1000, see MDC2250::commandMotors
+  long motor1_effort;
+  long motor2_effort;
+};
+
+/*!
+ * This function type describes the prototype for a control step.
+ * 
+ * The function is given the latest telemetry and a MotorCommand, which is 
+ * cleared before every call, and it should set the command's send flag if 
+ * the efforts should be sent to the motor controller.
+ */
+typedef boost::function<void(const TelemetrySnapshot&, MotorCommand&)>
+  ControlStepCallback;
+
+/*!
+ * Timing statistics of a ControlLoop, all times are in nanoseconds.
+ */
+struct ControlLoopStatistics {
+  // Number of completed cycles
+  uint64_t cycles;
+  // Number of deadlines skipped because a cycle ran too long
+  uint64_t overruns;
+  // Number of motor commands which failed to be sent or acknowledged
+  uint64_t send_failures;
+  // Wake up time relative to the deadline
+  int64_t jitter_min;
+  int64_t jitter_max;
+  double jitter_mean;
+  // Time between consecutive wake ups
+  int64_t cycle_min;
+  int64_t cycle_max;
+  double cycle_mean;
+  // Time spent in the step function and sending its command
+  int64_t step_max;
+  double step_mean;
+};
+
+/*!
+ * Runs a control step at a fixed period against an MDC2250.
+ * 
+ * The loop sleeps until absolute deadlines (clock_nanosleep on Linux), so
+ * the period does not drift with the time spent in the step.  If a step
+ * overruns, the missed deadlines are skipped and counted rather than run
+ * back to back.
+ * 
+ * Example:
+ * <pre>
+ *    void step(const TelemetrySnapshot &telemetry, MotorCommand &command) {
+ *      command.motor1_effort = ...;
+ *      command.motor2_effort = ...;
+ *      command.send = true;
+ *    }
+ *    
+ *    mdc2250::ControlLoop loop(my_mdc2250, step);
+ *    loop.start(10000, mdc2250::ThreadOptions(80, 2));
+ * </pre>
+ */
+class ControlLoop {
+public:
+  ControlLoop(MDC2250 &mdc2250, ControlStepCallback step);
+  virtual ~ControlLoop();
+
+  /*!
+   * Starts the loop in a new thread.
+   * 
+   * \param period_us size_t period of the loop in microseconds.
+   * \param options ThreadOptions for the loop's thread.
+   * \param lock_memory bool true to lock the process' memory with mlockall
+   * before the loop starts.
+   * 
+   * \throws std::invalid_argument if period_us is 0.
+   * \throws std::runtime_error if the options could not be applied.
+   */
+  void start(size_t period_us,
+             const ThreadOptions &options = ThreadOptions(),
+             bool lock_memory = false);
+
+  /*!
+   * Stops the loop and waits for its thread to finish.
+   */
+  void stop();
+
+  /*!
+   * Returns true if the loop is running.
+   */
+  bool isRunning() const {
+    return this->running_;
+  }
+
+  /*!
+   * Returns the timing statistics, this never blocks the loop.
+   */
+  ControlLoopStatistics getStatistics() const {
+    return this->statistics_.load();
+  }
+
+private:
+  // Body of the loop's thread
+  void run_(ThreadOptions options, bool lock_memory);
+
+  MDC2250 &mdc2250_;
+  ControlStepCallback step_;
+  uint64_t period_ns_;
+
+  boost::thread thread_;
+  boost::atomic<bool> running_;
+
+  // Used to report the result of applying the thread options to start
+  boost::mutex startup_mutex_;
+  boost::condition_variable startup_condition_;
+  bool started_;
+  std::string startup_error_;
+
+  SeqLock<ControlLoopStatistics> statistics_;
+};
+
+} // mdc2250 namespace
+
+#endif
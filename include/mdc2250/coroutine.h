@@ -0,0 +1,222 @@
+/*!
+ * \file mdc2250/coroutine.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides C++20 awaitables over the asynchronous requests of the MDC2250
+ * class, so a coroutine can co_await a query, command or telemetry update
+ * without blocking a thread.  It is included by mdc2250/mdc2250.h when the
+ * compiler supports coroutines.
+ */
+
+#ifndef MDC2250_COROUTINE_H
+#define MDC2250_COROUTINE_H
+
+// Standard Library Headers
+#include <coroutine>
+#include <string>
+
+// Boost Headers
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+
+// MDC2250 Headers
+#include "mdc2250/mdc2250.h"
+#include "mdc2250/decode.h"
+
+namespace mdc2250 {
+
+/*!
+ * Result of an awaited query or command, with the raw response of a query.
+ */
+struct AsyncResponse {
+  Result result;
+  std::string response;
+
+  bool ok() const {
+    return this->result.ok();
+  }
+};
+
+/*!
+ * Result of an awaited telemetry update, with its decoded channels.
+ */
+struct TelemetryResult {
+  Result result;
+  TelemetryValue value;
+
+  bool ok() const {
+    return this->result.ok();
+  }
+};
+
+/*!
+ * Common part of the awaitables, resumes the awaiting coroutine from the
+ * listener thread when the request completes or times out.
+ * 
+ * A request which completes before await_suspend returns, like one failing
+ * because the controller is not connected, does not resume the coroutine 
+ * from within await_suspend: await_suspend returns false instead and the
+ * coroutine continues on the awaiting thread, so awaiting in a loop never 
+ * nests resumptions on the stack.
+ */
+class AsyncAwaitable {
+public:
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+protected:
+  AsyncAwaitable(MDC2250 &mdc2250, long timeout_ms)
+  : mdc2250_(mdc2250), timeout_ms_(timeout_ms), handed_off_(false)
+  {}
+
+  // Called once the request is issued, returns true if the coroutine stays
+  // suspended until complete_ resumes it
+  bool suspend_() {
+    return !this->handed_off_.exchange(true);
+  }
+
+  AsyncCallback callback_() {
+    return boost::bind(&AsyncAwaitable::complete_, this, _1, _2, _3);
+  }
+
+  void complete_(const Result &result, const char *response, size_t length) {
+    this->result_ = result;
+    if (length > 0) {
+      this->response_.assign(response, length);
+    }
+    // Whichever of complete_ and suspend_ comes second resumes
+    if (this->handed_off_.exchange(true)) {
+      this->handle_.resume();
+    }
+  }
+
+  MDC2250 &mdc2250_;
+  long timeout_ms_;
+  std::coroutine_handle<> handle_;
+  Result result_;
+  std::string response_;
+  boost::atomic<bool> handed_off_;
+};
+
+class QueryAwaitable : public AsyncAwaitable {
+public:
+  QueryAwaitable(MDC2250 &mdc2250, const std::string &query, long timeout_ms)
+  : AsyncAwaitable(mdc2250, timeout_ms), query_(query)
+  {}
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    this->handle_ = handle;
+    this->mdc2250_.asyncQuery(this->query_, this->callback_(),
+                              this->timeout_ms_);
+    return this->suspend_();
+  }
+
+  AsyncResponse await_resume() {
+    AsyncResponse response;
+    response.result = this->result_;
+    response.response.swap(this->response_);
+    return response;
+  }
+
+private:
+  std::string query_;
+};
+
+class CommandAwaitable : public AsyncAwaitable {
+public:
+  CommandAwaitable(MDC2250 &mdc2250, const std::string &command,
+                   long timeout_ms)
+  : AsyncAwaitable(mdc2250, timeout_ms), command_(command)
+  {}
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    this->handle_ = handle;
+    this->mdc2250_.asyncCommand(this->command_, this->callback_(),
+                                this->timeout_ms_);
+    return this->suspend_();
+  }
+
+  AsyncResponse await_resume() {
+    AsyncResponse response;
+    response.result = this->result_;
+    return response;
+  }
+
+private:
+  std::string command_;
+};
+
+class TelemetryAwaitable : public AsyncAwaitable {
+public:
+  TelemetryAwaitable(MDC2250 &mdc2250, queries::QueryType type,
+                     long timeout_ms)
+  : AsyncAwaitable(mdc2250, timeout_ms), type_(type)
+  {}
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    this->handle_ = handle;
+    this->mdc2250_.asyncNextTelemetry(this->type_, this->callback_(),
+                                      this->timeout_ms_);
+    return this->suspend_();
+  }
+
+  TelemetryResult await_resume() {
+    TelemetryResult telemetry;
+    telemetry.result = this->result_;
+    telemetry.value = TelemetryValue();
+    telemetry.value.count = (uint32_t)decode_channels(
+      this->response_.data(), this->response_.length(),
+      telemetry.value.values, max_telemetry_channels);
+    return telemetry;
+  }
+
+private:
+  queries::QueryType type_;
+};
+
+inline QueryAwaitable
+MDC2250::query(const std::string &query, long timeout_ms) {
+  return QueryAwaitable(*this, query, timeout_ms);
+}
+
+inline CommandAwaitable
+MDC2250::command(const std::string &command, long timeout_ms) {
+  return CommandAwaitable(*this, command, timeout_ms);
+}
+
+inline TelemetryAwaitable
+MDC2250::nextTelemetry(queries::QueryType type, long timeout_ms) {
+  return TelemetryAwaitable(*this, type, timeout_ms);
+}
+
+}
+
+#endif
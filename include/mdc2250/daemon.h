@@ -0,0 +1,318 @@
+/*!
+ * \file mdc2250/daemon.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides a daemon which shares one MDC2250 among many local clients over
+ * a Unix domain socket, the client side of it and their binary protocol.
+ */
+
+#ifndef MDC2250_DAEMON_H
+#define MDC2250_DAEMON_H
+
+// Standard Library Headers
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Boost Headers
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+// MDC2250 Headers
+#include "mdc2250/mdc2250.h"
+#include "mdc2250/result.h"
+
+namespace mdc2250 {
+
+namespace daemon_frames {
+  /*
+   * This is an enumeration of the frames exchanged with the daemon.
+   */
+  typedef enum {
+    // Client to daemon, answered with a reply of the same id
+    command = 1,      // text is a runtime or configuration command
+    query,            // text is a query, the reply carries the response
+    subscribe,        // text is a query like "CR", values[0] its period
+    unsubscribe,      // text is the query to stop receiving
+    motors,           // values are both efforts, priority arbitrates
+    release,          // gives up the motors
+    // Daemon to client
+    reply,            // code is a mdc2250::results::ResultCode
+    telemetry         // text is a telemetry response, id is 0
+  } FrameType;
+} // daemon_frames namespace
+
+/*!
+ * Longest text carried by a DaemonFrame.
+ */
+const size_t max_daemon_text_length = 64;
+
+/*!
+ * The fixed size unit of the daemon protocol, in host byte order since 
+ * both ends run on the same machine.
+ */
+struct DaemonFrame {
+  // Chosen by the client, echoed in the reply
+  uint32_t id;
+  // mdc2250::daemon_frames::FrameType
+  uint8_t type;
+  // For motors frames, a higher priority preempts a lower one
+  uint8_t priority;
+  // mdc2250::results::ResultCode of a reply
+  uint8_t code;
+  // Number of characters used in text
+  uint8_t length;
+  int32_t values[2];
+  char text[max_daemon_text_length];
+};
+
+/*!
+ * Statistics of a Daemon.
+ */
+struct DaemonStatistics {
+  // Clients connected now
+  size_t clients;
+  // Requests received from all clients
+  uint64_t requests;
+  // Motor commands refused because another client held the motors
+  uint64_t preempted;
+  // Telemetry frames sent to clients
+  uint64_t telemetry_sent;
+  // Frames dropped because a client was not reading
+  uint64_t dropped;
+  // Time from a telemetry response reaching the daemon until it was sent 
+  // to a client, the latency the daemon adds
+  double telemetry_latency_mean_us;
+  uint64_t telemetry_latency_max_us;
+  // Current merged telemetry schedule, like "CR,V", and its "#" period
+  std::string schedule;
+  size_t schedule_period_ms;
+};
+
+/*!
+ * Shares one MDC2250 among many local processes.
+ * 
+ * Clients connect to a Unix domain socket and exchange DaemonFrames.  
+ * Commands and queries are forwarded with the asynchronous interface of 
+ * the MDC2250, so their replies are sent straight from the listener 
+ * thread.  The telemetry subscriptions of all clients are merged into one 
+ * "#" query history, fast enough for the most demanding client, and each 
+ * client receives its queries at about the period it asked for.  The 
+ * telemetry is queued per client and sent from a thread of its own, so a 
+ * slow client never holds up the listener or the other clients.  Motor 
+ * commands are arbitrated: the client holding the motors keeps them until 
+ * it releases them, disconnects or stops commanding them for the claim 
+ * timeout, unless a client with a higher or equal priority commands them.
+ * 
+ * The executable mdc2250d wraps this class.
+ */
+class Daemon {
+public:
+  /*!
+   * \param claim_timeout_ms size_t time after which an idle client loses 
+   * the motors.
+   */
+  Daemon(MDC2250 &mdc2250, size_t claim_timeout_ms = 500);
+  virtual ~Daemon();
+
+  /*!
+   * Listens on socket_path, replacing a stale socket file, and starts 
+   * serving clients.
+   * 
+   * \throws std::runtime_error if the socket could not be created.
+   */
+  void start(const std::string &socket_path);
+
+  /*!
+   * Disconnects all clients and removes the socket file.
+   */
+  void stop();
+
+  bool isRunning() const {
+    return this->running_;
+  }
+
+  DaemonStatistics getStatistics();
+
+private:
+  Daemon(const Daemon &);
+  void operator=(const Daemon &);
+
+  struct Client;
+  typedef boost::shared_ptr<Client> ClientPtr;
+
+  // Body of the thread which accepts clients and reads their requests
+  void serve_();
+  // Body of the thread which applies telemetry schedule changes
+  void schedule_();
+  // Body of the thread which sends the queued telemetry to the clients
+  void send_telemetry_();
+  void handle_frame_(const ClientPtr &client, const DaemonFrame &frame);
+  void handle_motors_(const ClientPtr &client, const DaemonFrame &frame);
+  void remove_client_(const ClientPtr &client);
+  // Sends a frame without blocking, false if the client is not reading
+  bool send_(const ClientPtr &client, const DaemonFrame &frame);
+  void reply_(const ClientPtr &client, uint32_t id, const Result &result,
+              const char *text = NULL, size_t length = 0);
+  void complete_(ClientPtr client, uint32_t id, const Result &result,
+                 const char *response, size_t length);
+  void on_telemetry_(const std::string &token);
+
+  MDC2250 &mdc2250_;
+  uint64_t claim_timeout_us_;
+  std::string socket_path_;
+  int listen_fd_;
+  int wake_fds_[2];
+  boost::atomic<bool> running_;
+  boost::thread thread_;
+  boost::thread schedule_thread_;
+  boost::thread send_thread_;
+
+  // Clients, their subscriptions and the motor claim
+  boost::mutex clients_mutex_;
+  std::vector<ClientPtr> clients_;
+  ClientPtr motor_owner_;
+  uint64_t motor_claim_us_;
+  DaemonStatistics statistics_;
+  // Set when telemetry was queued for the send thread
+  boost::condition_variable telemetry_condition_;
+  bool telemetry_queued_;
+  // Asynchronous requests which will still reply through this object
+  boost::atomic<size_t> in_flight_;
+
+  // Set when the subscriptions changed, with the clients waiting on it
+  boost::mutex schedule_mutex_;
+  boost::condition_variable schedule_condition_;
+  bool schedule_dirty_;
+  std::vector<std::pair<ClientPtr, uint32_t> > schedule_waiters_;
+};
+
+/*!
+ * Typedef for the function called with each telemetry response received
+ * by a DaemonClient.
+ */
+typedef boost::function<void(const char*, size_t)> DaemonTelemetryCallback;
+
+/*!
+ * Connects to an mdc2250d daemon and makes requests through it.
+ * 
+ * Requests block until the daemon replies, and may be made from several 
+ * threads at once.  Telemetry is delivered from the client's reader thread.
+ */
+class DaemonClient {
+public:
+  DaemonClient();
+  virtual ~DaemonClient();
+
+  /*!
+   * \throws std::runtime_error if the daemon could not be reached.
+   */
+  void connect(const std::string &socket_path);
+
+  void disconnect();
+
+  bool isConnected() const {
+    return this->fd_ >= 0;
+  }
+
+  /*!
+   * Sets the function called with each subscribed telemetry response.
+   */
+  void setTelemetryHandler(DaemonTelemetryCallback handler) {
+    this->telemetry_handler_ = handler;
+  }
+
+  /*!
+   * Issues a runtime or configuration command, like "!G 1 500".
+   */
+  Result command(const std::string &command, long timeout_ms = 1000);
+
+  /*!
+   * Issues a query, like "?V", storing its response.
+   */
+  Result query(const std::string &query, std::string &response,
+               long timeout_ms = 1000);
+
+  /*!
+   * Receives the response to the query name, like "CR", about every 
+   * period_ms milliseconds.
+   * 
+   * \returns Result with code results::invalid_argument if name is not 
+   * the name of a query.
+   */
+  Result subscribe(const std::string &name, size_t period_ms,
+                   long timeout_ms = 5000);
+
+  Result unsubscribe(const std::string &name, long timeout_ms = 5000);
+
+  /*!
+   * Commands both motors, if no other client holds them with a higher 
+   * priority.
+   * 
+   * \returns Result with code results::busy if another client holds them.
+   */
+  Result commandMotors(long motor1_effort, long motor2_effort,
+                       uint8_t priority = 0, long timeout_ms = 1000);
+
+  /*!
+   * Gives up the motors so a lower priority client may command them.
+   */
+  Result releaseMotors(long timeout_ms = 1000);
+
+private:
+  DaemonClient(const DaemonClient &);
+  void operator=(const DaemonClient &);
+
+  struct Pending {
+    bool done;
+    DaemonFrame reply;
+  };
+
+  Result request_(DaemonFrame &frame, long timeout_ms,
+                  std::string *response = NULL);
+  // Body of the thread which reads replies and telemetry
+  void read_();
+
+  int fd_;
+  boost::thread thread_;
+  DaemonTelemetryCallback telemetry_handler_;
+  boost::mutex mutex_;
+  boost::condition_variable condition_;
+  uint32_t next_id_;
+  std::map<uint32_t, Pending *> pending_;
+};
+
+} // mdc2250 namespace
+
+#endif
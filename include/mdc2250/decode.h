@@ -41,6 +41,9 @@
 
 // Standard Library Headers
 #include <string>
+#include <vector>
+#include <sstream>
+#include <iostream>
 #include <cstdlib>
 
 // Boost headers
@@ -92,75 +95,90 @@ namespace queries {
   } QueryType;
 } // queries namespace
 
-bool
+inline bool
 starts_with(const std::string str, const std::string prefix) {
   return str.substr(0,prefix.length()) == prefix;
 }
 
-queries::QueryType
-detect_response_type(const std::string &raw) {
+inline bool
+starts_with(const char *str, size_t length, const char *prefix) {
+  for (size_t i = 0; prefix[i] != '\0'; ++i) {
+    if (i == length || str[i] != prefix[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*!
+ * Detects the type of a response without copying it.
+ * 
+ * \params raw Pointer to the raw data from the motor controller.
+ * \params length The number of characters in raw.
+ */
+inline queries::QueryType
+detect_response_type(const char *raw, size_t length) {
   using namespace queries;
-  if (raw.empty()) {
-    std::cerr << "In detect_response_type: Got an empty string." << std::endl;
+  if (length == 0) {
     return unknown;
   }
   switch(raw[0]) {
     case 'A':
-      if (starts_with(raw, "A=")) return motor_amps;
-      if (starts_with(raw, "AI=")) return analog_input;
+      if (starts_with(raw, length, "A=")) return motor_amps;
+      if (starts_with(raw, length, "AI=")) return analog_input;
       break;
     case 'B':
-      if (starts_with(raw, "BA=")) return battery_amps;
-      if (starts_with(raw, "BS=")) return brushless_motor_speed_rpm;
-      if (starts_with(raw, "BSR=")) return brushless_motor_speed_percent;
+      if (starts_with(raw, length, "BA=")) return battery_amps;
+      if (starts_with(raw, length, "BS=")) return brushless_motor_speed_rpm;
+      if (starts_with(raw, length, "BSR=")) return brushless_motor_speed_percent;
       break;
     case 'C':
-      if (starts_with(raw, "C=")) return encoder_count_absolute;
-      if (starts_with(raw, "CB=")) return brushless_encoder_count_absolute;
-      if (starts_with(raw, "CBR=")) return brushless_encoder_count_relative;
-      if (starts_with(raw, "CIA=")) return internal_analog;
-      if (starts_with(raw, "CIP=")) return internal_pulse;
-      if (starts_with(raw, "CIS=")) return internal_serial;
-      if (starts_with(raw, "CR=")) return encoder_count_relative;
+      if (starts_with(raw, length, "C=")) return encoder_count_absolute;
+      if (starts_with(raw, length, "CB=")) return brushless_encoder_count_absolute;
+      if (starts_with(raw, length, "CBR=")) return brushless_encoder_count_relative;
+      if (starts_with(raw, length, "CIA=")) return internal_analog;
+      if (starts_with(raw, length, "CIP=")) return internal_pulse;
+      if (starts_with(raw, length, "CIS=")) return internal_serial;
+      if (starts_with(raw, length, "CR=")) return encoder_count_relative;
       break;
     case 'D':
-      if (starts_with(raw, "D=")) return digital_inputs;
-      if (starts_with(raw, "DI=")) return individual_digital_inputs;
-      if (starts_with(raw, "DO=")) return digital_output_status;
+      if (starts_with(raw, length, "D=")) return digital_inputs;
+      if (starts_with(raw, length, "DI=")) return individual_digital_inputs;
+      if (starts_with(raw, length, "DO=")) return digital_output_status;
       break;
     case 'E':
-      if (starts_with(raw, "E=")) return closed_loop_error;
+      if (starts_with(raw, length, "E=")) return closed_loop_error;
       break;
     case 'F':
-      if (starts_with(raw, "F=")) return feedback_in;
-      if (starts_with(raw, "FF=")) return fault_flag;
-      if (starts_with(raw, "FID=")) return firmware_id;
-      if (starts_with(raw, "FS=")) return status_flag;
+      if (starts_with(raw, length, "F=")) return feedback_in;
+      if (starts_with(raw, length, "FF=")) return fault_flag;
+      if (starts_with(raw, length, "FID=")) return firmware_id;
+      if (starts_with(raw, length, "FS=")) return status_flag;
       break;
     case 'L':
-      if (starts_with(raw, "LK=")) return lock_status;
+      if (starts_with(raw, length, "LK=")) return lock_status;
       break;
     case 'M':
-      if (starts_with(raw, "M=")) return motor_command_applied;
+      if (starts_with(raw, length, "M=")) return motor_command_applied;
       break;
     case 'P':
-      if (starts_with(raw, "P=")) return motor_power_output_applied;
-      if (starts_with(raw, "PI=")) return pulse_input;
+      if (starts_with(raw, length, "P=")) return motor_power_output_applied;
+      if (starts_with(raw, length, "PI=")) return pulse_input;
       break;
     case 'S':
-      if (starts_with(raw, "S=")) return encoder_speed_rpm;
-      if (starts_with(raw, "SR=")) return encoder_speed_relative;
+      if (starts_with(raw, length, "S=")) return encoder_speed_rpm;
+      if (starts_with(raw, length, "SR=")) return encoder_speed_relative;
       break;
     case 'T':
-      if (starts_with(raw, "T=")) return temperature;
-      if (starts_with(raw, "TM=")) return read_time;
-      if (starts_with(raw, "TRN=")) {
+      if (starts_with(raw, length, "T=")) return temperature;
+      if (starts_with(raw, length, "TM=")) return read_time;
+      if (starts_with(raw, length, "TRN=")) {
         return control_unit_type_and_controller_model;
       }
       break;
     case 'V':
-      if (starts_with(raw, "V=")) return volts;
-      if (starts_with(raw, "VAR=")) return user_variable;
+      if (starts_with(raw, length, "V=")) return volts;
+      if (starts_with(raw, length, "VAR=")) return user_variable;
       break;
     default:
       break;
@@ -168,10 +186,19 @@ detect_response_type(const std::string &raw) {
   return unknown;
 }
 
+inline queries::QueryType
+detect_response_type(const std::string &raw) {
+  if (raw.empty()) {
+    std::cerr << "In detect_response_type: Got an empty string." << std::endl;
+    return queries::unknown;
+  }
+  return detect_response_type(raw.data(), raw.length());
+}
+
 /*!
  * Returns the corresponding std::string given a QueryType.
  */
-std::string
+inline std::string
 response_type_to_string(queries::QueryType res) {
   using namespace queries;
   switch (res) {
@@ -223,18 +250,22 @@ class DecodingException : public std::exception {
   const std::string e_what_;
   const std::string raw_;
   const queries::QueryType res_;
+  std::string what_;
 public:
   DecodingException(const std::string &e_what = "",
                     const std::string &raw = "",
                     queries::QueryType res = queries::unknown)
-  : e_what_(e_what), raw_(raw), res_(res) {}
-  ~DecodingException() throw() {}
-
-  virtual const char * what() const throw() {
+  : e_what_(e_what), raw_(raw), res_(res)
+  {
     std::stringstream ss;
     ss << "Failed to decode `" << this->raw_ << "` as a ";
     ss << response_type_to_string(this->res_) << ": " << this->e_what_;
-    return ss.str().c_str();
+    this->what_ = ss.str();
+  }
+  ~DecodingException() throw() {}
+
+  virtual const char * what() const throw() {
+    return this->what_.c_str();
   }
 };
 
@@ -251,7 +282,7 @@ public:
  * 
  * \throws mdc2250::DecodingException
  */
-size_t
+inline size_t
 decode_generic_response(const std::string &raw, std::vector<long> &channels) {
   queries::QueryType res = detect_response_type(raw);
   if (res == queries::unknown) {
@@ -270,6 +301,56 @@ decode_generic_response(const std::string &raw, std::vector<long> &channels) {
   return channels.size();
 }
 
+/*
+ * Decodes the values of a response in place, without allocating memory.
+ * 
+ * This is meant for the listener's hot path, where responses like
+ * "CR=12:-4" arrive at the telemetry rate.  Everything up to and including 
+ * the '=' is skipped and the ':' separated values are stored in channels.
+ * 
+ * \params raw Pointer to the raw data from the motor controller.
+ * \params length The number of characters in raw.
+ * \params channels Array which receives the decoded values.
+ * \params max_channels The capacity of channels.
+ * 
+ * \returns size_t The number of values decoded, 0 if the format is invalid.
+ */
+inline size_t
+decode_channels(const char *raw, size_t length,
+                long *channels, size_t max_channels)
+{
+  const char *end = raw + length;
+  const char *it = raw;
+  while (it != end && *it != '=') {
+    ++it;
+  }
+  if (it == end) {
+    return 0;
+  }
+  size_t count = 0;
+  while (it != end && count < max_channels) {
+    ++it; // Skip the '=' or ':'
+    bool negative = false;
+    if (it != end && (*it == '-' || *it == '+')) {
+      negative = (*it == '-');
+      ++it;
+    }
+    if (it == end || *it < '0' || *it > '9') {
+      return 0;
+    }
+    long value = 0;
+    while (it != end && *it >= '0' && *it <= '9') {
+      value = value * 10 + (*it - '0');
+      ++it;
+    }
+    channels[count++] = negative ? -value : value;
+    if (it != end && *it != ':') {
+      return 0;
+    }
+  }
+  return count;
+}
+
 } // mdc2250 namespace
 
 #endif
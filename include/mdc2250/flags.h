@@ -0,0 +1,198 @@
+/*!
+ * \file mdc2250/flags.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides bit level decoding of the fault (FF) and status (FS) flags and
+ * a monitor which reports each flag transition.
+ */
+
+#ifndef MDC2250_FLAGS_H
+#define MDC2250_FLAGS_H
+
+// Standard Library Headers
+#include <cstddef>
+#include <stdint.h>
+
+// Boost Headers
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+
+// MDC2250 Headers
+#include "mdc2250/decode.h"
+
+namespace mdc2250 {
+
+namespace fault_flags {
+  /*
+   * This is an enumeration of the bits of the ?FF response.
+   */
+  typedef enum {
+    overheat = 1,
+    overvoltage = 2,
+    undervoltage = 4,
+    short_circuit = 8,
+    emergency_stop = 16,
+    sensor_fault = 32,        // Sepex excitation or brushless sensor fault
+    mosfet_failure = 64,
+    default_configuration = 128 // Configuration was reset at startup
+  } FaultFlag;
+} // fault_flags namespace
+
+namespace status_flags {
+  /*
+   * This is an enumeration of the bits of the ?FS response.
+   */
+  typedef enum {
+    serial_mode = 1,
+    pulse_mode = 2,
+    analog_mode = 4,
+    power_stage_off = 8,
+    stall_detected = 16,
+    at_limit = 32,
+    script_running = 128
+  } StatusFlag;
+} // status_flags namespace
+
+/*!
+ * Returns the name of a single fault flag bit, like "emergency_stop".
+ */
+inline const char *
+fault_flag_to_string(uint32_t flag) {
+  using namespace fault_flags;
+  switch (flag) {
+    case overheat: return "overheat";
+    case overvoltage: return "overvoltage";
+    case undervoltage: return "undervoltage";
+    case short_circuit: return "short_circuit";
+    case emergency_stop: return "emergency_stop";
+    case sensor_fault: return "sensor_fault";
+    case mosfet_failure: return "mosfet_failure";
+    case default_configuration: return "default_configuration";
+    default: break;
+  }
+  return "unknown";
+}
+
+/*!
+ * Returns the name of a single status flag bit, like "stall_detected".
+ */
+inline const char *
+status_flag_to_string(uint32_t flag) {
+  using namespace status_flags;
+  switch (flag) {
+    case serial_mode: return "serial_mode";
+    case pulse_mode: return "pulse_mode";
+    case analog_mode: return "analog_mode";
+    case power_stage_off: return "power_stage_off";
+    case stall_detected: return "stall_detected";
+    case at_limit: return "at_limit";
+    case script_running: return "script_running";
+    default: break;
+  }
+  return "unknown";
+}
+
+/*!
+ * One flag which was set or cleared.
+ */
+struct FlagEvent {
+  // Receive time of the response, see mdc2250::monotonic_usec
+  uint64_t stamp_us;
+  // queries::fault_flag or queries::status_flag
+  queries::QueryType type;
+  // The single bit which changed
+  uint32_t flag;
+  // true if it was set, false if it was cleared
+  bool set;
+  // All of the flags after the change
+  uint32_t flags;
+};
+
+/*!
+ * Typedef for the function called with each flag transition.
+ */
+typedef boost::function<void(const FlagEvent&)> FlagCallback;
+
+/*!
+ * Tracks the fault and status flags and reports every bit which changes.
+ * 
+ * Responses are expected from a single thread, normally the listener 
+ * thread, which also calls the handler.  The first response of each kind
+ * reports the bits which are set, since nothing is known before it.
+ */
+class FlagMonitor {
+public:
+  FlagMonitor();
+
+  /*!
+   * Sets the function called with each transition, from the thread 
+   * calling update, so it should return quickly.
+   */
+  void setHandler(FlagCallback handler) {
+    this->handler_ = handler;
+  }
+
+  /*!
+   * Forgets the flags, the next responses are treated as the first.
+   */
+  void reset();
+
+  /*!
+   * Processes a decoded FF= or FS= response.
+   * 
+   * \returns size_t the number of flags which changed.
+   */
+  size_t update(queries::QueryType type, uint32_t flags, uint64_t stamp_us);
+
+  /*!
+   * Returns the latest fault flags, 0 if none were received yet.
+   */
+  uint32_t faults() const {
+    return this->faults_;
+  }
+
+  /*!
+   * Returns the latest status flags, 0 if none were received yet.
+   */
+  uint32_t status() const {
+    return this->status_;
+  }
+
+private:
+  FlagCallback handler_;
+  boost::atomic<uint32_t> faults_;
+  boost::atomic<uint32_t> status_;
+  bool have_faults_;
+  bool have_status_;
+};
+
+} // mdc2250 namespace
+
+#endif
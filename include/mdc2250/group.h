@@ -0,0 +1,259 @@
+/*!
+ * \file mdc2250/group.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides a group of motor controllers, such as the two or four
+ * MDC2250s of a skid steer platform, whose motor commands are written
+ * together to keep the skew between the controllers low.
+ */
+
+#ifndef MDC2250_GROUP_H
+#define MDC2250_GROUP_H
+
+// Standard Library Headers
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+
+// Boost Headers
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+// MDC2250 Headers
+#include "mdc2250/mdc2250.h"
+#include "mdc2250/realtime.h"
+#include "mdc2250/result.h"
+
+namespace mdc2250 {
+
+namespace broadcast_modes {
+  /*
+   * This is an enumeration of the ways a ControllerGroup writes commands.
+   */
+  typedef enum {
+    // The calling thread writes every command, one right after another
+    back_to_back,
+    // A thread per controller writes its command, all released at once
+    parallel
+  } BroadcastMode;
+} // broadcast_modes namespace
+
+/*!
+ * The efforts of both motors of one controller.
+ */
+struct MotorEfforts {
+  MotorEfforts(long motor1_ = 0, long motor2_ = 0)
+  : motor1(motor1_), motor2(motor2_) {}
+
+  long motor1;
+  long motor2;
+};
+
+/*!
+ * The outcome of one broadcast.
+ */
+struct BroadcastResult {
+  // Result of each controller's command, in the order they were added
+  std::vector<Result> results;
+  // Time between the first and the last command being written
+  uint64_t skew_ns;
+  // Time from starting the first write until the last was acknowledged
+  uint64_t ack_ns;
+
+  /*!
+   * Returns true if every controller acknowledged its command.
+   */
+  bool ok() const {
+    for (size_t i = 0; i < this->results.size(); ++i) {
+      if (!this->results[i].ok()) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+/*!
+ * The skew of the broadcasts so far.
+ */
+struct BroadcastStatistics {
+  uint64_t broadcasts;
+  // Broadcasts which some controller failed to acknowledge
+  uint64_t failures;
+  uint64_t skew_last_ns;
+  double skew_mean_ns;
+  uint64_t skew_max_ns;
+};
+
+/*!
+ * This function type describes the prototype of the broadcast callbacks.
+ * 
+ * It is called once every controller acknowledged its command, or failed 
+ * to, from the listener thread of the last controller to answer.
+ */
+typedef boost::function<void(const BroadcastResult&)> BroadcastCallback;
+
+/*!
+ * Commands the motors of several connected controllers at once.
+ * 
+ * Calling commandMotors on each controller in turn waits for every echo and 
+ * acknowledgement before the next command is even written, so the last 
+ * controller gets its setpoint milliseconds after the first.  A broadcast 
+ * encodes and registers every command first, then writes them all with 
+ * nothing in between, and collects the acknowledgements asynchronously on 
+ * the listener threads.
+ * 
+ * With broadcast_modes::back_to_back the calling thread writes the 
+ * commands, bypassing the writers' queues like MDC2250's estop does, so 
+ * they may overtake commands queued by other threads.  With 
+ * broadcast_modes::parallel each controller has a thread, which can be 
+ * pinned to its own CPU, blocked until the commands are ready and then 
+ * released together.  The group must outlive its asynchronous broadcasts.
+ * 
+ * <pre>
+ *    mdc2250::ControllerGroup group;
+ *    group.add(front);
+ *    group.add(rear);
+ *    std::vector<mdc2250::MotorEfforts> efforts(2,
+ *      mdc2250::MotorEfforts(500, -500));
+ *    mdc2250::BroadcastResult result = group.broadcast(efforts);
+ * </pre>
+ */
+class ControllerGroup {
+public:
+  ControllerGroup(broadcast_modes::BroadcastMode mode =
+                    broadcast_modes::back_to_back);
+  virtual ~ControllerGroup();
+
+  /*!
+   * Adds a controller, which must outlive the group, and returns its index.
+   * 
+   * \param options ThreadOptions of the controller's thread in parallel 
+   * mode, for instance to pin it to a CPU.
+   * 
+   * \throws std::runtime_error if the options could not be applied.
+   */
+  size_t add(MDC2250 &mdc2250, const ThreadOptions &options = ThreadOptions());
+
+  /*!
+   * Returns the number of controllers in the group.
+   */
+  size_t size() const {
+    return this->members_.size();
+  }
+
+  /*!
+   * Commands every controller's motors, like MDC2250::tryCommandMotors, and
+   * waits for the acknowledgements.
+   * 
+   * \param efforts std::vector of one MotorEfforts per controller.
+   * \param timeout_ms long time to wait for the acknowledgements, if 0 
+   * each controller's round trip estimate is used.
+   * 
+   * \throws std::invalid_argument if there are not as many efforts as 
+   * controllers.
+   */
+  BroadcastResult broadcast(const std::vector<MotorEfforts> &efforts,
+                            long timeout_ms = 0);
+
+  /*!
+   * Commands every controller's motors like broadcast, but returns once 
+   * the commands are written and calls the callback with the result.
+   */
+  void broadcastAsync(const std::vector<MotorEfforts> &efforts,
+                      BroadcastCallback callback, long timeout_ms = 0);
+
+  /*!
+   * Returns the skew of the broadcasts so far.
+   */
+  BroadcastStatistics getStatistics();
+
+private:
+  ControllerGroup(const ControllerGroup &);
+  void operator=(const ControllerGroup &);
+
+  // The acknowledgements still expected by one broadcast
+  struct Broadcast {
+    boost::mutex mutex;
+    boost::condition_variable condition;
+    BroadcastResult result;
+    size_t pending;
+    uint64_t start_ns;
+    BroadcastCallback callback;
+  };
+  typedef boost::shared_ptr<Broadcast> BroadcastPtr;
+
+  struct Member {
+    Member(MDC2250 &mdc2250_) : mdc2250(mdc2250_), length(0), index(0),
+                                registered(false), written_ns(0) {}
+    MDC2250 &mdc2250;
+    // The encoded command and its asynchronous request
+    char command[32];
+    size_t length;
+    size_t index;
+    bool registered;
+    uint64_t written_ns;
+    boost::thread thread;
+  };
+  typedef boost::shared_ptr<Member> MemberPtr;
+
+  // Registers and writes every command of a broadcast
+  BroadcastPtr start_(const std::vector<MotorEfforts> &efforts,
+                      BroadcastCallback callback, long timeout_ms);
+  // Called from the listener threads as the commands are acknowledged
+  void acknowledged_(BroadcastPtr broadcast, size_t member,
+                     const Result &result);
+  // Counts down the pending parts of a broadcast, finishing it at 0
+  void done_(BroadcastPtr broadcast);
+  // Body of a member's thread in parallel mode
+  void run_(Member *member, uint64_t generation);
+
+  broadcast_modes::BroadcastMode mode_;
+  std::vector<MemberPtr> members_;
+  // Held for the whole of writing a broadcast
+  boost::mutex broadcast_mutex_;
+
+  // Releases the members' threads in parallel mode
+  boost::mutex release_mutex_;
+  boost::condition_variable release_condition_;
+  boost::condition_variable written_condition_;
+  uint64_t generation_;
+  size_t writing_;
+  bool running_;
+
+  boost::mutex statistics_mutex_;
+  BroadcastStatistics statistics_;
+};
+
+} // mdc2250 namespace
+
+#endif
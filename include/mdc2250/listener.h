@@ -0,0 +1,481 @@
+/*!
+ * \file mdc2250/listener.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides the serial listener used by the MDC2250 class.  It reads
+ * from the transport into a fixed buffer, tokenizes on carriage return and
+ * ACK in place, and dispatches the tokens to filters without allocating
+ * memory once it is running.
+ */
+
+#ifndef MDC2250_LISTENER_H
+#define MDC2250_LISTENER_H
+
+// Standard Library Headers
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Boost Headers
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+// MDC2250 Headers
+#include "mdc2250/realtime.h"
+#include "mdc2250/transport.h"
+
+namespace mdc2250 {
+
+/*!
+ * This function type describes the prototype for the exception callback.
+ * 
+ * The function takes a std::exception reference and returns nothing.  It is 
+ * called from the library when an exception occurs in a library thread.
+ * This exposes these exceptions to the user so they can to error handling.
+ * 
+ * \see MDC2250::setExceptionHandler
+ */
+typedef boost::function<void(const std::exception&)> ExceptionCallback;
+
+/*!
+ * This function type describes the prototype for the data callbacks.
+ * 
+ * The function takes a std::string reference to a token and returns nothing.
+ * The reference is only valid for the duration of the call.
+ */
+typedef boost::function<void(const std::string&)> DataCallback;
+
+/*!
+ * This function type describes the prototype for the filter comparators.
+ * 
+ * The function takes a std::string reference to a token and returns true if 
+ * the token should be given to the filter.
+ */
+typedef boost::function<bool(const std::string&)> ComparatorType;
+
+/*!
+ * This function type describes the prototype for the line handler.
+ * 
+ * The function is called from the listener's read thread for every token, 
+ * before the filters, with a pointer to the token, its length and the time 
+ * it was received in microseconds, see mdc2250::monotonic_usec.  It returns 
+ * true if it consumed the token, which is then not given to the filters.
+ */
+typedef boost::function<bool(const char*, size_t, uint64_t)> LineHandler;
+
+/*!
+ * This function type describes the prototype for the tick handler.
+ * 
+ * The function is called from the listener's read thread after every read,
+ * including reads which timed out, with the current time in microseconds.
+ */
+typedef boost::function<void(uint64_t)> TickHandler;
+
+/*!
+ * The maximum length of a token, longer runs without a delimiter are 
+ * discarded as garbage.
+ */
+const size_t max_token_length = 128;
+
+namespace callback_executors {
+  /*
+   * This is an enumeration of the ways the filter callbacks can be run.
+   */
+  typedef enum {
+    run_inline,       // On the read thread, delays every following token
+    dedicated_thread, // On one callback thread, in the order received
+    thread_pool       // On several threads, in order for each filter
+  } CallbackExecutor;
+} // callback_executors namespace
+
+/*!
+ * Statistics of the callbacks run by a Listener.
+ */
+struct CallbackStatistics {
+  // Callbacks run so far
+  uint64_t executed;
+  // Tokens dropped because their callback queue was full
+  uint64_t dropped;
+  // Tokens waiting for a callback thread now, and the most ever waiting 
+  // in one queue
+  size_t queue_depth;
+  size_t max_queue_depth;
+  // Time spent in callbacks, in total and the longest single call
+  uint64_t duration_total_us;
+  uint64_t duration_max_us;
+};
+
+class Listener;
+class BufferedFilter;
+
+/*!
+ * Routes the tokens matched by a comparator to a callback.
+ * 
+ * Filters are created with Listener::createFilter and removed with 
+ * Listener::removeFilter.
+ */
+class Filter {
+public:
+  Filter(ComparatorType comparator, DataCallback callback)
+  : comparator_(comparator), callback_(callback), buffer_(NULL),
+    queue_index_(0) {}
+
+private:
+  friend class Listener;
+  friend class BufferedFilter;
+
+  ComparatorType comparator_;
+  DataCallback callback_;
+  // Set if the tokens are buffered instead of passed to callback_
+  BufferedFilter *buffer_;
+  // Selects the callback queue, so one filter's callbacks stay in order
+  size_t queue_index_;
+};
+
+typedef boost::shared_ptr<Filter> FilterPtr;
+
+/*!
+ * Buffers the tokens matched by a comparator until they are waited on.
+ * 
+ * The buffer has a fixed capacity, allocated when the filter is created, 
+ * and the oldest token is dropped when it is full.  The filter removes 
+ * itself from the listener when it is destroyed.
+ */
+class BufferedFilter {
+public:
+  BufferedFilter(ComparatorType comparator, size_t capacity,
+                 Listener &listener);
+  virtual ~BufferedFilter();
+
+  /*!
+   * Waits for a token and returns it, or an empty string on timeout.
+   * 
+   * \param ms long milliseconds to wait.
+   */
+  std::string wait(long ms);
+
+  /*!
+   * Waits for a token and copies it into the given buffer, without 
+   * allocating memory.
+   * 
+   * \param ms long milliseconds to wait.
+   * \param buffer char array which receives the token, it is truncated to 
+   * size characters and is not null terminated.
+   * \param size size_t capacity of the buffer.
+   * 
+   * \returns size_t length of the token, 0 on timeout.
+   */
+  size_t wait(long ms, char *buffer, size_t size);
+
+  /*!
+   * Discards any buffered tokens.
+   */
+  void clear();
+
+  /*!
+   * Returns the number of buffered tokens.
+   */
+  size_t count();
+
+private:
+  BufferedFilter(const BufferedFilter &);
+  void operator=(const BufferedFilter &);
+
+  friend class Listener;
+  // Called from the read thread with a matched token
+  void push_(const char *token, size_t length);
+
+  Listener &listener_;
+  FilterPtr filter_ptr_;
+
+  boost::mutex mutex_;
+  boost::condition_variable condition_;
+  std::vector<char> tokens_;
+  std::vector<size_t> lengths_;
+  size_t capacity_;
+  size_t head_;
+  size_t count_;
+};
+
+typedef boost::shared_ptr<BufferedFilter> BufferedFilterPtr;
+
+/*!
+ * Listens to a transport and dispatches its tokens to filters.
+ * 
+ * The listener's read thread reads and tokenizes the incoming data, calls 
+ * the line handler and matches the tokens against the filters.  
+ * BufferedFilters are filled directly from the read thread, so protocol 
+ * handling never waits for application code.  The callbacks of matched 
+ * Filters and the default handler are run by the configured executor, by 
+ * default a dedicated callback thread, see Listener::setCallbackExecutor.
+ * 
+ * Tokens are matched against the filters in the order the filters were 
+ * created and only the first match receives the token.
+ * 
+ * Once listening, no memory is allocated on the path from the transport 
+ * to the callbacks, tokens are passed through fixed size buffers.
+ */
+class Listener {
+public:
+  /*!
+   * Constructs the Listener.
+   * 
+   * \param callback_queue_size size_t number of tokens which can be waiting 
+   * for each callback thread, further tokens are dropped.
+   */
+  Listener(size_t callback_queue_size = 256);
+  virtual ~Listener();
+
+  /*!
+   * Sets the scheduling options of the listener's threads, which are 
+   * applied the next time startListening is called.
+   */
+  void setThreadOptions(const ThreadOptions &options) {
+    this->thread_options_ = options;
+  }
+
+  /*!
+   * Selects how the callbacks of filters and the default handler are run,
+   * which is applied the next time startListening is called.
+   * 
+   * With callback_executors::thread_pool, each filter is assigned to one of
+   * the threads when it is created, so the callbacks of a filter are never 
+   * run concurrently or out of order, while a slow callback only delays the
+   * filters sharing its thread.  The default handler runs on the first.
+   * 
+   * \param threads size_t number of threads of the pool.
+   * 
+   * \throws std::invalid_argument if threads is 0 for a thread pool.
+   */
+  void setCallbackExecutor(callback_executors::CallbackExecutor executor,
+                           size_t threads = 2);
+
+  /*!
+   * Returns the statistics of the callbacks.
+   */
+  CallbackStatistics getCallbackStatistics();
+
+  /*!
+   * Sets the function called from the read thread for every token.
+   * 
+   * This must not be changed while listening.
+   */
+  void setLineHandler(LineHandler line_handler) {
+    this->line_handler_ = line_handler;
+  }
+
+  /*!
+   * Sets the function called from the read thread after every read, at 
+   * least once per read timeout of the transport.
+   * 
+   * This must not be changed while listening.
+   */
+  void setTickHandler(TickHandler tick_handler) {
+    this->tick_handler_ = tick_handler;
+  }
+
+  /*!
+   * Sets the function called for tokens which match no filter.
+   * 
+   * This must not be changed while listening.
+   */
+  void setDefaultHandler(DataCallback default_handler) {
+    this->default_handler_ = default_handler;
+  }
+
+  /*!
+   * Sets the function called when an exception occurs in a listener thread.
+   */
+  void setExceptionHandler(ExceptionCallback exception_handler) {
+    this->handle_exc_ = exception_handler;
+  }
+
+  /*!
+   * Starts the listener's threads on an open transport, which must outlive
+   * the listening.
+   * 
+   * \throws std::runtime_error if the thread options could not be applied.
+   */
+  void startListening(Transport &transport);
+
+  /*!
+   * Stops the listener's threads, this waits for any pending read to time 
+   * out.
+   */
+  void stopListening();
+
+  /*!
+   * Returns true if the listener is running.
+   */
+  bool isListening() const {
+    return this->listening_;
+  }
+
+  /*!
+   * Creates a filter which calls the callback, from the callback executor, 
+   * for every token matched by the comparator.
+   */
+  FilterPtr createFilter(ComparatorType comparator, DataCallback callback);
+
+  /*!
+   * Creates a filter which buffers every token matched by the comparator.
+   * 
+   * \param capacity size_t the number of tokens that can be buffered.
+   * \param first bool true to match tokens ahead of the existing filters.
+   */
+  BufferedFilterPtr createBufferedFilter(ComparatorType comparator,
+                                         size_t capacity = 32,
+                                         bool first = false);
+
+  /*!
+   * Removes the old filters and adds the new ones at once, so no token is 
+   * matched by both or by neither.
+   * 
+   * \param old_filters filters created by this listener, to be removed.
+   * \param new_filters filters not yet added, created with their public 
+   * constructor.
+   */
+  void replaceFilters(const std::vector<FilterPtr> &old_filters,
+                      const std::vector<FilterPtr> &new_filters);
+
+  /*!
+   * Removes a filter, its callback may still be called once for tokens 
+   * which were already matched.
+   */
+  void removeFilter(FilterPtr filter);
+
+  /*!
+   * Removes a buffered filter, it will receive no more tokens.
+   */
+  void removeFilter(BufferedFilterPtr filter);
+
+  /*!
+   * Returns the number of tokens dropped because the callback queue was 
+   * full or because they exceeded mdc2250::max_token_length.
+   */
+  uint64_t droppedTokens() const {
+    return this->dropped_tokens_;
+  }
+
+  /*!
+   * Returns the number of bytes read from the transport.
+   */
+  uint64_t bytesReceived() const {
+    return this->bytes_received_.load(boost::memory_order_relaxed);
+  }
+
+  /*!
+   * Returns the number of reads from the transport, including those which
+   * timed out, which is how often the read thread woke up.
+   */
+  uint64_t reads() const {
+    return this->reads_.load(boost::memory_order_relaxed);
+  }
+
+  /*!
+   * Returns a comparator which matches tokens equal to the given string.
+   */
+  static ComparatorType exactly(const std::string &exact_str);
+
+  /*!
+   * Returns a comparator which matches tokens starting with the prefix.
+   */
+  static ComparatorType startsWith(const std::string &prefix);
+
+private:
+  Listener(const Listener &);
+  void operator=(const Listener &);
+
+  // Body of the read thread
+  void read_();
+  struct CallbackSlot {
+    FilterPtr filter;
+    size_t length;
+    char token[max_token_length];
+  };
+
+  // Tokens waiting for one callback thread
+  struct CallbackQueue {
+    CallbackQueue(size_t size) : slots(size), head(0), count(0),
+                                 max_count(0) {}
+    boost::mutex mutex;
+    boost::condition_variable condition;
+    std::vector<CallbackSlot> slots;
+    size_t head;
+    size_t count;
+    size_t max_count;
+    boost::thread thread;
+  };
+  typedef boost::shared_ptr<CallbackQueue> CallbackQueuePtr;
+
+  // Body of a callback thread
+  void callbacks_(CallbackQueue *queue);
+  // Runs the callback of a filter, or the default handler if it is empty
+  void run_callback_(const FilterPtr &filter, const std::string &token);
+  // Matches a token against the filters and dispatches it
+  void dispatch_(const char *token, size_t length, uint64_t stamp_us);
+
+  ThreadOptions thread_options_;
+  LineHandler line_handler_;
+  TickHandler tick_handler_;
+  DataCallback default_handler_;
+  ExceptionCallback handle_exc_;
+
+  Transport *transport_;
+  boost::atomic<bool> listening_;
+  boost::thread read_thread_;
+  boost::atomic<uint64_t> dropped_tokens_;
+  boost::atomic<uint64_t> bytes_received_;
+  boost::atomic<uint64_t> reads_;
+
+  // Read buffer and reusable token string for the comparators
+  std::vector<char> read_buffer_;
+  std::string token_;
+
+  boost::mutex filter_mutex_;
+  std::vector<FilterPtr> filters_;
+  size_t next_queue_index_;
+
+  // Callback executor, one queue per callback thread
+  callback_executors::CallbackExecutor executor_;
+  size_t executor_threads_;
+  size_t callback_queue_size_;
+  std::vector<CallbackQueuePtr> callback_queues_;
+  boost::atomic<uint64_t> callbacks_executed_;
+  boost::atomic<uint64_t> callbacks_dropped_;
+  boost::atomic<uint64_t> callback_total_us_;
+  boost::atomic<uint64_t> callback_max_us_;
+};
+
+} // mdc2250 namespace
+
+#endif
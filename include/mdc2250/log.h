@@ -0,0 +1,259 @@
+/*!
+ * \file mdc2250/log.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides leveled, structured log records which are queued without
+ * locking and emitted by a background thread.
+ */
+
+#ifndef MDC2250_LOG_H
+#define MDC2250_LOG_H
+
+// Standard Library Headers
+#include <cstddef>
+#include <string>
+#include <stdint.h>
+
+// Boost Headers
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+// MDC2250 Headers
+#include "mdc2250/bounded_queue.h"
+
+/*!
+ * The lowest log level compiled in, 0 is debug, 1 info, 2 warning and 3 
+ * error.  Records below it are removed by the MDC2250_LOG_* macros at 
+ * compile time, so define it as 1 to remove the debug records.
+ */
+#ifndef MDC2250_LOG_LEVEL
+# define MDC2250_LOG_LEVEL 0
+#endif
+
+#if MDC2250_LOG_LEVEL <= 0
+# define MDC2250_LOG_DEBUG(logger, event, text) \
+  (logger).log(mdc2250::log_levels::debug, (event), (text))
+#else
+# define MDC2250_LOG_DEBUG(logger, event, text) ((void)0)
+#endif
+
+#if MDC2250_LOG_LEVEL <= 1
+# define MDC2250_LOG_INFO(logger, event, text) \
+  (logger).log(mdc2250::log_levels::info, (event), (text))
+#else
+# define MDC2250_LOG_INFO(logger, event, text) ((void)0)
+#endif
+
+#if MDC2250_LOG_LEVEL <= 2
+# define MDC2250_LOG_WARNING(logger, event, text) \
+  (logger).log(mdc2250::log_levels::warning, (event), (text))
+#else
+# define MDC2250_LOG_WARNING(logger, event, text) ((void)0)
+#endif
+
+#define MDC2250_LOG_ERROR(logger, event, text) \
+  (logger).log(mdc2250::log_levels::error, (event), (text))
+
+namespace mdc2250 {
+
+namespace log_levels {
+  /*
+   * This is an enumeration of the log levels, in increasing severity.
+   */
+  typedef enum {
+    debug,
+    info,
+    warning,
+    error
+  } LogLevel;
+} // log_levels namespace
+
+/*!
+ * Returns the name of a LogLevel.
+ */
+inline const char *
+log_level_to_string(log_levels::LogLevel level) {
+  using namespace log_levels;
+  switch (level) {
+    case debug: return "debug";
+    case info: return "info";
+    case warning: return "warning";
+    case error: return "error";
+    default: break;
+  }
+  return "unknown";
+}
+
+// Longest text stored in a LogRecord, longer text is truncated
+const size_t max_log_text_length = 120;
+
+/*!
+ * A structured log record.
+ */
+struct LogRecord {
+  // monotonic_nsec time at which the record was logged
+  uint64_t stamp_ns;
+  log_levels::LogLevel level;
+  // Short, static name of what happened, like "estop" or "unparsed"
+  const char *event;
+  // Free form text, not null terminated
+  size_t length;
+  char text[max_log_text_length];
+
+  /*!
+   * Returns the text as a std::string.
+   */
+  std::string str() const {
+    return std::string(this->text, this->length);
+  }
+};
+
+/*!
+ * This function type describes the prototype for the log record sink.
+ * 
+ * It is called from the Logger's thread, so it may block without affecting 
+ * the threads which log.
+ */
+typedef boost::function<void(const LogRecord&)> LogSink;
+
+/*!
+ * Formats a record as "[level] event: text".
+ */
+std::string format_log_record(const LogRecord &record);
+
+/*!
+ * Queues log records without locking and emits them from a background 
+ * thread.
+ * 
+ * log copies the record into a fixed ring and returns, so it never blocks, 
+ * never allocates and never formats; records which don't fit are counted 
+ * and dropped.  The thread started with start drains the ring periodically 
+ * and hands each record to the sink.  While the thread is not running, 
+ * records are handed to the sink directly by log, one thread at a time.
+ */
+class Logger {
+public:
+  /*!
+   * Constructs the Logger.
+   * 
+   * \param capacity size_t number of records which can be queued, rounded 
+   * up to a power of two.
+   */
+  Logger(size_t capacity = 256);
+  virtual ~Logger();
+
+  /*!
+   * Sets the function which receives the records.
+   */
+  void setSink(LogSink sink) {
+    this->sink_ = sink;
+  }
+
+  /*!
+   * Sets the lowest level logged at runtime, defaults to info.
+   * 
+   * \see MDC2250_LOG_LEVEL for removing levels at compile time.
+   */
+  void setLevel(log_levels::LogLevel level) {
+    this->level_ = level;
+  }
+
+  /*!
+   * Returns true if records of the given level are logged.
+   */
+  bool enabled(log_levels::LogLevel level) const {
+    return level >= this->level_;
+  }
+
+  /*!
+   * Starts the thread which emits the records.
+   * 
+   * \param period_ms size_t how often the queued records are emitted.
+   */
+  void start(size_t period_ms = 10);
+
+  /*!
+   * Emits anything still queued, including records being logged 
+   * concurrently, and stops the thread.
+   */
+  void stop();
+
+  /*!
+   * Logs a record.
+   * 
+   * \param level LogLevel of the record.
+   * \param event const char pointer to a static string naming the event.
+   * \param text const char pointer to the text.
+   * \param length size_t length of text.
+   * 
+   * \returns bool false if the record was dropped, because the queue is full 
+   * or its level is disabled.
+   */
+  bool log(log_levels::LogLevel level, const char *event,
+           const char *text, size_t length);
+  bool log(log_levels::LogLevel level, const char *event, const char *text);
+  bool log(log_levels::LogLevel level, const char *event,
+           const std::string &text);
+
+  /*!
+   * Returns the number of records dropped because the queue was full.
+   */
+  uint64_t dropped() const {
+    return this->dropped_;
+  }
+
+private:
+  Logger(const Logger &);
+  void operator=(const Logger &);
+
+  // Body of the thread
+  void run_();
+  // Hands everything queued to the sink
+  void drain_();
+
+  LogSink sink_;
+  // Serializes the calls to the sink
+  boost::mutex sink_mutex_;
+  boost::atomic<int> level_;
+  size_t period_ms_;
+
+  BoundedQueue<LogRecord> queue_;
+  boost::atomic<uint64_t> dropped_;
+  // Calls to log between checking running_ and publishing their record
+  boost::atomic<int> logging_;
+
+  boost::atomic<bool> running_;
+  boost::thread thread_;
+};
+
+} // mdc2250 namespace
+
+#endif
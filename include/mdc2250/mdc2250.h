@@ -46,14 +46,43 @@
 // Boost Headers
 #include "boost/function.hpp"
 
-#define SERIAL_LISTENER_DEBUG 0
+// MDC2250 Headers
+#include "mdc2250/aggregate.h"
+#include "mdc2250/bandwidth.h"
+#include "mdc2250/flags.h"
+#include "mdc2250/listener.h"
+#include "mdc2250/log.h"
+#include "mdc2250/odometry.h"
+#include "mdc2250/realtime.h"
+#include "mdc2250/result.h"
+#include "mdc2250/rtt.h"
+#include "mdc2250/seqlock.h"
+#include "mdc2250/shared_telemetry.h"
+#include "mdc2250/telemetry.h"
+#include "mdc2250/telemetry_health.h"
+#include "mdc2250/trace.h"
+#include "mdc2250/transport.h"
+#include "mdc2250/writer.h"
 
-// Serial Headers
-#include "serial/serial.h"
-#include "serial/utils/serial_listener.h"
+/*!
+ * Defined if the compiler supports C++20 coroutines, in which case the 
+ * awaitable interface in mdc2250/coroutine.h is available.  Define 
+ * MDC2250_NO_COROUTINES to disable it.
+ */
+#if defined(__cpp_impl_coroutine) && !defined(MDC2250_NO_COROUTINES)
+# define MDC2250_HAS_COROUTINES 1
+#endif
 
 namespace mdc2250 {
 
+#if defined(MDC2250_HAS_COROUTINES)
+class QueryAwaitable;
+class CommandAwaitable;
+class TelemetryAwaitable;
+#endif
+template <typename Model> class Controller;
+class ControllerGroup;
+
 /*!
  * This function type describes the prototype for the logging callbacks.
  * 
@@ -63,24 +92,54 @@ namespace mdc2250 {
  * logging system.  It can be set with any of the set<log level>Handler 
  * functions.
  * 
- * \see SerialListener::setInfoHandler, SerialListener::setDebugHandler, 
- * SerialListener::setWarningHandler
+ * \see MDC2250::setInfoHandler
  */
 typedef boost::function<void(const std::string&)> LoggingCallback;
 
 /*!
- * This function type describes the prototype for the exception callback.
+ * This function type describes the prototype for the estop callback.
+ * 
+ * The function takes a bool, which is true if the motor controller reported 
+ * that it is estopped, and returns nothing.
+ * 
+ * \see MDC2250::setEstopHandler
+ */
+typedef boost::function<void(bool)> EstopCallback;
+
+/*!
+ * This function type describes the prototype for the asynchronous request 
+ * callbacks.
  * 
- * The function takes a std::exception reference and returns nothing.  It is 
- * called from the library when an exception occurs in a library thread.
- * This exposes these exceptions to the user so they can to error handling.
+ * The function takes the Result of the request and the matching response 
+ * with its length, which is empty for commands, and returns nothing.  It is 
+ * called from the listener's read thread, as soon as the response has been 
+ * read or the request timed out, unless the request failed immediately, in 
+ * which case it is called from the requesting thread.
  * 
- * \see SerialListener::setExceptionHandler
+ * \see MDC2250::asyncQuery, MDC2250::asyncCommand, 
+ * MDC2250::asyncNextTelemetry
  */
-typedef boost::function<void(const std::exception&)> ExceptionCallback;
+typedef boost::function<void(const Result&, const char*, size_t)>
+  AsyncCallback;
+
+// Maximum number of asynchronous requests outstanding per MDC2250
+const size_t max_async_requests = 32;
+
+// Maximum number of commands in one MDC2250::tryIssueCommands
+const size_t max_batch_commands = 32;
+
+// Maximum number of estops awaiting their acknowledgement without echo
+const size_t max_pending_estops = 8;
 
 /*!
  * Represents an MDC2250 Device and provides and interface to it.
+ * 
+ * Once connected and the telemetry is set, the steady state operation of 
+ * the library does not allocate memory: receiving, tokenizing, dispatching 
+ * and decoding telemetry, as well as encoding, writing and acknowledging 
+ * the motor commands (commandMotor and commandMotors), all use fixed 
+ * buffers.  This does not hold in debug mode, or for the paths which report
+ * failures by throwing.
  */
 class MDC2250 {
 public:
@@ -94,7 +153,9 @@ public:
    * Connects to the MDC2250 motor controller given a serial port.
    * 
    * \param port Defines which serial port to connect to in serial mode.
-   * Examples: Linux - "/dev/ttyS0" Windows - "COM1"
+   * Examples: Linux - "/dev/ttyS0" Windows - "COM1".  A port of the form 
+   * "tcp://<host>:<port>" connects to a serial over Ethernet gateway 
+   * instead, see mdc2250::createTransport.
    * 
    * \param watchdog_time size_t that defines how long the motor controller's
    * watchdog timer should be set to in milliseconds.  A value of 0 will 
@@ -113,11 +174,57 @@ public:
                size_t watchdog_time = 1000,
                bool echo = true);
 
+  /*!
+   * Connects to the MDC2250 motor controller over the given transport, 
+   * which is opened here and closed by disconnect.
+   * 
+   * The transport's name takes the place of the port, for instance in the 
+   * identity cache.
+   * 
+   * \see mdc2250::Transport, mdc2250::LoopbackTransport, 
+   * mdc2250::TcpTransport
+   */
+  void connect(TransportPtr transport,
+               size_t watchdog_time = 1000,
+               bool echo = true);
+
   /*!
    * Disconnects from the MDC2250 motor controller given a serial port.
    */
   void disconnect();
 
+  /*!
+   * Returns the firmware identification answered to "?$1E".
+   * 
+   * The identity is cached across reconnects to the same port, as long as 
+   * the controller announces the same firmware when it is reset.
+   */
+  const std::string & getDeviceString() const {
+    return this->device_string_;
+  }
+
+  /*!
+   * Returns the control unit type answered to "?TRN", like "DC".
+   */
+  const std::string & getControlUnit() const {
+    return this->control_unit_;
+  }
+
+  /*!
+   * Returns the controller model answered to "?TRN", like "MDC2250".
+   */
+  const std::string & getControllerModel() const {
+    return this->controller_model_;
+  }
+
+  /*!
+   * Forgets the cached identity, so the next connect queries it again.
+   */
+  void clearIdentityCache() {
+    this->identity_port_.clear();
+    this->identity_fid_.clear();
+  }
+
   /*!
    * Takes a std::string query, a Comparator to match the response, a 
    * std::string response for storing the response, a std::string for storing 
@@ -134,7 +241,7 @@ public:
    * \return bool true for success, false for failure.
    */
   bool issueQuery(const std::string &query,
-                  serial::utils::ComparatorType comparator,
+                  ComparatorType comparator,
                   std::string &response,
                   std::string &failure_reason);
 
@@ -150,6 +257,51 @@ public:
    */
   bool issueCommand(const std::string &command, std::string &failure_reason);
 
+  /*!
+   * Issues a query like issueQuery, but returns a Result instead of 
+   * formatting a failure reason.
+   * 
+   * \see MDC2250::issueQuery, mdc2250::Result
+   */
+  Result tryIssueQuery(const std::string &query,
+                       ComparatorType comparator,
+                       std::string &response);
+
+  /*!
+   * Issues a command like issueCommand, but returns a Result instead of 
+   * formatting a failure reason.
+   * 
+   * \see MDC2250::issueCommand, mdc2250::Result
+   */
+  Result tryIssueCommand(const std::string &command);
+
+  /*!
+   * Issues several commands on one line, separated by '_', and returns the 
+   * result of each.
+   * 
+   * The controller executes the commands of a line in order and 
+   * acknowledges each with a '+' or '-', so setting several configuration 
+   * values or setpoints takes one round trip instead of one per command.  
+   * Commands which do not fit on one line are continued on the next.
+   * 
+   * Example:
+   * <pre>
+   *    std::vector<std::string> commands;
+   *    commands.push_back("^ALIM 1 500");
+   *    commands.push_back("^ALIM 2 500");
+   *    std::vector<Result> command_results;
+   *    my_mdc2250.tryIssueCommands(commands, command_results);
+   * </pre>
+   * 
+   * \param commands runtime (!), configuration (^) or maintenance (%) 
+   * commands, at most mdc2250::max_batch_commands, without '_' or '\r'.
+   * \param command_results filled with one Result per command.
+   * 
+   * \return Result the first which failed, or success.
+   */
+  Result tryIssueCommands(const std::vector<std::string> &commands,
+                          std::vector<Result> &command_results);
+
   /*!
    * Sends an ASCII QRY to the controller to check for its presence.
    * 
@@ -170,6 +322,18 @@ public:
    */
   void setWatchdog(size_t timeout);
 
+  /*!
+   * Sets the watchdog timer like setWatchdog, without throwing.
+   */
+  Result trySetWatchdog(size_t timeout);
+
+  /*!
+   * Returns the watchdog timeout last set, in milliseconds, 0 if disabled.
+   */
+  size_t getWatchdog() const {
+    return this->watchdog_;
+  }
+
   /*!
    * Sets the command echoing on or off.
    * 
@@ -179,24 +343,55 @@ public:
 
   /*!
    * Sets the emergency stop, motors won't move until estop is cleared.
+   * 
+   * The !EX command is written immediately from the calling thread, ahead 
+   * of any queued traffic and without waiting for a command in progress, 
+   * so it is only delayed by a write which is already on the wire.  The 
+   * estop state is then confirmed asynchronously with a ?FF query, which 
+   * updates isEstopped and calls the estop handler.
+   * 
+   * \see MDC2250::setEstopHandler, WriterStatistics::urgent_latency_max
    */
   void estop();
 
+  /*!
+   * Sets the emergency stop like estop, without throwing.
+   */
+  Result tryEstop();
+
   /*!
    * Clears the emergency stop, motors won't move until estop is cleared.
    */
   void clearEstop();
 
+  /*!
+   * Clears the emergency stop like clearEstop, without throwing.  The estop 
+   * state is confirmed asynchronously, like after estop.
+   */
+  Result tryClearEstop();
+
   /*!
    * Returns the estop status, true for estopped, false otherwise.
    * 
+   * This is kept current by every FF= response, so with flag monitoring 
+   * enabled it is at most one telemetry period old.
+   * 
    * \returns bool true means it is estopped, false means it is not
    */
   bool isEstopped() {
-    // this->detect_emergency_stop_();
     return this->estop_;
   }
 
+  /*!
+   * Sets the function called with the confirmed estop state after estop.
+   * 
+   * It is called from an internal thread, after the motor controller has 
+   * answered the ?FF query which follows the estop.
+   */
+  void setEstopHandler(EstopCallback estop_handler) {
+    this->estop_handler_ = estop_handler;
+  }
+
   /*!
    * Sets the Telemetry string, rate, and callback.
    * 
@@ -210,7 +405,8 @@ public:
    * Automatic telemetry will be interrupted by several actions, activating
    * the estop, changing the echo state, or making an arbitrary query.  If you
    * wish to deliberately stop the automatic telemetry, then you can make a
-   * call to setTelemetry with an empty string for the telemetry_queries.
+   * call to setTelemetry with an empty string for the telemetry_queries, or
+   * call stopTelemetry.
    * 
    * \params telemetry_queries std::string that describes the telemetry order 
    * and is a series of queries separated by comma.
@@ -218,12 +414,32 @@ public:
    * \params period size_t period in milliseconds between each telemetry 
    * element being sent by the motor controller.
    * 
-   * \params callback serial::utils::DataCallback function to be called when 
+   * \params callback mdc2250::DataCallback function to be called when 
    * new telemetry data has arrived.
+   * 
+   * The expected bandwidth of the telemetry, plus the replies to the 
+   * measured command traffic, is checked against the link budget before 
+   * anything is sent, see MDC2250::setLinkBudget.
+   * 
+   * Changing the telemetry stops the old stream, sends every query at once 
+   * and waits for their answers, swaps the callbacks in one step and then 
+   * restarts the stream, so the telemetry is only interrupted for about 
+   * one round trip, see MDC2250::getTelemetrySwitch.  If a query is 
+   * rejected, or the new telemetry can not be started, the previous 
+   * telemetry and its callbacks are restored.
+   * 
+   * \throws CommandFailedException if a query is not answered.
    */
   void setTelemetry(std::string telemetry_queries,
                     size_t period,
-                    serial::utils::DataCallback callback);
+                    DataCallback callback);
+
+  /*!
+   * Stops the automatic telemetry and removes its callbacks.
+   * 
+   * \throws CommandFailedException if "# C" could not be sent.
+   */
+  void stopTelemetry();
 
   /*!
    * Commands a given motor to a given motor effort.
@@ -254,6 +470,15 @@ public:
    */
   void commandMotor(size_t motor_index, ssize_t motor_effort = 0);
 
+  /*!
+   * Commands a motor like commandMotor, without throwing.
+   * 
+   * Invalid arguments are reported as results::invalid_argument, and timeouts 
+   * and non-acknowledgements are reported without formatting a message, so 
+   * this is suitable for control loops where failures are expected events.
+   */
+  Result tryCommandMotor(size_t motor_index, ssize_t motor_effort = 0);
+
   /*!
    * Commands both motors given their respective efforts.
    * 
@@ -288,6 +513,417 @@ public:
    */
   void commandMotors(ssize_t motor1_effort = 0, ssize_t motor2_effort = 0);
 
+  /*!
+   * Commands both motors like commandMotors, without throwing.
+   * 
+   * \see MDC2250::tryCommandMotor
+   */
+  Result tryCommandMotors(ssize_t motor1_effort = 0,
+                          ssize_t motor2_effort = 0);
+
+  /*!
+   * Returns the latest decoded value of every response, this never blocks.
+   * 
+   * Every response with numeric values is decoded on the listener thread as 
+   * soon as it is tokenized, whether it came from telemetry or a query.
+   * 
+   * \returns TelemetrySnapshot indexed by mdc2250::queries::QueryType.
+   */
+  TelemetrySnapshot getTelemetry() const {
+    return this->telemetry_.load();
+  }
+
+  /*!
+   * Returns how long the last setTelemetry interrupted the telemetry.
+   */
+  TelemetrySwitch getTelemetrySwitch() {
+    boost::mutex::scoped_lock lock(this->link_mutex_);
+    return this->telemetry_switch_;
+  }
+
+  /*!
+   * Returns the lost, duplicated and corrupted lines and the arrival jitter
+   * of the telemetry since the last setTelemetry.
+   * 
+   * The controller sends one response of the query history per period, in 
+   * order, so every line has an expected place in that cycle.  Answers to 
+   * queries of the same responses made while the telemetry runs can not be
+   * told apart from it, and are counted as duplicates or skew the position.
+   * 
+   * \see mdc2250::TelemetryHealthMonitor
+   */
+  TelemetryHealth getTelemetryHealth() {
+    return this->telemetry_health_.health();
+  }
+
+  /*!
+   * Sets the scheduling options of the serial listener's and writer's 
+   * threads.
+   * 
+   * The threads are created in connect, so this must be called before 
+   * connecting to have any effect.  Failing to apply the options causes 
+   * connect to throw a ConnectionFailedException.
+   * 
+   * \see mdc2250::Listener, mdc2250::Writer
+   * 
+   * \param options ThreadOptions with the SCHED_FIFO priority and CPU.
+   * 
+   * \see mdc2250::ThreadOptions
+   */
+  void setListenerThreadOptions(const ThreadOptions &options) {
+    this->listener_.setThreadOptions(options);
+    this->writer_.setThreadOptions(options);
+  }
+
+  /*!
+   * Selects how telemetry and other callbacks are run, must be called
+   * before connecting to have any effect.
+   *
+   * Responses to commands and queries are handled on the listener's read
+   * thread regardless, so slow callbacks never make commands time out.
+   *
+   * \see mdc2250::Listener::setCallbackExecutor
+   */
+  void setCallbackExecutor(callback_executors::CallbackExecutor executor,
+                           size_t threads = 2) {
+    this->listener_.setCallbackExecutor(executor, threads);
+  }
+
+  /*!
+   * Returns the counters of the callbacks run so far.
+   *
+   * \see mdc2250::CallbackStatistics
+   */
+  CallbackStatistics getCallbackStatistics() {
+    return this->listener_.getCallbackStatistics();
+  }
+
+  /*!
+   * Sets how long the writer thread waits for more messages before writing.
+   * 
+   * \param delay_us size_t microseconds, 0 (the default) writes immediately.
+   * 
+   * \see mdc2250::Writer::setCoalescingDelay
+   */
+  void setWriteCoalescingDelay(size_t delay_us) {
+    this->writer_.setCoalescingDelay(delay_us);
+  }
+
+  /*!
+   * Selects how a serial port is read, must be called before connecting to
+   * have any effect.  TCP gateways only take its read timeout, and it does
+   * not apply to transports given to connect.
+   * 
+   * \see mdc2250::ReadLatencyProfile, mdc2250::read_latency_profile, 
+   * MDC2250::measureReadLatency
+   */
+  void setReadLatencyProfile(const ReadLatencyProfile &profile) {
+    this->read_latency_profile_ = profile;
+  }
+
+  /*!
+   * Measures how soon the read thread sees what the controller sends, and 
+   * how often it wakes up, by pinging the controller.
+   * 
+   * The latency of each ping is its round trip less the time its two bytes
+   * spend on the wire, so it also includes the controller's turnaround.  
+   * The wakeups include those for any telemetry running meanwhile.
+   * 
+   * \param samples size_t number of pings.
+   * 
+   * \throws std::invalid_argument if samples is 0.
+   * \throws CommandFailedException if not connected.
+   * 
+   * \see mdc2250::probeReadLatency
+   */
+  ReadLatencyMeasurement measureReadLatency(size_t samples = 100);
+
+  /*!
+   * Returns the number of messages waiting for the writer thread.
+   */
+  size_t getWriteQueueDepth() const {
+    return this->writer_.queueDepth();
+  }
+
+  /*!
+   * Returns the writer's message, syscall and latency statistics.
+   * 
+   * \returns WriterStatistics, see mdc2250::WriterStatistics.
+   */
+  WriterStatistics getWriterStatistics() const {
+    return this->writer_.getStatistics();
+  }
+
+  /*!
+   * Sets the largest fraction of the serial link setTelemetry may use.
+   * 
+   * \param max_utilization double fraction of the link capacity, the 
+   * default is 0.8.
+   * \param reject bool true to have setTelemetry throw a 
+   * CommandFailedException for configurations over the limit, false (the 
+   * default) to only report them with the info handler.
+   */
+  void setLinkBudget(double max_utilization, bool reject = false);
+
+  /*!
+   * Returns the expected and measured utilization of the serial link.
+   * 
+   * The measured rates are averaged since the previous call, or over the 
+   * last 100 milliseconds if called more often.
+   * 
+   * \returns LinkUtilization, see mdc2250::LinkUtilization.
+   */
+  LinkUtilization getLinkUtilization();
+
+  /*!
+   * Enables the odometry integrator on the encoder count telemetry.
+   * 
+   * The integrator is fed directly from the listener thread as encoder count 
+   * responses are tokenized, before any filters or callbacks are run.  The 
+   * encoder counts still have to be requested, for example:
+   * <pre>
+   *    my_mdc2250.enableOdometry(OdometryIntegrator::relative_counts,
+   *                              counts_per_meter, counts_per_meter);
+   *    my_mdc2250.setTelemetry("CR,A", 10, my_callback);
+   * </pre>
+   * 
+   * Calling this again resets the integrator, it should not be called while 
+   * the selected encoder counts are streaming.
+   * 
+   * \param source OdometryIntegrator::Source selecting C= or CR= responses.
+   * \param counts_per_unit1 double encoder counts per unit for wheel 1.
+   * \param counts_per_unit2 double encoder counts per unit for wheel 2.
+   * 
+   * \throws std::invalid_argument
+   * 
+   * \see mdc2250::OdometryIntegrator
+   */
+  void enableOdometry(OdometryIntegrator::Source source =
+                        OdometryIntegrator::relative_counts,
+                      double counts_per_unit1 = 1.0,
+                      double counts_per_unit2 = 1.0);
+
+  /*!
+   * Stops feeding encoder count responses to the odometry integrator.
+   */
+  void disableOdometry();
+
+  /*!
+   * Keeps rolling statistics of one channel of a type of response over 
+   * 100 ms, 1 s and 10 s windows.
+   * 
+   * Like the odometry, the aggregation is fed from the listener thread as 
+   * responses are decoded, and the responses still have to be requested:
+   * <pre>
+   *    size_t amps = my_mdc2250.aggregateTelemetry(queries::motor_amps, 0);
+   *    my_mdc2250.setTelemetry("A,V", 10, my_callback);
+   *    ...
+   *    AggregateSnapshot aggregate = my_mdc2250.getAggregate(amps);
+   * </pre>
+   * 
+   * \param type QueryType of the responses, e.g. queries::motor_amps.
+   * \param channel size_t index of the value in the response, from 0.
+   * 
+   * \return size_t the index of the signal, for getAggregate.
+   * 
+   * \throws std::invalid_argument
+   * 
+   * \see mdc2250::TelemetryAggregator
+   */
+  size_t aggregateTelemetry(queries::QueryType type, size_t channel = 0) {
+    return this->aggregator_.addSignal(type, channel);
+  }
+
+  /*!
+   * Returns the rolling statistics of a signal over the windows ending now,
+   * this never blocks.
+   * 
+   * Samples age out of the windows even when no more are received, so after
+   * the telemetry stops the windows empty, while stamp_us keeps the receive 
+   * time of the newest sample to tell how stale the signal is.
+   * 
+   * \throws std::invalid_argument if there is no such signal.
+   */
+  AggregateSnapshot getAggregate(size_t signal) const {
+    return this->aggregator_.getSnapshot(signal);
+  }
+
+  /*!
+   * Stops aggregating every signal, it should not be called while the 
+   * aggregated responses are streaming.
+   */
+  void clearAggregation() {
+    this->aggregator_.clear();
+  }
+
+  /*!
+   * Publishes decoded telemetry and acknowledged motor commands into a POSIX
+   * shared memory segment, for other processes to read with a
+   * TelemetrySubscriber.
+   * 
+   * \param name std::string shared memory name, like "/mdc2250".
+   * 
+   * \throws std::runtime_error if the segment could not be created.
+   * 
+   * \see mdc2250::TelemetrySubscriber
+   */
+  void enableSharedTelemetry(const std::string &name);
+
+  /*!
+   * Stops publishing and removes the shared memory segment.
+   */
+  void disableSharedTelemetry();
+
+  /*!
+   * Bounds the time waited for echoes, acks and responses.
+   * 
+   * The waits adapt to the measured round trip of each kind of exchange, 
+   * see mdc2250::RttEstimator, starting at 200 ms and staying within these
+   * bounds, which default to 20 ms and 1000 ms.  Equal bounds give a fixed 
+   * timeout.
+   * 
+   * \throws std::invalid_argument if min_ms is 0 or greater than max_ms.
+   */
+  void setTimeoutBounds(size_t min_ms, size_t max_ms) {
+    this->rtt_.setBounds((uint64_t)min_ms * 1000, (uint64_t)max_ms * 1000);
+  }
+
+  /*!
+   * Returns the round trip estimate and current timeout of one kind of 
+   * exchange.
+   */
+  RttEstimate getRttEstimate(rtt_kinds::RttKind kind) const {
+    return this->rtt_.estimate(kind);
+  }
+
+  /*!
+   * Includes the fault (FF) and status (FS) flags in the query history of 
+   * the next setTelemetry, so flag changes are seen one telemetry period 
+   * after they happen instead of when someone polls for them.  Flags added
+   * this way only go to the flag monitor, not to the telemetry callback.
+   * 
+   * \see MDC2250::setFlagHandler
+   */
+  void setFlagMonitoring(bool enabled) {
+    this->monitor_flags_ = enabled;
+  }
+
+  /*!
+   * Sets the function called for each fault or status flag which is set or
+   * cleared, with the receive time of the response.
+   * 
+   * It is called from the listener thread, so it should return quickly.
+   * 
+   * \see mdc2250::FlagEvent
+   */
+  void setFlagHandler(FlagCallback flag_handler) {
+    this->flag_monitor_.setHandler(flag_handler);
+  }
+
+  /*!
+   * Returns the latest fault flags, see mdc2250::fault_flags.
+   */
+  uint32_t getFaultFlags() const {
+    return this->flag_monitor_.faults();
+  }
+
+  /*!
+   * Returns the latest status flags, see mdc2250::status_flags.
+   */
+  uint32_t getStatusFlags() const {
+    return this->flag_monitor_.status();
+  }
+
+  /*!
+   * Returns the latest odometry estimate, this never blocks.
+   * 
+   * \returns OdometrySnapshot with per wheel counts, position and velocity.
+   */
+  OdometrySnapshot getOdometry() const {
+    return this->odometry_.getSnapshot();
+  }
+
+  /*!
+   * Issues a query without blocking.
+   * 
+   * The query is queued with the writer and the callback is called with 
+   * the first response starting with the query's name, like "C=" for "?C", 
+   * or with results::response_timeout.  The response is still given to any 
+   * filter or telemetry callback which matches it.
+   * 
+   * Timeouts are checked by the listener's read thread after every read, 
+   * so they fire up to one serial port read timeout late.
+   * 
+   * \param query std::string query, like "?C" or "?AI 1".
+   * \param callback mdc2250::AsyncCallback called with the result.
+   * \param timeout_ms long time to wait for the response, 0 for the timeout
+   * derived from the measured round trips, see MDC2250::setTimeoutBounds.
+   */
+  void asyncQuery(const std::string &query, AsyncCallback callback,
+                  long timeout_ms = 0);
+
+  /*!
+   * Issues a command without blocking.
+   * 
+   * The callback is called once the command has been acknowledged, with 
+   * results::nak, results::echo_timeout or results::ack_timeout.  With echo 
+   * enabled, the echo of the command identifies its acknowledgement.  With 
+   * echo disabled, acknowledgements are given to the asynchronous commands 
+   * in order, so they should not be mixed with blocking commands.
+   * 
+   * \param command std::string command, like "!G 1 500".
+   * \param callback mdc2250::AsyncCallback called with the result.
+   * \param timeout_ms long time to wait for the echo and the 
+   * acknowledgement, 0 for the timeout derived from the measured round 
+   * trips.
+   */
+  void asyncCommand(const std::string &command, AsyncCallback callback,
+                    long timeout_ms = 0);
+
+  /*!
+   * Waits without blocking for the next response of a given type, usually 
+   * from the automatic telemetry, see MDC2250::setTelemetry.
+   * 
+   * \param type mdc2250::queries::QueryType to wait for.
+   * \param callback mdc2250::AsyncCallback called with the response.
+   * \param timeout_ms long time to wait, 0 for the maximum timeout.
+   */
+  void asyncNextTelemetry(queries::QueryType type, AsyncCallback callback,
+                          long timeout_ms = 0);
+
+  /*!
+   * Returns the number of asynchronous requests outstanding.
+   */
+  size_t getPendingRequests() const {
+    return this->async_pending_;
+  }
+
+#if defined(MDC2250_HAS_COROUTINES)
+  /*!
+   * Returns an awaitable which issues a query, see asyncQuery.
+   * 
+   * Example: mdc2250::AsyncResponse r = co_await my_mdc2250.query("?C");
+   * 
+   * \see mdc2250/coroutine.h
+   */
+  QueryAwaitable query(const std::string &query, long timeout_ms = 0);
+
+  /*!
+   * Returns an awaitable which issues a command, see asyncCommand.
+   * 
+   * Example: mdc2250::AsyncResponse r = 
+   *            co_await my_mdc2250.command("!G 1 500");
+   */
+  CommandAwaitable command(const std::string &command, long timeout_ms = 0);
+
+  /*!
+   * Returns an awaitable which waits for the next response of a type, see 
+   * asyncNextTelemetry.
+   */
+  TelemetryAwaitable nextTelemetry(queries::QueryType type,
+                                   long timeout_ms = 0);
+#endif
+
   /*!
    * Sets the function to be called when an info logging message occurs.
    * 
@@ -335,12 +971,44 @@ public:
    * \param info_handler A function pointer to the callback to handle new 
    * Info messages.
    * 
-   * \see serial::utils::LoggingCallback
+   * While connected, the callback is called from the logging thread, not 
+   * from the thread which logged the message.
+   * 
+   * \see mdc2250::LoggingCallback, MDC2250::setLogHandler
    */
   void setInfoHandler(LoggingCallback info_handler) {
     this->info = info_handler;
   }
 
+  /*!
+   * Sets the function to receive structured log records instead of the 
+   * info handler.
+   * 
+   * Records are queued without locking by the thread which logs them and 
+   * handed to this function from a background thread while connected.
+   * 
+   * \see mdc2250::Logger, mdc2250::LogRecord
+   */
+  void setLogHandler(LogSink log_handler) {
+    this->log_handler_ = log_handler;
+  }
+
+  /*!
+   * Sets the lowest level logged, defaults to info, or debug in debug mode.
+   * 
+   * \see MDC2250_LOG_LEVEL for removing levels at compile time.
+   */
+  void setLogLevel(log_levels::LogLevel level) {
+    this->logger_.setLevel(level);
+  }
+
+  /*!
+   * Returns the number of log records dropped because the queue was full.
+   */
+  uint64_t getDroppedLogRecords() const {
+    return this->logger_.dropped();
+  }
+
   /*!
    * Sets the function to be called when an exception occurs internally.
    * 
@@ -355,27 +1023,126 @@ public:
   void
   setExceptionHandler (ExceptionCallback exception_handler) {
     this->handle_exc = exception_handler;
-    // Reset the listener's exception handler
+    // Reset the listener's and writer's exception handlers
     this->listener_.setExceptionHandler(this->handle_exc);
+    this->writer_.setExceptionHandler(this->handle_exc);
   }
 
 private:
-  // Implementation of _issueCommand, used by issueQuery too
-  bool _issueCommand(const std::string &command, std::string &failure_reason,
-                     const std::string &cmd_type);
+  template <typename Model> friend class Controller;
+  friend class ControllerGroup;
+
+  // Opens the transport set by connect, starts the threads and sets up the
+  // controller
+  void connect_(size_t watchdog_time, bool echo);
+  // Stops the threads, closes the transport and fails pending requests
+  void teardown_();
+  // Logs tokens which no filter matched, in debug mode
+  void log_unparsed_(const std::string &token);
+  // Sink of the logger, hands records to the log or info handler
+  void emit_log_(const LogRecord &record);
+  // Handles a complete line as soon as it has been tokenized, returns true
+  // if it was consumed
+  bool handle_line_(const char *line, size_t length, uint64_t stamp_us);
+  // Expires asynchronous requests, called from the read thread
+  void handle_tick_(uint64_t now_us);
+  // Matches the echo of the command in flight
+  bool is_echo_(const std::string &token);
+  // An outstanding asynchronous request
+  struct AsyncRequest {
+    enum State {
+      idle,
+      awaiting_echo,
+      awaiting_ack,
+      awaiting_response,
+      awaiting_telemetry
+    } state;
+    // Used to find the oldest request
+    uint64_t sequence;
+    uint64_t deadline_us;
+    queries::QueryType type;
+    // Queued messages the writer has written once this command is, zero if
+    // written urgently and SIZE_MAX until written
+    size_t written_mark;
+    // The command as sent, and the echo or response prefix to match
+    size_t command_length;
+    char command[max_token_length];
+    size_t match_length;
+    char match[max_token_length];
+    AsyncCallback callback;
+  };
+  // A finished asynchronous request, whose callback is called unlocked
+  struct AsyncCompletion {
+    AsyncCallback callback;
+    Result result;
+    size_t length;
+    char response[max_token_length];
+  };
+  // Registers an asynchronous request and writes its command, if any
+  void start_async_(AsyncRequest::State state, const char *command,
+                    size_t length, queries::QueryType type, long timeout_ms,
+                    AsyncCallback callback);
+  // Registers an asynchronous request, returns its index, or
+  // max_async_requests after calling the callback with the failure
+  size_t register_async_(AsyncRequest::State state, const char *command,
+                         size_t length, queries::QueryType type,
+                         long timeout_ms, AsyncCallback callback);
+  // Writes the command of a registered request, queued with the writer or
+  // urgently from the calling thread, fails the request if it can't
+  bool write_async_(size_t index, const char *command, size_t length,
+                    bool urgent);
+  // Takes the echo and acknowledgements of the batch in flight, returns 
+  // true if the line was part of them
+  bool match_batch_(const char *line, size_t length);
+  // Advances over the next part of the batch's echo if the text matches it,
+  // called with batch_mutex_ held
+  bool match_batch_echo_(const char *text, size_t length);
+  // Acknowledgements owed to commands the writer had written before 
+  // writing written queued messages, called with urgent_mutex_ held
+  size_t acks_written_(size_t written);
+  // Matches a line against the asynchronous requests, returns true if it
+  // was consumed
+  bool match_async_(const char *line, size_t length,
+                    queries::QueryType type);
+  // Moves a request to the completions, called with async_mutex_ held
+  void complete_async_(size_t index, results::ResultCode code,
+                       const char *response, size_t length,
+                       AsyncCompletion *completions, size_t &count);
+  // Calls the callbacks of finished requests
+  void finish_async_(AsyncCompletion *completions, size_t count);
+
+  // Starts confirming the estop state in the background
+  void confirm_estop_async_();
+  // Body of the estop confirmation thread
+  void confirm_estop_();
+  // Queues a null terminated string with the writer
+  bool write_(const char *data);
+  // Allocation free implementation of issueCommand, waits for the ack
+  Result issue_command_(const char *command, size_t length);
+  // Commands the effort of one channel, which the callers have validated
+  Result command_channel_(size_t channel, long effort);
+  // Writes a command and waits for its echo, used by queries too, acks is
+  // the number of acknowledgements it owes the transaction in progress
+  Result write_command_(const char *command, size_t length, size_t acks = 0);
+  // Queues a message owing acknowledgements to the transaction in progress
+  bool queue_owed_(const char *data, size_t length, size_t acks);
   // Function to setup commonly used, persistent filters
   void setupFilters();
   // Detects the motor controller's echo state
   void detect_echo_();
   // Detects the motor controller's estop state
   void detect_emergency_stop_();
+  // Checks a telemetry configuration against the link budget
+  void check_link_budget_(double telemetry);
 
-  // Time to wait for responses from the device
-  long cmd_time;
+  // Round trip estimates, the waits for responses are derived from them
+  RttEstimator rtt_;
 
   // Exception callback handle
   ExceptionCallback handle_exc;
   LoggingCallback info;
+  LogSink log_handler_;
+  Logger logger_;
 
   // Serial port name
   std::string port_;
@@ -384,16 +1151,42 @@ private:
   std::string device_string_;
   std::string control_unit_;
   std::string controller_model_;
+  // Announcement of the last reset, and the port and announcement the
+  // device info above was queried for
+  std::string fid_;
+  std::string identity_port_;
+  std::string identity_fid_;
+
+  // Transport and listener
+  TransportPtr                  transport_;
+  Listener                      listener_;
+  Writer                        writer_;
+  ReadLatencyProfile            read_latency_profile_;
 
-  // Serial port and listener
-  serial::Serial                serial_port_;
-  serial::utils::SerialListener listener_;
+  // Held for the duration of each command and response exchange
+  boost::mutex transaction_mutex_;
 
   // Fitlers
-  serial::utils::BufferedFilterPtr ack_filter;
-  serial::utils::BufferedFilterPtr nak_filter;
-  serial::utils::BufferedFilterPtr ping_filter;
-  std::vector<serial::utils::FilterPtr> telemetry_filters_;
+  BufferedFilterPtr echo_filter;
+  BufferedFilterPtr ack_filter;
+  BufferedFilterPtr ping_filter;
+  std::vector<FilterPtr> telemetry_filters_;
+
+  // The running telemetry, restarted if a new one is rejected
+  std::vector<std::string> telemetry_queries_;
+  size_t telemetry_period_;
+  // Sends "# C", a ping and the queries, waits for them to be answered
+  Result probe_telemetry_(const std::vector<std::string> &queries);
+  // Writes "# <period>", called with the transaction_mutex_ held
+  Result start_telemetry_(size_t period);
+  // Restarts the running telemetry after a failed switch, called with the 
+  // transaction_mutex_ held and its callbacks in place
+  void restore_telemetry_();
+
+  // Echo expected for the command in flight, matched by is_echo_
+  boost::mutex echo_mutex_;
+  char expected_echo_[max_token_length];
+  size_t expected_echo_length_;
 
   // Connection state
   bool connected_;
@@ -401,11 +1194,94 @@ private:
   // Echo setting state
   bool echo_;
 
+  // Watchdog timeout in milliseconds
+  boost::atomic<size_t> watchdog_;
+
+  // Link budget and the counters of the previous utilization sample
+  boost::mutex link_mutex_;
+  double max_link_utilization_;
+  bool reject_over_budget_;
+  double telemetry_bandwidth_;
+  TelemetrySwitch telemetry_switch_;
+  uint64_t link_sample_ns_;
+  uint64_t link_sent_;
+  uint64_t link_received_;
+  uint64_t link_commands_;
+  LinkUtilization link_utilization_;
+
   // Estop state
-  bool estop_;
+  boost::atomic<bool> estop_;
+  EstopCallback estop_handler_;
+
+  // Urgent estops whose acknowledgement has not been seen yet, and whether
+  // the next acknowledgement belongs to one, only used by the tokenizer
+  boost::atomic<size_t> urgent_acks_pending_;
+  bool urgent_ack_next_;
+  // Without echo, the command acknowledgements that come before that of 
+  // each estop, after the previous one, guarded by urgent_mutex_
+  boost::mutex urgent_mutex_;
+  size_t estop_skips_[max_pending_estops];
+  size_t estop_skips_head_;
+  size_t estop_skips_count_;
+  // Acknowledgements owed to the command transaction in progress, and the 
+  // queue ticket of the message owing each, guarded by urgent_mutex_
+  boost::atomic<size_t> acks_owed_;
+  size_t owed_tickets_[max_batch_commands];
+  size_t owed_tickets_count_;
+
+  // The batch in flight, see tryIssueCommands
+  boost::mutex batch_mutex_;
+  boost::condition_variable batch_condition_;
+  boost::atomic<bool> batch_active_;
+  std::string batch_echo_;
+  size_t batch_echo_position_;
+  char batch_acks_[max_batch_commands];
+  size_t batch_acks_received_;
+  // Commands sent in batches beyond the first of each line
+  boost::atomic<uint64_t> batched_commands_;
+
+  // Asynchronous requests, the ack owner is only used by the read thread
+  boost::mutex async_mutex_;
+  AsyncRequest async_requests_[max_async_requests];
+  boost::atomic<size_t> async_pending_;
+  uint64_t async_sequence_;
+  int async_ack_owner_;
+
+  // Background confirmation of the estop state
+  boost::atomic<bool> estop_confirm_pending_;
+  boost::atomic<bool> estop_confirming_;
+  boost::thread estop_confirm_thread_;
 
   // Debug mode
   bool debug_mode_;
+
+  // Latest decoded responses, written only from the tokenizer
+  TelemetrySnapshot telemetry_state_;
+  SeqLock<TelemetrySnapshot> telemetry_;
+
+  // Odometry integrator, fed from the tokenizer
+  OdometryIntegrator odometry_;
+  boost::atomic<bool> odometry_enabled_;
+
+  // Position in the telemetry cycle, fed from the tokenizer
+  TelemetryHealthMonitor telemetry_health_;
+
+  // Rolling statistics, fed from the tokenizer
+  TelemetryAggregator aggregator_;
+
+  // Fault and status flags, fed from the tokenizer
+  FlagMonitor flag_monitor_;
+  bool monitor_flags_;
+  // Set while the telemetry carries flags the caller did not ask for, which
+  // handle_line_ keeps from the callbacks
+  boost::atomic<bool> hide_fault_flags_;
+  boost::atomic<bool> hide_status_flags_;
+
+  // Shared memory publisher, fed from the tokenizer and the motor commands
+  void publish_estop_();
+  TelemetryPublisher publisher_;
+  boost::mutex publisher_mutex_;
+  boost::atomic<bool> publishing_;
 };
 
 /*!
@@ -414,17 +1290,19 @@ private:
 class ConnectionFailedException : public std::exception {
   const std::string e_what_;
   int error_type_;
+  std::string what_;
 public:
   ConnectionFailedException(const std::string &e_what, int error_type = 0)
-  : e_what_(e_what), error_type_(error_type) {}
+  : e_what_(e_what), error_type_(error_type)
+  {
+    this->what_ = "Connecting to the MDC2250: " + this->e_what_;
+  }
   ~ConnectionFailedException() throw() {}
 
   int error_type() {return error_type_;}
 
   virtual const char * what() const throw() {
-    std::stringstream ss;
-    ss << "Connecting to the MDC2250: " << this->e_what_;
-    return ss.str().c_str();
+    return this->what_.c_str();
   }
 };
 
@@ -434,21 +1312,54 @@ public:
 class CommandFailedException : public std::exception {
   const std::string command_, e_what_;
   int error_type_;
+  std::string what_;
 public:
   CommandFailedException(const std::string &command,
                          const std::string &e_what, int error_type = 0)
-  : command_(command), e_what_(e_what), error_type_(error_type) {}
+  : command_(command), e_what_(e_what), error_type_(error_type)
+  {
+    this->what_ = "Command " + this->command_ + " failed: " + this->e_what_;
+  }
+  /*!
+   * Constructs the exception from a failed Result, error_type returns the 
+   * results::ResultCode.
+   */
+  CommandFailedException(const std::string &command, const Result &result)
+  : command_(command), e_what_(result.message()), error_type_(result.code)
+  {
+    this->what_ = "Command " + this->command_ + " failed: " + this->e_what_;
+  }
   ~CommandFailedException() throw() {}
 
   int error_type() {return error_type_;}
 
   virtual const char * what() const throw() {
-    std::stringstream ss;
-    ss << "Command " << this->command_ << " failed: " << this->e_what_;
-    return ss.str().c_str();
+    return this->what_.c_str();
   }
 };
 
+/*!
+ * Connects to the controller on a serial port once with each profile and 
+ * measures it with MDC2250::measureReadLatency, to choose between the 
+ * lowest latency and the fewest wakeups.
+ * 
+ * Connecting resets the controller, so nothing else may be using it.
+ * 
+ * \param port std::string serial port, like "/dev/ttyUSB0".
+ * \param profiles the ReadLatencyProfiles to try.
+ * \param samples size_t number of pings with each.
+ * 
+ * \throws ConnectionFailedException if a connection attempt fails.
+ */
+std::vector<ReadLatencyMeasurement>
+probeReadLatency(const std::string &port,
+                 const std::vector<ReadLatencyProfile> &profiles,
+                 size_t samples = 100);
+
 }
 
+#if defined(MDC2250_HAS_COROUTINES)
+# include "mdc2250/coroutine.h"
+#endif
+
 #endif
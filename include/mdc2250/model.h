@@ -0,0 +1,334 @@
+/*!
+ * \file mdc2250/model.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides compile time traits of the Roboteq controller models and a
+ * controller class templated on them, whose commands and readings use fixed
+ * size arrays and compile time checked channels.
+ */
+
+#ifndef MDC2250_MODEL_H
+#define MDC2250_MODEL_H
+
+// Standard Library Headers
+#include <cstddef>
+#include <string>
+#include <stdint.h>
+
+// Boost Headers
+#include <boost/array.hpp>
+#include <boost/static_assert.hpp>
+
+// MDC2250 Headers
+#include "mdc2250/clock.h"
+#include "mdc2250/decode.h"
+#include "mdc2250/mdc2250.h"
+#include "mdc2250/result.h"
+#include "mdc2250/telemetry.h"
+
+/*!
+ * The bit of a query in the query_mask of the model traits.
+ */
+#define MDC2250_QUERY_BIT(type) (((uint64_t)1) << mdc2250::queries::type)
+
+namespace mdc2250 {
+
+/*!
+ * Traits of a query whose number of values is known at compile time.
+ * 
+ * A query answers values plus per_channel times the model's number of 
+ * channels values, and name is what is sent after the '?'.  Queries whose 
+ * number of values depends on the model's inputs, like "?AI", have no 
+ * traits and are only available through the MDC2250 class.
+ */
+template <queries::QueryType Type> struct QueryTraits;
+
+#define MDC2250_QUERY_TRAITS(type, query, fixed, channel)                   \
+  template <> struct QueryTraits<queries::type> {                           \
+    static const size_t values = fixed;                                     \
+    static const size_t per_channel = channel;                              \
+    static const char * name() { return query; }                            \
+  }
+
+MDC2250_QUERY_TRAITS(motor_amps, "A", 0, 1);
+MDC2250_QUERY_TRAITS(battery_amps, "BA", 0, 1);
+MDC2250_QUERY_TRAITS(brushless_motor_speed_rpm, "BS", 0, 1);
+MDC2250_QUERY_TRAITS(brushless_motor_speed_percent, "BSR", 0, 1);
+MDC2250_QUERY_TRAITS(encoder_count_absolute, "C", 0, 1);
+MDC2250_QUERY_TRAITS(brushless_encoder_count_absolute, "CB", 0, 1);
+MDC2250_QUERY_TRAITS(brushless_encoder_count_relative, "CBR", 0, 1);
+MDC2250_QUERY_TRAITS(encoder_count_relative, "CR", 0, 1);
+MDC2250_QUERY_TRAITS(digital_inputs, "D", 1, 0);
+MDC2250_QUERY_TRAITS(digital_output_status, "DO", 1, 0);
+MDC2250_QUERY_TRAITS(closed_loop_error, "E", 0, 1);
+MDC2250_QUERY_TRAITS(feedback_in, "F", 0, 1);
+MDC2250_QUERY_TRAITS(fault_flag, "FF", 1, 0);
+MDC2250_QUERY_TRAITS(status_flag, "FS", 1, 0);
+MDC2250_QUERY_TRAITS(lock_status, "LK", 1, 0);
+MDC2250_QUERY_TRAITS(motor_command_applied, "M", 0, 1);
+MDC2250_QUERY_TRAITS(motor_power_output_applied, "P", 0, 1);
+MDC2250_QUERY_TRAITS(encoder_speed_rpm, "S", 0, 1);
+MDC2250_QUERY_TRAITS(encoder_speed_relative, "SR", 0, 1);
+// The MCU's temperature, then one per channel
+MDC2250_QUERY_TRAITS(temperature, "T", 1, 1);
+// Internal, battery and 5V output volts
+MDC2250_QUERY_TRAITS(volts, "V", 3, 0);
+
+#undef MDC2250_QUERY_TRAITS
+
+/*!
+ * The number of values a query answers on the given model.
+ */
+template <typename Model, queries::QueryType Type>
+struct QueryValues {
+  static const size_t count = QueryTraits<Type>::values +
+    QueryTraits<Type>::per_channel * Model::channels;
+};
+
+template <typename Model, queries::QueryType Type>
+const size_t QueryValues<Model, Type>::count;
+
+/*!
+ * True if the given model answers the query.
+ */
+template <typename Model, queries::QueryType Type>
+struct SupportsQuery {
+  static const bool value = ((Model::query_mask >> Type) & 1) != 0;
+};
+
+template <typename Model, queries::QueryType Type>
+const bool SupportsQuery<Model, Type>::value;
+
+// Queries answered by every model with brushed motors
+const uint64_t brushed_queries =
+  MDC2250_QUERY_BIT(motor_amps) | MDC2250_QUERY_BIT(battery_amps) |
+  MDC2250_QUERY_BIT(encoder_count_absolute) |
+  MDC2250_QUERY_BIT(encoder_count_relative) |
+  MDC2250_QUERY_BIT(digital_inputs) |
+  MDC2250_QUERY_BIT(digital_output_status) |
+  MDC2250_QUERY_BIT(closed_loop_error) | MDC2250_QUERY_BIT(feedback_in) |
+  MDC2250_QUERY_BIT(fault_flag) | MDC2250_QUERY_BIT(status_flag) |
+  MDC2250_QUERY_BIT(lock_status) |
+  MDC2250_QUERY_BIT(motor_command_applied) |
+  MDC2250_QUERY_BIT(motor_power_output_applied) |
+  MDC2250_QUERY_BIT(encoder_speed_rpm) |
+  MDC2250_QUERY_BIT(encoder_speed_relative) |
+  MDC2250_QUERY_BIT(temperature) | MDC2250_QUERY_BIT(volts);
+
+/*!
+ * The dual channel MDC2250.
+ * 
+ * A model's traits give its number of motor channels, the range of the 
+ * motor efforts and the query_mask of the queries it answers, see 
+ * MDC2250_QUERY_BIT.  Traits of other models can be defined the same way.
+ */
+struct MDC2250Traits {
+  static const size_t channels = 2;
+  static const long min_effort = -1000;
+  static const long max_effort = 1000;
+  static const uint64_t query_mask = brushed_queries;
+  static const char * name() { return "MDC2250"; }
+};
+
+/*!
+ * The single channel SDC2130.
+ */
+struct SDC2130Traits {
+  static const size_t channels = 1;
+  static const long min_effort = -1000;
+  static const long max_effort = 1000;
+  static const uint64_t query_mask = brushed_queries;
+  static const char * name() { return "SDC2130"; }
+};
+
+/*!
+ * Commands and reads a connected controller with the types of its model.
+ * 
+ * Channels are template arguments checked at compile time, efforts and 
+ * readings are fixed size arrays sized by the model, and only the queries 
+ * the model answers compile.  It uses the given MDC2250, which speaks the 
+ * protocol shared by Roboteq's controllers, for everything else:
+ * 
+ * <pre>
+ *    mdc2250::MDC2250 mdc2250;
+ *    mdc2250.connect("/dev/ttyUSB0");
+ *    mdc2250::Controller<mdc2250::SDC2130Traits> controller(mdc2250);
+ *    controller.command<1>(500);
+ *    // controller.command<2>(500); does not compile
+ *    mdc2250::Controller<mdc2250::SDC2130Traits>::Reading<
+ *      mdc2250::queries::motor_amps> amps;
+ *    controller.query(amps);
+ * </pre>
+ */
+template <typename Model>
+class Controller {
+public:
+  typedef boost::array<long, Model::channels> Efforts;
+
+  /*!
+   * The values of one query, sized for the model.
+   */
+  template <queries::QueryType Type>
+  struct Reading {
+    typedef boost::array<long, QueryValues<Model, Type>::count> Values;
+    Values values;
+    // Receive time, see mdc2250::monotonic_usec, if known
+    uint64_t stamp_us;
+    // True if every value was received
+    bool valid;
+
+    Reading() : stamp_us(0), valid(false) {
+      this->values.assign(0);
+    }
+  };
+
+  explicit Controller(MDC2250 &mdc2250) : mdc2250_(mdc2250) {}
+
+  /*!
+   * Returns the MDC2250 used.
+   */
+  MDC2250 & device() {
+    return this->mdc2250_;
+  }
+
+  /*!
+   * Commands the effort of a channel, numbered from 1.
+   * 
+   * \return Result, invalid_argument if the effort is out of the model's
+   * range.
+   */
+  template <size_t Channel>
+  Result command(long effort) {
+    BOOST_STATIC_ASSERT(Channel >= 1 && Channel <= Model::channels);
+    if (effort < Model::min_effort || effort > Model::max_effort) {
+      return Result(results::invalid_argument, "!G", 2);
+    }
+    return this->mdc2250_.command_channel_(Channel, effort);
+  }
+
+  /*!
+   * Commands the efforts of every channel, with "!M" on dual channel 
+   * models and one "!G" per channel otherwise.
+   */
+  Result commandAll(const Efforts &efforts) {
+    for (size_t i = 0; i < Model::channels; ++i) {
+      if (efforts[i] < Model::min_effort || efforts[i] > Model::max_effort) {
+        return Result(results::invalid_argument, "!M", 2);
+      }
+    }
+    if (Model::channels == 2) {
+      return this->mdc2250_.tryCommandMotors(efforts[0],
+                                             efforts[Model::channels - 1]);
+    }
+    Result result;
+    for (size_t i = 0; i < Model::channels && result.ok(); ++i) {
+      result = this->mdc2250_.command_channel_(i + 1, efforts[i]);
+    }
+    return result;
+  }
+
+  /*!
+   * Returns the latest telemetry of a query, see MDC2250::getTelemetry.
+   */
+  template <queries::QueryType Type>
+  Reading<Type> latest() const {
+    BOOST_STATIC_ASSERT((SupportsQuery<Model, Type>::value));
+    BOOST_STATIC_ASSERT(
+      (QueryValues<Model, Type>::count <= max_telemetry_channels));
+    TelemetrySnapshot snapshot = this->mdc2250_.getTelemetry();
+    const TelemetryValue &value = snapshot[Type];
+    Reading<Type> reading;
+    for (size_t i = 0; i < reading.values.size() && i < value.count; ++i) {
+      reading.values[i] = value.values[i];
+    }
+    reading.stamp_us = value.stamp_us;
+    reading.valid = (value.count == reading.values.size());
+    return reading;
+  }
+
+  /*!
+   * Queries the controller once.
+   * 
+   * \return Result, invalid_response if the response did not have the 
+   * model's number of values.
+   */
+  template <queries::QueryType Type>
+  Result query(Reading<Type> &reading) {
+    BOOST_STATIC_ASSERT((SupportsQuery<Model, Type>::value));
+    std::string query = std::string("?") + QueryTraits<Type>::name();
+    std::string prefix = std::string(QueryTraits<Type>::name()) + "=";
+    std::string response;
+    Result result = this->mdc2250_.tryIssueQuery(
+      query, Listener::startsWith(prefix), response);
+    if (!result.ok()) {
+      return result;
+    }
+    if (!decode(response.data(), response.length(), reading)) {
+      return Result(results::invalid_response, query.data(),
+                    query.length());
+    }
+    reading.stamp_us = monotonic_usec();
+    return result;
+  }
+
+  /*!
+   * Decodes a response of the query in place, without allocating memory.
+   * 
+   * \return bool true if it was a response of the query with the model's 
+   * number of values.
+   */
+  template <queries::QueryType Type>
+  static bool decode(const char *raw, size_t length, Reading<Type> &reading)
+  {
+    reading.valid = false;
+    if (detect_response_type(raw, length) != Type) {
+      return false;
+    }
+    // Decode one more than expected to detect extra values
+    long values[QueryValues<Model, Type>::count + 1];
+    size_t count = decode_channels(raw, length, values,
+                                   reading.values.size() + 1);
+    if (count != reading.values.size()) {
+      return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      reading.values[i] = values[i];
+    }
+    reading.valid = true;
+    return true;
+  }
+
+private:
+  MDC2250 &mdc2250_;
+};
+
+} // mdc2250 namespace
+
+#endif
@@ -0,0 +1,139 @@
+/*!
+ * \file mdc2250/odometry.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides an incremental wheel odometry integrator which is fed
+ * directly by the encoder count telemetry of the MDC2250.
+ */
+
+#ifndef MDC2250_ODOMETRY_H
+#define MDC2250_ODOMETRY_H
+
+// Standard Library Headers
+#include <cstddef>
+#include <stdint.h>
+
+// MDC2250 Headers
+#include "mdc2250/seqlock.h"
+
+namespace mdc2250 {
+
+/*!
+ * The latest odometry estimate for both wheels.
+ */
+struct OdometrySnapshot {
+  // Accumulated encoder counts, extended to 64 bits
+  int64_t counts[2];
+  // Position of each wheel, counts divided by counts per unit
+  double position[2];
+  // Velocity of each wheel in units per second
+  double velocity[2];
+  // Receive time of the last sample, see mdc2250::monotonic_usec
+  uint64_t stamp_us;
+  // Number of samples integrated since the last reset
+  uint64_t samples;
+};
+
+/*!
+ * Integrates encoder count responses into per wheel position and velocity.
+ * 
+ * Samples are expected from a single thread, normally the listener thread,
+ * and the result is published through a SeqLock so any thread can read the
+ * latest estimate with getSnapshot without blocking the listener.
+ */
+class OdometryIntegrator {
+public:
+  /*!
+   * Selects which encoder count response is integrated.
+   */
+  typedef enum {
+    absolute_counts, // C= responses, 32 bit counters which wrap around
+    relative_counts  // CR= responses, counts since the last CR query
+  } Source;
+
+  OdometryIntegrator();
+
+  /*!
+   * Sets up the integrator and resets its state.
+   * 
+   * \param source Which of the encoder responses to integrate.
+   * \param counts_per_unit1 Encoder counts per unit of distance on wheel 1.
+   * \param counts_per_unit2 Encoder counts per unit of distance on wheel 2.
+   * 
+   * \throws std::invalid_argument if either counts_per_unit is 0.
+   */
+  void configure(Source source, double counts_per_unit1,
+                 double counts_per_unit2);
+
+  /*!
+   * Clears the accumulated counts and the published snapshot.
+   */
+  void reset();
+
+  /*!
+   * Returns the configured source.
+   */
+  Source source() const {
+    return this->source_;
+  }
+
+  /*!
+   * Integrates a sample of encoder counts.
+   * 
+   * \param counts The decoded values of the response, one per channel.
+   * \param channels The number of values in counts, extra values are 
+   * ignored and a missing second channel is treated as unchanged.
+   * \param stamp_us The time the response was received in microseconds.
+   */
+  void update(const long *counts, size_t channels, uint64_t stamp_us);
+
+  /*!
+   * Returns the most recently published estimate.
+   */
+  OdometrySnapshot getSnapshot() const {
+    return this->snapshot_.load();
+  }
+
+private:
+  Source source_;
+  double counts_per_unit_[2];
+
+  // Integration state, only touched by the thread calling update
+  bool have_last_;
+  uint32_t last_raw_[2];
+  uint64_t last_stamp_us_;
+  OdometrySnapshot state_;
+
+  SeqLock<OdometrySnapshot> snapshot_;
+};
+
+} // mdc2250 namespace
+
+#endif
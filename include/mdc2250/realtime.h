@@ -0,0 +1,99 @@
+/*!
+ * \file mdc2250/realtime.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides helpers for running library threads with real-time
+ * scheduling, CPU affinity and locked memory.
+ */
+
+#ifndef MDC2250_REALTIME_H
+#define MDC2250_REALTIME_H
+
+// Boost Headers
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+namespace mdc2250 {
+
+/*!
+ * Describes how a thread should be scheduled.
+ * 
+ * The defaults leave the thread untouched.
+ */
+struct ThreadOptions {
+  ThreadOptions(int priority_ = 0, int cpu_ = -1)
+  : priority(priority_), cpu(cpu_) {}
+
+  /*!
+   * Returns true if these options leave the thread unchanged.
+   */
+  bool isDefault() const {
+    return this->priority == 0 && this->cpu < 0;
+  }
+
+  // SCHED_FIFO priority from 1 to 99, 0 keeps the default policy
+  int priority;
+  // CPU to pin the thread to, -1 allows any CPU
+  int cpu;
+};
+
+/*!
+ * Applies the given options to the calling thread.
+ * 
+ * Real-time priorities usually require elevated privileges (CAP_SYS_NICE or 
+ * an rtprio limit), and CPU affinity is only supported on Linux.
+ * 
+ * \throws std::runtime_error if the options cannot be applied.
+ */
+void configureCurrentThread(const ThreadOptions &options);
+
+/*!
+ * Locks all current and future pages of the process into memory.
+ * 
+ * \throws std::runtime_error if mlockall fails.
+ */
+void lockMemory();
+
+/*!
+ * Starts a thread which applies the options to itself before running the
+ * function, the calling thread is left untouched.
+ * 
+ * Unless the options are the defaults, this waits until the new thread has
+ * applied them, so a failure is reported to the caller.
+ * 
+ * \throws std::runtime_error if the options cannot be applied, in which 
+ * case the function is never run.
+ */
+boost::thread startThread(const ThreadOptions &options,
+                          const boost::function<void()> &function);
+
+} // mdc2250 namespace
+
+#endif
@@ -0,0 +1,136 @@
+/*!
+ * \file mdc2250/result.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides the result codes returned by the exception free interface of
+ * the MDC2250 class.
+ */
+
+#ifndef MDC2250_RESULT_H
+#define MDC2250_RESULT_H
+
+// Standard Library Headers
+#include <cstring>
+#include <string>
+
+namespace mdc2250 {
+
+namespace results {
+  /*
+   * This is an enumeration of the possible outcomes of a command or query.
+   */
+  typedef enum {
+    success,
+    not_connected,
+    invalid_argument,
+    command_too_long,
+    write_failed,
+    echo_timeout,
+    nak,
+    ack_timeout,
+    response_timeout,
+    invalid_response,
+    busy
+  } ResultCode;
+} // results namespace
+
+/*!
+ * Returns a short description of a ResultCode.
+ */
+inline const char *
+result_code_to_string(results::ResultCode code) {
+  using namespace results;
+  switch (code) {
+    case success: return "success";
+    case not_connected: return "not connected";
+    case invalid_argument: return "invalid argument";
+    case command_too_long: return "command is too long";
+    case write_failed: return "failed to write the command";
+    case echo_timeout: return "timed out waiting for the echo";
+    case nak: return "received a non-acknowledgement ('-')";
+    case ack_timeout: return "timed out waiting for an acknowledgement";
+    case response_timeout: return "timed out waiting for a response";
+    case invalid_response: return "received an invalid response";
+    case busy: return "too many requests are outstanding";
+    default: break;
+  }
+  return "unknown";
+}
+
+/*!
+ * The outcome of a command or query, returned by the try* functions of 
+ * MDC2250.
+ * 
+ * It is small and does not allocate memory, the human readable message is 
+ * only formatted when message is called.
+ */
+struct Result {
+  // Longest command stored, longer commands are truncated
+  static const size_t max_command_length = 15;
+
+  Result(results::ResultCode code_ = results::success,
+         const char *command_ = "", size_t length = 0)
+  : code(code_)
+  {
+    if (length > max_command_length) {
+      length = max_command_length;
+    }
+    std::memcpy(this->command, command_, length);
+    this->command[length] = '\0';
+  }
+
+  /*!
+   * Returns true if the command or query succeeded.
+   */
+  bool ok() const {
+    return this->code == results::success;
+  }
+
+  /*!
+   * Formats a message describing the result.
+   */
+  std::string message() const {
+    std::string message = "Command ";
+    message += this->command;
+    message += ": ";
+    message += result_code_to_string(this->code);
+    message += ".";
+    return message;
+  }
+
+  // What happened
+  results::ResultCode code;
+  // The command or query which this is the result of, null terminated
+  char command[max_command_length + 1];
+};
+
+} // mdc2250 namespace
+
+#endif
@@ -0,0 +1,180 @@
+/*!
+ * \file mdc2250/rtt.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides round trip time estimation for the exchanges with the motor
+ * controller, from which the timeouts of those exchanges are derived.
+ */
+
+#ifndef MDC2250_RTT_H
+#define MDC2250_RTT_H
+
+// Standard Library Headers
+#include <cstddef>
+#include <stdint.h>
+
+// Boost Headers
+#include <boost/thread/mutex.hpp>
+
+namespace mdc2250 {
+
+namespace rtt_kinds {
+  /*
+   * This is an enumeration of the exchanges whose round trip is tracked.
+   */
+  typedef enum {
+    echo,          // From writing a command until its echo
+    command,       // Until the ack of a runtime (!) command
+    configuration, // Until the ack or response of a ^ or ~ command
+    query,         // Until the response of a ? query
+    ping,          // From writing ^E until the ^F
+    count
+  } RttKind;
+} // rtt_kinds namespace
+
+/*!
+ * Returns the name of an RttKind, like "query".
+ */
+inline const char *
+rtt_kind_to_string(rtt_kinds::RttKind kind) {
+  using namespace rtt_kinds;
+  switch (kind) {
+    case echo: return "echo";
+    case command: return "command";
+    case configuration: return "configuration";
+    case query: return "query";
+    case ping: return "ping";
+    default: break;
+  }
+  return "unknown";
+}
+
+/*!
+ * Returns the kind of exchange a command or query makes after its echo.
+ */
+inline rtt_kinds::RttKind
+rtt_kind_of(const char *command, size_t length) {
+  if (length == 0) {
+    return rtt_kinds::command;
+  }
+  switch (command[0]) {
+    case '?': return rtt_kinds::query;
+    case '^': case '~': return rtt_kinds::configuration;
+    case '\x05': return rtt_kinds::ping;
+    default: break;
+  }
+  return rtt_kinds::command;
+}
+
+/*!
+ * The round trip estimate of one kind of exchange.
+ */
+struct RttEstimate {
+  // Smoothed round trip time, 0 before the first sample
+  uint64_t srtt_us;
+  // Smoothed mean deviation of the round trip time
+  uint64_t rttvar_us;
+  // Timeout currently used for this kind of exchange
+  uint64_t timeout_us;
+  // Number of round trips measured
+  uint64_t samples;
+  // Number of exchanges which timed out
+  uint64_t timeouts;
+};
+
+/*!
+ * Estimates round trip times and derives timeouts from them, the way TCP
+ * derives its retransmission timeout (RFC 6298).
+ * 
+ * Each kind of exchange keeps a smoothed round trip time and its mean 
+ * deviation, and times out after the smoothed time plus four deviations, 
+ * bounded by a configurable minimum and maximum.  A timeout doubles the 
+ * timeout of its kind until the next successful exchange, so a link which 
+ * became slower is not declared dead over and over.  Only exchanges which 
+ * completed are sampled.
+ */
+class RttEstimator {
+public:
+  /*!
+   * \param initial_timeout_us uint64_t timeout used before the first 
+   * sample of each kind.
+   */
+  RttEstimator(uint64_t min_timeout_us = 20000,
+               uint64_t max_timeout_us = 1000000,
+               uint64_t initial_timeout_us = 200000);
+
+  /*!
+   * Sets the bounds of every timeout.
+   * 
+   * \throws std::invalid_argument if min_timeout_us is 0 or greater than 
+   * max_timeout_us.
+   */
+  void setBounds(uint64_t min_timeout_us, uint64_t max_timeout_us);
+
+  /*!
+   * Forgets every estimate.
+   */
+  void reset();
+
+  /*!
+   * Adds a measured round trip.
+   */
+  void sample(rtt_kinds::RttKind kind, uint64_t rtt_us);
+
+  /*!
+   * Records an exchange which timed out, backing its timeout off.
+   */
+  void timedOut(rtt_kinds::RttKind kind);
+
+  /*!
+   * Returns the timeout of a kind of exchange in milliseconds, rounded up.
+   */
+  long timeoutMs(rtt_kinds::RttKind kind) const;
+
+  /*!
+   * Returns the maximum timeout in milliseconds, rounded up.
+   */
+  long maxTimeoutMs() const;
+
+  RttEstimate estimate(rtt_kinds::RttKind kind) const;
+
+private:
+  uint64_t clamp_(uint64_t timeout_us) const;
+
+  mutable boost::mutex mutex_;
+  uint64_t min_timeout_us_;
+  uint64_t max_timeout_us_;
+  uint64_t initial_timeout_us_;
+  RttEstimate estimates_[rtt_kinds::count];
+};
+
+} // mdc2250 namespace
+
+#endif
@@ -0,0 +1,102 @@
+/*!
+ * \file mdc2250/seqlock.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides a single writer, many reader sequence lock used to publish
+ * snapshots of state from the listener thread without blocking either side.
+ */
+
+#ifndef MDC2250_SEQLOCK_H
+#define MDC2250_SEQLOCK_H
+
+// Standard Library Headers
+#include <cstring>
+#include <stdint.h>
+
+// Boost Headers
+#include <boost/atomic.hpp>
+
+namespace mdc2250 {
+
+/*!
+ * Publishes the latest value of a plain data type to any number of readers.
+ * 
+ * There must only be one thread writing at a time, but readers never block
+ * the writer and the writer never blocks readers.  A reader which races
+ * with a write simply retries its copy.  T must be safe to copy with memcpy.
+ */
+template <typename T>
+class SeqLock {
+public:
+  SeqLock() : sequence_(0) {
+    std::memset(&this->value_, 0, sizeof(T));
+  }
+
+  /*!
+   * Publishes a new value, only call this from the single writer thread.
+   */
+  void store(const T &value) {
+    uint32_t seq = this->sequence_.load(boost::memory_order_relaxed);
+    this->sequence_.store(seq + 1, boost::memory_order_relaxed);
+    boost::atomic_thread_fence(boost::memory_order_release);
+    std::memcpy(&this->value_, &value, sizeof(T));
+    this->sequence_.store(seq + 2, boost::memory_order_release);
+  }
+
+  /*!
+   * Returns a consistent copy of the most recently published value.
+   */
+  T load() const {
+    T result;
+    uint32_t before, after;
+    do {
+      before = this->sequence_.load(boost::memory_order_acquire);
+      std::memcpy(&result, &this->value_, sizeof(T));
+      boost::atomic_thread_fence(boost::memory_order_acquire);
+      after = this->sequence_.load(boost::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return result;
+  }
+
+  /*!
+   * Returns the number of values published so far.
+   */
+  uint32_t version() const {
+    return this->sequence_.load(boost::memory_order_acquire) / 2;
+  }
+
+private:
+  boost::atomic<uint32_t> sequence_;
+  T value_;
+};
+
+} // mdc2250 namespace
+
+#endif
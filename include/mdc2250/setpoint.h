@@ -0,0 +1,175 @@
+/*!
+ * \file mdc2250/setpoint.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides a setpoint channel which rate limits and coalesces motor
+ * commands before they are sent to the motor controller.
+ */
+
+#ifndef MDC2250_SETPOINT_H
+#define MDC2250_SETPOINT_H
+
+// Standard Library Headers
+#include <cstddef>
+#include <string>
+#include <stdint.h>
+
+// Boost Headers
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+
+// MDC2250 Headers
+#include "mdc2250/mdc2250.h"
+#include "mdc2250/realtime.h"
+#include "mdc2250/seqlock.h"
+
+namespace mdc2250 {
+
+/*!
+ * Statistics of a SetpointStreamer.
+ */
+struct SetpointStatistics {
+  // Number of calls to set and setMotor
+  uint64_t updates;
+  // Number of motor commands sent, including refreshes
+  uint64_t sent;
+  // Number of updates which were replaced by a newer one before being sent
+  uint64_t coalesced;
+  // Number of sends skipped because the setpoint had not changed
+  uint64_t unchanged;
+  // Number of unchanged setpoints sent again to feed the watchdog
+  uint64_t refreshes;
+  // Number of motor commands which failed to be sent or acknowledged
+  uint64_t send_failures;
+};
+
+/*!
+ * Sends motor setpoints at a bounded rate, keeping only the newest one.
+ * 
+ * Callers write the desired efforts with set or setMotor, which never block 
+ * and can be called at any rate from any thread.  A sender thread wakes at 
+ * the configured maximum rate and sends the newest setpoint with 
+ * MDC2250::commandMotors, but only if it changed since the last send or if 
+ * the motor controller's watchdog needs to be fed.  This keeps a fast 
+ * planner from saturating the serial link and starving the telemetry.
+ * 
+ * Example:
+ * <pre>
+ *    mdc2250::SetpointStreamer setpoints(my_mdc2250);
+ *    setpoints.start(50); // At most 50 commands per second
+ *    ...
+ *    setpoints.set(left_effort, right_effort); // From the 1 kHz planner
+ * </pre>
+ */
+class SetpointStreamer {
+public:
+  SetpointStreamer(MDC2250 &mdc2250);
+  virtual ~SetpointStreamer();
+
+  /*!
+   * Starts the sender thread.
+   * 
+   * \param max_rate_hz size_t maximum number of commands sent per second.
+   * \param refresh_ms size_t time in milliseconds after which an unchanged 
+   * setpoint is sent again.  If 0, half of the MDC2250's watchdog timeout is 
+   * used, and no refreshes are sent if the watchdog is disabled.
+   * \param options ThreadOptions for the sender thread.
+   * 
+   * \throws std::invalid_argument if max_rate_hz is 0.
+   * \throws std::runtime_error if the options could not be applied.
+   */
+  void start(size_t max_rate_hz, size_t refresh_ms = 0,
+             const ThreadOptions &options = ThreadOptions());
+
+  /*!
+   * Stops the sender thread, a pending setpoint is not sent.
+   */
+  void stop();
+
+  /*!
+   * Returns true if the sender thread is running.
+   */
+  bool isRunning() const {
+    return this->running_;
+  }
+
+  /*!
+   * Sets the efforts of both motors, see MDC2250::commandMotors.
+   * 
+   * \throws std::invalid_argument if an effort is not between -1000 and 
+   * 1000 inclusively.
+   */
+  void set(long motor1_effort, long motor2_effort);
+
+  /*!
+   * Sets the effort of one motor, leaving the other unchanged.
+   * 
+   * \param motor_index size_t 1 or 2.
+   * \param motor_effort long between -1000 and 1000 inclusively.
+   * 
+   * \throws std::invalid_argument if either argument is out of range.
+   */
+  void setMotor(size_t motor_index, long motor_effort);
+
+  /*!
+   * Returns the statistics, this never blocks the sender.
+   */
+  SetpointStatistics getStatistics() const;
+
+private:
+  SetpointStreamer(const SetpointStreamer &);
+  void operator=(const SetpointStreamer &);
+
+  // Body of the sender thread
+  void run_(ThreadOptions options);
+
+  MDC2250 &mdc2250_;
+  uint64_t period_ns_;
+  uint64_t refresh_ns_;
+
+  // Both efforts packed as 16 bit halves, so they are updated together
+  boost::atomic<uint32_t> setpoint_;
+  boost::atomic<uint64_t> updates_;
+
+  boost::thread thread_;
+  boost::atomic<bool> running_;
+
+  // Used to report the result of applying the thread options to start
+  boost::mutex startup_mutex_;
+  boost::condition_variable startup_condition_;
+  bool started_;
+  std::string startup_error_;
+
+  SeqLock<SetpointStatistics> statistics_;
+};
+
+} // mdc2250 namespace
+
+#endif
@@ -0,0 +1,252 @@
+/*!
+ * \file mdc2250/shared_telemetry.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides a publisher of decoded telemetry and command state in a POSIX
+ * shared memory segment, and the reader used by other processes.
+ */
+
+#ifndef MDC2250_SHARED_TELEMETRY_H
+#define MDC2250_SHARED_TELEMETRY_H
+
+// Standard Library Headers
+#include <cstddef>
+#include <string>
+#include <stdint.h>
+
+// Boost Headers
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+
+// MDC2250 Headers
+#include "mdc2250/decode.h"
+#include "mdc2250/seqlock.h"
+#include "mdc2250/telemetry.h"
+
+namespace mdc2250 {
+
+// Identifies a segment and its layout, bump the version on any change
+const uint32_t shared_telemetry_magic = 0x4d444332; // "MDC2"
+const uint32_t shared_telemetry_version = 2;
+
+/*!
+ * Number of samples kept in the broadcast ring, a power of 2.
+ */
+const size_t shared_telemetry_ring_size = 1024;
+
+/*!
+ * The last motor commands acknowledged by the motor controller.
+ */
+struct SharedCommandState {
+  // Efforts of motor 1 and 2, between -1000 and 1000
+  long efforts[2];
+  // Number of motor commands acknowledged
+  uint64_t commands;
+  // Time of the last motor command, see mdc2250::monotonic_usec
+  uint64_t stamp_us;
+  // 1 if the motor controller is emergency stopped
+  uint32_t estopped;
+};
+
+/*!
+ * One decoded response, as broadcast to every reader.
+ */
+struct SharedSample {
+  // Position of the sample in the stream, starting at 0
+  uint64_t sequence;
+  // mdc2250::queries::QueryType of the response
+  uint32_t type;
+  TelemetryValue value;
+};
+
+/*!
+ * Layout of the shared memory segment.
+ * 
+ * The publisher is the only writer.  The latest values are seqlocked, and 
+ * each ring slot is a seqlock of its own, so readers never block the 
+ * publisher and a reader which falls more than a ring behind only loses 
+ * the overwritten samples.
+ */
+struct SharedTelemetrySegment {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t ring_size;
+  // Process id of the publisher
+  uint32_t pid;
+  // Cleared when the publisher closes the segment
+  boost::atomic<uint32_t> publishing;
+  SeqLock<TelemetrySnapshot> latest;
+  SeqLock<SharedCommandState> commands;
+  // Number of samples written to the ring so far
+  boost::atomic<uint64_t> head;
+  SeqLock<SharedSample> ring[shared_telemetry_ring_size];
+};
+
+/*!
+ * Publishes telemetry into a named shared memory segment.
+ * 
+ * Samples must be published from a single thread, which MDC2250 does from
+ * its listener.  Command state may be published from any thread.
+ */
+class TelemetryPublisher {
+public:
+  TelemetryPublisher();
+  virtual ~TelemetryPublisher();
+
+  /*!
+   * Creates the segment, replacing any left behind by an earlier publisher.
+   * 
+   * \param name std::string shared memory name, like "/mdc2250".
+   * 
+   * \throws std::runtime_error if the segment could not be created.
+   */
+  void open(const std::string &name);
+
+  /*!
+   * Marks the segment as no longer published and removes its name, readers
+   * which have it mapped keep their mapping.
+   */
+  void close();
+
+  bool isOpen() const {
+    return this->segment_ != NULL;
+  }
+
+  /*!
+   * Publishes a decoded response and the snapshot which includes it.
+   */
+  void publishSample(queries::QueryType type, const TelemetryValue &value,
+                     const TelemetrySnapshot &snapshot);
+
+  /*!
+   * Publishes the acknowledged effort of one motor, motor_index is 1 or 2.
+   */
+  void publishCommand(size_t motor_index, long motor_effort);
+
+  /*!
+   * Publishes the acknowledged efforts of both motors.
+   */
+  void publishCommands(long motor1_effort, long motor2_effort);
+
+  /*!
+   * Publishes the emergency stop state.
+   */
+  void publishEstop(bool estopped);
+
+private:
+  TelemetryPublisher(const TelemetryPublisher &);
+  void operator=(const TelemetryPublisher &);
+
+  // Stores command_state_ with command_mutex_ held
+  void store_commands_();
+
+  std::string name_;
+  SharedTelemetrySegment *segment_;
+  uint64_t head_;
+  // Serializes the command state writers
+  boost::mutex command_mutex_;
+  SharedCommandState command_state_;
+};
+
+/*!
+ * Reads a segment published by a TelemetryPublisher, usually in another 
+ * process.
+ * 
+ * Example:
+ * <pre>
+ *    mdc2250::TelemetrySubscriber subscriber;
+ *    subscriber.open("/mdc2250");
+ *    mdc2250::SharedSample sample;
+ *    while (subscriber.next(sample)) {
+ *      // Every sample since the last call, oldest first
+ *    }
+ *    mdc2250::TelemetrySnapshot latest = subscriber.latest();
+ * </pre>
+ */
+class TelemetrySubscriber {
+public:
+  TelemetrySubscriber();
+  virtual ~TelemetrySubscriber();
+
+  /*!
+   * Maps the segment read only and starts reading at the newest sample.
+   * 
+   * \throws std::runtime_error if the segment doesn't exist or was made 
+   * by an incompatible version.
+   */
+  void open(const std::string &name);
+
+  void close();
+
+  bool isOpen() const {
+    return this->segment_ != NULL;
+  }
+
+  /*!
+   * Returns true while the publisher has the segment open.
+   */
+  bool isPublishing() const;
+
+  /*!
+   * Returns the latest value of every type of response.
+   */
+  TelemetrySnapshot latest() const;
+
+  /*!
+   * Returns the last acknowledged motor commands and estop state.
+   */
+  SharedCommandState commands() const;
+
+  /*!
+   * Copies the next unread sample into sample.
+   * 
+   * \returns bool false if there is no new sample.
+   */
+  bool next(SharedSample &sample);
+
+  /*!
+   * Returns the number of samples overwritten before they were read.
+   */
+  uint64_t lost() const {
+    return this->lost_;
+  }
+
+private:
+  TelemetrySubscriber(const TelemetrySubscriber &);
+  void operator=(const TelemetrySubscriber &);
+
+  const SharedTelemetrySegment *segment_;
+  uint64_t next_;
+  uint64_t lost_;
+};
+
+} // mdc2250 namespace
+
+#endif
@@ -0,0 +1,89 @@
+/*!
+ * \file mdc2250/telemetry.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides the snapshot of the latest decoded telemetry which the
+ * MDC2250 class publishes from its listener thread.
+ */
+
+#ifndef MDC2250_TELEMETRY_H
+#define MDC2250_TELEMETRY_H
+
+// Standard Library Headers
+#include <cstddef>
+#include <stdint.h>
+
+// MDC2250 Headers
+#include "mdc2250/decode.h"
+
+namespace mdc2250 {
+
+/*!
+ * The maximum number of values kept for a single telemetry response.
+ */
+const size_t max_telemetry_channels = 4;
+
+/*!
+ * The latest decoded values of one type of response.
+ */
+struct TelemetryValue {
+  // Decoded values, one per channel
+  long values[max_telemetry_channels];
+  // Number of valid entries in values, 0 if never received
+  uint32_t count;
+  // Receive time, see mdc2250::monotonic_usec
+  uint64_t stamp_us;
+  // Position in the telemetry stream, see MDC2250::getTelemetryHealth, 0 if 
+  // the response was not part of the telemetry cycle
+  uint64_t sequence;
+};
+
+/*!
+ * The latest decoded value of every type of response.
+ */
+struct TelemetrySnapshot {
+  // Indexed by mdc2250::queries::QueryType
+  TelemetryValue fields[queries::unknown];
+  // Receive time of the newest response of any type
+  uint64_t stamp_us;
+  // Number of responses decoded since connecting
+  uint64_t samples;
+
+  /*!
+   * Returns the latest value of the given type of response.
+   */
+  const TelemetryValue & operator[](queries::QueryType type) const {
+    return this->fields[type];
+  }
+};
+
+} // mdc2250 namespace
+
+#endif
@@ -0,0 +1,227 @@
+/*!
+ * \file mdc2250/telemetry_health.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides tracking of the telemetry sent with "#" query history.
+ * The controller repeats the history in a fixed order, one response per
+ * period, so lost, duplicated and corrupted lines can be detected from the
+ * position in that cycle.
+ */
+
+#ifndef MDC2250_TELEMETRY_HEALTH_H
+#define MDC2250_TELEMETRY_HEALTH_H
+
+// Standard Library Headers
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+
+// Boost Headers
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+
+// MDC2250 Headers
+#include "mdc2250/decode.h"
+
+namespace mdc2250 {
+
+/*!
+ * Statistics of arrival intervals, in microseconds.
+ */
+struct IntervalStatistics {
+  uint64_t samples;
+  double mean_us;
+  // Standard deviation, the jitter around the mean
+  double jitter_us;
+  uint64_t max_us;
+};
+
+/*!
+ * The health of one field of the telemetry cycle.
+ */
+struct FieldHealth {
+  queries::QueryType type;
+  uint64_t received;
+  // Lines expected in the cycle which never arrived
+  uint64_t lost;
+  uint64_t duplicated;
+  // Lines which arrived in this field's place but could not be decoded
+  uint64_t corrupted;
+  // Lost and corrupted lines over the lines expected
+  double loss_rate;
+  // Between successive lines of this field, ideally the cycle's length
+  IntervalStatistics interval;
+};
+
+/*!
+ * The health of the telemetry since it was last configured.
+ */
+struct TelemetryHealth {
+  // Number of responses in the cycle and the period between them
+  size_t cycle_length;
+  size_t period_ms;
+  // Totals of the fields
+  uint64_t received;
+  uint64_t lost;
+  uint64_t duplicated;
+  uint64_t corrupted;
+  double loss_rate;
+  // Complete cycles seen
+  uint64_t cycles;
+  // Silences longer than two periods, and the longest silence
+  uint64_t gaps;
+  uint64_t longest_gap_us;
+  // Between successive lines of any field, ideally the period
+  IntervalStatistics interval;
+  // Receive time of the newest line, see mdc2250::monotonic_usec
+  uint64_t last_stamp_us;
+  // One per field of the cycle, in the order they are sent
+  std::vector<FieldHealth> fields;
+};
+
+/*!
+ * The interruption of the telemetry by the last reconfiguration.
+ */
+struct TelemetrySwitch {
+  // Number of queries probed, and the time until all were answered
+  size_t queries;
+  uint64_t probe_us;
+  // Time from stopping the old telemetry to starting the new one
+  uint64_t stopped_us;
+  // Estimated longest time without telemetry the switch causes: the time 
+  // stopped plus one period of each of the old and the new telemetry.  This
+  // is computed, not measured, the measured gaps are in TelemetryHealth.
+  uint64_t gap_estimate_us;
+};
+
+/*!
+ * Follows the position in the telemetry cycle line by line.
+ * 
+ * When a line arrives which is not the expected one, the lines skipped to
+ * reach it are counted as lost.  A line of the same field arriving again 
+ * well within a period is a duplicate.  A line of a field of the cycle 
+ * which can not be decoded, or which has unprintable characters, takes the
+ * place of the expected line and is counted as corrupted.  Lines of other 
+ * fields, such as the answers to queries and configuration reads, are 
+ * ignored, but answers to queries of the cycle's fields made while it runs
+ * are indistinguishable from telemetry.
+ * 
+ * update is called from the listener's read thread and does not allocate.
+ */
+class TelemetryHealthMonitor {
+public:
+  TelemetryHealthMonitor();
+
+  /*!
+   * Starts following the given cycle, resetting the statistics.
+   * 
+   * \param cycle the types of the responses in the order they are sent.
+   * \param period_ms size_t period between responses in milliseconds.
+   */
+  void start(const std::vector<queries::QueryType> &cycle, size_t period_ms);
+
+  /*!
+   * Stops following the cycle, the statistics are kept.
+   */
+  void stop();
+
+  /*!
+   * Returns true if a cycle is being followed.
+   */
+  bool isRunning() const {
+    return this->running_;
+  }
+
+  /*!
+   * Accounts for a line, returns its sequence number: its position in the
+   * stream of expected lines, counting the lost ones, starting at 1.
+   * 
+   * \param type QueryType of the line, queries::unknown if not recognized.
+   * \param valid bool false if the line could not be decoded.
+   * \param printable bool false if the line has unprintable characters.
+   * \param stamp_us uint64_t receive time of the line.
+   * 
+   * \return uint64_t the sequence number, 0 if not part of the cycle.
+   */
+  uint64_t update(queries::QueryType type, bool valid, bool printable,
+                  uint64_t stamp_us);
+
+  /*!
+   * Returns the health of the telemetry so far.
+   */
+  TelemetryHealth health();
+
+private:
+  struct FieldState {
+    uint64_t received;
+    uint64_t lost;
+    uint64_t duplicated;
+    uint64_t corrupted;
+    uint64_t last_stamp_us;
+    // Welford's running mean and sum of squared deviations
+    uint64_t intervals;
+    double interval_mean;
+    double interval_m2;
+    uint64_t interval_max;
+  };
+
+  // Records an interval into running statistics
+  static void add_interval_(uint64_t interval, uint64_t &count, double &mean,
+                            double &m2, uint64_t &max);
+  static IntervalStatistics interval_statistics_(uint64_t count, double mean,
+                                                 double m2, uint64_t max);
+
+  boost::atomic<bool> running_;
+  boost::mutex mutex_;
+  std::vector<queries::QueryType> cycle_;
+  // One per position of the cycle
+  std::vector<FieldState> fields_;
+  // Bit per QueryType in the cycle
+  uint64_t cycle_mask_;
+  size_t period_ms_;
+  // Next expected position in the cycle and sequence number
+  size_t position_;
+  uint64_t sequence_;
+  uint64_t cycles_;
+  uint64_t gaps_;
+  uint64_t longest_gap_us_;
+  uint64_t last_stamp_us_;
+  // Position and sequence number of the last line, for duplicates
+  size_t last_position_;
+  uint64_t last_sequence_;
+  uint64_t intervals_;
+  double interval_mean_;
+  double interval_m2_;
+  uint64_t interval_max_;
+};
+
+} // mdc2250 namespace
+
+#endif
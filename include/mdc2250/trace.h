@@ -0,0 +1,135 @@
+/*!
+ * \file mdc2250/trace.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides low overhead tracing of the protocol path.  Each thread
+ * records events into its own ring buffer, which can be written out in the
+ * Chrome trace event format.
+ */
+
+#ifndef MDC2250_TRACE_H
+#define MDC2250_TRACE_H
+
+// Standard Library Headers
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <stdint.h>
+
+// Boost Headers
+#include <boost/atomic.hpp>
+
+/*!
+ * Define MDC2250_NO_TRACING to remove the trace points at compile time, 
+ * otherwise they cost a relaxed load while tracing is disabled.
+ */
+#if !defined(MDC2250_NO_TRACING)
+# define MDC2250_TRACE(phase, name, value)                                  \
+  do {                                                                      \
+    if (mdc2250::tracing_enabled_.load(boost::memory_order_relaxed)) {     \
+      mdc2250::record_trace_event_((phase), (name), (uint64_t)(value));    \
+    }                                                                       \
+  } while (0)
+#else
+# define MDC2250_TRACE(phase, name, value) ((void)0)
+#endif
+
+/*!
+ * Trace points, name must be a string literal.  Begin and end events must 
+ * be paired on the same thread, instant events stand alone.  The value is 
+ * shown as the event's argument, like a byte count or a result code.
+ */
+#define MDC2250_TRACE_BEGIN(name, value) MDC2250_TRACE('B', name, value)
+#define MDC2250_TRACE_END(name, value) MDC2250_TRACE('E', name, value)
+#define MDC2250_TRACE_INSTANT(name, value) MDC2250_TRACE('i', name, value)
+
+namespace mdc2250 {
+
+// Events kept per thread unless given to enableTracing
+const size_t default_trace_events = 65536;
+
+/*!
+ * Starts recording trace events.
+ * 
+ * Each thread gets a ring buffer of the given number of events the first 
+ * time it records one, once full the oldest events are overwritten.  The 
+ * size of existing buffers does not change.  When a thread exits its 
+ * events are kept until a new thread takes over its buffer, so threads 
+ * that come and go do not add up.
+ */
+void enableTracing(size_t events_per_thread = default_trace_events);
+
+/*!
+ * Stops recording trace events, the recorded events are kept.
+ */
+void disableTracing();
+
+/*!
+ * Returns true if trace events are being recorded.
+ */
+bool isTracing();
+
+/*!
+ * Forgets the events recorded so far.
+ */
+void clearTrace();
+
+/*!
+ * Names the calling thread in traces, name must be a string literal.
+ * 
+ * This does not allocate and may be called whether tracing or not.
+ */
+void setTraceThreadName(const char *name);
+
+/*!
+ * Writes the recorded events as Chrome trace event JSON, which 
+ * chrome://tracing and the Perfetto UI open.
+ * 
+ * This may be called while tracing, events overwritten while they are 
+ * being written out are skipped.
+ * 
+ * \return size_t the number of events written.
+ */
+size_t writeChromeTrace(std::ostream &out);
+
+/*!
+ * Writes the Chrome trace to a file, see writeChromeTrace.
+ * 
+ * \throws std::runtime_error if the file could not be written.
+ */
+size_t writeChromeTrace(const std::string &path);
+
+// Used by the MDC2250_TRACE macros
+extern boost::atomic<bool> tracing_enabled_;
+void record_trace_event_(char phase, const char *name, uint64_t value);
+
+} // mdc2250 namespace
+
+#endif
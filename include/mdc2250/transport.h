@@ -0,0 +1,366 @@
+/*!
+ * \file mdc2250/transport.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides the transports the MDC2250 class talks to the controller
+ * over: a serial port, an in memory loopback pair for tests and benchmarks
+ * and a raw TCP client for serial over Ethernet gateways.
+ */
+
+#ifndef MDC2250_TRANSPORT_H
+#define MDC2250_TRANSPORT_H
+
+// Standard Library Headers
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+// Boost Headers
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+// Serial Headers
+#include "serial/serial.h"
+
+namespace mdc2250 {
+
+/*!
+ * Thrown by the transports when opening, reading or writing fails.
+ */
+class TransportException : public std::runtime_error {
+public:
+  TransportException(const std::string &what)
+  : std::runtime_error(what) {}
+};
+
+/*!
+ * A byte stream to the motor controller.
+ * 
+ * The Listener reads from one thread while the Writer writes from another,
+ * so implementations must allow one concurrent reader and writer.
+ */
+class Transport {
+public:
+  virtual ~Transport() {}
+
+  /*!
+   * Opens the transport, throws a TransportException on failure.
+   */
+  virtual void open() = 0;
+
+  /*!
+   * Closes the transport, a blocked read returns soon after.
+   */
+  virtual void close() = 0;
+
+  virtual bool isOpen() const = 0;
+
+  /*!
+   * Waits up to the read timeout for data, then reads whatever has arrived.
+   * 
+   * \param buffer uint8_t pointer to at least size bytes.
+   * \param size size_t the most bytes to read, at least 1.
+   * 
+   * \return size_t the number of bytes read, 0 if the timeout passed.
+   */
+  virtual size_t read(uint8_t *buffer, size_t size) = 0;
+
+  /*!
+   * Writes all of the given bytes, throws a TransportException on failure.
+   */
+  virtual void write(const uint8_t *data, size_t size) = 0;
+
+  /*!
+   * Returns the longest a read waits for data in milliseconds, which bounds
+   * how late the Listener's tick handler runs.
+   */
+  virtual size_t readTimeoutMs() const = 0;
+
+  /*!
+   * Returns the rate the controller's end of the link carries in bytes per
+   * second, which the link budget is computed from.
+   */
+  virtual double bytesPerSecond() const = 0;
+
+  /*!
+   * Returns a name of the other end, such as the serial port.
+   */
+  virtual std::string name() const = 0;
+};
+
+typedef boost::shared_ptr<Transport> TransportPtr;
+
+namespace latency_profiles {
+  /*!
+   * Presets trading how soon received bytes are tokenized against how 
+   * often the read thread wakes up, see mdc2250::read_latency_profile.
+   */
+  typedef enum {
+    lowest_latency, // Every byte as soon as it arrives, driver low latency
+    balanced,       // Whatever has arrived when the first byte does
+    fewest_wakeups  // Lines gathered until the link goes quiet
+  } LatencyProfile;
+} // latency_profiles namespace
+
+/*!
+ * How a serial port is read, see mdc2250::SerialTransport.
+ * 
+ * The default is latency_profiles::balanced.
+ */
+struct ReadLatencyProfile {
+  ReadLatencyProfile()
+  : read_timeout_ms(100), min_read_bytes(1), inter_byte_timeout_ms(0),
+    read_buffer_bytes(1024), low_latency(false) {}
+
+  // Longest a read waits for the first byte, which bounds how late the 
+  // asynchronous request timeouts are checked
+  size_t read_timeout_ms;
+  // Bytes a read gathers before returning, 1 returns with the first byte
+  size_t min_read_bytes;
+  // Gap which ends a read short of min_read_bytes
+  size_t inter_byte_timeout_ms;
+  // Most bytes returned by one read
+  size_t read_buffer_bytes;
+  // Sets the driver's ASYNC_LOW_LATENCY flag on Linux, which makes USB 
+  // adapters like the FTDI ones hand bytes over at once instead of every 
+  // 16 ms
+  bool low_latency;
+};
+
+/*!
+ * Returns the settings of a preset.
+ * 
+ * latency_profiles::fewest_wakeups ends a read only after the link has been
+ * quiet for its whole inter-byte gap, so every short reply, like a lone 
+ * "+\r" acknowledgement, is delayed by the full gap.
+ */
+ReadLatencyProfile
+read_latency_profile(latency_profiles::LatencyProfile profile);
+
+/*!
+ * The latency and the read thread wakeups measured with a profile, see 
+ * mdc2250::MDC2250::measureReadLatency.
+ */
+struct ReadLatencyMeasurement {
+  ReadLatencyProfile profile;
+  // True if the low latency flag was requested and could be set
+  bool low_latency;
+  size_t samples;
+  // Round trip of a ping less the time its two bytes spend on the wire
+  double mean_us;
+  uint64_t min_us;
+  uint64_t p99_us;
+  uint64_t max_us;
+  // Reads returned by the transport, with or without data
+  double wakeups_per_second;
+  double wakeups_per_ping;
+};
+
+/*!
+ * A serial port, 8N1 at the given baud rate.
+ * 
+ * Reads block for the first byte, up to the read timeout, and then take 
+ * whatever else the driver has buffered.  With a ReadLatencyProfile asking
+ * for more than one byte per read, the read keeps gathering until it has 
+ * them or nothing arrives for the inter byte timeout.
+ */
+class SerialTransport : public Transport {
+public:
+  /*!
+   * Constructs the SerialTransport.
+   * 
+   * \param port std::string serial port, like "/dev/ttyUSB0".
+   * \param baudrate uint32_t baud rate, the MDC2250 defaults to 115200.
+   * \param read_timeout_ms size_t longest a read blocks.
+   */
+  SerialTransport(const std::string &port, uint32_t baudrate = 115200,
+                  size_t read_timeout_ms = 100);
+
+  /*!
+   * Constructs the SerialTransport with a read latency profile.
+   * 
+   * \param port std::string serial port, like "/dev/ttyUSB0".
+   * \param baudrate uint32_t baud rate, the MDC2250 defaults to 115200.
+   * \param profile ReadLatencyProfile how the port is read.
+   */
+  SerialTransport(const std::string &port, uint32_t baudrate,
+                  const ReadLatencyProfile &profile);
+
+  void open();
+  void close();
+  bool isOpen() const;
+  size_t read(uint8_t *buffer, size_t size);
+  void write(const uint8_t *data, size_t size);
+  size_t readTimeoutMs() const;
+  double bytesPerSecond() const;
+  std::string name() const;
+
+  /*!
+   * Returns true if the driver's low latency flag was set by open.
+   */
+  bool isLowLatency() const {
+    return this->low_latency_;
+  }
+
+private:
+  serial::Serial serial_port_;
+  std::string port_;
+  uint32_t baudrate_;
+  size_t read_timeout_ms_;
+  ReadLatencyProfile profile_;
+  bool low_latency_;
+};
+
+/*!
+ * One end of an in memory pipe pair, see LoopbackTransport::createPair.
+ * 
+ * Bytes are handed over through a fixed ring buffer and a condition 
+ * variable, so a read returns as soon as the other end writes, without a 
+ * system call.  A write blocks while the ring is full.  There is no baud 
+ * rate, bytesPerSecond returns the rate the pair was created with only so
+ * the link budget stays meaningful in benchmarks.
+ */
+class LoopbackTransport : public Transport {
+public:
+  /*!
+   * Creates two connected ends, what is written to one is read from the 
+   * other.  Closing either end closes both.
+   * 
+   * \param capacity size_t bytes buffered in each direction.
+   * \param bytes_per_second double rate reported by bytesPerSecond.
+   * \param read_timeout_ms size_t longest a read blocks.
+   */
+  static std::pair<TransportPtr, TransportPtr>
+  createPair(size_t capacity = 4096, double bytes_per_second = 11520.0,
+             size_t read_timeout_ms = 10);
+
+  void open();
+  void close();
+  bool isOpen() const;
+  size_t read(uint8_t *buffer, size_t size);
+  void write(const uint8_t *data, size_t size);
+  size_t readTimeoutMs() const;
+  double bytesPerSecond() const;
+  std::string name() const;
+
+private:
+  struct Pipe {
+    Pipe(size_t capacity) : data(capacity), head(0), count(0) {}
+    boost::mutex mutex;
+    boost::condition_variable condition;
+    std::vector<uint8_t> data;
+    size_t head;
+    size_t count;
+  };
+  struct Shared {
+    Shared(size_t capacity) : closed(false), a_to_b(capacity),
+                              b_to_a(capacity) {}
+    boost::atomic<bool> closed;
+    Pipe a_to_b;
+    Pipe b_to_a;
+  };
+
+  LoopbackTransport(const boost::shared_ptr<Shared> &shared, bool first,
+                    double bytes_per_second, size_t read_timeout_ms);
+
+  boost::shared_ptr<Shared> shared_;
+  Pipe &in_;
+  Pipe &out_;
+  bool first_;
+  double bytes_per_second_;
+  size_t read_timeout_ms_;
+};
+
+/*!
+ * A raw TCP connection to a serial over Ethernet gateway, which passes the 
+ * bytes on to the controller's serial port unchanged.
+ * 
+ * Nagle's algorithm is disabled so each command leaves in its own segment 
+ * at once, and keepalives detect a gateway which disappeared.  Reads wait 
+ * with poll, so the read timeout can be short without spinning.
+ */
+class TcpTransport : public Transport {
+public:
+  /*!
+   * Constructs the TcpTransport.
+   * 
+   * \param host std::string host name or address of the gateway.
+   * \param port uint16_t TCP port of the gateway.
+   * \param baudrate uint32_t baud rate of the gateway's serial port.
+   * \param read_timeout_ms size_t longest a read blocks.
+   * \param connect_timeout_ms size_t longest open waits for the gateway.
+   */
+  TcpTransport(const std::string &host, uint16_t port,
+               uint32_t baudrate = 115200, size_t read_timeout_ms = 20,
+               size_t connect_timeout_ms = 2000);
+  virtual ~TcpTransport();
+
+  void open();
+  void close();
+  bool isOpen() const;
+  size_t read(uint8_t *buffer, size_t size);
+  void write(const uint8_t *data, size_t size);
+  size_t readTimeoutMs() const;
+  double bytesPerSecond() const;
+  std::string name() const;
+
+private:
+  std::string host_;
+  uint16_t port_;
+  uint32_t baudrate_;
+  size_t read_timeout_ms_;
+  size_t connect_timeout_ms_;
+  boost::atomic<int> socket_;
+  // Reads and writes in progress, see close
+  boost::atomic<int> users_;
+};
+
+/*!
+ * Creates the transport for a port name: "tcp://<host>:<port>" gives a 
+ * TcpTransport, anything else a SerialTransport read with the given 
+ * profile.  A TcpTransport only takes the profile's read timeout.
+ * 
+ * \param baudrate uint32_t baud rate of the serial port, or of the 
+ * gateway's serial port.
+ * 
+ * Throws a TransportException if a TCP port name is malformed.
+ */
+TransportPtr createTransport(const std::string &port,
+                             const ReadLatencyProfile &profile =
+                               ReadLatencyProfile(),
+                             uint32_t baudrate = 115200);
+
+}
+
+#endif
@@ -0,0 +1,247 @@
+/*!
+ * \file mdc2250/writer.h
+ * \author William Woodall <wjwwood@gmail.com>
+ * \version 0.1
+ *
+ * \section LICENSE
+ *
+ * The BSD License
+ *
+ * Copyright (c) 2011 William Woodall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * \section DESCRIPTION
+ *
+ * This provides the writer used by the MDC2250 class.  All outgoing bytes
+ * are queued on a bounded, lock free, multiple producer queue and a single
+ * thread drains it, coalescing whatever is queued into one write.
+ */
+
+#ifndef MDC2250_WRITER_H
+#define MDC2250_WRITER_H
+
+// Standard Library Headers
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+
+// Boost Headers
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+
+// MDC2250 Headers
+#include "mdc2250/bounded_queue.h"
+#include "mdc2250/listener.h"
+#include "mdc2250/realtime.h"
+#include "mdc2250/seqlock.h"
+#include "mdc2250/transport.h"
+
+namespace mdc2250 {
+
+/*!
+ * Statistics of a Writer, all times are in nanoseconds.
+ */
+struct WriterStatistics {
+  // Number of messages written
+  uint64_t messages;
+  // Number of calls to write on the transport
+  uint64_t writes;
+  // Number of bytes written, urgent ones included
+  uint64_t bytes;
+  // Number of messages rejected because the queue was full
+  uint64_t rejected;
+  // Largest number of messages seen waiting in the queue
+  uint64_t queue_depth_max;
+  // Time from queueing a message until the write containing it returned
+  double latency_mean;
+  uint64_t latency_max;
+  // Time spent in each call to write
+  double write_mean;
+  uint64_t write_max;
+  // Number of messages and bytes written with writeUrgent
+  uint64_t urgent_messages;
+  uint64_t urgent_bytes;
+  // Time from calling writeUrgent until its write returned, this bounds the 
+  // time an emergency stop waits for traffic already being written
+  double urgent_latency_mean;
+  uint64_t urgent_latency_max;
+};
+
+/*!
+ * Serializes all writes to a transport through a single thread.
+ * 
+ * Any number of threads can queue messages with write, which never blocks 
+ * and never allocates memory.  The writer thread takes everything that is 
+ * queued at the time, up to its batch size, and writes it with a single 
+ * call, so the messages are written in the order they were queued.
+ * 
+ * Messages which must not wait behind the queue, like an emergency stop, 
+ * are written with writeUrgent, which bypasses the queue entirely.
+ */
+class Writer {
+public:
+  /*!
+   * Constructs the Writer.
+   * 
+   * \param queue_size size_t number of messages which can be queued, 
+   * rounded up to a power of two.
+   */
+  Writer(size_t queue_size = 64);
+  virtual ~Writer();
+
+  /*!
+   * Sets the scheduling options of the writer thread, which are applied the
+   * next time start is called.
+   */
+  void setThreadOptions(const ThreadOptions &options) {
+    this->thread_options_ = options;
+  }
+
+  /*!
+   * Sets the function called when writing a batch to the transport throws, 
+   * writeUrgent reports failures through its return value instead.
+   */
+  void setExceptionHandler(ExceptionCallback exception_handler) {
+    this->handle_exc_ = exception_handler;
+  }
+
+  /*!
+   * Sets how long the writer waits for more messages after the first one 
+   * before writing.  Defaults to 0, which writes immediately and only 
+   * coalesces messages which queued up during the previous write.
+   * 
+   * \param delay_us size_t microseconds to wait.
+   */
+  void setCoalescingDelay(size_t delay_us) {
+    this->coalescing_delay_ns_ = (uint64_t)delay_us * 1000ULL;
+  }
+
+  /*!
+   * Starts the writer thread on an open transport, which must outlive the
+   * writer thread.
+   */
+  void start(Transport &transport);
+
+  /*!
+   * Writes anything still queued and stops the writer thread.
+   */
+  void stop();
+
+  /*!
+   * Queues a message to be written.
+   * 
+   * \param data const char pointer to the message.
+   * \param length size_t length of the message, at most 
+   * mdc2250::max_token_length.
+   * \param ticket size_t pointer, if given set to the position of the 
+   * message in the queue, see writeUrgent.
+   * 
+   * \returns bool true if queued, false if the message is too long, the 
+   * queue is full or the writer is not running.
+   */
+  bool write(const char *data, size_t length, size_t *ticket = NULL);
+
+  /*!
+   * Writes a message immediately from the calling thread, ahead of anything 
+   * waiting in the queue.
+   * 
+   * This only waits for a write which is already in progress, so the 
+   * message lands between two complete batches and never splits a line.  
+   * The time taken is recorded in the urgent statistics.
+   * 
+   * \param data const char pointer to the message.
+   * \param length size_t length of the message, at most 
+   * mdc2250::max_token_length.
+   * \param written size_t pointer, if given set to the number of queued 
+   * messages written before this one, so those whose ticket is below it 
+   * reached the transport first.
+   * 
+   * \returns bool true if written, false if the message is too long, the 
+   * writer is not running or the write failed.  This never throws, so it is
+   * safe on the estop and teardown paths.
+   */
+  bool writeUrgent(const char *data, size_t length, size_t *written = NULL);
+
+  /*!
+   * Returns the number of messages currently waiting in the queue.
+   */
+  size_t queueDepth() const {
+    return this->queue_.size();
+  }
+
+  /*!
+   * Returns the statistics, this never blocks the writer.
+   */
+  WriterStatistics getStatistics() const;
+
+private:
+  Writer(const Writer &);
+  void operator=(const Writer &);
+
+  // Body of the writer thread
+  void run_();
+  // Takes queued messages into the batch, returns the number taken
+  size_t gather_(size_t &batch_length, uint64_t *stamps, size_t max);
+
+  struct UrgentStatistics {
+    uint64_t messages;
+    uint64_t bytes;
+    double latency_mean;
+    uint64_t latency_max;
+  };
+
+  struct Message {
+    size_t length;
+    uint64_t stamp_ns;
+    char data[max_token_length];
+  };
+
+  ThreadOptions thread_options_;
+  ExceptionCallback handle_exc_;
+  uint64_t coalescing_delay_ns_;
+  Transport *transport_;
+
+  BoundedQueue<Message> queue_;
+  boost::atomic<uint64_t> rejected_;
+
+  boost::atomic<bool> running_;
+  boost::atomic<bool> sleeping_;
+  boost::mutex wake_mutex_;
+  boost::condition_variable wake_condition_;
+  boost::thread thread_;
+
+  // Held while writing to the transport, by the thread and writeUrgent
+  boost::mutex port_mutex_;
+  // Queued messages taken by the thread, and those written or discarded, 
+  // the latter guarded by port_mutex_
+  size_t taken_;
+  size_t written_;
+
+  std::vector<char> batch_;
+  std::vector<uint64_t> batch_stamps_;
+  WriterStatistics stats_;
+  SeqLock<WriterStatistics> statistics_;
+  UrgentStatistics urgent_stats_;
+  SeqLock<UrgentStatistics> urgent_statistics_;
+};
+
+} // mdc2250 namespace
+
+#endif
@@ -20,6 +20,7 @@ ENDIF(EXISTS /usr/bin/clang)
 
 option(MDC2250_BUILD_TESTS "Build all of the mdc2250 tests." OFF)
 option(MDC2250_BUILD_EXAMPLES "Build all of the mdc2250 examples." OFF)
+option(MDC2250_BUILD_DAEMON "Build the mdc2250d daemon." ON)
 
 # Allow for building shared libs override
 IF(NOT BUILD_SHARED_LIBS)
@@ -41,9 +42,53 @@ ENDIF(NOT DEFINED(LIBRARY_OUTPUT_PATH))
 include_directories(${PROJECT_SOURCE_DIR}/include)
 
 # Add default source files
-set(MDC2250_SRCS src/mdc2250.cc)
+set(MDC2250_SRCS src/mdc2250.cc
+                 src/aggregate.cc
+                 src/bandwidth.cc
+                 src/config.cc
+                 src/daemon.cc
+                 src/flags.cc
+                 src/group.cc
+                 src/control_loop.cc
+                 src/listener.cc
+                 src/log.cc
+                 src/odometry.cc
+                 src/realtime.cc
+                 src/rtt.cc
+                 src/setpoint.cc
+                 src/shared_telemetry.cc
+                 src/telemetry_health.cc
+                 src/trace.cc
+                 src/transport.cc
+                 src/writer.cc)
 # Add default header files
-set(MDC2250_HEADERS include/mdc2250/mdc2250.h)
+set(MDC2250_HEADERS include/mdc2250/mdc2250.h
+                    include/mdc2250/decode.h
+                    include/mdc2250/flags.h
+                    include/mdc2250/group.h
+                    include/mdc2250/aggregate.h
+                    include/mdc2250/bandwidth.h
+                    include/mdc2250/bounded_queue.h
+                    include/mdc2250/clock.h
+                    include/mdc2250/config.h
+                    include/mdc2250/control_loop.h
+                    include/mdc2250/coroutine.h
+                    include/mdc2250/daemon.h
+                    include/mdc2250/listener.h
+                    include/mdc2250/log.h
+                    include/mdc2250/model.h
+                    include/mdc2250/odometry.h
+                    include/mdc2250/realtime.h
+                    include/mdc2250/result.h
+                    include/mdc2250/rtt.h
+                    include/mdc2250/seqlock.h
+                    include/mdc2250/setpoint.h
+                    include/mdc2250/shared_telemetry.h
+                    include/mdc2250/telemetry.h
+                    include/mdc2250/telemetry_health.h
+                    include/mdc2250/trace.h
+                    include/mdc2250/transport.h
+                    include/mdc2250/writer.h)
 
 # Find Boost, if it hasn't already been found
 IF(NOT Boost_FOUND OR NOT Boost_SYSTEM_FOUND OR NOT Boost_FILESYSTEM_FOUND OR NOT Boost_THREAD_FOUND)
@@ -56,6 +101,10 @@ include_directories(${Boost_INCLUDE_DIRS})
 set(MDC2250_LINK_LIBS ${Boost_SYSTEM_LIBRARY}
                       ${Boost_FILESYSTEM_LIBRARY}
                       ${Boost_THREAD_LIBRARY})
+# shm_open is in librt on older Linux systems
+IF(UNIX AND NOT APPLE)
+    list(APPEND MDC2250_LINK_LIBS rt)
+ENDIF(UNIX AND NOT APPLE)
 
 # Find serial, if it hasn't already been found
 IF(NOT serial_FOUND)
@@ -75,6 +124,14 @@ endif(serial_FOUND)
 add_library(mdc2250 ${MDC2250_SRCS} ${MDC2250_HEADERS})
 target_link_libraries(mdc2250 ${MDC2250_LINK_LIBS})
 
+## Build the daemon
+
+# If asked to
+IF(MDC2250_BUILD_DAEMON)
+    add_executable(mdc2250d src/mdc2250d.cc)
+    target_link_libraries(mdc2250d mdc2250)
+ENDIF(MDC2250_BUILD_DAEMON)
+
 ## Build Examples
 
 # If asked to
@@ -99,8 +156,37 @@ IF(MDC2250_BUILD_TESTS)
     # Link the Test program to the mdc2250 library
     target_link_libraries(mdc2250_tests ${GTEST_BOTH_LIBRARIES}
                           mdc2250)
-
-    add_test(AllTestsIntest_mdc2250 mdc2250_tests)
+    # The simulated controller uses openpty
+    IF(UNIX AND NOT APPLE)
+        target_link_libraries(mdc2250_tests util)
+    ENDIF(UNIX AND NOT APPLE)
+
+    add_test(AllTestsIntest_mdc2250 ${EXECUTABLE_OUTPUT_PATH}/mdc2250_tests)
+
+    # Build the tests again as C++20 for the coroutine tests, if the 
+    # compiler supports coroutines
+    include(CheckCXXSourceCompiles)
+    set(CMAKE_REQUIRED_FLAGS "-std=c++20")
+    check_cxx_source_compiles("#include <coroutine>
+#if !defined(__cpp_impl_coroutine)
+# error No coroutines
+#endif
+int main() { return std::coroutine_handle<>() ? 1 : 0; }"
+                              MDC2250_CXX20_COROUTINES)
+    unset(CMAKE_REQUIRED_FLAGS)
+    IF(MDC2250_CXX20_COROUTINES)
+        add_executable(mdc2250_coroutine_tests tests/mdc2250_tests.cc)
+        set_target_properties(mdc2250_coroutine_tests PROPERTIES
+                              COMPILE_FLAGS "-std=c++20")
+        target_link_libraries(mdc2250_coroutine_tests ${GTEST_BOTH_LIBRARIES}
+                              mdc2250)
+        IF(UNIX AND NOT APPLE)
+            target_link_libraries(mdc2250_coroutine_tests util)
+        ENDIF(UNIX AND NOT APPLE)
+        add_test(CoroutineTestsIntest_mdc2250
+                 ${EXECUTABLE_OUTPUT_PATH}/mdc2250_coroutine_tests
+                 --gtest_filter=CoroutineTests.*)
+    ENDIF(MDC2250_CXX20_COROUTINES)
 ENDIF(MDC2250_BUILD_TESTS)
 
 ## Setup install and uninstall
@@ -118,7 +204,7 @@ IF(NOT MDC2250_DONT_CONFIGURE_INSTALL)
       ARCHIVE DESTINATION lib
     )
     
-    INSTALL(FILES include/mdc2250/mdc2250.h
+    INSTALL(FILES ${MDC2250_HEADERS}
             DESTINATION include/mdc2250)
     
     IF(NOT CMAKE_FIND_INSTALL_PATH)
@@ -27,7 +27,25 @@ ENDIF(EXISTS /usr/bin/clang)
 
 include_directories(include)
 
-set(MDC2250_SRCS src/mdc2250.cc)
+set(MDC2250_SRCS src/mdc2250.cc
+                 src/aggregate.cc
+                 src/bandwidth.cc
+                 src/config.cc
+                 src/daemon.cc
+                 src/flags.cc
+                 src/group.cc
+                 src/control_loop.cc
+                 src/listener.cc
+                 src/log.cc
+                 src/odometry.cc
+                 src/realtime.cc
+                 src/rtt.cc
+                 src/setpoint.cc
+                 src/shared_telemetry.cc
+                 src/telemetry_health.cc
+                 src/trace.cc
+                 src/transport.cc
+                 src/writer.cc)
 
 # Build the mdc2250 library
 rosbuild_add_library(${PROJECT_NAME} ${MDC2250_SRCS})
@@ -35,6 +53,13 @@ rosbuild_add_library(${PROJECT_NAME} ${MDC2250_SRCS})
 # Add boost dependencies
 rosbuild_add_boost_directories()
 rosbuild_link_boost(${PROJECT_NAME} system filesystem thread)
+IF(UNIX AND NOT APPLE)
+    target_link_libraries(${PROJECT_NAME} rt)
+ENDIF(UNIX AND NOT APPLE)
+
+# Build the daemon
+rosbuild_add_executable(mdc2250d src/mdc2250d.cc)
+target_link_libraries(mdc2250d ${PROJECT_NAME})
 
 # Build example
 rosbuild_add_executable(mdc2250_example examples/mdc2250_example.cc)
@@ -0,0 +1,189 @@
+#include "mdc2250/aggregate.h"
+#include "mdc2250/clock.h"
+
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+using namespace mdc2250;
+
+uint64_t
+mdc2250::aggregate_window_us(aggregate_windows::AggregateWindow window) {
+  switch (window) {
+    case aggregate_windows::milliseconds_100: return 100000;
+    case aggregate_windows::seconds_1: return 1000000;
+    case aggregate_windows::seconds_10: return 10000000;
+  }
+  return 0;
+}
+
+TelemetryAggregator::TelemetryAggregator() : size_(0), type_mask_(0) {}
+
+size_t TelemetryAggregator::addSignal(queries::QueryType type,
+                                      size_t channel)
+{
+  boost::mutex::scoped_lock lock(this->mutex_);
+  if (type >= queries::unknown || channel >= max_telemetry_channels) {
+    std::stringstream ss;
+    ss << "In addSignal, there is no channel " << channel << " of ";
+    ss << response_type_to_string(type) << " responses.";
+    throw(std::invalid_argument(ss.str()));
+  }
+  size_t index = this->size_.load(boost::memory_order_relaxed);
+  if (index == max_aggregate_signals) {
+    std::stringstream ss;
+    ss << "In addSignal, at most " << max_aggregate_signals;
+    ss << " signals can be aggregated.";
+    throw(std::invalid_argument(ss.str()));
+  }
+  Signal &signal = this->signals_[index];
+  signal.type = type;
+  signal.channel = channel;
+  for (size_t i = 0; i < aggregate_window_count; ++i) {
+    Window &window = signal.state.windows[i];
+    std::memset(&window, 0, sizeof(window));
+    window.bucket_us = aggregate_window_us(
+      (aggregate_windows::AggregateWindow)i) / aggregate_buckets;
+  }
+  signal.state.latest = 0.0;
+  signal.state.stamp_us = 0;
+  signal.state.samples = 0;
+  signal.published.store(signal.state);
+  // Publish the signal only once it is set up
+  this->size_.store(index + 1, boost::memory_order_release);
+  this->type_mask_.fetch_or(((uint64_t)1) << type);
+  return index;
+}
+
+void TelemetryAggregator::clear() {
+  boost::mutex::scoped_lock lock(this->mutex_);
+  this->type_mask_ = 0;
+  this->size_ = 0;
+}
+
+void TelemetryAggregator::update(queries::QueryType type,
+                                 const long *values, size_t count,
+                                 uint64_t stamp_us)
+{
+  if (type >= queries::unknown ||
+      (this->type_mask_.load(boost::memory_order_relaxed) &
+       (((uint64_t)1) << type)) == 0)
+  {
+    return;
+  }
+  size_t size = this->size_.load(boost::memory_order_acquire);
+  for (size_t i = 0; i < size; ++i) {
+    Signal &signal = this->signals_[i];
+    if (signal.type != type || signal.channel >= count) {
+      continue;
+    }
+    double value = (double)values[signal.channel];
+    signal.state.latest = value;
+    signal.state.stamp_us = stamp_us;
+    signal.state.samples++;
+    for (size_t w = 0; w < aggregate_window_count; ++w) {
+      add_sample_(signal.state.windows[w], value, stamp_us);
+    }
+    signal.published.store(signal.state);
+  }
+}
+
+AggregateSnapshot TelemetryAggregator::getSnapshot(size_t signal) const {
+  return this->getSnapshot(signal, monotonic_usec());
+}
+
+AggregateSnapshot TelemetryAggregator::getSnapshot(size_t signal,
+                                                   uint64_t now_us) const
+{
+  if (signal >= this->size()) {
+    std::stringstream ss;
+    ss << "In getSnapshot, there is no signal " << signal << ".";
+    throw(std::invalid_argument(ss.str()));
+  }
+  const Signal &source = this->signals_[signal];
+  State state = source.published.load();
+  AggregateSnapshot snapshot;
+  snapshot.type = source.type;
+  snapshot.channel = (uint32_t)source.channel;
+  snapshot.latest = state.latest;
+  snapshot.stamp_us = state.stamp_us;
+  snapshot.samples = state.samples;
+  snapshot.now_us = now_us;
+  for (size_t w = 0; w < aggregate_window_count; ++w) {
+    statistics_(state.windows[w], state.latest, state.stamp_us, now_us,
+                snapshot.windows[w]);
+  }
+  return snapshot;
+}
+
+void TelemetryAggregator::add_sample_(Window &window, double value,
+                                      uint64_t stamp_us)
+{
+  uint64_t id = stamp_us / window.bucket_us + 1;
+  if (id > window.buckets[window.current].id) {
+    // A new bucket begins, it replaces the one which left the window
+    window.current = (size_t)(id % (aggregate_buckets + 1));
+    Bucket &bucket = window.buckets[window.current];
+    std::memset(&bucket, 0, sizeof(bucket));
+    bucket.id = id;
+  }
+  Bucket &bucket = window.buckets[window.current];
+  if (bucket.samples == 0) {
+    bucket.min = value;
+    bucket.max = value;
+    bucket.first = value;
+    bucket.first_us = stamp_us;
+  } else if (value < bucket.min) {
+    bucket.min = value;
+  } else if (value > bucket.max) {
+    bucket.max = value;
+  }
+  bucket.samples++;
+  bucket.sum += value;
+  bucket.sum_squares += value * value;
+}
+
+void TelemetryAggregator::statistics_(const Window &window, double latest,
+                                      uint64_t stamp_us, uint64_t now_us,
+                                      WindowStatistics &result)
+{
+  std::memset(&result, 0, sizeof(result));
+  // The window ends at the bucket of now, or of the newest sample if later
+  uint64_t current = now_us / window.bucket_us + 1;
+  if (window.buckets[window.current].id > current) {
+    current = window.buckets[window.current].id;
+  }
+  const Bucket *oldest = NULL;
+  double sum = 0.0, sum_squares = 0.0;
+  for (size_t i = 0; i < aggregate_buckets + 1; ++i) {
+    const Bucket &bucket = window.buckets[i];
+    if (bucket.samples == 0 || bucket.id + aggregate_buckets < current) {
+      continue;
+    }
+    if (oldest == NULL) {
+      result.min = bucket.min;
+      result.max = bucket.max;
+    } else {
+      result.min = bucket.min < result.min ? bucket.min : result.min;
+      result.max = bucket.max > result.max ? bucket.max : result.max;
+    }
+    if (oldest == NULL || bucket.first_us < oldest->first_us) {
+      oldest = &bucket;
+    }
+    result.samples += bucket.samples;
+    sum += bucket.sum;
+    sum_squares += bucket.sum_squares;
+  }
+  if (oldest == NULL) {
+    return;
+  }
+  // The newest sample is in the newest bucket, so in the window
+  double samples = (double)result.samples;
+  result.mean = sum / samples;
+  result.rms = std::sqrt(sum_squares / samples);
+  if (stamp_us > oldest->first_us) {
+    result.rate = (latest - oldest->first) * 1e6 /
+                  (double)(stamp_us - oldest->first_us);
+  }
+}
@@ -0,0 +1,85 @@
+#include "mdc2250/bandwidth.h"
+
+#include <cstring>
+
+#include <boost/static_assert.hpp>
+
+using namespace mdc2250;
+
+namespace mdc2250_ {
+
+// Channels and widest value of each response, in QueryType order
+struct ResponseFormat {
+  const char *prefix;
+  size_t channels;
+  size_t width;
+};
+
+const ResponseFormat response_formats[] = {
+  {"A=", 2, 5},      // motor_amps
+  {"AI=", 4, 5},     // analog_input
+  {"BA=", 2, 5},     // battery_amps
+  {"BS=", 2, 6},     // brushless_motor_speed_rpm
+  {"BSR=", 2, 5},    // brushless_motor_speed_percent
+  {"C=", 2, 11},     // encoder_count_absolute
+  {"CB=", 2, 11},    // brushless_encoder_count_absolute
+  {"CBR=", 2, 11},   // brushless_encoder_count_relative
+  {"CIA=", 2, 5},    // internal_analog
+  {"CIP=", 2, 5},    // internal_pulse
+  {"CIS=", 2, 5},    // internal_serial
+  {"CR=", 2, 11},    // encoder_count_relative
+  {"D=", 1, 5},      // digital_inputs
+  {"DI=", 6, 1},     // individual_digital_inputs
+  {"DO=", 1, 3},     // digital_output_status
+  {"E=", 2, 6},      // closed_loop_error
+  {"F=", 2, 5},      // feedback_in
+  {"FF=", 1, 3},     // fault_flag
+  {"FID=", 1, 40},   // firmware_id
+  {"FS=", 1, 3},     // status_flag
+  {"LK=", 1, 1},     // lock_status
+  {"M=", 2, 5},      // motor_command_applied
+  {"P=", 2, 5},      // motor_power_output_applied
+  {"PI=", 5, 5},     // pulse_input
+  {"S=", 2, 6},      // encoder_speed_rpm
+  {"SR=", 2, 5},     // encoder_speed_relative
+  {"T=", 3, 4},      // temperature
+  {"TM=", 1, 10},    // read_time
+  {"TRN=", 1, 16},   // control_unit_type_and_controller_model
+  {"V=", 3, 5},      // volts
+  {"VAR=", 1, 11}    // user_variable
+};
+
+BOOST_STATIC_ASSERT(sizeof(response_formats) / sizeof(ResponseFormat) ==
+                    queries::unknown);
+
+// Used for responses which can't be identified
+const size_t unknown_response_length = 32;
+
+}
+
+using namespace mdc2250_;
+
+size_t mdc2250::response_length(queries::QueryType query) {
+  if (query < 0 || query >= queries::unknown) {
+    return unknown_response_length;
+  }
+  const ResponseFormat &format = response_formats[query];
+  // Prefix, values separated by ':' and the carriage return
+  return std::strlen(format.prefix) + format.channels * format.width +
+         (format.channels - 1) + 1;
+}
+
+double mdc2250::telemetry_bandwidth(const std::vector<std::string> &queries,
+                                    size_t period)
+{
+  if (queries.empty() || period == 0) {
+    return 0.0;
+  }
+  size_t total = 0;
+  std::vector<std::string>::const_iterator it;
+  for (it = queries.begin(); it != queries.end(); ++it) {
+    total += response_length(detect_response_type((*it) + "="));
+  }
+  double mean = (double)total / (double)queries.size();
+  return mean * 1000.0 / (double)period;
+}
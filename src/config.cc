@@ -0,0 +1,196 @@
+#include "mdc2250/config.h"
+
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+using namespace mdc2250;
+
+namespace mdc2250_ {
+
+// Shared between a pipeline and the completions of its requests
+struct PipelineState {
+  boost::mutex mutex;
+  boost::condition_variable condition;
+  size_t outstanding;
+  Result failure;
+  std::vector<std::string> *responses;
+};
+
+inline void pipelineDone(PipelineState *state, size_t index,
+                         const Result &result, const char *response,
+                         size_t length)
+{
+  boost::mutex::scoped_lock lock(state->mutex);
+  if (!result.ok()) {
+    if (state->failure.ok()) {
+      state->failure = result;
+    }
+  } else if (state->responses != NULL) {
+    (*state->responses)[index].assign(response, length);
+  }
+  state->outstanding--;
+  state->condition.notify_all();
+}
+
+}
+
+using namespace mdc2250_;
+
+std::vector<ConfigChange>
+mdc2250::diff_configuration(const ConfigSnapshot &current,
+                            const ConfigSnapshot &desired)
+{
+  std::vector<ConfigChange> changes;
+  std::map<std::string, std::vector<long> >::const_iterator it;
+  for (it = desired.parameters.begin(); it != desired.parameters.end();
+       ++it)
+  {
+    std::map<std::string, std::vector<long> >::const_iterator found =
+      current.parameters.find(it->first);
+    const std::vector<long> &values = it->second;
+    for (size_t i = 0; i < values.size(); ++i) {
+      if (found != current.parameters.end() &&
+          i < found->second.size() && found->second[i] == values[i])
+      {
+        continue;
+      }
+      ConfigChange change;
+      change.name = it->first;
+      // Parameters with a single value take no channel
+      change.channel = values.size() == 1 ? 0 : i + 1;
+      change.value = values[i];
+      changes.push_back(change);
+    }
+  }
+  return changes;
+}
+
+std::string mdc2250::format_config_command(const ConfigChange &change) {
+  std::stringstream ss;
+  ss << "^" << change.name << " ";
+  if (change.channel != 0) {
+    ss << change.channel << " ";
+  }
+  ss << change.value;
+  return ss.str();
+}
+
+Configurator::Configurator(MDC2250 &mdc2250, size_t window)
+: mdc2250_(mdc2250), window_(window)
+{
+  if (window == 0) {
+    throw(std::invalid_argument("In Configurator::Configurator, window "
+                                "must be greater than 0."));
+  }
+  if (this->window_ > max_async_requests) {
+    this->window_ = max_async_requests;
+  }
+}
+
+ConfigSnapshot Configurator::read(const std::vector<std::string> &names) {
+  ConfigSnapshot snapshot;
+  Result result = this->tryRead(names, snapshot);
+  if (!result.ok()) {
+    throw(CommandFailedException("Configurator::read", result));
+  }
+  return snapshot;
+}
+
+Result Configurator::tryRead(const std::vector<std::string> &names,
+                             ConfigSnapshot &snapshot)
+{
+  std::vector<std::string> queries(names.size());
+  for (size_t i = 0; i < names.size(); ++i) {
+    queries[i] = "~" + names[i];
+  }
+  std::vector<std::string> responses(names.size());
+  Result result = this->pipeline_(queries, true, &responses);
+  if (!result.ok()) {
+    return result;
+  }
+  for (size_t i = 0; i < names.size(); ++i) {
+    // Room for every value the response can hold, each takes at least a 
+    // digit and a separator, so none are cut off
+    std::vector<long> &values = snapshot.parameters[names[i]];
+    values.resize(responses[i].length() / 2 + 1);
+    size_t count = decode_channels(responses[i].data(),
+                                   responses[i].length(), &values[0],
+                                   values.size());
+    if (count == 0) {
+      // Not a numeric parameter, or a malformed response
+      snapshot.parameters.erase(names[i]);
+      return Result(results::invalid_response, queries[i].data(),
+                    queries[i].length());
+    }
+    values.resize(count);
+  }
+  return result;
+}
+
+void Configurator::apply(const std::vector<ConfigChange> &changes) {
+  Result result = this->tryApply(changes);
+  if (!result.ok()) {
+    throw(CommandFailedException("Configurator::apply", result));
+  }
+}
+
+Result Configurator::tryApply(const std::vector<ConfigChange> &changes) {
+  std::vector<std::string> commands(changes.size());
+  for (size_t i = 0; i < changes.size(); ++i) {
+    commands[i] = format_config_command(changes[i]);
+  }
+  return this->pipeline_(commands, false, NULL);
+}
+
+size_t Configurator::restore(const ConfigSnapshot &desired) {
+  std::vector<std::string> names;
+  std::map<std::string, std::vector<long> >::const_iterator it;
+  for (it = desired.parameters.begin(); it != desired.parameters.end();
+       ++it)
+  {
+    names.push_back(it->first);
+  }
+  std::vector<ConfigChange> changes =
+    diff_configuration(this->read(names), desired);
+  this->apply(changes);
+  return changes.size();
+}
+
+Result
+Configurator::pipeline_(const std::vector<std::string> &requests,
+                        bool queries, std::vector<std::string> *responses)
+{
+  PipelineState state;
+  state.outstanding = 0;
+  state.responses = responses;
+  boost::mutex::scoped_lock lock(state.mutex);
+  size_t next = 0;
+  while (next < requests.size() || state.outstanding != 0) {
+    if (next < requests.size() && state.failure.ok() &&
+        state.outstanding < this->window_)
+    {
+      size_t index = next++;
+      state.outstanding++;
+      // A request can complete before it returns, so don't hold the lock
+      lock.unlock();
+      AsyncCallback done =
+        boost::bind(pipelineDone, &state, index, _1, _2, _3);
+      if (queries) {
+        this->mdc2250_.asyncQuery(requests[index], done);
+      } else {
+        this->mdc2250_.asyncCommand(requests[index], done);
+      }
+      lock.lock();
+      continue;
+    }
+    if (state.outstanding == 0) {
+      // Stopped issuing after a failure
+      break;
+    }
+    state.condition.wait(lock);
+  }
+  return state.failure;
+}
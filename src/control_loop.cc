@@ -0,0 +1,150 @@
+#include "mdc2250/control_loop.h"
+#include "mdc2250/clock.h"
+
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+
+using namespace mdc2250;
+
+namespace mdc2250_ {
+
+// Touches a chunk of stack so it is resident before the loop starts
+inline void prefaultStack() {
+  volatile char stack[64*1024];
+  for (size_t i = 0; i < sizeof(stack); i += 4096) {
+    stack[i] = 0;
+  }
+}
+
+}
+
+using namespace mdc2250_;
+
+ControlLoop::ControlLoop(MDC2250 &mdc2250, ControlStepCallback step)
+: mdc2250_(mdc2250), step_(step), period_ns_(0), running_(false),
+  started_(false)
+{}
+
+ControlLoop::~ControlLoop() {
+  this->stop();
+}
+
+void
+ControlLoop::start(size_t period_us, const ThreadOptions &options,
+                   bool lock_memory)
+{
+  if (period_us == 0) {
+    throw(std::invalid_argument("In ControlLoop::start, period_us must be "
+                                "greater than 0."));
+  }
+  this->stop();
+  this->period_ns_ = (uint64_t)period_us * 1000ULL;
+  ControlLoopStatistics empty;
+  std::memset(&empty, 0, sizeof(empty));
+  this->statistics_.store(empty);
+  // Start the thread and wait for it to apply its options
+  boost::mutex::scoped_lock lock(this->startup_mutex_);
+  this->started_ = false;
+  this->startup_error_.clear();
+  this->running_ = true;
+  this->thread_ =
+    boost::thread(boost::bind(&ControlLoop::run_, this, options,
+                              lock_memory));
+  while (!this->started_) {
+    this->startup_condition_.wait(lock);
+  }
+  if (!this->startup_error_.empty()) {
+    lock.unlock();
+    this->thread_.join();
+    throw(std::runtime_error(this->startup_error_));
+  }
+}
+
+void ControlLoop::stop() {
+  this->running_ = false;
+  if (this->thread_.joinable()) {
+    this->thread_.join();
+  }
+}
+
+void ControlLoop::run_(ThreadOptions options, bool lock_memory) {
+  {
+    boost::mutex::scoped_lock lock(this->startup_mutex_);
+    try {
+      if (lock_memory) {
+        lockMemory();
+        prefaultStack();
+      }
+      configureCurrentThread(options);
+    } catch (std::exception &e) {
+      this->startup_error_ = e.what();
+      this->running_ = false;
+    }
+    this->started_ = true;
+    this->startup_condition_.notify_all();
+  }
+
+  ControlLoopStatistics stats;
+  std::memset(&stats, 0, sizeof(stats));
+  uint64_t next = monotonic_nsec() + this->period_ns_;
+  uint64_t last_wake = 0;
+  while (this->running_) {
+    sleep_until_nsec(next);
+    uint64_t wake = monotonic_nsec();
+    if (!this->running_) {
+      break;
+    }
+
+    // Run the step with the latest telemetry and send its command
+    MotorCommand command;
+    std::memset(&command, 0, sizeof(command));
+    this->step_(this->mdc2250_.getTelemetry(), command);
+    if (command.send &&
+        !this->mdc2250_.tryCommandMotors(command.motor1_effort,
+                                         command.motor2_effort).ok())
+    {
+      stats.send_failures++;
+    }
+    uint64_t done = monotonic_nsec();
+
+    // Update the statistics
+    int64_t jitter = (int64_t)(wake - next);
+    int64_t step = (int64_t)(done - wake);
+    double n = (double)(++stats.cycles);
+    if (stats.cycles == 1 || jitter < stats.jitter_min) {
+      stats.jitter_min = jitter;
+    }
+    if (stats.cycles == 1 || jitter > stats.jitter_max) {
+      stats.jitter_max = jitter;
+    }
+    stats.jitter_mean += ((double)jitter - stats.jitter_mean) / n;
+    if (step > stats.step_max) {
+      stats.step_max = step;
+    }
+    stats.step_mean += ((double)step - stats.step_mean) / n;
+    if (last_wake != 0) {
+      int64_t cycle = (int64_t)(wake - last_wake);
+      double cycles = (double)(stats.cycles - 1);
+      if (stats.cycles == 2 || cycle < stats.cycle_min) {
+        stats.cycle_min = cycle;
+      }
+      if (stats.cycles == 2 || cycle > stats.cycle_max) {
+        stats.cycle_max = cycle;
+      }
+      stats.cycle_mean += ((double)cycle - stats.cycle_mean) / cycles;
+    }
+    last_wake = wake;
+
+    // Advance the deadline, skipping any which have already passed
+    next += this->period_ns_;
+    if (done >= next) {
+      uint64_t missed = (done - next) / this->period_ns_ + 1;
+      stats.overruns += missed;
+      next += missed * this->period_ns_;
+    }
+    this->statistics_.store(stats);
+  }
+}
@@ -0,0 +1,801 @@
+#include "mdc2250/daemon.h"
+#include "mdc2250/clock.h"
+#include "mdc2250/decode.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+
+using namespace mdc2250;
+
+namespace mdc2250_ {
+
+#if defined(MSG_NOSIGNAL)
+const int send_flags = MSG_NOSIGNAL;
+#else
+const int send_flags = 0;
+#endif
+
+inline std::runtime_error socketError(const char *where,
+                                      const std::string &path)
+{
+  std::stringstream ss;
+  ss << "In " << where << ", failed for socket " << path << ": ";
+  ss << std::strerror(errno);
+  return std::runtime_error(ss.str());
+}
+
+inline bool socketAddress(const std::string &path, struct sockaddr_un &addr)
+{
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.length() >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  std::memcpy(addr.sun_path, path.data(), path.length());
+  return true;
+}
+
+inline void fillFrame(DaemonFrame &frame, uint32_t id,
+                      daemon_frames::FrameType type, const char *text,
+                      size_t length)
+{
+  std::memset(&frame, 0, sizeof(frame));
+  frame.id = id;
+  frame.type = (uint8_t)type;
+  if (length > max_daemon_text_length) {
+    length = max_daemon_text_length;
+  }
+  if (length > 0) {
+    std::memcpy(frame.text, text, length);
+  }
+  frame.length = (uint8_t)length;
+}
+
+// Telemetry frames queued per client before the newest are dropped
+const size_t max_queued_telemetry = 64;
+
+struct QueuedTelemetry {
+  DaemonFrame frame;
+  uint64_t queued_us;
+};
+
+// True for the name of a query, like "CR", since it goes into the merged
+// "#" query history as is
+inline bool isQueryName(const std::string &name) {
+  if (name.empty()) {
+    return false;
+  }
+  for (size_t i = 0; i < name.length(); ++i) {
+    if (name[i] < 'A' || name[i] > 'Z') {
+      return false;
+    }
+  }
+  return detect_response_type(name + "=") != queries::unknown;
+}
+
+// Reads or writes a whole frame, false if the peer went away
+inline bool transferFrame(int fd, DaemonFrame &frame, bool receive) {
+  char *data = reinterpret_cast<char *>(&frame);
+  size_t done = 0;
+  while (done < sizeof(frame)) {
+    ssize_t n = receive ? recv(fd, data + done, sizeof(frame) - done, 0)
+                        : send(fd, data + done, sizeof(frame) - done,
+                               send_flags);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    done += (size_t)n;
+  }
+  return true;
+}
+
+}
+
+using namespace mdc2250_;
+
+/***** Daemon *****/
+
+struct Daemon::Client {
+  Client(int fd_)
+  : fd(fd_), received(0), priority(0), telemetry(max_queued_telemetry),
+    telemetry_head(0), telemetry_count(0) {}
+
+  int fd;
+  // Serializes the frames sent to this client
+  boost::mutex send_mutex;
+  // Partially received request, only touched by the serving thread
+  DaemonFrame partial;
+  size_t received;
+  // Guarded by clients_mutex_
+  uint8_t priority;
+  std::map<std::string, size_t> subscriptions;
+  std::map<std::string, uint64_t> last_sent_us;
+  // Telemetry waiting for the send thread
+  std::vector<QueuedTelemetry> telemetry;
+  size_t telemetry_head;
+  size_t telemetry_count;
+};
+
+Daemon::Daemon(MDC2250 &mdc2250, size_t claim_timeout_ms)
+: mdc2250_(mdc2250), claim_timeout_us_((uint64_t)claim_timeout_ms * 1000),
+  listen_fd_(-1), running_(false), motor_claim_us_(0),
+  telemetry_queued_(false), in_flight_(0), schedule_dirty_(false)
+{
+  this->wake_fds_[0] = this->wake_fds_[1] = -1;
+  this->statistics_.clients = 0;
+  this->statistics_.requests = 0;
+  this->statistics_.preempted = 0;
+  this->statistics_.telemetry_sent = 0;
+  this->statistics_.dropped = 0;
+  this->statistics_.telemetry_latency_mean_us = 0.0;
+  this->statistics_.telemetry_latency_max_us = 0;
+  this->statistics_.schedule_period_ms = 0;
+}
+
+Daemon::~Daemon() {
+  this->stop();
+}
+
+void Daemon::start(const std::string &socket_path) {
+  this->stop();
+  struct sockaddr_un addr;
+  if (!socketAddress(socket_path, addr)) {
+    throw(std::invalid_argument("In Daemon::start, socket path is too "
+                                "long: " + socket_path));
+  }
+  // Replace a socket left behind by a daemon which didn't exit cleanly
+  unlink(socket_path.c_str());
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    throw(socketError("Daemon::start", socket_path));
+  }
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 16) != 0 || pipe(this->wake_fds_) != 0)
+  {
+    std::runtime_error e = socketError("Daemon::start", socket_path);
+    ::close(fd);
+    unlink(socket_path.c_str());
+    throw(e);
+  }
+  this->socket_path_ = socket_path;
+  this->listen_fd_ = fd;
+  this->running_ = true;
+  this->thread_ = boost::thread(boost::bind(&Daemon::serve_, this));
+  this->schedule_thread_ =
+    boost::thread(boost::bind(&Daemon::schedule_, this));
+  this->send_thread_ =
+    boost::thread(boost::bind(&Daemon::send_telemetry_, this));
+}
+
+void Daemon::stop() {
+  if (!this->running_) {
+    return;
+  }
+  this->running_ = false;
+  // Wake the threads
+  if (write(this->wake_fds_[1], "x", 1) < 0) {
+    // The poll timeout wakes the thread anyway
+  }
+  {
+    boost::mutex::scoped_lock lock(this->schedule_mutex_);
+    this->schedule_condition_.notify_all();
+  }
+  {
+    boost::mutex::scoped_lock lock(this->clients_mutex_);
+    this->telemetry_condition_.notify_all();
+  }
+  this->thread_.join();
+  this->schedule_thread_.join();
+  this->send_thread_.join();
+  // The telemetry callback points at this object too
+  bool scheduled;
+  {
+    boost::mutex::scoped_lock lock(this->clients_mutex_);
+    scheduled = !this->statistics_.schedule.empty();
+    this->statistics_.schedule.clear();
+    this->statistics_.schedule_period_ms = 0;
+  }
+  if (scheduled) {
+    try {
+      this->mdc2250_.stopTelemetry();
+    } catch (std::exception &e) {
+      // Disconnected, so no more telemetry arrives anyway
+    }
+  }
+  // Outstanding requests reply through this object, wait for them
+  while (this->in_flight_ != 0) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+  }
+  std::vector<ClientPtr> clients;
+  {
+    boost::mutex::scoped_lock lock(this->clients_mutex_);
+    clients = this->clients_;
+  }
+  for (size_t i = 0; i < clients.size(); ++i) {
+    this->remove_client_(clients[i]);
+  }
+  ::close(this->listen_fd_);
+  ::close(this->wake_fds_[0]);
+  ::close(this->wake_fds_[1]);
+  this->listen_fd_ = this->wake_fds_[0] = this->wake_fds_[1] = -1;
+  unlink(this->socket_path_.c_str());
+}
+
+DaemonStatistics Daemon::getStatistics() {
+  boost::mutex::scoped_lock lock(this->clients_mutex_);
+  this->statistics_.clients = this->clients_.size();
+  return this->statistics_;
+}
+
+void Daemon::serve_() {
+  std::vector<struct pollfd> fds;
+  std::vector<ClientPtr> clients;
+  while (this->running_) {
+    {
+      boost::mutex::scoped_lock lock(this->clients_mutex_);
+      clients = this->clients_;
+    }
+    fds.resize(clients.size() + 2);
+    fds[0].fd = this->listen_fd_;
+    fds[1].fd = this->wake_fds_[0];
+    for (size_t i = 0; i < clients.size(); ++i) {
+      fds[i + 2].fd = clients[i]->fd;
+    }
+    for (size_t i = 0; i < fds.size(); ++i) {
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+    if (poll(&fds[0], fds.size(), 100) <= 0) {
+      continue;
+    }
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(this->listen_fd_, NULL, NULL);
+      if (fd >= 0) {
+        boost::mutex::scoped_lock lock(this->clients_mutex_);
+        this->clients_.push_back(ClientPtr(new Client(fd)));
+      }
+    }
+    for (size_t i = 0; i < clients.size(); ++i) {
+      if (fds[i + 2].revents == 0) {
+        continue;
+      }
+      const ClientPtr &client = clients[i];
+      char *data = reinterpret_cast<char *>(&client->partial);
+      ssize_t n = recv(client->fd, data + client->received,
+                       sizeof(DaemonFrame) - client->received, 0);
+      if (n <= 0) {
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+          continue;
+        }
+        this->remove_client_(client);
+        continue;
+      }
+      client->received += (size_t)n;
+      if (client->received == sizeof(DaemonFrame)) {
+        client->received = 0;
+        this->handle_frame_(client, client->partial);
+      }
+    }
+  }
+}
+
+void Daemon::handle_frame_(const ClientPtr &client,
+                           const DaemonFrame &frame)
+{
+  {
+    boost::mutex::scoped_lock lock(this->clients_mutex_);
+    this->statistics_.requests++;
+  }
+  if (frame.length > max_daemon_text_length) {
+    this->reply_(client, frame.id, Result(results::invalid_argument));
+    return;
+  }
+  std::string text(frame.text, frame.length);
+  switch (frame.type) {
+    case daemon_frames::command:
+    case daemon_frames::query:
+    {
+      this->in_flight_++;
+      AsyncCallback callback =
+        boost::bind(&Daemon::complete_, this, client, frame.id, _1, _2, _3);
+      if (frame.type == daemon_frames::command) {
+        this->mdc2250_.asyncCommand(text, callback);
+      } else {
+        this->mdc2250_.asyncQuery(text, callback);
+      }
+      break;
+    }
+    case daemon_frames::subscribe:
+    case daemon_frames::unsubscribe:
+    {
+      bool subscribe = frame.type == daemon_frames::subscribe;
+      if (!isQueryName(text) || (subscribe && frame.values[0] <= 0)) {
+        this->reply_(client, frame.id, Result(results::invalid_argument));
+        break;
+      }
+      {
+        boost::mutex::scoped_lock lock(this->clients_mutex_);
+        if (subscribe) {
+          client->subscriptions[text] = (size_t)frame.values[0];
+        } else {
+          client->subscriptions.erase(text);
+        }
+      }
+      // Replied once the merged schedule is applied
+      boost::mutex::scoped_lock lock(this->schedule_mutex_);
+      this->schedule_dirty_ = true;
+      this->schedule_waiters_.push_back(std::make_pair(client, frame.id));
+      this->schedule_condition_.notify_all();
+      break;
+    }
+    case daemon_frames::motors:
+      this->handle_motors_(client, frame);
+      break;
+    case daemon_frames::release:
+    {
+      {
+        boost::mutex::scoped_lock lock(this->clients_mutex_);
+        if (this->motor_owner_ == client) {
+          this->motor_owner_.reset();
+        }
+      }
+      this->reply_(client, frame.id, Result(results::success));
+      break;
+    }
+    default:
+      this->reply_(client, frame.id, Result(results::invalid_argument));
+      break;
+  }
+}
+
+void Daemon::handle_motors_(const ClientPtr &client,
+                            const DaemonFrame &frame)
+{
+  long motor1_effort = frame.values[0], motor2_effort = frame.values[1];
+  if (motor1_effort < -1000 || motor1_effort > 1000 ||
+      motor2_effort < -1000 || motor2_effort > 1000)
+  {
+    this->reply_(client, frame.id, Result(results::invalid_argument, "!M", 2));
+    return;
+  }
+  uint64_t now = monotonic_usec();
+  {
+    boost::mutex::scoped_lock lock(this->clients_mutex_);
+    if (this->motor_owner_ && this->motor_owner_ != client &&
+        now - this->motor_claim_us_ < this->claim_timeout_us_ &&
+        this->motor_owner_->priority > frame.priority)
+    {
+      // Held by a more important client
+      this->statistics_.preempted++;
+      lock.unlock();
+      this->reply_(client, frame.id, Result(results::busy, "!M", 2));
+      return;
+    }
+    this->motor_owner_ = client;
+    this->motor_claim_us_ = now;
+    client->priority = frame.priority;
+  }
+  std::stringstream ss;
+  ss << "!M " << motor1_effort << " " << motor2_effort;
+  this->in_flight_++;
+  this->mdc2250_.asyncCommand(ss.str(),
+    boost::bind(&Daemon::complete_, this, client, frame.id, _1, _2, _3));
+}
+
+void Daemon::remove_client_(const ClientPtr &client) {
+  bool subscribed = false;
+  {
+    boost::mutex::scoped_lock lock(this->clients_mutex_);
+    std::vector<ClientPtr>::iterator it =
+      std::find(this->clients_.begin(), this->clients_.end(), client);
+    if (it == this->clients_.end()) {
+      return;
+    }
+    this->clients_.erase(it);
+    if (this->motor_owner_ == client) {
+      this->motor_owner_.reset();
+    }
+    subscribed = !client->subscriptions.empty();
+  }
+  {
+    boost::mutex::scoped_lock lock(client->send_mutex);
+    ::close(client->fd);
+    client->fd = -1;
+  }
+  if (subscribed) {
+    boost::mutex::scoped_lock lock(this->schedule_mutex_);
+    this->schedule_dirty_ = true;
+    this->schedule_condition_.notify_all();
+  }
+}
+
+bool Daemon::send_(const ClientPtr &client, const DaemonFrame &frame) {
+  boost::mutex::scoped_lock lock(client->send_mutex);
+  if (client->fd < 0) {
+    return false;
+  }
+  const char *data = reinterpret_cast<const char *>(&frame);
+  size_t done = 0;
+  while (done < sizeof(frame)) {
+    ssize_t n = send(client->fd, data + done, sizeof(frame) - done,
+                     MSG_DONTWAIT | send_flags);
+    if (n > 0) {
+      done += (size_t)n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && done == 0) {
+      // Not reading, drop this frame rather than wait for it
+      return false;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // Never leave half a frame in the stream
+      struct pollfd pfd = {client->fd, POLLOUT, 0};
+      if (poll(&pfd, 1, 10) > 0) {
+        continue;
+      }
+    }
+    // Broken, the serving thread removes it when it sees the hang up
+    shutdown(client->fd, SHUT_RDWR);
+    return false;
+  }
+  return true;
+}
+
+void Daemon::reply_(const ClientPtr &client, uint32_t id,
+                    const Result &result, const char *text, size_t length)
+{
+  DaemonFrame frame;
+  fillFrame(frame, id, daemon_frames::reply, text, length);
+  frame.code = (uint8_t)result.code;
+  if (!this->send_(client, frame)) {
+    boost::mutex::scoped_lock lock(this->clients_mutex_);
+    this->statistics_.dropped++;
+  }
+}
+
+void Daemon::complete_(ClientPtr client, uint32_t id, const Result &result,
+                       const char *response, size_t length)
+{
+  this->reply_(client, id, result, response, length);
+  this->in_flight_--;
+}
+
+void Daemon::on_telemetry_(const std::string &token) {
+  size_t equals = token.find('=');
+  if (equals == std::string::npos) {
+    return;
+  }
+  std::string name = token.substr(0, equals);
+  DaemonFrame frame;
+  fillFrame(frame, 0, daemon_frames::telemetry, token.data(),
+            token.length());
+  uint64_t now = monotonic_usec();
+  // Only queue it here, the send thread writes to the sockets
+  boost::mutex::scoped_lock lock(this->clients_mutex_);
+  // Allow half a schedule period of jitter
+  uint64_t slack = (uint64_t)this->statistics_.schedule_period_ms * 500;
+  bool queued = false;
+  for (size_t i = 0; i < this->clients_.size(); ++i) {
+    Client &client = *this->clients_[i];
+    std::map<std::string, size_t>::const_iterator subscription =
+      client.subscriptions.find(name);
+    if (subscription == client.subscriptions.end()) {
+      continue;
+    }
+    uint64_t &last = client.last_sent_us[name];
+    uint64_t period = (uint64_t)subscription->second * 1000;
+    if (last != 0 && now - last + slack < period) {
+      continue;
+    }
+    if (client.telemetry_count == max_queued_telemetry) {
+      // Not keeping up
+      this->statistics_.dropped++;
+      continue;
+    }
+    QueuedTelemetry &slot = client.telemetry[
+      (client.telemetry_head + client.telemetry_count) % max_queued_telemetry];
+    slot.frame = frame;
+    slot.queued_us = now;
+    client.telemetry_count++;
+    last = now;
+    queued = true;
+  }
+  if (queued) {
+    this->telemetry_queued_ = true;
+    this->telemetry_condition_.notify_one();
+  }
+}
+
+void Daemon::send_telemetry_() {
+  std::vector<std::pair<ClientPtr, QueuedTelemetry> > outgoing;
+  outgoing.reserve(max_queued_telemetry);
+  while (true) {
+    outgoing.clear();
+    {
+      boost::mutex::scoped_lock lock(this->clients_mutex_);
+      while (this->running_ && !this->telemetry_queued_) {
+        this->telemetry_condition_.wait(lock);
+      }
+      if (!this->running_) {
+        break;
+      }
+      this->telemetry_queued_ = false;
+      for (size_t i = 0; i < this->clients_.size(); ++i) {
+        Client &client = *this->clients_[i];
+        for (; client.telemetry_count != 0; client.telemetry_count--) {
+          outgoing.push_back(std::make_pair(this->clients_[i],
+            client.telemetry[client.telemetry_head]));
+          client.telemetry_head =
+            (client.telemetry_head + 1) % max_queued_telemetry;
+        }
+      }
+    }
+    // Send without holding the clients, a slow one only delays itself
+    uint64_t sent = 0, dropped = 0, latency_total = 0, latency_max = 0;
+    for (size_t i = 0; i < outgoing.size(); ++i) {
+      if (!this->send_(outgoing[i].first, outgoing[i].second.frame)) {
+        dropped++;
+        continue;
+      }
+      uint64_t latency = monotonic_usec() - outgoing[i].second.queued_us;
+      latency_total += latency;
+      latency_max = std::max(latency_max, latency);
+      sent++;
+    }
+    boost::mutex::scoped_lock lock(this->clients_mutex_);
+    DaemonStatistics &statistics = this->statistics_;
+    statistics.dropped += dropped;
+    if (sent != 0) {
+      statistics.telemetry_sent += sent;
+      statistics.telemetry_latency_mean_us +=
+        ((double)latency_total / (double)sent -
+         statistics.telemetry_latency_mean_us) * (double)sent /
+        (double)statistics.telemetry_sent;
+      statistics.telemetry_latency_max_us =
+        std::max(statistics.telemetry_latency_max_us, latency_max);
+    }
+  }
+}
+
+void Daemon::schedule_() {
+  while (true) {
+    std::vector<std::pair<ClientPtr, uint32_t> > waiters;
+    {
+      boost::mutex::scoped_lock lock(this->schedule_mutex_);
+      while (this->running_ && !this->schedule_dirty_) {
+        this->schedule_condition_.wait(lock);
+      }
+      if (!this->running_) {
+        break;
+      }
+      this->schedule_dirty_ = false;
+      waiters.swap(this->schedule_waiters_);
+    }
+    // Merge the subscriptions, each query at the fastest period asked for
+    std::map<std::string, size_t> merged;
+    {
+      boost::mutex::scoped_lock lock(this->clients_mutex_);
+      for (size_t i = 0; i < this->clients_.size(); ++i) {
+        std::map<std::string, size_t>::const_iterator it;
+        for (it = this->clients_[i]->subscriptions.begin();
+             it != this->clients_[i]->subscriptions.end(); ++it)
+        {
+          size_t &period = merged[it->first];
+          if (period == 0 || it->second < period) {
+            period = it->second;
+          }
+        }
+      }
+    }
+    // The history sends one query per period, so a query comes back every
+    // period times the number of queries
+    std::string schedule;
+    size_t fastest = 0;
+    std::map<std::string, size_t>::const_iterator it;
+    for (it = merged.begin(); it != merged.end(); ++it) {
+      schedule += (schedule.empty() ? "" : ",") + it->first;
+      if (fastest == 0 || it->second < fastest) {
+        fastest = it->second;
+      }
+    }
+    size_t period = merged.empty() ? 0 : fastest / merged.size();
+    if (!merged.empty() && period == 0) {
+      period = 1;
+    }
+    Result result(results::success);
+    try {
+      if (schedule.empty()) {
+        this->mdc2250_.stopTelemetry();
+      } else {
+        this->mdc2250_.setTelemetry(schedule, period,
+          boost::bind(&Daemon::on_telemetry_, this, _1));
+      }
+      boost::mutex::scoped_lock lock(this->clients_mutex_);
+      this->statistics_.schedule = schedule;
+      this->statistics_.schedule_period_ms = period;
+    } catch (CommandFailedException &e) {
+      int code = e.error_type();
+      result.code = (code > 0 && code <= results::busy)
+                    ? (results::ResultCode)code : results::invalid_response;
+    } catch (std::invalid_argument &e) {
+      result.code = results::invalid_argument;
+    } catch (std::exception &e) {
+      result.code = results::write_failed;
+    }
+    for (size_t i = 0; i < waiters.size(); ++i) {
+      this->reply_(waiters[i].first, waiters[i].second, result);
+    }
+  }
+}
+
+/***** DaemonClient *****/
+
+DaemonClient::DaemonClient() : fd_(-1), next_id_(1) {}
+
+DaemonClient::~DaemonClient() {
+  this->disconnect();
+}
+
+void DaemonClient::connect(const std::string &socket_path) {
+  this->disconnect();
+  struct sockaddr_un addr;
+  if (!socketAddress(socket_path, addr)) {
+    throw(std::invalid_argument("In DaemonClient::connect, socket path is "
+                                "too long: " + socket_path));
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    throw(socketError("DaemonClient::connect", socket_path));
+  }
+  if (::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    std::runtime_error e = socketError("DaemonClient::connect", socket_path);
+    ::close(fd);
+    throw(e);
+  }
+  this->fd_ = fd;
+  this->thread_ = boost::thread(boost::bind(&DaemonClient::read_, this));
+}
+
+void DaemonClient::disconnect() {
+  if (this->fd_ < 0) {
+    return;
+  }
+  // Unblocks the reader
+  shutdown(this->fd_, SHUT_RDWR);
+  this->thread_.join();
+  ::close(this->fd_);
+  this->fd_ = -1;
+}
+
+Result DaemonClient::command(const std::string &command, long timeout_ms) {
+  DaemonFrame frame;
+  fillFrame(frame, 0, daemon_frames::command, command.data(),
+            command.length());
+  return this->request_(frame, timeout_ms);
+}
+
+Result DaemonClient::query(const std::string &query, std::string &response,
+                           long timeout_ms)
+{
+  DaemonFrame frame;
+  fillFrame(frame, 0, daemon_frames::query, query.data(), query.length());
+  return this->request_(frame, timeout_ms, &response);
+}
+
+Result DaemonClient::subscribe(const std::string &name, size_t period_ms,
+                               long timeout_ms)
+{
+  DaemonFrame frame;
+  fillFrame(frame, 0, daemon_frames::subscribe, name.data(), name.length());
+  frame.values[0] = (int32_t)period_ms;
+  return this->request_(frame, timeout_ms);
+}
+
+Result DaemonClient::unsubscribe(const std::string &name, long timeout_ms) {
+  DaemonFrame frame;
+  fillFrame(frame, 0, daemon_frames::unsubscribe, name.data(),
+            name.length());
+  return this->request_(frame, timeout_ms);
+}
+
+Result DaemonClient::commandMotors(long motor1_effort, long motor2_effort,
+                                   uint8_t priority, long timeout_ms)
+{
+  DaemonFrame frame;
+  fillFrame(frame, 0, daemon_frames::motors, NULL, 0);
+  frame.values[0] = (int32_t)motor1_effort;
+  frame.values[1] = (int32_t)motor2_effort;
+  frame.priority = priority;
+  return this->request_(frame, timeout_ms);
+}
+
+Result DaemonClient::releaseMotors(long timeout_ms) {
+  DaemonFrame frame;
+  fillFrame(frame, 0, daemon_frames::release, NULL, 0);
+  return this->request_(frame, timeout_ms);
+}
+
+Result DaemonClient::request_(DaemonFrame &frame, long timeout_ms,
+                              std::string *response)
+{
+  Result result(results::success, frame.text, frame.length);
+  if (this->fd_ < 0) {
+    result.code = results::not_connected;
+    return result;
+  }
+  Pending pending;
+  pending.done = false;
+  boost::mutex::scoped_lock lock(this->mutex_);
+  frame.id = this->next_id_++;
+  this->pending_[frame.id] = &pending;
+  if (!transferFrame(this->fd_, frame, false)) {
+    this->pending_.erase(frame.id);
+    result.code = results::write_failed;
+    return result;
+  }
+  boost::system_time deadline = boost::get_system_time() +
+    boost::posix_time::milliseconds(timeout_ms);
+  while (!pending.done) {
+    if (!this->condition_.timed_wait(lock, deadline)) {
+      break;
+    }
+  }
+  this->pending_.erase(frame.id);
+  if (!pending.done) {
+    result.code = results::response_timeout;
+    return result;
+  }
+  result.code = (results::ResultCode)pending.reply.code;
+  if (response != NULL) {
+    response->assign(pending.reply.text, pending.reply.length);
+  }
+  return result;
+}
+
+void DaemonClient::read_() {
+  DaemonFrame frame;
+  while (transferFrame(this->fd_, frame, true)) {
+    if (frame.length > max_daemon_text_length) {
+      break;
+    }
+    if (frame.type == daemon_frames::telemetry) {
+      if (this->telemetry_handler_) {
+        this->telemetry_handler_(frame.text, frame.length);
+      }
+      continue;
+    }
+    boost::mutex::scoped_lock lock(this->mutex_);
+    std::map<uint32_t, Pending *>::iterator it = this->pending_.find(frame.id);
+    if (it != this->pending_.end()) {
+      it->second->reply = frame;
+      it->second->done = true;
+      this->condition_.notify_all();
+    }
+  }
+  // The daemon went away, fail everything still waiting
+  boost::mutex::scoped_lock lock(this->mutex_);
+  std::map<uint32_t, Pending *>::iterator it;
+  for (it = this->pending_.begin(); it != this->pending_.end(); ++it) {
+    it->second->reply.code = (uint8_t)results::not_connected;
+    it->second->reply.length = 0;
+    it->second->done = true;
+  }
+  this->condition_.notify_all();
+}
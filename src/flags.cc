@@ -0,0 +1,55 @@
+#include "mdc2250/flags.h"
+
+using namespace mdc2250;
+
+FlagMonitor::FlagMonitor()
+: faults_(0), status_(0), have_faults_(false), have_status_(false)
+{}
+
+void FlagMonitor::reset() {
+  this->have_faults_ = false;
+  this->have_status_ = false;
+  this->faults_ = 0;
+  this->status_ = 0;
+}
+
+size_t FlagMonitor::update(queries::QueryType type, uint32_t flags,
+                           uint64_t stamp_us)
+{
+  boost::atomic<uint32_t> *current;
+  bool *have;
+  if (type == queries::fault_flag) {
+    current = &this->faults_;
+    have = &this->have_faults_;
+  } else if (type == queries::status_flag) {
+    current = &this->status_;
+    have = &this->have_status_;
+  } else {
+    return 0;
+  }
+  uint32_t previous = *have ? current->load() : 0;
+  *have = true;
+  current->store(flags);
+  uint32_t changed = previous ^ flags;
+  if (changed == 0) {
+    return 0;
+  }
+  size_t count = 0;
+  FlagEvent event;
+  event.stamp_us = stamp_us;
+  event.type = type;
+  event.flags = flags;
+  // Report each bit on its own, lowest first
+  for (uint32_t bit = 1; bit != 0 && bit <= changed; bit <<= 1) {
+    if ((changed & bit) == 0) {
+      continue;
+    }
+    ++count;
+    if (this->handler_) {
+      event.flag = bit;
+      event.set = (flags & bit) != 0;
+      this->handler_(event);
+    }
+  }
+  return count;
+}
@@ -0,0 +1,237 @@
+#include "mdc2250/group.h"
+#include "mdc2250/clock.h"
+#include "mdc2250/trace.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+
+using namespace mdc2250;
+
+namespace mdc2250_ {
+
+inline bool validGroupEffort(long effort) {
+  return effort >= -1000 && effort <= 1000;
+}
+
+}
+
+using namespace mdc2250_;
+
+ControllerGroup::ControllerGroup(broadcast_modes::BroadcastMode mode)
+: mode_(mode), generation_(0), writing_(0), running_(true)
+{
+  std::memset(&this->statistics_, 0, sizeof(this->statistics_));
+}
+
+ControllerGroup::~ControllerGroup() {
+  {
+    boost::mutex::scoped_lock lock(this->release_mutex_);
+    this->running_ = false;
+    this->release_condition_.notify_all();
+  }
+  for (size_t i = 0; i < this->members_.size(); ++i) {
+    if (this->members_[i]->thread.joinable()) {
+      this->members_[i]->thread.join();
+    }
+  }
+}
+
+size_t ControllerGroup::add(MDC2250 &mdc2250, const ThreadOptions &options) {
+  boost::mutex::scoped_lock lock(this->broadcast_mutex_);
+  MemberPtr member(new Member(mdc2250));
+  if (this->mode_ == broadcast_modes::parallel) {
+    // The thread applies the scheduling options to itself
+    member->thread = startThread(options,
+                                 boost::bind(&ControllerGroup::run_, this,
+                                             member.get(),
+                                             this->generation_));
+  }
+  this->members_.push_back(member);
+  return this->members_.size() - 1;
+}
+
+BroadcastResult
+ControllerGroup::broadcast(const std::vector<MotorEfforts> &efforts,
+                           long timeout_ms)
+{
+  BroadcastPtr broadcast =
+    this->start_(efforts, BroadcastCallback(), timeout_ms);
+  // Every request has a deadline, so this does not wait forever
+  boost::mutex::scoped_lock lock(broadcast->mutex);
+  while (broadcast->pending > 0) {
+    broadcast->condition.wait(lock);
+  }
+  return broadcast->result;
+}
+
+void ControllerGroup::broadcastAsync(const std::vector<MotorEfforts> &efforts,
+                                     BroadcastCallback callback,
+                                     long timeout_ms)
+{
+  this->start_(efforts, callback, timeout_ms);
+}
+
+BroadcastStatistics ControllerGroup::getStatistics() {
+  boost::mutex::scoped_lock lock(this->statistics_mutex_);
+  return this->statistics_;
+}
+
+ControllerGroup::BroadcastPtr
+ControllerGroup::start_(const std::vector<MotorEfforts> &efforts,
+                        BroadcastCallback callback, long timeout_ms)
+{
+  if (efforts.size() != this->members_.size()) {
+    throw(std::invalid_argument("In ControllerGroup::broadcast, there must "
+                                "be one MotorEfforts per controller."));
+  }
+  boost::mutex::scoped_lock lock(this->broadcast_mutex_);
+  size_t count = this->members_.size();
+  BroadcastPtr broadcast(new Broadcast);
+  broadcast->result.results.resize(count);
+  broadcast->result.skew_ns = 0;
+  broadcast->result.ack_ns = 0;
+  // One for each command, and one for writing them
+  broadcast->pending = count + 1;
+  broadcast->start_ns = monotonic_nsec();
+  broadcast->callback = callback;
+
+  // Encode and register every command before writing any
+  for (size_t i = 0; i < count; ++i) {
+    Member &member = *this->members_[i];
+    member.registered = false;
+    member.written_ns = 0;
+    if (!validGroupEffort(efforts[i].motor1) ||
+        !validGroupEffort(efforts[i].motor2))
+    {
+      this->acknowledged_(broadcast, i,
+                          Result(results::invalid_argument, "!M", 2));
+      continue;
+    }
+    member.length = (size_t)std::snprintf(member.command,
+                                          sizeof(member.command),
+                                          "!M %ld %ld", efforts[i].motor1,
+                                          efforts[i].motor2);
+    MDC2250::AsyncRequest::State state =
+      member.mdc2250.echo_ ? MDC2250::AsyncRequest::awaiting_echo
+                           : MDC2250::AsyncRequest::awaiting_ack;
+    member.index = member.mdc2250.register_async_(
+      state, member.command, member.length, queries::unknown, timeout_ms,
+      boost::bind(&ControllerGroup::acknowledged_, this, broadcast, i, _1));
+    member.registered = (member.index != max_async_requests);
+  }
+
+  // Write them all with nothing in between
+  MDC2250_TRACE_BEGIN("broadcast", count);
+  broadcast->start_ns = monotonic_nsec();
+  if (this->mode_ == broadcast_modes::parallel) {
+    boost::mutex::scoped_lock release_lock(this->release_mutex_);
+    this->writing_ = count;
+    this->generation_++;
+    this->release_condition_.notify_all();
+    while (this->writing_ > 0) {
+      this->written_condition_.wait(release_lock);
+    }
+  } else {
+    for (size_t i = 0; i < count; ++i) {
+      Member &member = *this->members_[i];
+      if (member.registered) {
+        member.mdc2250.write_async_(member.index, member.command,
+                                    member.length, true);
+        member.written_ns = monotonic_nsec();
+      }
+    }
+  }
+  MDC2250_TRACE_END("broadcast", count);
+
+  // The skew is between the first and the last write to complete
+  uint64_t first = 0, last = 0;
+  for (size_t i = 0; i < count; ++i) {
+    uint64_t written = this->members_[i]->written_ns;
+    if (written == 0) {
+      continue;
+    }
+    if (first == 0 || written < first) {
+      first = written;
+    }
+    if (written > last) {
+      last = written;
+    }
+  }
+  {
+    boost::mutex::scoped_lock broadcast_lock(broadcast->mutex);
+    broadcast->result.skew_ns = last - first;
+  }
+  this->done_(broadcast);
+  return broadcast;
+}
+
+void ControllerGroup::acknowledged_(BroadcastPtr broadcast, size_t member,
+                                    const Result &result)
+{
+  {
+    boost::mutex::scoped_lock lock(broadcast->mutex);
+    broadcast->result.results[member] = result;
+  }
+  this->done_(broadcast);
+}
+
+void ControllerGroup::done_(BroadcastPtr broadcast) {
+  BroadcastResult result;
+  BroadcastCallback callback;
+  {
+    boost::mutex::scoped_lock lock(broadcast->mutex);
+    if (--broadcast->pending > 0) {
+      return;
+    }
+    broadcast->result.ack_ns = monotonic_nsec() - broadcast->start_ns;
+    result = broadcast->result;
+    callback.swap(broadcast->callback);
+    // Count it before anyone waiting on the broadcast can look
+    {
+      boost::mutex::scoped_lock statistics_lock(this->statistics_mutex_);
+      BroadcastStatistics &stats = this->statistics_;
+      stats.broadcasts++;
+      if (!result.ok()) {
+        stats.failures++;
+      }
+      stats.skew_last_ns = result.skew_ns;
+      stats.skew_mean_ns += ((double)result.skew_ns - stats.skew_mean_ns) /
+                            (double)stats.broadcasts;
+      if (result.skew_ns > stats.skew_max_ns) {
+        stats.skew_max_ns = result.skew_ns;
+      }
+    }
+    broadcast->condition.notify_all();
+  }
+  if (callback) {
+    callback(result);
+  }
+}
+
+void ControllerGroup::run_(Member *member, uint64_t generation) {
+  setTraceThreadName("mdc2250_broadcast");
+  while (true) {
+    {
+      boost::mutex::scoped_lock lock(this->release_mutex_);
+      while (this->running_ && this->generation_ == generation) {
+        this->release_condition_.wait(lock);
+      }
+      if (!this->running_) {
+        return;
+      }
+      generation = this->generation_;
+    }
+    if (member->registered) {
+      member->mdc2250.write_async_(member->index, member->command,
+                                   member->length, true);
+      member->written_ns = monotonic_nsec();
+    }
+    boost::mutex::scoped_lock lock(this->release_mutex_);
+    if (--this->writing_ == 0) {
+      this->written_condition_.notify_all();
+    }
+  }
+}
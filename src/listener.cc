@@ -0,0 +1,438 @@
+#include "mdc2250/listener.h"
+#include "mdc2250/clock.h"
+#include "mdc2250/trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+
+using namespace mdc2250;
+
+namespace mdc2250_ {
+
+// Size of the read buffer, a read never exceeds this minus the partial token
+const size_t read_buffer_size = 1024;
+
+inline bool exactlyComparator(const std::string &exact_str,
+                              const std::string &token)
+{
+  return token == exact_str;
+}
+
+inline bool startsWithComparator(const std::string &prefix,
+                                 const std::string &token)
+{
+  return token.compare(0, prefix.length(), prefix) == 0;
+}
+
+inline void defaultExceptionCallback(const std::exception &error) {
+  std::cerr << "MDC2250 Listener Unhandled Exception: " << error.what();
+  std::cerr << std::endl;
+  throw(error);
+}
+
+}
+
+using namespace mdc2250_;
+
+/***** BufferedFilter Functions *****/
+
+BufferedFilter::BufferedFilter(ComparatorType comparator, size_t capacity,
+                               Listener &listener)
+: listener_(listener), tokens_(capacity * max_token_length),
+  lengths_(capacity), capacity_(capacity), head_(0), count_(0)
+{
+  this->filter_ptr_ = FilterPtr(new Filter(comparator, DataCallback()));
+  this->filter_ptr_->buffer_ = this;
+}
+
+BufferedFilter::~BufferedFilter() {
+  this->listener_.removeFilter(this->filter_ptr_);
+}
+
+std::string BufferedFilter::wait(long ms) {
+  char token[max_token_length];
+  size_t length = this->wait(ms, token, sizeof(token));
+  return std::string(token, length);
+}
+
+size_t BufferedFilter::wait(long ms, char *buffer, size_t size) {
+  MDC2250_TRACE_BEGIN("filter_wait", ms);
+  boost::mutex::scoped_lock lock(this->mutex_);
+  if (this->count_ == 0 && ms > 0) {
+    boost::system_time timeout =
+      boost::get_system_time() + boost::posix_time::milliseconds(ms);
+    while (this->count_ == 0) {
+      if (!this->condition_.timed_wait(lock, timeout)) {
+        break;
+      }
+    }
+  }
+  if (this->count_ == 0) {
+    MDC2250_TRACE_END("filter_wait", 0);
+    return 0;
+  }
+  size_t length = this->lengths_[this->head_];
+  if (length > size) {
+    length = size;
+  }
+  std::memcpy(buffer, &this->tokens_[this->head_ * max_token_length],
+              length);
+  this->head_ = (this->head_ + 1) % this->capacity_;
+  this->count_--;
+  MDC2250_TRACE_END("filter_wait", length);
+  return length;
+}
+
+void BufferedFilter::clear() {
+  boost::mutex::scoped_lock lock(this->mutex_);
+  this->head_ = 0;
+  this->count_ = 0;
+}
+
+size_t BufferedFilter::count() {
+  boost::mutex::scoped_lock lock(this->mutex_);
+  return this->count_;
+}
+
+void BufferedFilter::push_(const char *token, size_t length) {
+  boost::mutex::scoped_lock lock(this->mutex_);
+  if (this->count_ == this->capacity_) {
+    // Full, drop the oldest token
+    this->head_ = (this->head_ + 1) % this->capacity_;
+    this->count_--;
+  }
+  size_t tail = (this->head_ + this->count_) % this->capacity_;
+  std::memcpy(&this->tokens_[tail * max_token_length], token, length);
+  this->lengths_[tail] = length;
+  this->count_++;
+  this->condition_.notify_all();
+}
+
+/***** Listener Functions *****/
+
+Listener::Listener(size_t callback_queue_size)
+: handle_exc_(defaultExceptionCallback), transport_(NULL),
+  listening_(false), dropped_tokens_(0), bytes_received_(0), reads_(0),
+  read_buffer_(read_buffer_size), next_queue_index_(0),
+  executor_(callback_executors::dedicated_thread), executor_threads_(1),
+  callback_queue_size_(callback_queue_size), callbacks_executed_(0),
+  callbacks_dropped_(0), callback_total_us_(0), callback_max_us_(0)
+{
+  this->token_.reserve(max_token_length);
+}
+
+Listener::~Listener() {
+  this->stopListening();
+}
+
+void Listener::startListening(Transport &transport) {
+  if (this->listening_) {
+    return;
+  }
+  this->transport_ = &transport;
+  size_t threads = 0;
+  if (this->executor_ == callback_executors::dedicated_thread) {
+    threads = 1;
+  } else if (this->executor_ == callback_executors::thread_pool) {
+    threads = this->executor_threads_;
+  }
+  this->callback_queues_.clear();
+  for (size_t i = 0; i < threads; ++i) {
+    this->callback_queues_.push_back(
+      CallbackQueuePtr(new CallbackQueue(this->callback_queue_size_)));
+  }
+  // Each thread applies the scheduling options to itself
+  this->listening_ = true;
+  try {
+    this->read_thread_ = startThread(this->thread_options_,
+                                     boost::bind(&Listener::read_, this));
+    for (size_t i = 0; i < threads; ++i) {
+      CallbackQueue *queue = this->callback_queues_[i].get();
+      queue->thread = startThread(this->thread_options_,
+        boost::bind(&Listener::callbacks_, this, queue));
+    }
+  } catch (...) {
+    // Stop the threads which did start
+    this->stopListening();
+    throw;
+  }
+}
+
+void Listener::stopListening() {
+  if (!this->listening_) {
+    return;
+  }
+  this->listening_ = false;
+  if (this->read_thread_.joinable() &&
+      this->read_thread_.get_id() != boost::this_thread::get_id()) {
+    this->read_thread_.join();
+  }
+  for (size_t i = 0; i < this->callback_queues_.size(); ++i) {
+    CallbackQueue &queue = *this->callback_queues_[i];
+    {
+      boost::mutex::scoped_lock lock(queue.mutex);
+      queue.condition.notify_all();
+    }
+    if (queue.thread.joinable() &&
+        queue.thread.get_id() != boost::this_thread::get_id()) {
+      queue.thread.join();
+    }
+  }
+}
+
+void
+Listener::setCallbackExecutor(callback_executors::CallbackExecutor executor,
+                              size_t threads)
+{
+  if (executor == callback_executors::thread_pool && threads == 0) {
+    throw(std::invalid_argument("In Listener::setCallbackExecutor, a "
+                                "thread pool needs at least 1 thread."));
+  }
+  this->executor_ = executor;
+  this->executor_threads_ = threads;
+}
+
+CallbackStatistics Listener::getCallbackStatistics() {
+  CallbackStatistics statistics;
+  statistics.executed = this->callbacks_executed_;
+  statistics.dropped = this->callbacks_dropped_;
+  statistics.queue_depth = 0;
+  statistics.max_queue_depth = 0;
+  statistics.duration_total_us = this->callback_total_us_;
+  statistics.duration_max_us = this->callback_max_us_;
+  for (size_t i = 0; i < this->callback_queues_.size(); ++i) {
+    CallbackQueue &queue = *this->callback_queues_[i];
+    boost::mutex::scoped_lock lock(queue.mutex);
+    statistics.queue_depth += queue.count;
+    if (queue.max_count > statistics.max_queue_depth) {
+      statistics.max_queue_depth = queue.max_count;
+    }
+  }
+  return statistics;
+}
+
+FilterPtr
+Listener::createFilter(ComparatorType comparator, DataCallback callback) {
+  FilterPtr filter(new Filter(comparator, callback));
+  boost::mutex::scoped_lock lock(this->filter_mutex_);
+  filter->queue_index_ = this->next_queue_index_++;
+  this->filters_.push_back(filter);
+  return filter;
+}
+
+BufferedFilterPtr
+Listener::createBufferedFilter(ComparatorType comparator, size_t capacity,
+                               bool first)
+{
+  BufferedFilterPtr buffered(new BufferedFilter(comparator, capacity, *this));
+  boost::mutex::scoped_lock lock(this->filter_mutex_);
+  if (first) {
+    this->filters_.insert(this->filters_.begin(), buffered->filter_ptr_);
+  } else {
+    this->filters_.push_back(buffered->filter_ptr_);
+  }
+  return buffered;
+}
+
+void Listener::replaceFilters(const std::vector<FilterPtr> &old_filters,
+                              const std::vector<FilterPtr> &new_filters)
+{
+  boost::mutex::scoped_lock lock(this->filter_mutex_);
+  std::vector<FilterPtr>::const_iterator it;
+  for (it = old_filters.begin(); it != old_filters.end(); ++it) {
+    this->filters_.erase(
+      std::remove(this->filters_.begin(), this->filters_.end(), (*it)),
+      this->filters_.end());
+  }
+  for (it = new_filters.begin(); it != new_filters.end(); ++it) {
+    (*it)->queue_index_ = this->next_queue_index_++;
+    this->filters_.push_back((*it));
+  }
+}
+
+void Listener::removeFilter(FilterPtr filter) {
+  boost::mutex::scoped_lock lock(this->filter_mutex_);
+  std::vector<FilterPtr>::iterator it;
+  for (it = this->filters_.begin(); it != this->filters_.end(); ++it) {
+    if ((*it) == filter) {
+      this->filters_.erase(it);
+      return;
+    }
+  }
+}
+
+void Listener::removeFilter(BufferedFilterPtr filter) {
+  this->removeFilter(filter->filter_ptr_);
+}
+
+ComparatorType Listener::exactly(const std::string &exact_str) {
+  return boost::bind(exactlyComparator, exact_str, _1);
+}
+
+ComparatorType Listener::startsWith(const std::string &prefix) {
+  return boost::bind(startsWithComparator, prefix, _1);
+}
+
+void Listener::read_() {
+  setTraceThreadName("mdc2250_read");
+  char *buffer = &this->read_buffer_[0];
+  // Number of bytes of an incomplete token at the start of the buffer
+  size_t partial = 0;
+  try {
+    while (this->listening_) {
+      // Wait for data, then take whatever has arrived
+      size_t length = this->transport_->read((uint8_t *)buffer + partial,
+                                             read_buffer_size - partial);
+      this->reads_.fetch_add(1, boost::memory_order_relaxed);
+      if (length == 0) {
+        if (this->tick_handler_) {
+          this->tick_handler_(monotonic_usec());
+        }
+        continue;
+      }
+      MDC2250_TRACE_INSTANT("serial_read", length);
+      uint64_t stamp_us = monotonic_usec();
+      this->bytes_received_.fetch_add(length, boost::memory_order_relaxed);
+      // Tokenize on carriage return and ACK (\x06) in place
+      size_t end = partial + length;
+      size_t start = 0;
+      for (size_t i = partial; i < end; ++i) {
+        if (buffer[i] != '\r' && buffer[i] != '\x06') {
+          continue;
+        }
+        if (i > start) {
+          if (i - start <= max_token_length) {
+            this->dispatch_(buffer + start, i - start, stamp_us);
+          } else {
+            this->dropped_tokens_++;
+          }
+        }
+        if (buffer[i] == '\x06') {
+          this->dispatch_(buffer + i, 1, stamp_us);
+        }
+        start = i + 1;
+      }
+      // Keep the incomplete token, unless it is already too long
+      partial = end - start;
+      if (partial > max_token_length) {
+        this->dropped_tokens_++;
+        partial = 0;
+      } else if (partial > 0 && start > 0) {
+        std::memmove(buffer, buffer + start, partial);
+      }
+      if (this->tick_handler_) {
+        this->tick_handler_(stamp_us);
+      }
+    }
+  } catch (std::exception &e) {
+    this->handle_exc_(e);
+  }
+}
+
+void Listener::dispatch_(const char *token, size_t length, uint64_t stamp_us)
+{
+  MDC2250_TRACE_INSTANT("token", length);
+  if (this->line_handler_ && this->line_handler_(token, length, stamp_us)) {
+    return;
+  }
+  // Capacity is reserved, so this does not allocate
+  this->token_.assign(token, length);
+  boost::mutex::scoped_lock lock(this->filter_mutex_);
+  FilterPtr matched;
+  std::vector<FilterPtr>::iterator it;
+  for (it = this->filters_.begin(); it != this->filters_.end(); ++it) {
+    if ((*it)->comparator_(this->token_)) {
+      matched = (*it);
+      break;
+    }
+  }
+  if (matched) {
+    MDC2250_TRACE_INSTANT("filter_matched", length);
+  }
+  if (matched && matched->buffer_) {
+    matched->buffer_->push_(token, length);
+    return;
+  }
+  if (!matched && !this->default_handler_) {
+    return;
+  }
+  if (this->callback_queues_.empty()) {
+    // Run inline, without holding the filters so the callback may change
+    // them
+    lock.unlock();
+    this->run_callback_(matched, this->token_);
+    return;
+  }
+  // Queue it for the callback thread of its filter
+  CallbackQueue &queue = *this->callback_queues_[
+    matched ? matched->queue_index_ % this->callback_queues_.size() : 0];
+  boost::mutex::scoped_lock callback_lock(queue.mutex);
+  if (queue.count == queue.slots.size()) {
+    this->dropped_tokens_++;
+    this->callbacks_dropped_++;
+    return;
+  }
+  size_t tail = (queue.head + queue.count) % queue.slots.size();
+  CallbackSlot &slot = queue.slots[tail];
+  slot.filter = matched;
+  slot.length = length;
+  std::memcpy(slot.token, token, length);
+  queue.count++;
+  if (queue.count > queue.max_count) {
+    queue.max_count = queue.count;
+  }
+  queue.condition.notify_one();
+}
+
+void Listener::callbacks_(CallbackQueue *queue) {
+  setTraceThreadName("mdc2250_callbacks");
+  std::string token;
+  token.reserve(max_token_length);
+  while (true) {
+    FilterPtr filter;
+    {
+      boost::mutex::scoped_lock lock(queue->mutex);
+      while (queue->count == 0 && this->listening_) {
+        queue->condition.wait(lock);
+      }
+      if (queue->count == 0) {
+        return;
+      }
+      CallbackSlot &slot = queue->slots[queue->head];
+      filter.swap(slot.filter);
+      token.assign(slot.token, slot.length);
+      queue->head = (queue->head + 1) % queue->slots.size();
+      queue->count--;
+    }
+    this->run_callback_(filter, token);
+  }
+}
+
+void Listener::run_callback_(const FilterPtr &filter,
+                             const std::string &token)
+{
+  MDC2250_TRACE_BEGIN("callback", token.length());
+  uint64_t start = monotonic_usec();
+  try {
+    if (filter) {
+      filter->callback_(token);
+    } else if (this->default_handler_) {
+      this->default_handler_(token);
+    }
+  } catch (std::exception &e) {
+    this->handle_exc_(e);
+  }
+  uint64_t duration = monotonic_usec() - start;
+  MDC2250_TRACE_END("callback", duration);
+  this->callbacks_executed_.fetch_add(1, boost::memory_order_relaxed);
+  this->callback_total_us_.fetch_add(duration, boost::memory_order_relaxed);
+  uint64_t longest = this->callback_max_us_.load(boost::memory_order_relaxed);
+  while (duration > longest &&
+         !this->callback_max_us_.compare_exchange_weak(
+           longest, duration, boost::memory_order_relaxed)) {
+  }
+}
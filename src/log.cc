@@ -0,0 +1,140 @@
+#include "mdc2250/log.h"
+#include "mdc2250/clock.h"
+
+#include <cstring>
+#include <iostream>
+
+#include <boost/bind.hpp>
+
+using namespace mdc2250;
+
+namespace mdc2250_ {
+
+inline void defaultLogSink(const LogRecord &record) {
+  std::clog << format_log_record(record) << '\n';
+}
+
+}
+
+using namespace mdc2250_;
+
+std::string mdc2250::format_log_record(const LogRecord &record) {
+  std::string formatted = "[";
+  formatted += log_level_to_string(record.level);
+  formatted += "] ";
+  formatted += record.event;
+  formatted += ": ";
+  formatted.append(record.text, record.length);
+  return formatted;
+}
+
+Logger::Logger(size_t capacity)
+: sink_(defaultLogSink), level_(log_levels::info), period_ms_(10),
+  queue_(capacity), dropped_(0), logging_(0), running_(false)
+{}
+
+Logger::~Logger() {
+  this->stop();
+}
+
+void Logger::start(size_t period_ms) {
+  if (this->running_) {
+    return;
+  }
+  this->period_ms_ = period_ms;
+  this->running_ = true;
+  this->thread_ = boost::thread(boost::bind(&Logger::run_, this));
+}
+
+void Logger::stop() {
+  if (!this->running_) {
+    return;
+  }
+  this->running_ = false;
+  if (this->thread_.joinable()) {
+    this->thread_.join();
+  }
+  // Wait for records claimed before running_ was cleared to be published, 
+  // so none is left behind to be emitted late by the next start
+  while (this->logging_ > 0) {
+    boost::this_thread::yield();
+  }
+  // Catch records queued while the thread was exiting
+  this->drain_();
+}
+
+bool Logger::log(log_levels::LogLevel level, const char *event,
+                 const char *text, size_t length)
+{
+  if (!this->enabled(level)) {
+    return false;
+  }
+  if (length > max_log_text_length) {
+    length = max_log_text_length;
+  }
+  // Counted before running_ is read, see stop
+  this->logging_++;
+  if (!this->running_) {
+    this->logging_--;
+    // Nothing to hand off to, emit it from this thread
+    LogRecord record;
+    record.stamp_ns = monotonic_nsec();
+    record.level = level;
+    record.event = event;
+    record.length = length;
+    std::memcpy(record.text, text, length);
+    boost::mutex::scoped_lock lock(this->sink_mutex_);
+    this->sink_(record);
+    return true;
+  }
+  size_t ticket;
+  LogRecord *record = this->queue_.claim(ticket);
+  if (record == NULL) {
+    this->logging_--;
+    this->dropped_++;
+    return false;
+  }
+  record->stamp_ns = monotonic_nsec();
+  record->level = level;
+  record->event = event;
+  record->length = length;
+  std::memcpy(record->text, text, length);
+  this->queue_.publish(ticket);
+  this->logging_--;
+  return true;
+}
+
+bool Logger::log(log_levels::LogLevel level, const char *event,
+                 const char *text)
+{
+  return this->log(level, event, text, std::strlen(text));
+}
+
+bool Logger::log(log_levels::LogLevel level, const char *event,
+                 const std::string &text)
+{
+  return this->log(level, event, text.data(), text.length());
+}
+
+void Logger::drain_() {
+  // Threads logging while the thread is stopped call the sink too
+  boost::mutex::scoped_lock lock(this->sink_mutex_);
+  LogRecord *record;
+  while ((record = this->queue_.front()) != NULL) {
+    try {
+      this->sink_(*record);
+    } catch (std::exception &e) {
+      std::cerr << "MDC2250 Logger Sink Exception: " << e.what() << '\n';
+    }
+    this->queue_.pop();
+  }
+}
+
+void Logger::run_() {
+  while (this->running_) {
+    this->drain_();
+    boost::this_thread::sleep(
+      boost::posix_time::milliseconds(this->period_ms_));
+  }
+  this->drain_();
+}
@@ -1,18 +1,20 @@
 #include "mdc2250/mdc2250.h"
+#include "mdc2250/decode.h"
+#include "mdc2250/clock.h"
+#include "mdc2250/trace.h"
 
 #include <iostream>
 #include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <limits>
+
+#include <boost/bind.hpp>
 
 /***** Inline Functions *****/
 
 namespace mdc2250_ {
 
-inline void unparsedMessages(const std::string &token) {
-  std::cout << "Unparsed token(" << token.length() << "): ";
-  std::cout << token << std::endl;
-}
-
 inline void defaultInfoCallback(const std::string &msg) {
   std::cout << "MDC2250 Info: " << msg << std::endl;
 }
@@ -30,49 +32,137 @@ inline void printHex(char * data, int length) {
     printf("\n");
 }
 
+// Appends the decimal representation of value to buffer, returns the length
+inline size_t appendLong(char *buffer, size_t length, long value) {
+  char digits[24];
+  size_t count = 0;
+  unsigned long magnitude = (value < 0) ? 0UL - (unsigned long)value
+                                        : (unsigned long)value;
+  do {
+    digits[count++] = (char)('0' + (magnitude % 10));
+    magnitude /= 10;
+  } while (magnitude != 0);
+  if (value < 0) {
+    buffer[length++] = '-';
+  }
+  while (count > 0) {
+    buffer[length++] = digits[--count];
+  }
+  return length;
 }
 
-using namespace mdc2250;
-using namespace mdc2250_;
-using namespace serial;
-using namespace serial::utils;
+inline bool isAckOrNak(const std::string &token) {
+  return token == "+" || token == "-";
+}
+
+// Motor efforts must be between -1000 and 1000 inclusive
+inline bool validEffort(ssize_t effort) {
+  return effort >= -1000 && effort <= 1000;
+}
 
-// Tokenizes on carriage return or ACK (\x06)
-inline void tokenizer(const std::string &data,
-                      std::vector<TokenPtr> &tokens)
+// Returns the types of the responses to the telemetry queries, in order
+inline std::vector<mdc2250::queries::QueryType>
+telemetryCycle(const std::vector<std::string> &telemetry_queries) {
+  std::vector<mdc2250::queries::QueryType> cycle;
+  std::vector<std::string>::const_iterator it;
+  for (it = telemetry_queries.begin(); it != telemetry_queries.end(); ++it) {
+    std::string response = (*it) + "=";
+    cycle.push_back(
+      mdc2250::detect_response_type(response.data(), response.length()));
+  }
+  return cycle;
+}
+
+// Matches the answers to the probed telemetry queries and rejections
+inline bool isProbeAnswer(const std::vector<std::string> *prefixes,
+                          const std::string &token)
 {
-  // Find the number of \x06 ASCII ACK's
-  size_t number_of_acks =
-    (size_t) std::count(data.begin(), data.end(), '\x06');
-  // Create tokens for each of the acks
-  for(size_t i = 0; i < number_of_acks; ++i) {
-    tokens.push_back(TokenPtr( new std::string("\x06") ));
+  if (token == "-") {
+    return true;
   }
-  // Split on \r and ack
-  typedef std::vector<std::string> find_vector_type;
-  find_vector_type t;
-  boost::split(t, data, boost::is_any_of("\r\x06"));
-  for (find_vector_type::iterator it = t.begin(); it != t.end(); it++) {
-    tokens.push_back(TokenPtr( new std::string(*it) ));
+  std::vector<std::string>::const_iterator it;
+  for (it = prefixes->begin(); it != prefixes->end(); ++it) {
+    if (token.compare(0, it->length(), (*it)) == 0) {
+      return true;
+    }
   }
+  return false;
 }
 
+// Responses are plain ASCII, control characters mean the line was garbled
+inline bool isPrintable(const char *line, size_t length) {
+  for (size_t i = 0; i < length; ++i) {
+    unsigned char c = (unsigned char)line[i];
+    if (c < 0x20 || c > 0x7E) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Takes one from a count shared with another thread, false if it was zero
+inline bool takeOne(boost::atomic<size_t> &count) {
+  size_t current = count.load();
+  while (current != 0) {
+    if (count.compare_exchange_weak(current, current - 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}
+
+using namespace mdc2250;
+using namespace mdc2250_;
+
 /***** MDC2250 Class Functions *****/
 
-MDC2250::MDC2250(bool debug_mode) : listener_(1) {
+MDC2250::MDC2250(bool debug_mode)
+: expected_echo_length_(0), watchdog_(0), estop_(false),
+  urgent_acks_pending_(0), urgent_ack_next_(false), estop_skips_head_(0),
+  estop_skips_count_(0), acks_owed_(0), owed_tickets_count_(0),
+  batch_active_(false), batch_echo_position_(0),
+  batch_acks_received_(0), batched_commands_(0),
+  estop_confirm_pending_(false), estop_confirming_(false),
+  odometry_enabled_(false), monitor_flags_(false), hide_fault_flags_(false),
+  hide_status_flags_(false), publishing_(false)
+{
   // Set default callbacks
   this->handle_exc = defaultExceptionCallback;
   this->info = defaultInfoCallback;
-  cmd_time = 200; // Default to 15 ms
   this->debug_mode_ = debug_mode;
+  this->logger_.setSink(boost::bind(&MDC2250::emit_log_, this, _1));
   if (this->debug_mode_) {
-    this->listener_.setDefaultHandler(unparsedMessages);
+    this->logger_.setLevel(log_levels::debug);
+    this->listener_.setDefaultHandler(
+      boost::bind(&MDC2250::log_unparsed_, this, _1));
   }
-  this->listener_.setTokenizer(tokenizer);
+  this->listener_.setLineHandler(
+    boost::bind(&MDC2250::handle_line_, this, _1, _2, _3));
+  this->listener_.setTickHandler(
+    boost::bind(&MDC2250::handle_tick_, this, _1));
   this->listener_.setExceptionHandler(this->handle_exc);
+  this->writer_.setExceptionHandler(this->handle_exc);
   this->connected_ = false;
   this->echo_ = false;
-  this->estop_ = false;
+  for (size_t i = 0; i < max_async_requests; ++i) {
+    this->async_requests_[i].state = AsyncRequest::idle;
+  }
+  this->async_pending_ = 0;
+  this->async_sequence_ = 0;
+  this->async_ack_owner_ = -1;
+  this->max_link_utilization_ = 0.8;
+  this->reject_over_budget_ = false;
+  this->telemetry_bandwidth_ = 0.0;
+  this->telemetry_period_ = 0;
+  std::memset(&this->telemetry_switch_, 0, sizeof(this->telemetry_switch_));
+  this->link_sample_ns_ = 0;
+  this->link_sent_ = 0;
+  this->link_received_ = 0;
+  this->link_commands_ = 0;
+  std::memset(&this->link_utilization_, 0, sizeof(this->link_utilization_));
+  std::memset(&this->telemetry_state_, 0, sizeof(this->telemetry_state_));
 }
 
 MDC2250::~MDC2250() {
@@ -82,33 +172,57 @@ MDC2250::~MDC2250() {
 }
 
 void MDC2250::connect(std::string port, size_t watchdog_time, bool echo) {
+  TransportPtr transport;
+  try {
+    transport = createTransport(port, this->read_latency_profile_);
+  } catch (std::exception &e) {
+    throw(ConnectionFailedException(e.what()));
+  }
+  this->connect(transport, watchdog_time, echo);
+}
+
+void MDC2250::connect(TransportPtr transport, size_t watchdog_time,
+                      bool echo)
+{
+  if (!transport) {
+    throw(ConnectionFailedException("No transport given."));
+  }
   // Set the port
-  this->port_ = port;
+  this->transport_ = transport;
+  this->port_ = transport->name();
+  // Emit log records from the background from now on
+  this->logger_.start();
+  try {
+    this->connect_(watchdog_time, echo);
+  } catch (...) {
+    // Leave no threads running or transport open behind a failed connect
+    this->teardown_();
+    throw;
+  }
+}
 
+void MDC2250::connect_(size_t watchdog_time, bool echo) {
   try {
-    // Setup and open serial port
-    this->serial_port_.setPort(port_);
-    this->serial_port_.setBaudrate(115200);
-    serial::Timeout to = serial::Timeout::simpleTimeout(100);
-    this->serial_port_.setTimeout(to);
-    this->serial_port_.open();
+    // Open the transport
+    this->transport_->open();
 
     // Setup filters
     this->setupFilters();
 
-    // Setup and start serial listener
-    listener_.startListening(this->serial_port_);
+    // Setup and start serial writer and listener
+    writer_.start(*this->transport_);
+    listener_.startListening(*this->transport_);
   } catch (std::exception &e) {
     throw(ConnectionFailedException(e.what()));
   }
 
   // Reset the controller to ensure clean setup
   this->reset();
+  this->flag_monitor_.reset();
   this->connected_ = true;
 
   // Ping the controller for presence
   if (!this->ping()) {
-    this->connected_ = false;
     // We didn't receive a ping from the device
     throw(ConnectionFailedException("Failed to get a response "
                                     "from ping.",1));
@@ -121,138 +235,453 @@ void MDC2250::connect(std::string port, size_t watchdog_time, bool echo) {
   this->setEcho(echo);
   this->setWatchdog(watchdog_time);
 
-  // Get the device version
+  // The identity never changes, only query it for a new port or firmware
+  if (this->fid_.empty() || this->port_ != this->identity_port_ ||
+      this->fid_ != this->identity_fid_)
   {
-    std::string res, fail_why;
-    if (!this->issueQuery("?$1E",
-                          SerialListener::startsWith("$1E="),
-                          res,
-                          fail_why))
+    // Get the device version
     {
-      this->connected_ = false;
-      throw(ConnectionFailedException(fail_why));
+      std::string res, fail_why;
+      if (!this->issueQuery("?$1E",
+                            Listener::startsWith("$1E="),
+                            res,
+                            fail_why))
+      {
+        throw(ConnectionFailedException(fail_why));
+      }
+      // Store the response
+      device_string_ = res.substr(4, res.length()-4);
     }
-    // Store the response
-    device_string_ = res.substr(4, res.length()-4);
-  }
 
-  // Get the control unit type and controller model
-  {
-    std::string res, fail_why;
-    if (!this->issueQuery("?TRN",
-                          SerialListener::startsWith("TRN="),
-                          res,
-                          fail_why))
+    // Get the control unit type and controller model
     {
-      this->connected_ = false;
-      throw(ConnectionFailedException(fail_why));
-    }
-    // Parse the response
-    size_t trn = res.find("TRN=");
-    size_t colon = res.find(":");
-    if (trn == std::string::npos || colon == std::string::npos) {
-      std::stringstream ss;
-      ss << "Invalid ?TRN query response: " << res;
-      this->connected_ = false;
-      throw(ConnectionFailedException(ss.str()));
+      std::string res, fail_why;
+      if (!this->issueQuery("?TRN",
+                            Listener::startsWith("TRN="),
+                            res,
+                            fail_why))
+      {
+        throw(ConnectionFailedException(fail_why));
+      }
+      // Parse the response
+      size_t trn = res.find("TRN=");
+      size_t colon = res.find(":");
+      if (trn == std::string::npos || colon == std::string::npos) {
+        std::stringstream ss;
+        ss << "Invalid ?TRN query response: " << res;
+        throw(ConnectionFailedException(ss.str()));
+      }
+      // Report device info
+      trn += 4;
+      control_unit_ = res.substr(trn, colon-(trn));
+      controller_model_ = res.substr(colon+1, res.length()-colon);
     }
-    // Report device info
-    trn += 4;
-    control_unit_ = res.substr(trn, colon-(trn));
-    controller_model_ = res.substr(colon+1, res.length()-colon);
+
+    this->identity_port_ = this->port_;
+    this->identity_fid_ = this->fid_;
+  } else {
+    MDC2250_LOG_DEBUG(this->logger_, "identity",
+                      "Using the cached device identity.");
   }
 
   std::stringstream ss;
   ss << "Connected to device " << device_string_ << " with control unit ";
   ss << control_unit_ << " and controller model ";
   ss << controller_model_ << ".";
-  this->info(ss.str());
+  MDC2250_LOG_INFO(this->logger_, "connected", ss.str());
 }
 
 void MDC2250::disconnect() {
   if (this->connected_ == false) {
     return;
   }
-  // E-stop
-  if (this->serial_port_.isOpen()) {
-    this->serial_port_.write("!EX\r");
+  this->teardown_();
+}
+
+void MDC2250::teardown_() {
+  // E-stop ahead of anything queued, stopping the writer flushes the rest
+  if (this->transport_->isOpen()) {
+    this->writer_.writeUrgent("!EX\r", 4);
+  }
+  if (this->estop_confirm_thread_.joinable()) {
+    this->estop_confirm_thread_.join();
   }
+  this->writer_.stop();
   this->listener_.stopListening();
+  this->transport_->close();
   this->connected_ = false;
+  // No acknowledgement is coming for estops still awaiting one
+  {
+    boost::mutex::scoped_lock lock(this->urgent_mutex_);
+    this->estop_skips_count_ = 0;
+    this->urgent_acks_pending_ = 0;
+    this->urgent_ack_next_ = false;
+  }
+  // Fail any requests still waiting for a response
+  {
+    AsyncCompletion completions[max_async_requests];
+    size_t count = 0;
+    {
+      boost::mutex::scoped_lock lock(this->async_mutex_);
+      for (size_t i = 0; i < max_async_requests; ++i) {
+        if (this->async_requests_[i].state != AsyncRequest::idle) {
+          this->complete_async_(i, results::not_connected, NULL, 0,
+                                completions, count);
+        }
+      }
+      this->async_ack_owner_ = -1;
+    }
+    this->finish_async_(completions, count);
+  }
+  this->logger_.stop();
 }
 
 bool MDC2250::issueQuery(const std::string &query,
-                         serial::utils::ComparatorType comparator,
+                         ComparatorType comparator,
                          std::string &response, std::string &failure_reason)
 {
+  Result result = this->tryIssueQuery(query, comparator, response);
+  if (!result.ok()) {
+    failure_reason = result.message();
+    return false;
+  }
+  return true;
+}
+
+Result MDC2250::tryIssueQuery(const std::string &query,
+                              ComparatorType comparator,
+                              std::string &response)
+{
+  boost::mutex::scoped_lock lock(this->transaction_mutex_);
   // BufferedFilter for response
   BufferedFilterPtr r = this->listener_.createBufferedFilter(comparator);
   // Issue command
-  if (!this->_issueCommand(query,failure_reason,"query"))
-    return false;
+  Result result = this->write_command_(query.data(), query.length());
+  if (!result.ok()) {
+    return result;
+  }
   // If that succeeded, get the response
-  response = r->wait(cmd_time);
+  rtt_kinds::RttKind kind = rtt_kind_of(query.data(), query.length());
+  uint64_t start = monotonic_usec();
+  response = r->wait(this->rtt_.timeoutMs(kind));
   if (response == "") {
     // This means we didn't get a response
-    std::stringstream error;
-    error << "Failed to receive a response for query " << query << ".";
-    failure_reason = error.str();
-    return false;
+    result.code = results::response_timeout;
+    this->rtt_.timedOut(kind);
+  } else {
+    this->rtt_.sample(kind, monotonic_usec() - start);
   }
-  return true;
+  return result;
 }
 
 bool MDC2250::issueCommand(const std::string &command,
                            std::string &failure_reason)
 {
-  if (!this->_issueCommand(command,failure_reason,"command"))
-    return false;
-  if (ack_filter->wait(cmd_time) == "") {
-    // This means we didn't get an ack ('+')
-    if (nak_filter->wait(cmd_time) == "") {
-      // This means we didn't get a nak either ('-')
-      std::stringstream error;
-      error << "Command " << command << " received a non-acknowledgement";
-      error << " ('-'), which means there was an error with the command";
-      error << ".";
-      failure_reason = error.str();
-      return false;
-    }
-    std::stringstream error;
-    error << "Failed to receive any acknowledgement from the device ";
-    error << "for command " << command << ".";
-    failure_reason = error.str();
+  Result result = this->tryIssueCommand(command);
+  if (!result.ok()) {
+    failure_reason = result.message();
     return false;
   }
   return true;
 }
 
+Result MDC2250::tryIssueCommand(const std::string &command) {
+  return this->issue_command_(command.data(), command.length());
+}
+
+Result MDC2250::tryIssueCommands(const std::vector<std::string> &commands,
+                                 std::vector<Result> &command_results)
+{
+  command_results.clear();
+  if (commands.empty() || commands.size() > max_batch_commands) {
+    return Result(results::invalid_argument);
+  }
+  // Queries and configuration reads are answered with values, not acks
+  std::vector<std::string>::const_iterator it;
+  for (it = commands.begin(); it != commands.end(); ++it) {
+    if (it->empty() || (*it)[0] == '?' || (*it)[0] == '~' ||
+        it->find_first_of("_\r") != std::string::npos)
+    {
+      return Result(results::invalid_argument, it->data(), it->length());
+    }
+    command_results.push_back(
+      Result(results::ack_timeout, it->data(), it->length()));
+  }
+  // Pack the commands into as few lines as possible
+  std::vector<std::string> lines(1);
+  std::vector<size_t> line_commands(1, 0);
+  for (it = commands.begin(); it != commands.end(); ++it) {
+    if (!lines.back().empty() &&
+        lines.back().length() + it->length() + 2 > max_token_length)
+    {
+      lines.push_back(std::string());
+      line_commands.push_back(0);
+    }
+    if (!lines.back().empty()) {
+      lines.back() += '_';
+    }
+    lines.back() += (*it);
+    line_commands.back()++;
+  }
+  MDC2250_TRACE_BEGIN("batch", commands.size());
+  boost::mutex::scoped_lock lock(this->transaction_mutex_);
+  if (!this->connected_) {
+    for (size_t i = 0; i < command_results.size(); ++i) {
+      command_results[i].code = results::not_connected;
+    }
+    MDC2250_TRACE_END("batch", results::not_connected);
+    return Result(results::not_connected, commands[0].data(),
+                  commands[0].length());
+  }
+  // The controller runs each command as soon as it reads the '_' after it,
+  // so the acknowledgements can come in the middle of the echo and are 
+  // picked out by match_batch_ on the read thread
+  {
+    boost::mutex::scoped_lock batch_lock(this->batch_mutex_);
+    this->batch_echo_.clear();
+    for (size_t i = 0; i < lines.size(); ++i) {
+      this->batch_echo_ += lines[i];
+      this->batch_echo_ += '\r';
+    }
+    this->batch_echo_position_ = 0;
+    this->batch_acks_received_ = 0;
+    this->batch_active_ = true;
+  }
+  size_t written = 0;
+  for (size_t i = 0; i < lines.size(); ++i) {
+    results::ResultCode code = results::success;
+    if (lines[i].length() + 1 > max_token_length) {
+      code = results::command_too_long;
+    } else {
+      char buffer[max_token_length];
+      std::memcpy(buffer, lines[i].data(), lines[i].length());
+      buffer[lines[i].length()] = '\r';
+      if (!this->queue_owed_(buffer, lines[i].length() + 1,
+                             line_commands[i]))
+      {
+        code = results::write_failed;
+      }
+    }
+    if (code != results::success) {
+      for (size_t j = written; j < command_results.size(); ++j) {
+        command_results[j].code = code;
+      }
+      break;
+    }
+    written += line_commands[i];
+    this->batched_commands_ += line_commands[i] - 1;
+  }
+  // The acknowledgements come in the order of the commands, only a batch 
+  // of one kind gives a round trip time for that kind
+  bool one_kind = true;
+  for (size_t i = 1; i < commands.size(); ++i) {
+    if (rtt_kind_of(commands[i].data(), commands[i].length()) !=
+        rtt_kind_of(commands[0].data(), commands[0].length()))
+    {
+      one_kind = false;
+    }
+  }
+  uint64_t start = monotonic_usec();
+  {
+    boost::mutex::scoped_lock batch_lock(this->batch_mutex_);
+    for (size_t i = 0; i < written; ++i) {
+      rtt_kinds::RttKind kind =
+        rtt_kind_of(commands[i].data(), commands[i].length());
+      long timeout_ms = this->rtt_.timeoutMs(kind);
+      if (i == 0 && this->echo_) {
+        timeout_ms += this->rtt_.timeoutMs(rtt_kinds::echo);
+      }
+      boost::system_time timeout =
+        boost::get_system_time() + boost::posix_time::milliseconds(timeout_ms);
+      while (this->batch_acks_received_ <= i) {
+        if (!this->batch_condition_.timed_wait(batch_lock, timeout)) {
+          break;
+        }
+      }
+      if (this->batch_acks_received_ <= i) {
+        this->rtt_.timedOut(kind);
+        break;
+      }
+      if (i == 0 && one_kind && !this->echo_) {
+        this->rtt_.sample(kind, monotonic_usec() - start);
+      }
+      command_results[i].code =
+        this->batch_acks_[i] == '+' ? results::success : results::nak;
+    }
+    this->batch_active_ = false;
+  }
+  {
+    boost::mutex::scoped_lock lock(this->urgent_mutex_);
+    this->acks_owed_ = 0;
+    this->owed_tickets_count_ = 0;
+  }
+  std::vector<Result>::const_iterator result;
+  for (result = command_results.begin(); result != command_results.end();
+       ++result)
+  {
+    if (!result->ok()) {
+      MDC2250_TRACE_END("batch", result->code);
+      return (*result);
+    }
+  }
+  MDC2250_TRACE_END("batch", results::success);
+  return Result(results::success, commands[0].data(), commands[0].length());
+}
+
+Result MDC2250::issue_command_(const char *command, size_t length) {
+  MDC2250_TRACE_BEGIN("command", length);
+  boost::mutex::scoped_lock lock(this->transaction_mutex_);
+  if (!this->connected_) {
+    MDC2250_TRACE_END("command", results::not_connected);
+    return Result(results::not_connected, command, length);
+  }
+  // Drop any acknowledgement left over from a command that timed out
+  this->ack_filter->clear();
+  Result result = this->write_command_(command, length, 1);
+  if (result.ok()) {
+    MDC2250_TRACE_INSTANT("command_written", length);
+    char response[1];
+    rtt_kinds::RttKind kind = rtt_kind_of(command, length);
+    uint64_t start = monotonic_usec();
+    if (this->ack_filter->wait(this->rtt_.timeoutMs(kind), response,
+                               sizeof(response)) == 0)
+    {
+      // This means we didn't get an ack ('+') or a nak ('-')
+      result.code = results::ack_timeout;
+      this->rtt_.timedOut(kind);
+    } else {
+      this->rtt_.sample(kind, monotonic_usec() - start);
+      if (response[0] == '-') {
+        // There was an error with the command
+        result.code = results::nak;
+      }
+    }
+  }
+  {
+    boost::mutex::scoped_lock lock(this->urgent_mutex_);
+    this->acks_owed_ = 0;
+    this->owed_tickets_count_ = 0;
+  }
+  // Ends with the result code, 0 once acknowledged
+  MDC2250_TRACE_END("command", result.code);
+  return result;
+}
+
+ReadLatencyMeasurement MDC2250::measureReadLatency(size_t samples) {
+  if (samples == 0) {
+    throw(std::invalid_argument("In measureReadLatency, samples must be "
+                                "greater than 0."));
+  }
+  if (!this->connected_) {
+    throw(CommandFailedException("measureReadLatency",
+                                 Result(results::not_connected)));
+  }
+  ReadLatencyMeasurement measurement;
+  measurement.profile = this->read_latency_profile_;
+  SerialTransport *serial =
+    dynamic_cast<SerialTransport *>(this->transport_.get());
+  measurement.low_latency = serial != NULL && serial->isLowLatency();
+  // ^E and ^F, one byte each way
+  uint64_t wire_us =
+    (uint64_t)(2.0 * 1e6 / this->transport_->bytesPerSecond());
+  std::vector<uint64_t> latencies;
+  latencies.reserve(samples);
+  uint64_t reads = this->listener_.reads();
+  uint64_t start = monotonic_usec();
+  for (size_t i = 0; i < samples; ++i) {
+    uint64_t sent = monotonic_usec();
+    if (!this->ping()) {
+      continue;
+    }
+    uint64_t round_trip = monotonic_usec() - sent;
+    latencies.push_back(round_trip > wire_us ? round_trip - wire_us : 0);
+  }
+  uint64_t elapsed = monotonic_usec() - start;
+  uint64_t wakeups = this->listener_.reads() - reads;
+  measurement.samples = latencies.size();
+  measurement.mean_us = 0.0;
+  measurement.min_us = 0;
+  measurement.p99_us = 0;
+  measurement.max_us = 0;
+  if (!latencies.empty()) {
+    std::sort(latencies.begin(), latencies.end());
+    uint64_t total = 0;
+    for (size_t i = 0; i < latencies.size(); ++i) {
+      total += latencies[i];
+    }
+    measurement.mean_us = (double)total / (double)latencies.size();
+    measurement.min_us = latencies.front();
+    measurement.p99_us = latencies[(latencies.size() - 1) * 99 / 100];
+    measurement.max_us = latencies.back();
+  }
+  measurement.wakeups_per_second =
+    elapsed == 0 ? 0.0 : (double)wakeups * 1e6 / (double)elapsed;
+  measurement.wakeups_per_ping = (double)wakeups / (double)samples;
+  return measurement;
+}
+
+std::vector<ReadLatencyMeasurement>
+mdc2250::probeReadLatency(const std::string &port,
+                          const std::vector<ReadLatencyProfile> &profiles,
+                          size_t samples)
+{
+  std::vector<ReadLatencyMeasurement> measurements;
+  std::vector<ReadLatencyProfile>::const_iterator it;
+  for (it = profiles.begin(); it != profiles.end(); ++it) {
+    MDC2250 mdc2250;
+    mdc2250.setReadLatencyProfile((*it));
+    mdc2250.connect(port);
+    measurements.push_back(mdc2250.measureReadLatency(samples));
+    mdc2250.disconnect();
+  }
+  return measurements;
+}
+
 bool MDC2250::ping() {
-  this->serial_port_.write("\x05");
-  // If the wait command == "", then no response was heard
-  std::string temp = this->ping_filter->wait(cmd_time);
-  return !temp.empty();
+  boost::mutex::scoped_lock lock(this->transaction_mutex_);
+  uint64_t start = monotonic_usec();
+  this->write_("\x05");
+  // If nothing was copied, then no response was heard
+  char response[1];
+  if (this->ping_filter->wait(this->rtt_.timeoutMs(rtt_kinds::ping),
+                              response, sizeof(response)) == 0)
+  {
+    this->rtt_.timedOut(rtt_kinds::ping);
+    return false;
+  }
+  this->rtt_.sample(rtt_kinds::ping, monotonic_usec() - start);
+  return true;
 }
 
 void
 MDC2250::reset() {
+  boost::mutex::scoped_lock lock(this->transaction_mutex_);
   BufferedFilterPtr fid_filt =
-    this->listener_.createBufferedFilter(SerialListener::startsWith("FID="));
-  this->serial_port_.write("%RESET 321654987\r");
-  fid_filt->wait(2000);
+    this->listener_.createBufferedFilter(Listener::startsWith("FID="));
+  this->write_("%RESET 321654987\r");
+  // Tells whether a cached identity still belongs to this device
+  this->fid_ = fid_filt->wait(2000);
 }
 
 void
 MDC2250::setWatchdog(size_t timeout) {
+  Result result = this->trySetWatchdog(timeout);
+  if (!result.ok()) {
+    // Something went wrong
+    throw(CommandFailedException("setWatchdog", result));
+  }
+}
+
+Result MDC2250::trySetWatchdog(size_t timeout) {
   // Create command
-  std::stringstream ss;
-  ss << "^RWD " << timeout;
+  char command[32] = "^RWD ";
+  size_t length = appendLong(command, 5, (long)timeout);
   // Issue command
-  std::string fail_why;
-  if (!this->issueCommand(ss.str(), fail_why)) {
-    // Something went wrong
-    throw(CommandFailedException("setWatchdog", fail_why));
+  Result result = this->issue_command_(command, length);
+  if (result.ok()) {
+    this->watchdog_ = timeout;
   }
+  return result;
 }
 
 void
@@ -277,41 +706,135 @@ MDC2250::setEcho(bool state) {
 
 void
 MDC2250::estop() {
-  // Issue Command
-  std::string fail_why;
-  if (!this->issueCommand("!EX", fail_why)) {
-    // Something went wrong
-    throw(CommandFailedException("estop", fail_why));
+  Result result = this->tryEstop();
+  if (!result.ok()) {
+    throw(CommandFailedException("estop", result));
+  }
+}
+
+Result MDC2250::tryEstop() {
+  if (!this->connected_) {
+    return Result(results::not_connected, "!EX", 3);
+  }
+  // Write it ahead of everything else, its acknowledgement is consumed by
+  // handle_line_ so it is not mistaken for that of another command.  With
+  // echo on it follows the echo of "!EX", without echo it follows those 
+  // owed to the commands the writer had already written, the lock keeps 
+  // handle_line_ from deciding before they are counted.
+  {
+    boost::mutex::scoped_lock lock(this->urgent_mutex_);
+    bool tracked =
+      this->echo_ || this->estop_skips_count_ < max_pending_estops;
+    if (tracked) {
+      this->urgent_acks_pending_++;
+    }
+    size_t written = 0;
+    if (!this->writer_.writeUrgent("!EX\r", 4, &written)) {
+      if (tracked) {
+        this->urgent_acks_pending_--;
+      }
+      return Result(results::write_failed, "!EX", 3);
+    }
+    if (tracked && !this->echo_) {
+      // Those owed before an earlier estop are already counted by it
+      size_t skip = this->acks_written_(written);
+      for (size_t i = 0; i < this->estop_skips_count_; ++i) {
+        size_t earlier = this->estop_skips_[
+          (this->estop_skips_head_ + i) % max_pending_estops];
+        skip -= std::min(skip, earlier);
+      }
+      this->estop_skips_[(this->estop_skips_head_ + this->estop_skips_count_)
+                         % max_pending_estops] = skip;
+      this->estop_skips_count_++;
+    }
+  }
+  this->estop_ = true;
+  this->publish_estop_();
+  // Get the resulting state without blocking the caller
+  this->confirm_estop_async_();
+  return Result(results::success, "!EX", 3);
+}
+
+void MDC2250::confirm_estop_async_() {
+  this->estop_confirm_pending_ = true;
+  if (this->estop_confirming_.exchange(true)) {
+    // The running confirmation picks up the pending request
+    return;
+  }
+  if (this->estop_confirm_thread_.joinable()) {
+    this->estop_confirm_thread_.join();
+  }
+  this->estop_confirm_thread_ =
+    boost::thread(boost::bind(&MDC2250::confirm_estop_, this));
+}
+
+void MDC2250::confirm_estop_() {
+  while (true) {
+    while (this->estop_confirm_pending_.exchange(false)) {
+      try {
+        this->detect_emergency_stop_();
+        if (this->estop_handler_) {
+          this->estop_handler_(this->estop_);
+        }
+      } catch (std::exception &e) {
+        this->handle_exc(e);
+      }
+    }
+    this->estop_confirming_ = false;
+    // Recheck in case a request arrived while giving up the role
+    if (!this->estop_confirm_pending_ ||
+        this->estop_confirming_.exchange(true)) {
+      break;
+    }
   }
-  // Get the resulting state
-  this->detect_emergency_stop_();
 }
 
 void MDC2250::clearEstop() {
   // Issue Command
-  std::string fail_why;
-  if (!this->issueCommand("!MG", fail_why)) {
+  Result result = this->issue_command_("!MG", 3);
+  if (!result.ok()) {
     // Something went wrong
-    throw(CommandFailedException("estop", fail_why));
+    throw(CommandFailedException("clearEstop", result));
   }
   // Get the resulting state
   this->detect_emergency_stop_();
 }
 
+Result MDC2250::tryClearEstop() {
+  Result result = this->issue_command_("!MG", 3);
+  if (result.ok()) {
+    // Get the resulting state without blocking the caller
+    this->confirm_estop_async_();
+  }
+  return result;
+}
+
 void
 MDC2250::setTelemetry(std::string telemetry_queries,
                       size_t period,
-                      serial::utils::DataCallback callback)
+                      DataCallback callback)
 {
-  // Stop the current telemetry if it is running
-  std::string fail_why;
-  if (!this->_issueCommand("# C", fail_why, "query history")) {
-    // Something went wrong
-    throw(CommandFailedException("setTelemetry", fail_why));
+  if (telemetry_queries.empty()) {
+    this->stopTelemetry();
+    return;
   }
   // Validate the parameters
   std::vector<std::string> queries;
   boost::split(queries, telemetry_queries, boost::is_any_of(","));
+  // The callbacks only get what the caller asked for, flags added for the
+  // monitor go to it alone
+  std::vector<std::string> requested = queries;
+  bool hide_faults = false, hide_status = false;
+  if (this->monitor_flags_) {
+    if (std::find(queries.begin(), queries.end(), "FF") == queries.end()) {
+      queries.push_back("FF");
+      hide_faults = true;
+    }
+    if (std::find(queries.begin(), queries.end(), "FS") == queries.end()) {
+      queries.push_back("FS");
+      hide_status = true;
+    }
+  }
   if (queries.size() == 0) {
     // There were no queries parsed out
     std::stringstream ss;
@@ -326,56 +849,257 @@ MDC2250::setTelemetry(std::string telemetry_queries,
     ss << period;
     throw(std::invalid_argument(ss.str()));
   }
-  // Remove old filters
-  {
-    std::vector<serial::utils::FilterPtr>::iterator i;
-    for (i = telemetry_filters_.begin(); i != telemetry_filters_.end(); i++)
-    {
-      this->listener_.removeFilter((*i));
-    }
-    telemetry_filters_.clear();
+  // Check the new configuration against the link budget
+  double telemetry = telemetry_bandwidth(queries, period);
+  this->check_link_budget_(telemetry);
+  // Follow the order the controller will send the responses in
+  std::vector<queries::QueryType> cycle = telemetryCycle(queries);
+  boost::mutex::scoped_lock lock(this->transaction_mutex_);
+  this->telemetry_health_.stop();
+  // The probe needs to see the flags' answers
+  bool hid_faults = this->hide_fault_flags_;
+  bool hid_status = this->hide_status_flags_;
+  this->hide_fault_flags_ = false;
+  this->hide_status_flags_ = false;
+  uint64_t stopped = monotonic_usec();
+  Result result = this->probe_telemetry_(queries);
+  uint64_t probed = monotonic_usec();
+  if (!result.ok()) {
+    this->restore_telemetry_();
+    this->hide_fault_flags_ = hid_faults;
+    this->hide_status_flags_ = hid_status;
+    throw(CommandFailedException("setTelemetry", result));
   }
-  // Run each query once, in order
+  // Swap the callbacks in one step, so no response goes to both or neither
+  std::vector<FilterPtr> filters;
+  std::vector<std::string> key;
   std::vector<std::string>::iterator it;
+  for (it = requested.begin(); it != requested.end(); ++it) {
+    // Make sure there are no duplicate filters
+    if (std::find(key.begin(), key.end(), (*it)) == key.end()) {
+      key.push_back((*it));
+      filters.push_back(
+        FilterPtr(new Filter(Listener::startsWith((*it)), callback)));
+    }
+  }
+  this->listener_.replaceFilters(this->telemetry_filters_, filters);
+  // Now that all of the queries have been answered, restart the automatic
+  // telemetry sending
+  this->telemetry_health_.start(cycle, period);
+  result = this->start_telemetry_(period);
+  if (!result.ok()) {
+    // Swap the previous callbacks back in and restart their telemetry
+    this->telemetry_health_.stop();
+    this->listener_.replaceFilters(filters, this->telemetry_filters_);
+    this->restore_telemetry_();
+    this->hide_fault_flags_ = hid_faults;
+    this->hide_status_flags_ = hid_status;
+    throw(CommandFailedException("setTelemetry", result));
+  }
+  this->hide_fault_flags_ = hide_faults;
+  this->hide_status_flags_ = hide_status;
+  uint64_t started = monotonic_usec();
+  TelemetrySwitch telemetry_switch;
+  telemetry_switch.queries = queries.size();
+  telemetry_switch.probe_us = probed - stopped;
+  telemetry_switch.stopped_us = started - stopped;
+  telemetry_switch.gap_estimate_us = telemetry_switch.stopped_us +
+    (uint64_t)(this->telemetry_period_ + period) * 1000;
+  this->telemetry_filters_ = filters;
+  this->telemetry_queries_ = queries;
+  this->telemetry_period_ = period;
+  boost::mutex::scoped_lock link_lock(this->link_mutex_);
+  this->telemetry_bandwidth_ = telemetry;
+  this->telemetry_switch_ = telemetry_switch;
+}
+
+void MDC2250::restore_telemetry_() {
+  // The previous callbacks are in place, restart their telemetry
+  if (!this->telemetry_queries_.empty() &&
+      this->probe_telemetry_(this->telemetry_queries_).ok() &&
+      this->start_telemetry_(this->telemetry_period_).ok())
+  {
+    this->telemetry_health_.start(telemetryCycle(this->telemetry_queries_),
+                                  this->telemetry_period_);
+  }
+}
+
+Result MDC2250::probe_telemetry_(const std::vector<std::string> &queries) {
+  // Catch the answers ahead of the telemetry filters, and the answer to a 
+  // ping sent behind "# C", with room for the old telemetry ahead of it
+  std::vector<std::string> prefixes;
+  std::vector<std::string>::const_iterator it;
   for (it = queries.begin(); it != queries.end(); ++it) {
-    // Wait to ensure we don't overload the mc
-    this->listener_.sleep(100);
-    // Issue the query once
-    std::string cmd, match, res, fail_why;
-    cmd = "?"+(*it);
-    match = (*it)+"=";
-    if (!issueQuery(cmd, SerialListener::startsWith(match), res, fail_why)) {
-      // Something went wrong
-      std::vector<serial::utils::FilterPtr>::iterator i;
-      for (i = telemetry_filters_.begin(); i != telemetry_filters_.end(); i++)
+    prefixes.push_back((*it) + "=");
+  }
+  prefixes.push_back("\x06");
+  BufferedFilterPtr probe = this->listener_.createBufferedFilter(
+    boost::bind(isProbeAnswer, &prefixes, _1), queries.size() + 1, true);
+  Result result = this->write_command_("# C", 3);
+  if (!result.ok()) {
+    return result;
+  }
+  // The controller answers in order, so anything the probe catches before
+  // the ping's answer is old telemetry still in flight when "# C" was 
+  // written, even without echo.  Send every query at once behind it.
+  if (!this->write_("\x05")) {
+    return Result(results::write_failed, "\x05", 1);
+  }
+  for (it = queries.begin(); it != queries.end(); ++it) {
+    std::string query = "?" + (*it) + "\r";
+    if (!this->writer_.write(query.data(), query.length())) {
+      return Result(results::write_failed, query.data(),
+                    query.length() - 1);
+    }
+  }
+  char token[max_token_length];
+  long ping_timeout_ms = this->rtt_.timeoutMs(rtt_kinds::ping);
+  while (true) {
+    size_t length = probe->wait(ping_timeout_ms, token, sizeof(token));
+    if (length == 0) {
+      this->rtt_.timedOut(rtt_kinds::ping);
+      return Result(results::response_timeout, "# C", 3);
+    }
+    if (length == 1 && token[0] == '\x06') {
+      break;
+    }
+  }
+  std::vector<bool> answered(queries.size(), false);
+  size_t rejected = 0;
+  long timeout_ms = this->rtt_.timeoutMs(rtt_kinds::query);
+  for (size_t i = 0; i < queries.size(); ++i) {
+    size_t length = probe->wait(timeout_ms, token, sizeof(token));
+    if (length == 0) {
+      this->rtt_.timedOut(rtt_kinds::query);
+      break;
+    }
+    // A rejection leaves its query unanswered
+    if (length == 1 && token[0] == '-') {
+      rejected++;
+      continue;
+    }
+    for (size_t j = 0; j < queries.size(); ++j) {
+      if (!answered[j] && length >= prefixes[j].length() &&
+          std::memcmp(token, prefixes[j].data(), prefixes[j].length()) == 0)
       {
-        this->listener_.removeFilter((*i));
+        answered[j] = true;
+        break;
       }
-      telemetry_filters_.clear();
-      this->serial_port_.write("# C\r");
-      throw(CommandFailedException("setTelemetry", fail_why));
     }
   }
-  // Now make filters
-  std::vector<std::string> key;
-  for (it = queries.begin(); it != queries.end(); ++it) {
-    // Make sure there are no duplicate filters
-    if (std::find(key.begin(), key.end(), (*it)) == key.end()) {
-      // Not a filter for it yet
-      key.push_back((*it));
-      // Add a fitler for it
-      telemetry_filters_.push_back(
-        listener_.createFilter(SerialListener::startsWith((*it)), callback));
+  for (size_t i = 0; i < queries.size(); ++i) {
+    if (!answered[i]) {
+      std::string query = "?" + queries[i];
+      return Result(rejected != 0 ? results::nak : results::response_timeout,
+                    query.data(), query.length());
     }
   }
-  // Now that all of the queries have run once and filters have been made
-  // Call the automatic telemetry sending
+  return result;
+}
+
+Result MDC2250::start_telemetry_(size_t period) {
   std::stringstream ss;
   ss << "# " << period;
-  if (!this->_issueCommand(ss.str(), fail_why, "query history")) {
-    // Something went wrong
-    throw(CommandFailedException("setTelemetry", fail_why));
+  return this->write_command_(ss.str().data(), ss.str().length());
+}
+
+void MDC2250::stopTelemetry() {
+  this->telemetry_health_.stop();
+  {
+    boost::mutex::scoped_lock lock(this->transaction_mutex_);
+    Result result = this->write_command_("# C", 3);
+    if (!result.ok()) {
+      // Something went wrong
+      throw(CommandFailedException("stopTelemetry", result));
+    }
+    this->telemetry_queries_.clear();
+    this->telemetry_period_ = 0;
+    this->hide_fault_flags_ = false;
+    this->hide_status_flags_ = false;
+  }
+  {
+    boost::mutex::scoped_lock lock(this->link_mutex_);
+    this->telemetry_bandwidth_ = 0.0;
+  }
+  // Remove old filters
+  std::vector<FilterPtr>::iterator i;
+  for (i = telemetry_filters_.begin(); i != telemetry_filters_.end(); i++) {
+    this->listener_.removeFilter((*i));
+  }
+  telemetry_filters_.clear();
+}
+
+void MDC2250::setLinkBudget(double max_utilization, bool reject) {
+  if (max_utilization <= 0.0) {
+    std::stringstream ss;
+    ss << "In setLinkBudget, max_utilization must be greater than 0, ";
+    ss << "given: " << max_utilization;
+    throw(std::invalid_argument(ss.str()));
+  }
+  boost::mutex::scoped_lock lock(this->link_mutex_);
+  this->max_link_utilization_ = max_utilization;
+  this->reject_over_budget_ = reject;
+}
+
+LinkUtilization MDC2250::getLinkUtilization() {
+  boost::mutex::scoped_lock lock(this->link_mutex_);
+  LinkUtilization &link = this->link_utilization_;
+  uint64_t now = monotonic_nsec();
+  uint64_t elapsed = now - this->link_sample_ns_;
+  if (this->link_sample_ns_ == 0 || elapsed >= 100000000ULL) {
+    // Urgent writes, like estops and group broadcasts, count too, and a 
+    // batch line counts once per command it carries
+    WriterStatistics writer = this->writer_.getStatistics();
+    uint64_t commands = writer.messages + writer.urgent_messages +
+                        this->batched_commands_;
+    uint64_t received = this->listener_.bytesReceived();
+    if (this->link_sample_ns_ != 0) {
+      double seconds = (double)elapsed / 1e9;
+      link.sent = (double)(writer.bytes - this->link_sent_) / seconds;
+      link.received = (double)(received - this->link_received_) / seconds;
+      link.commands = (double)(commands - this->link_commands_) / seconds;
+    }
+    this->link_sample_ns_ = now;
+    this->link_sent_ = writer.bytes;
+    this->link_received_ = received;
+    this->link_commands_ = commands;
+  }
+  // Until connected, assume the controller's default of 115200 baud
+  link.capacity =
+    this->transport_ ? this->transport_->bytesPerSecond() : 11520.0;
+  link.telemetry = this->telemetry_bandwidth_;
+  // Every command is echoed if echo is on, and acknowledged with "+\r"
+  link.command_replies = 2.0 * link.commands;
+  if (this->echo_) {
+    link.command_replies += link.sent;
+  }
+  link.transmit_utilization = link.sent / link.capacity;
+  link.receive_utilization =
+    (link.telemetry + link.command_replies) / link.capacity;
+  return link;
+}
+
+void MDC2250::check_link_budget_(double telemetry) {
+  LinkUtilization link = this->getLinkUtilization();
+  double utilization = (telemetry + link.command_replies) / link.capacity;
+  double limit;
+  bool reject;
+  {
+    boost::mutex::scoped_lock lock(this->link_mutex_);
+    limit = this->max_link_utilization_;
+    reject = this->reject_over_budget_;
   }
+  if (utilization <= limit) {
+    return;
+  }
+  std::stringstream ss;
+  ss << "The telemetry would use " << (int)(utilization * 100.0 + 0.5);
+  ss << "% of the link, including replies to the current commands, and ";
+  ss << "the limit is " << (int)(limit * 100.0 + 0.5) << "%.";
+  if (reject) {
+    throw(CommandFailedException("setTelemetry", ss.str()));
+  }
+  MDC2250_LOG_WARNING(this->logger_, "link_budget", ss.str());
 }
 
 void
@@ -388,122 +1112,700 @@ MDC2250::commandMotor(size_t motor_index, ssize_t motor_effort) {
     ss << motor_index;
     throw(std::invalid_argument(ss.str()));
   }
-  if (motor_effort < -1000 || motor_effort > 1000) {
+  if (!validEffort(motor_effort)) {
     // Invalid motor effort, must be between -1000 and 1000 inclusive
     std::stringstream ss;
     ss << "In commandMotor, motor_effort must be between -1000 and ";
     ss << "1000 inclusively, given: " << motor_effort;
     throw(std::invalid_argument(ss.str()));
   }
-  // Build the command
-  std::stringstream ss;
-  ss << "!G " << motor_index << " " << motor_effort;
   // Issue the command
-  std::string fail_why;
-  if (!this->issueCommand(ss.str(), fail_why)) {
+  Result result = this->tryCommandMotor(motor_index, motor_effort);
+  if (!result.ok()) {
     // Something went wrong
-    throw(CommandFailedException("commandMotor", fail_why));
+    throw(CommandFailedException("commandMotor", result));
+  }
+}
+
+Result
+MDC2250::tryCommandMotor(size_t motor_index, ssize_t motor_effort) {
+  if ((motor_index != 1 && motor_index != 2) || !validEffort(motor_effort)) {
+    return Result(results::invalid_argument, "!G", 2);
   }
+  return this->command_channel_(motor_index, (long)motor_effort);
+}
+
+Result MDC2250::command_channel_(size_t channel, long effort) {
+  // Build the command
+  char command[32] = "!G ";
+  size_t length = appendLong(command, 3, (long)channel);
+  command[length++] = ' ';
+  length = appendLong(command, length, effort);
+  // Issue the command
+  Result result = this->issue_command_(command, length);
+  if (result.ok() && this->publishing_) {
+    boost::mutex::scoped_lock lock(this->publisher_mutex_);
+    this->publisher_.publishCommand(channel, effort);
+  }
+  return result;
 }
 
 void
 MDC2250::commandMotors(ssize_t motor1_effort, ssize_t motor2_effort) {
   // Validate parameters
-  if (motor1_effort < -1000 || motor1_effort > 1000) {
+  if (!validEffort(motor1_effort)) {
     // motor1_effort is not valid
     std::stringstream ss;
     ss << "In commandMotors, motor1_effort must be between -1000 and ";
     ss << "1000 inclusively, given: " << motor1_effort;
     throw(std::invalid_argument(ss.str()));
   }
-  if (motor2_effort < -1000 || motor2_effort > 1000) {
+  if (!validEffort(motor2_effort)) {
     // motor2_effort is not valid
     std::stringstream ss;
     ss << "In commandMotors, motor2_effort must be between -1000 and ";
     ss << "1000 inclusively, given: " << motor2_effort;
     throw(std::invalid_argument(ss.str()));
   }
-  // Build the command
-  std::stringstream ss;
-  ss << "!M " << motor1_effort << " " << motor2_effort;
   // Issue the command
-  std::string fail_why;
-  if (!this->issueCommand(ss.str(), fail_why)) {
+  Result result = this->tryCommandMotors(motor1_effort, motor2_effort);
+  if (!result.ok()) {
     // Something went wrong
-    throw(CommandFailedException("commandMotors", fail_why));
+    throw(CommandFailedException("commandMotors", result));
   }
 }
 
-bool MDC2250::_issueCommand(const std::string &command,
-                            std::string &failure_reason,
-                            const std::string &cmd_type)
+Result
+MDC2250::tryCommandMotors(ssize_t motor1_effort, ssize_t motor2_effort) {
+  if (!validEffort(motor1_effort) || !validEffort(motor2_effort)) {
+    return Result(results::invalid_argument, "!M", 2);
+  }
+  // Build the command
+  char command[32] = "!M ";
+  size_t length = appendLong(command, 3, (long)motor1_effort);
+  command[length++] = ' ';
+  length = appendLong(command, length, (long)motor2_effort);
+  // Issue the command
+  Result result = this->issue_command_(command, length);
+  if (result.ok() && this->publishing_) {
+    boost::mutex::scoped_lock lock(this->publisher_mutex_);
+    this->publisher_.publishCommands((long)motor1_effort,
+                                     (long)motor2_effort);
+  }
+  return result;
+}
+
+Result MDC2250::write_command_(const char *command, size_t length,
+                               size_t acks)
 {
   if (!this->connected_) {
-    failure_reason = "Not connected.";
-    return false;
+    return Result(results::not_connected, command, length);
   }
+  if (length + 1 > max_token_length) {
+    return Result(results::command_too_long, command, length);
+  }
+  // Frame the command
+  char buffer[max_token_length];
+  std::memcpy(buffer, command, length);
+  buffer[length] = '\r';
   if (this->echo_) {
-    // BufferedFilter for echo of command
-    BufferedFilterPtr e =
-      this->listener_.createBufferedFilter(SerialListener::exactly(command));
-    // Send the command
-    this->serial_port_.write(command+"\r");
-    // Wait for the echo of the command
-    if (e->wait(cmd_time).empty()) {
-      // This means we didn't see it
-      std::stringstream error;
-      error << "Failed to get " << command << " " << cmd_type << " echo.";
-      failure_reason = error.str();
+    // Arm the echo filter for this command
+    {
+      boost::mutex::scoped_lock lock(this->echo_mutex_);
+      std::memcpy(this->expected_echo_, command, length);
+      this->expected_echo_length_ = length;
+    }
+    this->echo_filter->clear();
+    // Send the command and wait for its echo
+    results::ResultCode code = results::write_failed;
+    uint64_t start = monotonic_usec();
+    if (this->queue_owed_(buffer, length + 1, acks)) {
+      char echo[max_token_length];
+      if (this->echo_filter->wait(this->rtt_.timeoutMs(rtt_kinds::echo),
+                                  echo, sizeof(echo)) != 0)
+      {
+        code = results::success;
+        this->rtt_.sample(rtt_kinds::echo, monotonic_usec() - start);
+      } else {
+        // This means we didn't see it
+        code = results::echo_timeout;
+        this->rtt_.timedOut(rtt_kinds::echo);
+      }
+    }
+    {
+      boost::mutex::scoped_lock lock(this->echo_mutex_);
+      this->expected_echo_length_ = 0;
+    }
+    return Result(code, command, length);
+  }
+  if (!this->queue_owed_(buffer, length + 1, acks)) {
+    return Result(results::write_failed, command, length);
+  }
+  return Result(results::success, command, length);
+}
+
+bool MDC2250::queue_owed_(const char *data, size_t length, size_t acks) {
+  if (acks == 0) {
+    return this->writer_.write(data, length);
+  }
+  // Counted before the write so the acknowledgement can not come first
+  boost::mutex::scoped_lock lock(this->urgent_mutex_);
+  this->acks_owed_ += acks;
+  size_t ticket;
+  if (!this->writer_.write(data, length, &ticket)) {
+    this->acks_owed_ -= acks;
+    return false;
+  }
+  for (size_t i = 0; i < acks; ++i) {
+    if (this->owed_tickets_count_ < max_batch_commands) {
+      this->owed_tickets_[this->owed_tickets_count_++] = ticket;
+    }
+  }
+  return true;
+}
+
+bool MDC2250::write_(const char *data) {
+  return this->writer_.write(data, std::strlen(data));
+}
+
+bool MDC2250::is_echo_(const std::string &token) {
+  boost::mutex::scoped_lock lock(this->echo_mutex_);
+  return this->expected_echo_length_ != 0 &&
+         token.length() == this->expected_echo_length_ &&
+         token.compare(0, token.length(), this->expected_echo_,
+                       this->expected_echo_length_) == 0;
+}
+
+void
+MDC2250::enableOdometry(OdometryIntegrator::Source source,
+                        double counts_per_unit1, double counts_per_unit2)
+{
+  this->odometry_enabled_ = false;
+  this->odometry_.configure(source, counts_per_unit1, counts_per_unit2);
+  this->odometry_enabled_ = true;
+}
+
+void MDC2250::disableOdometry() {
+  this->odometry_enabled_ = false;
+}
+
+void MDC2250::enableSharedTelemetry(const std::string &name) {
+  boost::mutex::scoped_lock lock(this->publisher_mutex_);
+  this->publishing_ = false;
+  this->publisher_.open(name);
+  this->publisher_.publishEstop(this->estop_);
+  this->publishing_ = true;
+}
+
+void MDC2250::disableSharedTelemetry() {
+  boost::mutex::scoped_lock lock(this->publisher_mutex_);
+  this->publishing_ = false;
+  this->publisher_.close();
+}
+
+void MDC2250::publish_estop_() {
+  if (this->publishing_) {
+    boost::mutex::scoped_lock lock(this->publisher_mutex_);
+    this->publisher_.publishEstop(this->estop_);
+  }
+}
+
+bool MDC2250::handle_line_(const char *line, size_t length,
+                           uint64_t stamp_us)
+{
+  bool ack = length == 1 && (line[0] == '+' || line[0] == '-');
+  if (this->urgent_acks_pending_ != 0) {
+    // The echo of an urgent estop precedes its acknowledgement, without echo
+    // the acknowledgements owed to commands in flight come first
+    if (this->echo_ && length == 3 && std::memcmp(line, "!EX", 3) == 0) {
+      this->urgent_ack_next_ = true;
       return false;
     }
+    bool urgent = false;
+    if (ack && this->echo_) {
+      urgent = this->urgent_ack_next_;
+    } else if (ack) {
+      boost::mutex::scoped_lock lock(this->urgent_mutex_);
+      size_t &skip = this->estop_skips_[this->estop_skips_head_];
+      if (this->estop_skips_count_ != 0 && skip != 0) {
+        skip--;
+      } else if (this->estop_skips_count_ != 0) {
+        this->estop_skips_head_ =
+          (this->estop_skips_head_ + 1) % max_pending_estops;
+        this->estop_skips_count_--;
+        urgent = true;
+      }
+    }
+    if (urgent) {
+      // This acknowledges the estop, not a command in progress
+      this->urgent_ack_next_ = false;
+      this->urgent_acks_pending_--;
+      if (line[0] == '-') {
+        MDC2250_LOG_WARNING(this->logger_, "estop",
+                            "Estop received a non-acknowledgement ('-').");
+      }
+      return true;
+    }
+  }
+  if (ack) {
+    takeOne(this->acks_owed_);
+  }
+  queries::QueryType type = detect_response_type(line, length);
+  // Flags in the telemetry only for the monitor are not passed on
+  bool hidden = (type == queries::fault_flag && this->hide_fault_flags_) ||
+                (type == queries::status_flag && this->hide_status_flags_);
+  if (type == queries::unknown) {
+    if (this->telemetry_health_.isRunning()) {
+      this->telemetry_health_.update(type, false,
+                                     isPrintable(line, length),
+                                     stamp_us);
+    }
   } else {
-    // Send the command
-    this->serial_port_.write(command+"\r");
+    TelemetryValue &field = this->telemetry_state_.fields[type];
+    // Decode aside so a garbled line does not overwrite the last values
+    long values[max_telemetry_channels];
+    size_t n = decode_channels(line, length, values, max_telemetry_channels);
+    uint64_t sequence =
+      this->telemetry_health_.update(type, n != 0, true, stamp_us);
+    if (n != 0) {
+      std::copy(values, values + n, field.values);
+      field.count = (uint32_t)n;
+      field.stamp_us = stamp_us;
+      field.sequence = sequence;
+      this->telemetry_state_.stamp_us = stamp_us;
+      this->telemetry_state_.samples++;
+      this->telemetry_.store(this->telemetry_state_);
+      // Feed the odometry integrator from C= or CR= depending on its source
+      if (this->odometry_enabled_ &&
+          ((type == queries::encoder_count_absolute &&
+            this->odometry_.source() == OdometryIntegrator::absolute_counts)
+           || (type == queries::encoder_count_relative &&
+            this->odometry_.source() == OdometryIntegrator::relative_counts)))
+      {
+        this->odometry_.update(field.values, n, stamp_us);
+      }
+      this->aggregator_.update(type, field.values, n, stamp_us);
+      if (type == queries::fault_flag || type == queries::status_flag) {
+        this->flag_monitor_.update(type, (uint32_t)field.values[0],
+                                   stamp_us);
+        bool estop = (field.values[0] & fault_flags::emergency_stop) != 0;
+        if (type == queries::fault_flag && estop != this->estop_) {
+          this->estop_ = estop;
+          this->publish_estop_();
+        }
+      }
+      if (this->publishing_ && !hidden) {
+        boost::mutex::scoped_lock lock(this->publisher_mutex_);
+        this->publisher_.publishSample(type, field, this->telemetry_state_);
+      }
+    }
+  }
+  if (this->async_pending_ != 0 && this->match_async_(line, length, type)) {
+    return true;
+  }
+  if (hidden) {
+    return true;
+  }
+  return this->batch_active_ && this->match_batch_(line, length);
+}
+
+void MDC2250::asyncQuery(const std::string &query, AsyncCallback callback,
+                         long timeout_ms)
+{
+  this->start_async_(AsyncRequest::awaiting_response, query.data(),
+                     query.length(), queries::unknown, timeout_ms, callback);
+}
+
+void MDC2250::asyncCommand(const std::string &command,
+                           AsyncCallback callback, long timeout_ms)
+{
+  this->start_async_(this->echo_ ? AsyncRequest::awaiting_echo
+                                 : AsyncRequest::awaiting_ack,
+                     command.data(), command.length(), queries::unknown,
+                     timeout_ms, callback);
+}
+
+void MDC2250::asyncNextTelemetry(queries::QueryType type,
+                                 AsyncCallback callback, long timeout_ms)
+{
+  this->start_async_(AsyncRequest::awaiting_telemetry, "", 0, type,
+                     timeout_ms, callback);
+}
+
+void MDC2250::start_async_(AsyncRequest::State state, const char *command,
+                           size_t length, queries::QueryType type,
+                           long timeout_ms, AsyncCallback callback)
+{
+  size_t index = this->register_async_(state, command, length, type,
+                                       timeout_ms, callback);
+  if (index == max_async_requests ||
+      state == AsyncRequest::awaiting_telemetry)
+  {
+    return;
+  }
+  this->write_async_(index, command, length, false);
+}
+
+size_t MDC2250::register_async_(AsyncRequest::State state,
+                                const char *command, size_t length,
+                                queries::QueryType type, long timeout_ms,
+                                AsyncCallback callback)
+{
+  if (!this->connected_) {
+    callback(Result(results::not_connected, command, length), NULL, 0);
+    return max_async_requests;
+  }
+  if (length + 1 > max_token_length) {
+    callback(Result(results::command_too_long, command, length), NULL, 0);
+    return max_async_requests;
+  }
+  if (timeout_ms <= 0 && state == AsyncRequest::awaiting_telemetry) {
+    timeout_ms = this->rtt_.maxTimeoutMs();
+  } else if (timeout_ms <= 0) {
+    timeout_ms = this->rtt_.timeoutMs(rtt_kind_of(command, length));
+    if (this->echo_) {
+      timeout_ms += this->rtt_.timeoutMs(rtt_kinds::echo);
+    }
+  }
+  size_t index = max_async_requests;
+  {
+    boost::mutex::scoped_lock lock(this->async_mutex_);
+    for (size_t i = 0; i < max_async_requests; ++i) {
+      if (this->async_requests_[i].state == AsyncRequest::idle) {
+        index = i;
+        break;
+      }
+    }
+    if (index != max_async_requests) {
+      AsyncRequest &request = this->async_requests_[index];
+      request.state = state;
+      request.sequence = this->async_sequence_++;
+      request.deadline_us = monotonic_usec() + (uint64_t)timeout_ms * 1000;
+      request.type = type;
+      request.written_mark = std::numeric_limits<size_t>::max();
+      request.command_length = length;
+      std::memcpy(request.command, command, length);
+      if (state == AsyncRequest::awaiting_response) {
+        // Match "C=" for "?C" and "?C 1"
+        size_t end = 1;
+        while (end < length && command[end] != ' ') {
+          ++end;
+        }
+        request.match_length = end;
+        std::memcpy(request.match, command + 1, end - 1);
+        request.match[end - 1] = '=';
+      } else {
+        request.match_length = length;
+        std::memcpy(request.match, command, length);
+      }
+      request.callback.swap(callback);
+      this->async_pending_++;
+    }
+  }
+  if (index == max_async_requests) {
+    callback(Result(results::busy, command, length), NULL, 0);
+  }
+  return index;
+}
+
+bool MDC2250::write_async_(size_t index, const char *command, size_t length,
+                           bool urgent)
+{
+  // Write the command only once the request can be matched
+  char buffer[max_token_length];
+  std::memcpy(buffer, command, length);
+  buffer[length] = '\r';
+  bool written;
+  {
+    // Records where it was written for tryEstop
+    boost::mutex::scoped_lock lock(this->urgent_mutex_);
+    size_t ticket = 0;
+    written = urgent ? this->writer_.writeUrgent(buffer, length + 1)
+                     : this->writer_.write(buffer, length + 1, &ticket);
+    if (written) {
+      boost::mutex::scoped_lock async_lock(this->async_mutex_);
+      this->async_requests_[index].written_mark = urgent ? 0 : ticket + 1;
+    }
+  }
+  if (!written) {
+    AsyncCompletion completions[1];
+    size_t count = 0;
+    {
+      boost::mutex::scoped_lock lock(this->async_mutex_);
+      if (this->async_requests_[index].state != AsyncRequest::idle) {
+        this->complete_async_(index, results::write_failed, NULL, 0,
+                              completions, count);
+      }
+    }
+    this->finish_async_(completions, count);
+  }
+  return written;
+}
+
+bool MDC2250::match_batch_(const char *line, size_t length) {
+  boost::mutex::scoped_lock lock(this->batch_mutex_);
+  if (!this->batch_active_ || length == 0) {
+    return false;
+  }
+  // An acknowledgement ends the line it is in, which may start with echo
+  char last = line[length - 1];
+  bool ack = last == '+' || last == '-';
+  size_t echo_length = ack ? length - 1 : length;
+  if (echo_length != 0 &&
+      (!this->echo_ || !this->match_batch_echo_(line, echo_length)))
+  {
+    // Unless the whole line is echo
+    return ack && this->echo_ && this->match_batch_echo_(line, length);
+  }
+  if (ack) {
+    if (this->batch_acks_received_ == max_batch_commands) {
+      return false;
+    }
+    this->batch_acks_[this->batch_acks_received_++] = last;
+    if (length > 1) {
+      // handle_line_ only counts the acknowledgements on their own line
+      takeOne(this->acks_owed_);
+    }
+    this->batch_condition_.notify_all();
   }
   return true;
 }
 
+bool MDC2250::match_batch_echo_(const char *text, size_t length) {
+  // Parts of the echo may be missing, or separators echoed as line ends
+  size_t position =
+    this->batch_echo_.find(text, this->batch_echo_position_, length);
+  if (position == std::string::npos) {
+    return false;
+  }
+  this->batch_echo_position_ = position + length;
+  return true;
+}
+
+size_t MDC2250::acks_written_(size_t written) {
+  // Those of the transaction are owed by the last messages it queued
+  size_t owed = 0;
+  size_t count = std::min<size_t>(this->acks_owed_, this->owed_tickets_count_);
+  for (size_t i = this->owed_tickets_count_ - count;
+       i < this->owed_tickets_count_; ++i)
+  {
+    if (this->owed_tickets_[i] < written) {
+      owed++;
+    }
+  }
+  if (this->async_pending_ == 0) {
+    return owed;
+  }
+  boost::mutex::scoped_lock lock(this->async_mutex_);
+  for (size_t i = 0; i < max_async_requests; ++i) {
+    const AsyncRequest &request = this->async_requests_[i];
+    if (request.state == AsyncRequest::awaiting_ack &&
+        request.written_mark <= written)
+    {
+      owed++;
+    }
+  }
+  return owed;
+}
+
+bool MDC2250::match_async_(const char *line, size_t length,
+                           queries::QueryType type)
+{
+  AsyncCompletion completions[max_async_requests];
+  size_t count = 0;
+  bool consumed = false;
+  {
+    boost::mutex::scoped_lock lock(this->async_mutex_);
+    if (length == 1 && (line[0] == '+' || line[0] == '-')) {
+      // With echo the ack belongs to the command echoed last, without it
+      // to the oldest asynchronous command waiting for one
+      int owner = this->async_ack_owner_;
+      if (owner < 0 && !this->echo_) {
+        for (size_t i = 0; i < max_async_requests; ++i) {
+          const AsyncRequest &request = this->async_requests_[i];
+          if (request.state == AsyncRequest::awaiting_ack &&
+              (owner < 0 || request.sequence <
+                 this->async_requests_[owner].sequence))
+          {
+            owner = (int)i;
+          }
+        }
+      }
+      this->async_ack_owner_ = -1;
+      if (owner >= 0 &&
+          this->async_requests_[owner].state == AsyncRequest::awaiting_ack)
+      {
+        this->complete_async_((size_t)owner, line[0] == '+' ? results::success
+                                                            : results::nak,
+                              NULL, 0, completions, count);
+        consumed = true;
+      }
+    } else {
+      int oldest_response = -1;
+      for (size_t i = 0; i < max_async_requests; ++i) {
+        AsyncRequest &request = this->async_requests_[i];
+        switch (request.state) {
+          case AsyncRequest::awaiting_echo:
+            if (request.match_length == length &&
+                std::memcmp(request.match, line, length) == 0)
+            {
+              request.state = AsyncRequest::awaiting_ack;
+              this->async_ack_owner_ = (int)i;
+            }
+            break;
+          case AsyncRequest::awaiting_response:
+            if (request.match_length <= length &&
+                std::memcmp(request.match, line, request.match_length) == 0 &&
+                (oldest_response < 0 || request.sequence <
+                   this->async_requests_[oldest_response].sequence))
+            {
+              oldest_response = (int)i;
+            }
+            break;
+          case AsyncRequest::awaiting_telemetry:
+            if (request.type == type) {
+              this->complete_async_(i, results::success, line, length,
+                                    completions, count);
+            }
+            break;
+          default:
+            break;
+        }
+      }
+      if (oldest_response >= 0) {
+        this->complete_async_((size_t)oldest_response, results::success,
+                              line, length, completions, count);
+      }
+    }
+  }
+  this->finish_async_(completions, count);
+  return consumed;
+}
+
+void MDC2250::handle_tick_(uint64_t now_us) {
+  if (this->async_pending_ == 0) {
+    return;
+  }
+  AsyncCompletion completions[max_async_requests];
+  size_t count = 0;
+  {
+    boost::mutex::scoped_lock lock(this->async_mutex_);
+    for (size_t i = 0; i < max_async_requests; ++i) {
+      const AsyncRequest &request = this->async_requests_[i];
+      if (request.state == AsyncRequest::idle ||
+          now_us < request.deadline_us) {
+        continue;
+      }
+      results::ResultCode code = results::response_timeout;
+      if (request.state == AsyncRequest::awaiting_echo) {
+        code = results::echo_timeout;
+      } else if (request.state == AsyncRequest::awaiting_ack) {
+        code = results::ack_timeout;
+      }
+      if ((int)i == this->async_ack_owner_) {
+        this->async_ack_owner_ = -1;
+      }
+      this->complete_async_(i, code, NULL, 0, completions, count);
+    }
+  }
+  this->finish_async_(completions, count);
+}
+
+void MDC2250::complete_async_(size_t index, results::ResultCode code,
+                              const char *response, size_t length,
+                              AsyncCompletion *completions, size_t &count)
+{
+  AsyncRequest &request = this->async_requests_[index];
+  AsyncCompletion &completion = completions[count++];
+  completion.callback.swap(request.callback);
+  completion.result = Result(code, request.command, request.command_length);
+  completion.length = length;
+  if (length > 0) {
+    std::memcpy(completion.response, response, length);
+  }
+  request.state = AsyncRequest::idle;
+  this->async_pending_--;
+}
+
+void MDC2250::finish_async_(AsyncCompletion *completions, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    AsyncCompletion &completion = completions[i];
+    try {
+      completion.callback(completion.result, completion.response,
+                          completion.length);
+    } catch (std::exception &e) {
+      this->handle_exc(e);
+    }
+    completion.callback.clear();
+  }
+}
+
+void MDC2250::log_unparsed_(const std::string &token) {
+  MDC2250_LOG_DEBUG(this->logger_, "unparsed", token);
+}
+
+void MDC2250::emit_log_(const LogRecord &record) {
+  if (this->log_handler_) {
+    this->log_handler_(record);
+  } else if (record.level == log_levels::debug) {
+    this->info(format_log_record(record));
+  } else {
+    this->info(record.str());
+  }
+}
+
 void MDC2250::setupFilters() {
-  this->ack_filter =
-    this->listener_.createBufferedFilter(SerialListener::exactly("+"));
-  this->nak_filter =
-    this->listener_.createBufferedFilter(SerialListener::exactly("-"));
+  this->echo_filter = this->listener_.createBufferedFilter(
+    boost::bind(&MDC2250::is_echo_, this, _1));
+  this->ack_filter = this->listener_.createBufferedFilter(isAckOrNak);
   this->ping_filter =
-    this->listener_.createBufferedFilter(SerialListener::exactly("\x06"));
+    this->listener_.createBufferedFilter(Listener::exactly("\x06"));
 }
 
 void MDC2250::detect_echo_() {
+  boost::mutex::scoped_lock lock(this->transaction_mutex_);
   BufferedFilterPtr echo_setting_filt =
-  this->listener_.createBufferedFilter(SerialListener::startsWith("ECHOF="));
-  this->serial_port_.write("~ECHOF\r");
-  std::string echo_setting_res = echo_setting_filt->wait(cmd_time);
+  this->listener_.createBufferedFilter(Listener::startsWith("ECHOF="));
+  this->write_("~ECHOF\r");
+  std::string echo_setting_res =
+    echo_setting_filt->wait(this->rtt_.timeoutMs(rtt_kinds::configuration));
   if (echo_setting_res.empty()) {
     // Something went wrong
     throw(CommandFailedException("detect_echo_", "No echo state response."));
   }
   if (echo_setting_res.find('0') != std::string::npos) {
     this->echo_ = true;
-    this->info("Echo is enabled.");
+    MDC2250_LOG_INFO(this->logger_, "echo", "Echo is enabled.");
   } else {
     this->echo_ = false;
-    this->info("Echo is disabled.");
+    MDC2250_LOG_INFO(this->logger_, "echo", "Echo is disabled.");
   }
 }
 
 void MDC2250::detect_emergency_stop_() {
+  boost::mutex::scoped_lock lock(this->transaction_mutex_);
   BufferedFilterPtr estop_filt =
-    this->listener_.createBufferedFilter(SerialListener::startsWith("FF="));
-  this->serial_port_.write("?FF\r");
-  std::string estop_res = estop_filt->wait(cmd_time);
+    this->listener_.createBufferedFilter(Listener::startsWith("FF="));
+  this->write_("?FF\r");
+  std::string estop_res =
+    estop_filt->wait(this->rtt_.timeoutMs(rtt_kinds::query));
   if (estop_res.empty()) {
     // Something went wrong
-    throw(CommandFailedException("detect_echo_", "No echo state response."));
+    throw(CommandFailedException("detect_emergency_stop_",
+                                 "No fault flag response."));
+  }
+  long flags = 0;
+  if (decode_channels(estop_res.data(), estop_res.length(), &flags, 1) == 0)
+  {
+    throw(CommandFailedException("detect_emergency_stop_",
+                                 "Invalid fault flag response: " + estop_res));
   }
-  if (estop_res.find("16") != std::string::npos) {
+  if (flags & fault_flags::emergency_stop) {
     this->estop_ = true;
-    this->info("Estop is enabled.");
+    MDC2250_LOG_INFO(this->logger_, "estop", "Estop is enabled.");
   } else {
     this->estop_ = false;
-    this->info("Estop is disabled.");
+    MDC2250_LOG_INFO(this->logger_, "estop", "Estop is disabled.");
   }
+  this->publish_estop_();
 }
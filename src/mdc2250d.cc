@@ -0,0 +1,49 @@
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+
+#include "mdc2250/mdc2250.h"
+#include "mdc2250/daemon.h"
+
+// Shares one motor controller among local processes, usage:
+//   mdc2250d <serial port> [socket path] [watchdog ms]
+
+int run(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <serial port> [socket path] "
+              << "[watchdog ms]" << std::endl;
+    return 2;
+  }
+  std::string port = argv[1];
+  std::string socket_path = argc > 2 ? argv[2] : "/tmp/mdc2250d.sock";
+  size_t watchdog = argc > 3 ? (size_t)std::atol(argv[3]) : 1000;
+
+  // Block the signals before any thread starts so only sigwait sees them
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  mdc2250::MDC2250 mdc2250;
+  mdc2250.connect(port, watchdog);
+  mdc2250::Daemon daemon(mdc2250);
+  daemon.start(socket_path);
+  std::cout << "Serving " << port << " on " << socket_path << std::endl;
+
+  int received;
+  sigwait(&signals, &received);
+  daemon.stop();
+  mdc2250.disconnect();
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  try {
+    return run(argc, argv);
+  } catch (std::exception &e) {
+    std::cerr << "Unhandled Exception: " << e.what() << std::endl;
+    return 1;
+  }
+}
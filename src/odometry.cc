@@ -0,0 +1,80 @@
+#include "mdc2250/odometry.h"
+
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+using namespace mdc2250;
+
+OdometryIntegrator::OdometryIntegrator() : source_(relative_counts) {
+  this->counts_per_unit_[0] = 1.0;
+  this->counts_per_unit_[1] = 1.0;
+  this->reset();
+}
+
+void
+OdometryIntegrator::configure(Source source, double counts_per_unit1,
+                              double counts_per_unit2)
+{
+  if (counts_per_unit1 == 0.0 || counts_per_unit2 == 0.0) {
+    std::stringstream ss;
+    ss << "In OdometryIntegrator::configure, counts_per_unit must not be ";
+    ss << "0, given: " << counts_per_unit1 << " and " << counts_per_unit2;
+    throw(std::invalid_argument(ss.str()));
+  }
+  this->source_ = source;
+  this->counts_per_unit_[0] = counts_per_unit1;
+  this->counts_per_unit_[1] = counts_per_unit2;
+  this->reset();
+}
+
+void OdometryIntegrator::reset() {
+  this->have_last_ = false;
+  this->last_raw_[0] = this->last_raw_[1] = 0;
+  this->last_stamp_us_ = 0;
+  std::memset(&this->state_, 0, sizeof(this->state_));
+  this->snapshot_.store(this->state_);
+}
+
+void
+OdometryIntegrator::update(const long *counts, size_t channels,
+                           uint64_t stamp_us)
+{
+  if (channels == 0) {
+    return;
+  }
+  int64_t delta[2] = {0, 0};
+  for (size_t i = 0; i < 2 && i < channels; ++i) {
+    if (this->source_ == relative_counts) {
+      delta[i] = counts[i];
+    } else {
+      // The controller's counters are 32 bit and wrap around, so the
+      // difference is taken modulo 2^32 and extended to 64 bits
+      uint32_t raw = (uint32_t)counts[i];
+      if (this->have_last_) {
+        delta[i] = (int32_t)(raw - this->last_raw_[i]);
+      } else {
+        delta[i] = (int32_t)raw;
+      }
+      this->last_raw_[i] = raw;
+    }
+  }
+  double dt = 0.0;
+  if (this->have_last_ && stamp_us > this->last_stamp_us_) {
+    dt = (double)(stamp_us - this->last_stamp_us_) / 1e6;
+  }
+  for (size_t i = 0; i < 2; ++i) {
+    this->state_.counts[i] += delta[i];
+    this->state_.position[i] =
+      (double)this->state_.counts[i] / this->counts_per_unit_[i];
+    if (dt > 0.0) {
+      this->state_.velocity[i] =
+        ((double)delta[i] / this->counts_per_unit_[i]) / dt;
+    }
+  }
+  this->have_last_ = true;
+  this->last_stamp_us_ = stamp_us;
+  this->state_.stamp_us = stamp_us;
+  this->state_.samples++;
+  this->snapshot_.store(this->state_);
+}
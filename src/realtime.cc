@@ -0,0 +1,136 @@
+#include "mdc2250/realtime.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <boost/bind.hpp>
+
+#if !defined(_WIN32)
+# include <pthread.h>
+# include <sched.h>
+# include <sys/mman.h>
+#endif
+
+using namespace mdc2250;
+
+namespace mdc2250_ {
+
+inline void throwSystemError(const char *what, int error) {
+  std::stringstream ss;
+  ss << what << " failed: " << strerror(error);
+  throw(std::runtime_error(ss.str()));
+}
+
+}
+
+using namespace mdc2250_;
+
+#if !defined(_WIN32)
+
+void mdc2250::configureCurrentThread(const ThreadOptions &options) {
+  if (options.cpu >= 0) {
+#if defined(__linux__)
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(options.cpu, &cpus);
+    int error =
+      pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (error != 0) {
+      throwSystemError("Setting the CPU affinity", error);
+    }
+#else
+    throw(std::runtime_error("CPU affinity is only supported on Linux."));
+#endif
+  }
+  if (options.priority > 0) {
+    struct sched_param param;
+    std::memset(&param, 0, sizeof(param));
+    param.sched_priority = options.priority;
+    int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (error != 0) {
+      throwSystemError("Setting the SCHED_FIFO priority", error);
+    }
+  }
+}
+
+void mdc2250::lockMemory() {
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    throwSystemError("mlockall", errno);
+  }
+}
+
+#else // _WIN32
+
+void mdc2250::configureCurrentThread(const ThreadOptions &options) {
+  if (!options.isDefault()) {
+    throw(std::runtime_error("Thread options are not supported on Windows."));
+  }
+}
+
+void mdc2250::lockMemory() {
+  throw(std::runtime_error("Locking memory is not supported on Windows."));
+}
+
+#endif
+
+namespace mdc2250_ {
+
+// Reports from a new thread whether its options could be applied
+struct ThreadStart {
+  ThreadStart() : done(false), failed(false) {}
+  boost::mutex mutex;
+  boost::condition_variable condition;
+  bool done;
+  bool failed;
+  std::string error;
+};
+
+inline void runWithOptions(ThreadStart *start,
+                           mdc2250::ThreadOptions options,
+                           boost::function<void()> function)
+{
+  bool failed = false;
+  {
+    boost::mutex::scoped_lock lock(start->mutex);
+    try {
+      configureCurrentThread(options);
+    } catch (std::exception &e) {
+      start->error = e.what();
+      start->failed = true;
+      failed = true;
+    }
+    // The starter may go away once this is released
+    start->done = true;
+    start->condition.notify_all();
+  }
+  if (!failed) {
+    function();
+  }
+}
+
+}
+
+boost::thread mdc2250::startThread(const ThreadOptions &options,
+                                   const boost::function<void()> &function)
+{
+  if (options.isDefault()) {
+    return boost::thread(function);
+  }
+  ThreadStart start;
+  boost::thread thread(boost::bind(runWithOptions, &start, options,
+                                   function));
+  {
+    boost::mutex::scoped_lock lock(start.mutex);
+    while (!start.done) {
+      start.condition.wait(lock);
+    }
+  }
+  if (start.failed) {
+    thread.join();
+    throw(std::runtime_error(start.error));
+  }
+  return boost::move(thread);
+}
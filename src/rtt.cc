@@ -0,0 +1,103 @@
+#include "mdc2250/rtt.h"
+
+#include <cstring>
+#include <stdexcept>
+
+using namespace mdc2250;
+
+namespace mdc2250_ {
+
+// Resolution of the waits the timeouts are used for
+const uint64_t timeout_granularity_us = 1000;
+
+}
+
+using namespace mdc2250_;
+
+RttEstimator::RttEstimator(uint64_t min_timeout_us, uint64_t max_timeout_us,
+                           uint64_t initial_timeout_us)
+: min_timeout_us_(0), max_timeout_us_(0),
+  initial_timeout_us_(initial_timeout_us)
+{
+  std::memset(this->estimates_, 0, sizeof(this->estimates_));
+  this->setBounds(min_timeout_us, max_timeout_us);
+  this->reset();
+}
+
+void RttEstimator::setBounds(uint64_t min_timeout_us,
+                             uint64_t max_timeout_us)
+{
+  if (min_timeout_us == 0 || min_timeout_us > max_timeout_us) {
+    throw(std::invalid_argument("In RttEstimator::setBounds, the minimum "
+                                "timeout must be greater than 0 and not "
+                                "greater than the maximum."));
+  }
+  boost::mutex::scoped_lock lock(this->mutex_);
+  this->min_timeout_us_ = min_timeout_us;
+  this->max_timeout_us_ = max_timeout_us;
+  for (size_t i = 0; i < rtt_kinds::count; ++i) {
+    this->estimates_[i].timeout_us =
+      this->clamp_(this->estimates_[i].timeout_us);
+  }
+}
+
+void RttEstimator::reset() {
+  boost::mutex::scoped_lock lock(this->mutex_);
+  std::memset(this->estimates_, 0, sizeof(this->estimates_));
+  for (size_t i = 0; i < rtt_kinds::count; ++i) {
+    this->estimates_[i].timeout_us = this->clamp_(this->initial_timeout_us_);
+  }
+}
+
+void RttEstimator::sample(rtt_kinds::RttKind kind, uint64_t rtt_us) {
+  boost::mutex::scoped_lock lock(this->mutex_);
+  RttEstimate &e = this->estimates_[kind];
+  if (e.samples == 0) {
+    e.srtt_us = rtt_us;
+    e.rttvar_us = rtt_us / 2;
+  } else {
+    // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R
+    uint64_t deviation = e.srtt_us > rtt_us ? e.srtt_us - rtt_us
+                                            : rtt_us - e.srtt_us;
+    e.rttvar_us = (3 * e.rttvar_us + deviation) / 4;
+    e.srtt_us = (7 * e.srtt_us + rtt_us) / 8;
+  }
+  e.samples++;
+  uint64_t spread = 4 * e.rttvar_us;
+  if (spread < timeout_granularity_us) {
+    spread = timeout_granularity_us;
+  }
+  e.timeout_us = this->clamp_(e.srtt_us + spread);
+}
+
+void RttEstimator::timedOut(rtt_kinds::RttKind kind) {
+  boost::mutex::scoped_lock lock(this->mutex_);
+  RttEstimate &e = this->estimates_[kind];
+  e.timeouts++;
+  e.timeout_us = this->clamp_(2 * e.timeout_us);
+}
+
+long RttEstimator::maxTimeoutMs() const {
+  boost::mutex::scoped_lock lock(this->mutex_);
+  return (long)((this->max_timeout_us_ + 999) / 1000);
+}
+
+long RttEstimator::timeoutMs(rtt_kinds::RttKind kind) const {
+  boost::mutex::scoped_lock lock(this->mutex_);
+  return (long)((this->estimates_[kind].timeout_us + 999) / 1000);
+}
+
+RttEstimate RttEstimator::estimate(rtt_kinds::RttKind kind) const {
+  boost::mutex::scoped_lock lock(this->mutex_);
+  return this->estimates_[kind];
+}
+
+uint64_t RttEstimator::clamp_(uint64_t timeout_us) const {
+  if (timeout_us < this->min_timeout_us_) {
+    return this->min_timeout_us_;
+  }
+  if (timeout_us > this->max_timeout_us_) {
+    return this->max_timeout_us_;
+  }
+  return timeout_us;
+}
@@ -0,0 +1,192 @@
+#include "mdc2250/setpoint.h"
+#include "mdc2250/clock.h"
+
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+
+using namespace mdc2250;
+
+namespace mdc2250_ {
+
+inline void validateEffort(const char *where, long effort) {
+  if (effort < -1000 || effort > 1000) {
+    std::stringstream ss;
+    ss << "In " << where << ", motor effort must be between -1000 and ";
+    ss << "1000 inclusively, given: " << effort;
+    throw(std::invalid_argument(ss.str()));
+  }
+}
+
+inline uint32_t pack(long motor1_effort, long motor2_effort) {
+  return (uint32_t)(uint16_t)(int16_t)motor1_effort |
+         ((uint32_t)(uint16_t)(int16_t)motor2_effort << 16);
+}
+
+inline long unpack(uint32_t setpoint, size_t motor_index) {
+  return (long)(int16_t)(uint16_t)(setpoint >> (motor_index == 1 ? 0 : 16));
+}
+
+}
+
+using namespace mdc2250_;
+
+SetpointStreamer::SetpointStreamer(MDC2250 &mdc2250)
+: mdc2250_(mdc2250), period_ns_(0), refresh_ns_(0), setpoint_(0),
+  updates_(0), running_(false), started_(false)
+{
+  SetpointStatistics empty;
+  std::memset(&empty, 0, sizeof(empty));
+  this->statistics_.store(empty);
+}
+
+SetpointStreamer::~SetpointStreamer() {
+  this->stop();
+}
+
+void
+SetpointStreamer::start(size_t max_rate_hz, size_t refresh_ms,
+                        const ThreadOptions &options)
+{
+  if (max_rate_hz == 0) {
+    throw(std::invalid_argument("In SetpointStreamer::start, max_rate_hz "
+                                "must be greater than 0."));
+  }
+  this->stop();
+  this->period_ns_ = 1000000000ULL / (uint64_t)max_rate_hz;
+  if (refresh_ms == 0) {
+    refresh_ms = this->mdc2250_.getWatchdog() / 2;
+  }
+  this->refresh_ns_ = (uint64_t)refresh_ms * 1000000ULL;
+  // Start the thread and wait for it to apply its options
+  boost::mutex::scoped_lock lock(this->startup_mutex_);
+  this->started_ = false;
+  this->startup_error_.clear();
+  this->running_ = true;
+  this->thread_ =
+    boost::thread(boost::bind(&SetpointStreamer::run_, this, options));
+  while (!this->started_) {
+    this->startup_condition_.wait(lock);
+  }
+  if (!this->startup_error_.empty()) {
+    lock.unlock();
+    this->thread_.join();
+    throw(std::runtime_error(this->startup_error_));
+  }
+}
+
+void SetpointStreamer::stop() {
+  this->running_ = false;
+  if (this->thread_.joinable()) {
+    this->thread_.join();
+  }
+}
+
+void SetpointStreamer::set(long motor1_effort, long motor2_effort) {
+  validateEffort("SetpointStreamer::set", motor1_effort);
+  validateEffort("SetpointStreamer::set", motor2_effort);
+  this->setpoint_.store(pack(motor1_effort, motor2_effort),
+                        boost::memory_order_relaxed);
+  this->updates_.fetch_add(1, boost::memory_order_release);
+}
+
+void SetpointStreamer::setMotor(size_t motor_index, long motor_effort) {
+  if (motor_index != 1 && motor_index != 2) {
+    std::stringstream ss;
+    ss << "In SetpointStreamer::setMotor, motor_index must be 1 or 2, ";
+    ss << "given: " << motor_index;
+    throw(std::invalid_argument(ss.str()));
+  }
+  validateEffort("SetpointStreamer::setMotor", motor_effort);
+  uint32_t current = this->setpoint_.load(boost::memory_order_relaxed);
+  uint32_t desired;
+  do {
+    if (motor_index == 1) {
+      desired = pack(motor_effort, unpack(current, 2));
+    } else {
+      desired = pack(unpack(current, 1), motor_effort);
+    }
+  } while (!this->setpoint_.compare_exchange_weak(
+             current, desired, boost::memory_order_relaxed));
+  this->updates_.fetch_add(1, boost::memory_order_release);
+}
+
+SetpointStatistics SetpointStreamer::getStatistics() const {
+  SetpointStatistics statistics = this->statistics_.load();
+  statistics.updates = this->updates_.load(boost::memory_order_relaxed);
+  return statistics;
+}
+
+void SetpointStreamer::run_(ThreadOptions options) {
+  {
+    boost::mutex::scoped_lock lock(this->startup_mutex_);
+    try {
+      configureCurrentThread(options);
+    } catch (std::exception &e) {
+      this->startup_error_ = e.what();
+      this->running_ = false;
+    }
+    this->started_ = true;
+    this->startup_condition_.notify_all();
+  }
+
+  SetpointStatistics stats = this->statistics_.load();
+  uint64_t seen = this->updates_.load(boost::memory_order_acquire);
+  uint64_t last_send = 0;
+  uint32_t last_sent = 0;
+  bool has_sent = false;
+  bool retry = false;
+  uint64_t next = monotonic_nsec() + this->period_ns_;
+  while (this->running_) {
+    sleep_until_nsec(next);
+    if (!this->running_) {
+      break;
+    }
+    uint64_t now = monotonic_nsec();
+    next += this->period_ns_;
+    if (next <= now) {
+      // Sending took longer than a period, don't try to catch up
+      next = now + this->period_ns_;
+    }
+
+    uint64_t updates = this->updates_.load(boost::memory_order_acquire);
+    uint32_t setpoint = this->setpoint_.load(boost::memory_order_relaxed);
+    uint64_t fresh = updates - seen;
+    seen = updates;
+    bool refresh_due = has_sent && this->refresh_ns_ != 0 &&
+                       now - last_send >= this->refresh_ns_;
+    if (fresh == 0 && !refresh_due && !retry) {
+      continue;
+    }
+    if (has_sent && setpoint == last_sent && !retry) {
+      // Nothing new to say, unless the watchdog needs feeding
+      stats.coalesced += fresh;
+      if (!refresh_due) {
+        stats.unchanged++;
+        this->statistics_.store(stats);
+        continue;
+      }
+      stats.refreshes++;
+    } else if (fresh > 1) {
+      // Only the newest of these updates is sent
+      stats.coalesced += fresh - 1;
+    }
+
+    if (this->mdc2250_.tryCommandMotors(unpack(setpoint, 1),
+                                        unpack(setpoint, 2)).ok())
+    {
+      stats.sent++;
+      last_sent = setpoint;
+      last_send = now;
+      has_sent = true;
+      retry = false;
+    } else {
+      // Try again on the next cycle
+      stats.send_failures++;
+      retry = true;
+    }
+    this->statistics_.store(stats);
+  }
+}
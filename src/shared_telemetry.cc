@@ -0,0 +1,245 @@
+#include "mdc2250/shared_telemetry.h"
+#include "mdc2250/clock.h"
+
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace mdc2250;
+
+namespace mdc2250_ {
+
+inline std::runtime_error sharedMemoryError(const char *where,
+                                            const std::string &name)
+{
+  std::stringstream ss;
+  ss << "In " << where << ", failed for shared memory " << name << ": ";
+  ss << std::strerror(errno);
+  return std::runtime_error(ss.str());
+}
+
+}
+
+using namespace mdc2250_;
+
+/***** TelemetryPublisher *****/
+
+TelemetryPublisher::TelemetryPublisher() : segment_(NULL), head_(0) {
+  std::memset(&this->command_state_, 0, sizeof(this->command_state_));
+}
+
+TelemetryPublisher::~TelemetryPublisher() {
+  this->close();
+}
+
+void TelemetryPublisher::open(const std::string &name) {
+  this->close();
+  // Start from a fresh segment, readers of an old one keep their mapping
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) {
+    throw(sharedMemoryError("TelemetryPublisher::open", name));
+  }
+  if (ftruncate(fd, sizeof(SharedTelemetrySegment)) != 0) {
+    std::runtime_error e =
+      sharedMemoryError("TelemetryPublisher::open", name);
+    ::close(fd);
+    shm_unlink(name.c_str());
+    throw(e);
+  }
+  void *memory = mmap(NULL, sizeof(SharedTelemetrySegment),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (memory == MAP_FAILED) {
+    std::runtime_error e =
+      sharedMemoryError("TelemetryPublisher::open", name);
+    shm_unlink(name.c_str());
+    throw(e);
+  }
+  SharedTelemetrySegment *segment = new (memory) SharedTelemetrySegment();
+  segment->version = shared_telemetry_version;
+  segment->ring_size = shared_telemetry_ring_size;
+  segment->pid = (uint32_t)getpid();
+  segment->head = 0;
+  segment->publishing = 1;
+  // Readers check the magic last
+  boost::atomic_thread_fence(boost::memory_order_release);
+  segment->magic = shared_telemetry_magic;
+  this->name_ = name;
+  this->head_ = 0;
+  this->segment_ = segment;
+  boost::mutex::scoped_lock lock(this->command_mutex_);
+  this->store_commands_();
+}
+
+void TelemetryPublisher::close() {
+  if (this->segment_ == NULL) {
+    return;
+  }
+  this->segment_->publishing = 0;
+  munmap(this->segment_, sizeof(SharedTelemetrySegment));
+  shm_unlink(this->name_.c_str());
+  this->segment_ = NULL;
+}
+
+void TelemetryPublisher::publishSample(queries::QueryType type,
+                                       const TelemetryValue &value,
+                                       const TelemetrySnapshot &snapshot)
+{
+  if (this->segment_ == NULL) {
+    return;
+  }
+  SharedSample sample;
+  sample.sequence = this->head_;
+  sample.type = (uint32_t)type;
+  sample.value = value;
+  this->segment_->ring[this->head_ % shared_telemetry_ring_size]
+    .store(sample);
+  this->segment_->latest.store(snapshot);
+  // Readers only look at slots before head
+  this->segment_->head.store(++this->head_, boost::memory_order_release);
+}
+
+void TelemetryPublisher::publishCommand(size_t motor_index,
+                                        long motor_effort)
+{
+  if (motor_index != 1 && motor_index != 2) {
+    return;
+  }
+  boost::mutex::scoped_lock lock(this->command_mutex_);
+  this->command_state_.efforts[motor_index - 1] = motor_effort;
+  this->command_state_.commands++;
+  this->command_state_.stamp_us = monotonic_usec();
+  this->store_commands_();
+}
+
+void TelemetryPublisher::publishCommands(long motor1_effort,
+                                         long motor2_effort)
+{
+  boost::mutex::scoped_lock lock(this->command_mutex_);
+  this->command_state_.efforts[0] = motor1_effort;
+  this->command_state_.efforts[1] = motor2_effort;
+  this->command_state_.commands++;
+  this->command_state_.stamp_us = monotonic_usec();
+  this->store_commands_();
+}
+
+void TelemetryPublisher::publishEstop(bool estopped) {
+  boost::mutex::scoped_lock lock(this->command_mutex_);
+  this->command_state_.estopped = estopped ? 1 : 0;
+  this->store_commands_();
+}
+
+void TelemetryPublisher::store_commands_() {
+  if (this->segment_ != NULL) {
+    this->segment_->commands.store(this->command_state_);
+  }
+}
+
+/***** TelemetrySubscriber *****/
+
+TelemetrySubscriber::TelemetrySubscriber()
+: segment_(NULL), next_(0), lost_(0)
+{}
+
+TelemetrySubscriber::~TelemetrySubscriber() {
+  this->close();
+}
+
+void TelemetrySubscriber::open(const std::string &name) {
+  this->close();
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    throw(sharedMemoryError("TelemetrySubscriber::open", name));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (size_t)st.st_size < sizeof(SharedTelemetrySegment))
+  {
+    ::close(fd);
+    throw(std::runtime_error("In TelemetrySubscriber::open, shared memory "
+                             + name + " is not a telemetry segment."));
+  }
+  void *memory = mmap(NULL, sizeof(SharedTelemetrySegment), PROT_READ,
+                      MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (memory == MAP_FAILED) {
+    throw(sharedMemoryError("TelemetrySubscriber::open", name));
+  }
+  const SharedTelemetrySegment *segment =
+    static_cast<const SharedTelemetrySegment *>(memory);
+  if (segment->magic != shared_telemetry_magic ||
+      segment->version != shared_telemetry_version ||
+      segment->ring_size != shared_telemetry_ring_size)
+  {
+    munmap(memory, sizeof(SharedTelemetrySegment));
+    throw(std::runtime_error("In TelemetrySubscriber::open, shared memory "
+                             + name + " has an incompatible layout."));
+  }
+  boost::atomic_thread_fence(boost::memory_order_acquire);
+  this->segment_ = segment;
+  this->next_ = segment->head.load(boost::memory_order_acquire);
+  this->lost_ = 0;
+}
+
+void TelemetrySubscriber::close() {
+  if (this->segment_ == NULL) {
+    return;
+  }
+  munmap(const_cast<SharedTelemetrySegment *>(this->segment_),
+         sizeof(SharedTelemetrySegment));
+  this->segment_ = NULL;
+}
+
+bool TelemetrySubscriber::isPublishing() const {
+  return this->segment_ != NULL && this->segment_->publishing != 0;
+}
+
+TelemetrySnapshot TelemetrySubscriber::latest() const {
+  if (this->segment_ == NULL) {
+    TelemetrySnapshot empty;
+    std::memset(&empty, 0, sizeof(empty));
+    return empty;
+  }
+  return this->segment_->latest.load();
+}
+
+SharedCommandState TelemetrySubscriber::commands() const {
+  if (this->segment_ == NULL) {
+    SharedCommandState empty;
+    std::memset(&empty, 0, sizeof(empty));
+    return empty;
+  }
+  return this->segment_->commands.load();
+}
+
+bool TelemetrySubscriber::next(SharedSample &sample) {
+  if (this->segment_ == NULL) {
+    return false;
+  }
+  while (true) {
+    uint64_t head = this->segment_->head.load(boost::memory_order_acquire);
+    if (this->next_ >= head) {
+      return false;
+    }
+    if (head - this->next_ > shared_telemetry_ring_size) {
+      // Fell more than a ring behind, skip to the oldest sample still kept
+      this->lost_ += head - this->next_ - shared_telemetry_ring_size;
+      this->next_ = head - shared_telemetry_ring_size;
+    }
+    sample =
+      this->segment_->ring[this->next_ % shared_telemetry_ring_size].load();
+    if (sample.sequence == this->next_) {
+      this->next_++;
+      return true;
+    }
+    // Overwritten while copying it, try again from the new head
+  }
+}
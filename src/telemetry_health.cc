@@ -0,0 +1,200 @@
+#include "mdc2250/telemetry_health.h"
+
+#include <cmath>
+
+using namespace mdc2250;
+
+TelemetryHealthMonitor::TelemetryHealthMonitor()
+: running_(false), cycle_mask_(0), period_ms_(0), position_(0),
+  sequence_(0), cycles_(0), gaps_(0), longest_gap_us_(0), last_stamp_us_(0),
+  last_position_(0), last_sequence_(0), intervals_(0), interval_mean_(0.0),
+  interval_m2_(0.0), interval_max_(0)
+{}
+
+void TelemetryHealthMonitor::start(
+  const std::vector<queries::QueryType> &cycle, size_t period_ms)
+{
+  boost::mutex::scoped_lock lock(this->mutex_);
+  this->cycle_ = cycle;
+  this->cycle_mask_ = 0;
+  std::vector<queries::QueryType>::const_iterator it;
+  for (it = cycle.begin(); it != cycle.end(); ++it) {
+    if ((*it) != queries::unknown) {
+      this->cycle_mask_ |= ((uint64_t)1) << (*it);
+    }
+  }
+  FieldState empty = {0, 0, 0, 0, 0, 0, 0.0, 0.0, 0};
+  this->fields_.assign(cycle.size(), empty);
+  this->period_ms_ = period_ms;
+  this->position_ = 0;
+  this->sequence_ = 0;
+  this->cycles_ = 0;
+  this->gaps_ = 0;
+  this->longest_gap_us_ = 0;
+  this->last_stamp_us_ = 0;
+  this->last_position_ = 0;
+  this->last_sequence_ = 0;
+  this->intervals_ = 0;
+  this->interval_mean_ = 0.0;
+  this->interval_m2_ = 0.0;
+  this->interval_max_ = 0;
+  this->running_ = !cycle.empty() && period_ms != 0;
+}
+
+void TelemetryHealthMonitor::stop() {
+  this->running_ = false;
+}
+
+uint64_t TelemetryHealthMonitor::update(queries::QueryType type, bool valid,
+                                        bool printable, uint64_t stamp_us)
+{
+  if (!this->running_) {
+    return 0;
+  }
+  bool in_cycle = type != queries::unknown &&
+                  (this->cycle_mask_ & (((uint64_t)1) << type)) != 0;
+  bool corrupted = !valid || !printable;
+  // Unprintable lines of unknown type are most likely garbled telemetry
+  if (!in_cycle && !(type == queries::unknown && !printable)) {
+    return 0;
+  }
+  boost::mutex::scoped_lock lock(this->mutex_);
+  if (!this->running_) {
+    return 0;
+  }
+  size_t length = this->cycle_.size();
+  uint64_t interval = 0;
+  bool have_interval = this->sequence_ != 0 &&
+                       stamp_us >= this->last_stamp_us_;
+  if (have_interval) {
+    interval = stamp_us - this->last_stamp_us_;
+  }
+  uint64_t period_us = (uint64_t)this->period_ms_ * 1000;
+  // The same line again within half a period is a duplicate
+  if (have_interval && !corrupted && interval < period_us / 2 &&
+      this->cycle_[this->last_position_] == type)
+  {
+    this->fields_[this->last_position_].duplicated++;
+    return this->last_sequence_;
+  }
+  if (this->sequence_ == 0 && corrupted) {
+    // Can not know where in the cycle the stream begins
+    return 0;
+  }
+  if (have_interval) {
+    add_interval_(interval, this->intervals_, this->interval_mean_,
+                  this->interval_m2_, this->interval_max_);
+    if (interval > 2 * period_us) {
+      this->gaps_++;
+      if (interval > this->longest_gap_us_) {
+        this->longest_gap_us_ = interval;
+      }
+    }
+  }
+  this->last_stamp_us_ = stamp_us;
+  size_t skipped = 0;
+  if (!corrupted) {
+    if (this->sequence_ == 0) {
+      // The first line sets the position in the cycle
+      while (this->cycle_[this->position_] != type) {
+        this->position_++;
+      }
+    } else {
+      // Every line between the expected one and this one was lost, but 
+      // unrecognized responses are never seen so can not be missed
+      while (this->cycle_[(this->position_ + skipped) % length] != type) {
+        size_t missed = (this->position_ + skipped) % length;
+        if (this->cycle_[missed] != queries::unknown) {
+          this->fields_[missed].lost++;
+        }
+        skipped++;
+      }
+    }
+  }
+  size_t position = (this->position_ + skipped) % length;
+  FieldState &field = this->fields_[position];
+  if (corrupted) {
+    // A garbled line takes the place of the expected one
+    field.corrupted++;
+  } else {
+    if (field.received != 0 && stamp_us >= field.last_stamp_us) {
+      add_interval_(stamp_us - field.last_stamp_us, field.intervals,
+                    field.interval_mean, field.interval_m2,
+                    field.interval_max);
+    }
+    field.received++;
+    field.last_stamp_us = stamp_us;
+  }
+  this->sequence_ += skipped + 1;
+  this->cycles_ += (this->position_ + skipped + 1) / length;
+  this->position_ = (this->position_ + skipped + 1) % length;
+  this->last_position_ = position;
+  this->last_sequence_ = this->sequence_;
+  return this->sequence_;
+}
+
+TelemetryHealth TelemetryHealthMonitor::health() {
+  boost::mutex::scoped_lock lock(this->mutex_);
+  TelemetryHealth health;
+  health.cycle_length = this->cycle_.size();
+  health.period_ms = this->period_ms_;
+  health.received = 0;
+  health.lost = 0;
+  health.duplicated = 0;
+  health.corrupted = 0;
+  health.cycles = this->cycles_;
+  health.gaps = this->gaps_;
+  health.longest_gap_us = this->longest_gap_us_;
+  health.interval = interval_statistics_(this->intervals_,
+    this->interval_mean_, this->interval_m2_, this->interval_max_);
+  health.last_stamp_us = this->last_stamp_us_;
+  health.fields.resize(this->fields_.size());
+  for (size_t i = 0; i < this->fields_.size(); ++i) {
+    const FieldState &state = this->fields_[i];
+    FieldHealth &field = health.fields[i];
+    field.type = this->cycle_[i];
+    field.received = state.received;
+    field.lost = state.lost;
+    field.duplicated = state.duplicated;
+    field.corrupted = state.corrupted;
+    uint64_t expected = state.received + state.lost + state.corrupted;
+    field.loss_rate = expected == 0 ? 0.0 :
+      (double)(state.lost + state.corrupted) / (double)expected;
+    field.interval = interval_statistics_(state.intervals,
+      state.interval_mean, state.interval_m2, state.interval_max);
+    health.received += state.received;
+    health.lost += state.lost;
+    health.duplicated += state.duplicated;
+    health.corrupted += state.corrupted;
+  }
+  uint64_t expected = health.received + health.lost + health.corrupted;
+  health.loss_rate = expected == 0 ? 0.0 :
+    (double)(health.lost + health.corrupted) / (double)expected;
+  return health;
+}
+
+void TelemetryHealthMonitor::add_interval_(uint64_t interval,
+                                           uint64_t &count, double &mean,
+                                           double &m2, uint64_t &max)
+{
+  count++;
+  double delta = (double)interval - mean;
+  mean += delta / (double)count;
+  m2 += delta * ((double)interval - mean);
+  if (interval > max) {
+    max = interval;
+  }
+}
+
+IntervalStatistics
+TelemetryHealthMonitor::interval_statistics_(uint64_t count, double mean,
+                                             double m2, uint64_t max)
+{
+  IntervalStatistics statistics;
+  statistics.samples = count;
+  statistics.mean_us = mean;
+  statistics.jitter_us = count > 1 ? std::sqrt(m2 / (double)(count - 1))
+                                   : 0.0;
+  statistics.max_us = max;
+  return statistics;
+}
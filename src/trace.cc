@@ -0,0 +1,234 @@
+#include "mdc2250/trace.h"
+#include "mdc2250/clock.h"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include <unistd.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+using namespace mdc2250;
+
+namespace mdc2250_ {
+
+struct TraceEvent {
+  uint64_t stamp_ns;
+  const char *name;
+  uint64_t value;
+  char phase;
+};
+
+// One thread's ring of events, written only by that thread
+struct TraceBuffer {
+  TraceBuffer(size_t capacity, uint64_t tid_, const char *name_)
+  : events(capacity), mask(capacity - 1), head(0), start(0), tid(tid_),
+    name(name_) {}
+  std::vector<TraceEvent> events;
+  uint64_t mask;
+  // Number of events ever recorded, and the first one not cleared
+  boost::atomic<uint64_t> head;
+  boost::atomic<uint64_t> start;
+  boost::atomic<uint64_t> tid;
+  boost::atomic<const char *> name;
+};
+
+boost::mutex trace_mutex;
+std::vector<boost::shared_ptr<TraceBuffer> > trace_buffers;
+// Buffers of exited threads, their events are written out until reused
+std::vector<TraceBuffer *> free_trace_buffers;
+uint64_t next_trace_tid = 1;
+boost::atomic<size_t> trace_capacity(default_trace_events);
+
+__thread TraceBuffer *thread_trace_buffer = NULL;
+__thread const char *thread_trace_name = NULL;
+
+// Called as a recording thread exits, trace_buffers still owns the buffer
+void releaseTraceBuffer(TraceBuffer *buffer) {
+  boost::mutex::scoped_lock lock(trace_mutex);
+  free_trace_buffers.push_back(buffer);
+  thread_trace_buffer = NULL;
+}
+
+boost::thread_specific_ptr<TraceBuffer> thread_trace_owner(releaseTraceBuffer);
+
+// Rounds up to a power of two, so the ring is indexed with a mask
+inline size_t roundUpToPowerOfTwo(size_t value) {
+  size_t power = 1;
+  while (power < value) {
+    power <<= 1;
+  }
+  return power;
+}
+
+TraceBuffer * createTraceBuffer() {
+  boost::mutex::scoped_lock lock(trace_mutex);
+  size_t capacity = roundUpToPowerOfTwo(trace_capacity);
+  TraceBuffer *buffer = NULL;
+  while (buffer == NULL && !free_trace_buffers.empty()) {
+    buffer = free_trace_buffers.back();
+    free_trace_buffers.pop_back();
+    if (buffer->events.size() != capacity) {
+      // From before the capacity changed, drop it and its events
+      for (size_t i = 0; i < trace_buffers.size(); ++i) {
+        if (trace_buffers[i].get() == buffer) {
+          trace_buffers.erase(trace_buffers.begin() + i);
+          break;
+        }
+      }
+      buffer = NULL;
+    }
+  }
+  if (buffer != NULL) {
+    // Reuse the buffer of an exited thread, forgetting its events
+    buffer->start = buffer->head.load();
+    buffer->tid = next_trace_tid++;
+    buffer->name = thread_trace_name;
+  } else {
+    // Kept after the thread exits, so its events can still be written out
+    boost::shared_ptr<TraceBuffer> created(
+      new TraceBuffer(capacity, next_trace_tid++, thread_trace_name));
+    trace_buffers.push_back(created);
+    buffer = created.get();
+  }
+  thread_trace_owner.reset(buffer);
+  thread_trace_buffer = buffer;
+  return buffer;
+}
+
+// Escapes the characters JSON does not allow in strings
+void writeJsonString(std::ostream &out, const char *text) {
+  out << '"';
+  for (const char *c = text; *c != '\0'; ++c) {
+    if (*c == '"' || *c == '\\') {
+      out << '\\' << *c;
+    } else if ((unsigned char)*c >= 0x20) {
+      out << *c;
+    }
+  }
+  out << '"';
+}
+
+}
+
+using namespace mdc2250_;
+
+boost::atomic<bool> mdc2250::tracing_enabled_(false);
+
+void mdc2250::enableTracing(size_t events_per_thread) {
+  if (events_per_thread == 0) {
+    throw(std::invalid_argument("In enableTracing, events_per_thread "
+                                "must be at least 1."));
+  }
+  trace_capacity = events_per_thread;
+  tracing_enabled_ = true;
+}
+
+void mdc2250::disableTracing() {
+  tracing_enabled_ = false;
+}
+
+bool mdc2250::isTracing() {
+  return tracing_enabled_;
+}
+
+void mdc2250::clearTrace() {
+  boost::mutex::scoped_lock lock(trace_mutex);
+  for (size_t i = 0; i < trace_buffers.size(); ++i) {
+    trace_buffers[i]->start = trace_buffers[i]->head.load();
+  }
+}
+
+void mdc2250::setTraceThreadName(const char *name) {
+  thread_trace_name = name;
+  if (thread_trace_buffer != NULL) {
+    thread_trace_buffer->name = name;
+  }
+}
+
+void mdc2250::record_trace_event_(char phase, const char *name,
+                                  uint64_t value)
+{
+  TraceBuffer *buffer = thread_trace_buffer;
+  if (buffer == NULL) {
+    buffer = createTraceBuffer();
+  }
+  uint64_t head = buffer->head.load(boost::memory_order_relaxed);
+  TraceEvent &event = buffer->events[head & buffer->mask];
+  event.stamp_ns = monotonic_nsec();
+  event.name = name;
+  event.value = value;
+  event.phase = phase;
+  buffer->head.store(head + 1, boost::memory_order_release);
+}
+
+size_t mdc2250::writeChromeTrace(std::ostream &out) {
+  std::vector<boost::shared_ptr<TraceBuffer> > buffers;
+  {
+    boost::mutex::scoped_lock lock(trace_mutex);
+    buffers = trace_buffers;
+  }
+  int pid = (int)getpid();
+  size_t written = 0;
+  out << "{\"traceEvents\":[";
+  std::vector<TraceEvent> events;
+  for (size_t i = 0; i < buffers.size(); ++i) {
+    TraceBuffer &buffer = *buffers[i];
+    const char *name = buffer.name;
+    uint64_t tid = buffer.tid;
+    out << (i == 0 ? "\n" : ",\n");
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid;
+    out << ",\"tid\":" << tid << ",\"args\":{\"name\":";
+    if (name != NULL) {
+      writeJsonString(out, name);
+    } else {
+      out << "\"thread " << tid << "\"";
+    }
+    out << "}}";
+    // Copy the events, then drop those the thread overwrote meanwhile
+    uint64_t capacity = buffer.events.size();
+    uint64_t head = buffer.head.load(boost::memory_order_acquire);
+    uint64_t first = std::max(buffer.start.load(),
+                              head > capacity ? head - capacity : 0);
+    events.clear();
+    for (uint64_t j = first; j < head; ++j) {
+      events.push_back(buffer.events[j & buffer.mask]);
+    }
+    boost::atomic_thread_fence(boost::memory_order_acquire);
+    uint64_t now = buffer.head.load(boost::memory_order_relaxed);
+    uint64_t overwritten = now > capacity ? now - capacity : 0;
+    size_t skip = overwritten > first ? (size_t)(overwritten - first) : 0;
+    for (size_t j = std::min(skip, events.size()); j < events.size(); ++j) {
+      const TraceEvent &event = events[j];
+      out << ",\n{\"name\":";
+      writeJsonString(out, event.name);
+      out << ",\"cat\":\"mdc2250\",\"ph\":\"" << event.phase << "\"";
+      if (event.phase == 'i') {
+        out << ",\"s\":\"t\"";
+      }
+      uint64_t fraction = event.stamp_ns % 1000;
+      out << ",\"ts\":" << event.stamp_ns / 1000 << '.';
+      out << (char)('0' + fraction / 100) << (char)('0' + fraction / 10 % 10);
+      out << (char)('0' + fraction % 10);
+      out << ",\"pid\":" << pid << ",\"tid\":" << tid;
+      out << ",\"args\":{\"value\":" << event.value << "}}";
+      written++;
+    }
+  }
+  out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+  return written;
+}
+
+size_t mdc2250::writeChromeTrace(const std::string &path) {
+  std::ofstream out(path.c_str());
+  size_t written = writeChromeTrace(out);
+  out.close();
+  if (!out) {
+    throw(std::runtime_error("In writeChromeTrace, failed to write " +
+                             path + "."));
+  }
+  return written;
+}
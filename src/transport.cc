@@ -0,0 +1,495 @@
+#include "mdc2250/transport.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/serial.h>
+#endif
+
+using namespace mdc2250;
+
+namespace mdc2250_ {
+
+#if defined(MSG_NOSIGNAL)
+const int send_flags = MSG_NOSIGNAL;
+#else
+const int send_flags = 0;
+#endif
+
+// Longest a write waits for room in the socket's send buffer
+const int tcp_write_timeout_ms = 1000;
+
+inline TransportException transportError(const char *where,
+                                         const std::string &name)
+{
+  std::stringstream ss;
+  ss << "In " << where << " for " << name << ": " << std::strerror(errno);
+  return TransportException(ss.str());
+}
+
+inline void setSocketOption(int fd, int level, int option) {
+  int value = 1;
+  setsockopt(fd, level, option, &value, sizeof(value));
+}
+
+// Counts a call using the socket, close waits for it to return
+struct SocketUse {
+  SocketUse(boost::atomic<int> &users) : users_(users) {
+    ++this->users_;
+  }
+  ~SocketUse() {
+    --this->users_;
+  }
+  boost::atomic<int> &users_;
+};
+
+// Asks the serial driver to pass bytes on at once, returns true if it did
+inline bool setLowLatency(const std::string &port) {
+#if defined(__linux__) && defined(ASYNC_LOW_LATENCY)
+  int fd = ::open(port.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    return false;
+  }
+  struct serial_struct serial_info;
+  bool set = ioctl(fd, TIOCGSERIAL, &serial_info) == 0;
+  if (set) {
+    serial_info.flags |= ASYNC_LOW_LATENCY;
+    set = ioctl(fd, TIOCSSERIAL, &serial_info) == 0;
+  }
+  ::close(fd);
+  return set;
+#else
+  (void)port;
+  return false;
+#endif
+}
+
+}
+
+/***** SerialTransport *****/
+
+ReadLatencyProfile
+mdc2250::read_latency_profile(latency_profiles::LatencyProfile profile) {
+  ReadLatencyProfile settings;
+  switch (profile) {
+    case latency_profiles::lowest_latency:
+      settings.low_latency = true;
+      break;
+    case latency_profiles::fewest_wakeups:
+      // About eleven and a half bytes at 115200 baud without a new one
+      settings.min_read_bytes = 64;
+      settings.inter_byte_timeout_ms = 1;
+      break;
+    default:
+      break;
+  }
+  return settings;
+}
+
+SerialTransport::SerialTransport(const std::string &port, uint32_t baudrate,
+                                 size_t read_timeout_ms)
+: port_(port), baudrate_(baudrate), read_timeout_ms_(read_timeout_ms),
+  low_latency_(false)
+{
+  this->profile_.read_timeout_ms = read_timeout_ms;
+}
+
+SerialTransport::SerialTransport(const std::string &port, uint32_t baudrate,
+                                 const ReadLatencyProfile &profile)
+: port_(port), baudrate_(baudrate), read_timeout_ms_(profile.read_timeout_ms),
+  profile_(profile), low_latency_(false)
+{
+  if (this->profile_.min_read_bytes == 0) {
+    this->profile_.min_read_bytes = 1;
+  }
+  if (this->profile_.read_buffer_bytes == 0) {
+    this->profile_.read_buffer_bytes = 1;
+  }
+}
+
+void SerialTransport::open() {
+  try {
+    this->serial_port_.setPort(this->port_);
+    this->serial_port_.setBaudrate(this->baudrate_);
+    serial::Timeout to =
+      serial::Timeout::simpleTimeout((uint32_t)this->read_timeout_ms_);
+    this->serial_port_.setTimeout(to);
+    this->serial_port_.open();
+  } catch (std::exception &e) {
+    // Callers only have to handle the transport's own exceptions
+    std::stringstream ss;
+    ss << "In SerialTransport::open, failed to open " << this->port_;
+    ss << ": " << e.what();
+    throw(TransportException(ss.str()));
+  }
+  this->low_latency_ = false;
+  if (this->profile_.low_latency) {
+    this->low_latency_ = mdc2250_::setLowLatency(this->port_);
+  }
+}
+
+void SerialTransport::close() {
+  if (this->serial_port_.isOpen()) {
+    this->serial_port_.close();
+  }
+}
+
+bool SerialTransport::isOpen() const {
+  return this->serial_port_.isOpen();
+}
+
+size_t SerialTransport::read(uint8_t *buffer, size_t size) {
+  size = std::min(size, this->profile_.read_buffer_bytes);
+  // Block for the first byte, then take whatever else has arrived
+  size_t length = this->serial_port_.read(buffer, 1);
+  if (length == 0 || size == 1) {
+    return length;
+  }
+  size_t wanted = std::min(this->profile_.min_read_bytes, size);
+  while (length < size) {
+    size_t available =
+      std::min(this->serial_port_.available(), size - length);
+    if (available > 0) {
+      length += this->serial_port_.read(buffer + length, available);
+      continue;
+    }
+    if (length >= wanted) {
+      break;
+    }
+    // Gather more until the link goes quiet
+    boost::this_thread::sleep(boost::posix_time::milliseconds(
+      this->profile_.inter_byte_timeout_ms));
+    if (this->serial_port_.available() == 0) {
+      break;
+    }
+  }
+  return length;
+}
+
+void SerialTransport::write(const uint8_t *data, size_t size) {
+  size_t written = this->serial_port_.write(data, size);
+  if (written != size) {
+    std::stringstream ss;
+    ss << "Timed out writing to " << this->port_ << ", wrote " << written;
+    ss << " of " << size << " bytes.";
+    throw(TransportException(ss.str()));
+  }
+}
+
+size_t SerialTransport::readTimeoutMs() const {
+  return this->read_timeout_ms_;
+}
+
+double SerialTransport::bytesPerSecond() const {
+  // A start and a stop bit per byte
+  return (double)this->baudrate_ / 10.0;
+}
+
+std::string SerialTransport::name() const {
+  return this->port_;
+}
+
+/***** LoopbackTransport *****/
+
+std::pair<TransportPtr, TransportPtr>
+LoopbackTransport::createPair(size_t capacity, double bytes_per_second,
+                              size_t read_timeout_ms)
+{
+  if (capacity == 0) {
+    throw(TransportException("In LoopbackTransport::createPair, the "
+                             "capacity must be at least 1 byte."));
+  }
+  boost::shared_ptr<Shared> shared(new Shared(capacity));
+  TransportPtr first(new LoopbackTransport(shared, true, bytes_per_second,
+                                           read_timeout_ms));
+  TransportPtr second(new LoopbackTransport(shared, false, bytes_per_second,
+                                            read_timeout_ms));
+  return std::make_pair(first, second);
+}
+
+LoopbackTransport::LoopbackTransport(const boost::shared_ptr<Shared> &shared,
+                                     bool first, double bytes_per_second,
+                                     size_t read_timeout_ms)
+: shared_(shared), in_(first ? shared->b_to_a : shared->a_to_b),
+  out_(first ? shared->a_to_b : shared->b_to_a), first_(first),
+  bytes_per_second_(bytes_per_second), read_timeout_ms_(read_timeout_ms) {}
+
+void LoopbackTransport::open() {
+  if (this->shared_->closed) {
+    throw(TransportException("The loopback pair has been closed."));
+  }
+}
+
+void LoopbackTransport::close() {
+  this->shared_->closed = true;
+  // Wake readers and writers blocked on either end
+  {
+    boost::mutex::scoped_lock lock(this->in_.mutex);
+    this->in_.condition.notify_all();
+  }
+  boost::mutex::scoped_lock lock(this->out_.mutex);
+  this->out_.condition.notify_all();
+}
+
+bool LoopbackTransport::isOpen() const {
+  return !this->shared_->closed;
+}
+
+size_t LoopbackTransport::read(uint8_t *buffer, size_t size) {
+  Pipe &pipe = this->in_;
+  boost::mutex::scoped_lock lock(pipe.mutex);
+  if (pipe.count == 0 && !this->shared_->closed) {
+    pipe.condition.timed_wait(lock,
+      boost::posix_time::milliseconds(this->read_timeout_ms_));
+  }
+  size_t length = std::min(pipe.count, size);
+  for (size_t i = 0; i < length; ++i) {
+    buffer[i] = pipe.data[(pipe.head + i) % pipe.data.size()];
+  }
+  pipe.head = (pipe.head + length) % pipe.data.size();
+  pipe.count -= length;
+  if (length > 0) {
+    // Make room for a blocked writer
+    pipe.condition.notify_all();
+  }
+  return length;
+}
+
+void LoopbackTransport::write(const uint8_t *data, size_t size) {
+  Pipe &pipe = this->out_;
+  boost::mutex::scoped_lock lock(pipe.mutex);
+  size_t written = 0;
+  while (written < size) {
+    while (pipe.count == pipe.data.size() && !this->shared_->closed) {
+      pipe.condition.wait(lock);
+    }
+    if (this->shared_->closed) {
+      throw(TransportException("The loopback pair has been closed."));
+    }
+    size_t length = std::min(pipe.data.size() - pipe.count, size - written);
+    size_t tail = (pipe.head + pipe.count) % pipe.data.size();
+    for (size_t i = 0; i < length; ++i) {
+      pipe.data[(tail + i) % pipe.data.size()] = data[written + i];
+    }
+    pipe.count += length;
+    written += length;
+    pipe.condition.notify_all();
+  }
+}
+
+size_t LoopbackTransport::readTimeoutMs() const {
+  return this->read_timeout_ms_;
+}
+
+double LoopbackTransport::bytesPerSecond() const {
+  return this->bytes_per_second_;
+}
+
+std::string LoopbackTransport::name() const {
+  return this->first_ ? "loopback:a" : "loopback:b";
+}
+
+/***** TcpTransport *****/
+
+TcpTransport::TcpTransport(const std::string &host, uint16_t port,
+                           uint32_t baudrate, size_t read_timeout_ms,
+                           size_t connect_timeout_ms)
+: host_(host), port_(port), baudrate_(baudrate),
+  read_timeout_ms_(read_timeout_ms), connect_timeout_ms_(connect_timeout_ms),
+  socket_(-1), users_(0) {}
+
+TcpTransport::~TcpTransport() {
+  this->close();
+}
+
+void TcpTransport::open() {
+  using namespace mdc2250_;
+  if (this->socket_ >= 0) {
+    return;
+  }
+  struct addrinfo hints, *addresses = NULL;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  std::stringstream service;
+  service << this->port_;
+  int error = getaddrinfo(this->host_.c_str(), service.str().c_str(), &hints,
+                          &addresses);
+  if (error != 0) {
+    std::stringstream ss;
+    ss << "In TcpTransport::open, failed to resolve " << this->name();
+    ss << ": " << gai_strerror(error);
+    throw(TransportException(ss.str()));
+  }
+  int fd = -1;
+  errno = ETIMEDOUT;
+  for (struct addrinfo *a = addresses; a != NULL && fd < 0; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    // Connect without blocking, so the wait can be bounded
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+      int result = -1;
+      if (errno == EINPROGRESS) {
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        if (poll(&pfd, 1, (int)this->connect_timeout_ms_) > 0) {
+          socklen_t length = sizeof(result);
+          getsockopt(fd, SOL_SOCKET, SO_ERROR, &result, &length);
+          errno = result;
+        } else {
+          errno = ETIMEDOUT;
+        }
+      }
+      if (result != 0) {
+        int saved = errno;
+        ::close(fd);
+        errno = saved;
+        fd = -1;
+      }
+    }
+  }
+  freeaddrinfo(addresses);
+  if (fd < 0) {
+    throw(transportError("TcpTransport::open", this->name()));
+  }
+  // Send each command at once and notice a gateway which went away
+  setSocketOption(fd, IPPROTO_TCP, TCP_NODELAY);
+  setSocketOption(fd, SOL_SOCKET, SO_KEEPALIVE);
+  this->socket_ = fd;
+}
+
+void TcpTransport::close() {
+  int fd = this->socket_.exchange(-1);
+  if (fd < 0) {
+    return;
+  }
+  // Wake a read or write blocked on the socket, and only release the 
+  // descriptor once they have left, so it is never reused under them
+  shutdown(fd, SHUT_RDWR);
+  while (this->users_ > 0) {
+    boost::this_thread::yield();
+  }
+  ::close(fd);
+}
+
+bool TcpTransport::isOpen() const {
+  return this->socket_ >= 0;
+}
+
+size_t TcpTransport::read(uint8_t *buffer, size_t size) {
+  mdc2250_::SocketUse use(this->users_);
+  int fd = this->socket_;
+  if (fd < 0) {
+    throw(TransportException("In TcpTransport::read, not connected."));
+  }
+  struct pollfd pfd = {fd, POLLIN, 0};
+  int ready = poll(&pfd, 1, (int)this->read_timeout_ms_);
+  if (ready == 0 || (ready < 0 && errno == EINTR)) {
+    return 0;
+  }
+  if (ready < 0) {
+    throw(mdc2250_::transportError("TcpTransport::read", this->name()));
+  }
+  ssize_t length = recv(fd, buffer, size, MSG_DONTWAIT);
+  if (length < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return 0;
+    }
+    throw(mdc2250_::transportError("TcpTransport::read", this->name()));
+  }
+  if (length == 0) {
+    std::stringstream ss;
+    ss << "The gateway " << this->name() << " closed the connection.";
+    throw(TransportException(ss.str()));
+  }
+  return (size_t)length;
+}
+
+void TcpTransport::write(const uint8_t *data, size_t size) {
+  using namespace mdc2250_;
+  SocketUse use(this->users_);
+  int fd = this->socket_;
+  if (fd < 0) {
+    throw(TransportException("In TcpTransport::write, not connected."));
+  }
+  size_t written = 0;
+  while (written < size) {
+    ssize_t length = send(fd, data + written, size - written,
+                          send_flags | MSG_DONTWAIT);
+    if (length >= 0) {
+      written += (size_t)length;
+      continue;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      throw(transportError("TcpTransport::write", this->name()));
+    }
+    // The send buffer is full, wait for the gateway to catch up
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    if (poll(&pfd, 1, tcp_write_timeout_ms) == 0) {
+      errno = ETIMEDOUT;
+      throw(transportError("TcpTransport::write", this->name()));
+    }
+  }
+}
+
+size_t TcpTransport::readTimeoutMs() const {
+  return this->read_timeout_ms_;
+}
+
+double TcpTransport::bytesPerSecond() const {
+  // The gateway's serial port is the bottleneck
+  return (double)this->baudrate_ / 10.0;
+}
+
+std::string TcpTransport::name() const {
+  std::stringstream ss;
+  ss << "tcp://" << this->host_ << ":" << this->port_;
+  return ss.str();
+}
+
+/***** createTransport *****/
+
+TransportPtr mdc2250::createTransport(const std::string &port,
+                                      const ReadLatencyProfile &profile,
+                                      uint32_t baudrate)
+{
+  const std::string scheme = "tcp://";
+  if (port.compare(0, scheme.length(), scheme) != 0) {
+    return TransportPtr(new SerialTransport(port, baudrate, profile));
+  }
+  std::string address = port.substr(scheme.length());
+  size_t colon = address.rfind(':');
+  char *end = NULL;
+  long number = 0;
+  if (colon != std::string::npos) {
+    number = std::strtol(address.c_str() + colon + 1, &end, 10);
+  }
+  if (colon == std::string::npos || colon == 0 || end == NULL ||
+      *end != '\0' || number <= 0 || number > 65535)
+  {
+    std::stringstream ss;
+    ss << "Invalid TCP port name, expected tcp://<host>:<port>: " << port;
+    throw(TransportException(ss.str()));
+  }
+  return TransportPtr(new TcpTransport(address.substr(0, colon),
+                                       (uint16_t)number, baudrate,
+                                       profile.read_timeout_ms));
+}
@@ -0,0 +1,247 @@
+#include "mdc2250/writer.h"
+#include "mdc2250/clock.h"
+#include "mdc2250/trace.h"
+
+#include <cstring>
+#include <iostream>
+
+#include <boost/bind.hpp>
+
+using namespace mdc2250;
+
+namespace mdc2250_ {
+
+// Largest number of bytes written with a single call
+const size_t batch_size = 1024;
+
+inline void defaultWriterExceptionCallback(const std::exception &error) {
+  std::cerr << "MDC2250 Writer Unhandled Exception: " << error.what();
+  std::cerr << std::endl;
+  throw(error);
+}
+
+}
+
+using namespace mdc2250_;
+
+Writer::Writer(size_t queue_size)
+: handle_exc_(defaultWriterExceptionCallback), coalescing_delay_ns_(0),
+  transport_(NULL), queue_(queue_size), rejected_(0), running_(false),
+  sleeping_(false), taken_(0), written_(0), batch_(batch_size),
+  batch_stamps_(batch_size)
+{
+  std::memset(&this->stats_, 0, sizeof(this->stats_));
+  std::memset(&this->urgent_stats_, 0, sizeof(this->urgent_stats_));
+}
+
+Writer::~Writer() {
+  this->stop();
+}
+
+void Writer::start(Transport &transport) {
+  if (this->running_) {
+    return;
+  }
+  this->transport_ = &transport;
+  // Discard anything left over from before the last stop
+  size_t batch_length = 0;
+  while (this->gather_(batch_length, &this->batch_stamps_[0], 1) != 0) {
+    batch_length = 0;
+  }
+  {
+    boost::mutex::scoped_lock lock(this->port_mutex_);
+    this->written_ = this->taken_;
+  }
+  // The thread applies the scheduling options to itself
+  this->running_ = true;
+  try {
+    this->thread_ = startThread(this->thread_options_,
+                                boost::bind(&Writer::run_, this));
+  } catch (...) {
+    this->running_ = false;
+    throw;
+  }
+}
+
+void Writer::stop() {
+  if (!this->running_) {
+    return;
+  }
+  this->running_ = false;
+  {
+    boost::mutex::scoped_lock lock(this->wake_mutex_);
+    this->wake_condition_.notify_all();
+  }
+  if (this->thread_.joinable()) {
+    this->thread_.join();
+  }
+}
+
+bool Writer::write(const char *data, size_t length, size_t *ticket_out) {
+  if (length > max_token_length || !this->running_) {
+    this->rejected_++;
+    return false;
+  }
+  size_t ticket;
+  Message *message = this->queue_.claim(ticket);
+  if (message == NULL) {
+    // Full
+    this->rejected_++;
+    return false;
+  }
+  std::memcpy(message->data, data, length);
+  message->length = length;
+  message->stamp_ns = monotonic_nsec();
+  this->queue_.publish(ticket);
+  if (ticket_out != NULL) {
+    *ticket_out = ticket;
+  }
+  // Wake the writer if it is waiting for messages, the fence pairs with the
+  // one in run_ so either the writer sees this message or we see it asleep
+  boost::atomic_thread_fence(boost::memory_order_seq_cst);
+  if (this->sleeping_.load(boost::memory_order_relaxed)) {
+    boost::mutex::scoped_lock lock(this->wake_mutex_);
+    this->wake_condition_.notify_one();
+  }
+  return true;
+}
+
+bool Writer::writeUrgent(const char *data, size_t length, size_t *written) {
+  uint64_t start = monotonic_nsec();
+  if (length > max_token_length || !this->running_) {
+    this->rejected_++;
+    return false;
+  }
+  // Only waits for a batch which is already being written
+  boost::mutex::scoped_lock lock(this->port_mutex_);
+  if (written != NULL) {
+    *written = this->written_;
+  }
+  MDC2250_TRACE_BEGIN("serial_write_urgent", length);
+  try {
+    this->transport_->write((const uint8_t *)data, length);
+  } catch (std::exception &) {
+    // The caller sees the failure, the handler may rethrow
+    MDC2250_TRACE_END("serial_write_urgent", 0);
+    return false;
+  }
+  MDC2250_TRACE_END("serial_write_urgent", length);
+  uint64_t latency = monotonic_nsec() - start;
+  // Serialized by port_mutex_, so there is a single writer of the SeqLock
+  UrgentStatistics &stats = this->urgent_stats_;
+  stats.messages++;
+  stats.bytes += length;
+  stats.latency_mean +=
+    ((double)latency - stats.latency_mean) / (double)stats.messages;
+  if (latency > stats.latency_max) {
+    stats.latency_max = latency;
+  }
+  this->urgent_statistics_.store(stats);
+  return true;
+}
+
+WriterStatistics Writer::getStatistics() const {
+  WriterStatistics statistics = this->statistics_.load();
+  UrgentStatistics urgent = this->urgent_statistics_.load();
+  statistics.urgent_messages = urgent.messages;
+  statistics.urgent_bytes = urgent.bytes;
+  statistics.bytes += urgent.bytes;
+  statistics.urgent_latency_mean = urgent.latency_mean;
+  statistics.urgent_latency_max = urgent.latency_max;
+  return statistics;
+}
+
+size_t Writer::gather_(size_t &batch_length, uint64_t *stamps, size_t max) {
+  size_t count = 0;
+  while (count < max && batch_length + max_token_length <= batch_size) {
+    Message *message = this->queue_.front();
+    if (message == NULL) {
+      // Empty, or the next message is still being copied in
+      break;
+    }
+    std::memcpy(&this->batch_[batch_length], message->data, message->length);
+    batch_length += message->length;
+    stamps[count++] = message->stamp_ns;
+    this->queue_.pop();
+    this->taken_++;
+  }
+  return count;
+}
+
+void Writer::run_() {
+  setTraceThreadName("mdc2250_writer");
+  uint64_t *stamps = &this->batch_stamps_[0];
+  while (true) {
+    size_t batch_length = 0;
+    uint64_t depth = this->queueDepth();
+    size_t count = this->gather_(batch_length, stamps, batch_size);
+    if (count == 0) {
+      if (!this->running_) {
+        break;
+      }
+      // Wait for a producer, rechecking after announcing we are asleep
+      boost::mutex::scoped_lock lock(this->wake_mutex_);
+      this->sleeping_.store(true, boost::memory_order_relaxed);
+      boost::atomic_thread_fence(boost::memory_order_seq_cst);
+      if (this->queueDepth() == 0 && this->running_) {
+        this->wake_condition_.timed_wait(lock,
+          boost::posix_time::milliseconds(10));
+      }
+      this->sleeping_ = false;
+      continue;
+    }
+    if (this->coalescing_delay_ns_ > 0 && this->running_) {
+      // Give other producers a chance to add to this write
+      uint64_t deadline = stamps[0] + this->coalescing_delay_ns_;
+      uint64_t now = monotonic_nsec();
+      if (deadline > now) {
+        boost::this_thread::sleep(
+          boost::posix_time::microseconds((deadline - now) / 1000));
+      }
+      count += this->gather_(batch_length, stamps + count,
+                             batch_size - count);
+    }
+    // Write the whole batch with one call
+    uint64_t write_start, write_end;
+    {
+      boost::mutex::scoped_lock lock(this->port_mutex_);
+      write_start = monotonic_nsec();
+      MDC2250_TRACE_BEGIN("serial_write", batch_length);
+      try {
+        this->transport_->write((const uint8_t *)&this->batch_[0],
+                                batch_length);
+      } catch (std::exception &e) {
+        this->written_ = this->taken_;
+        this->handle_exc_(e);
+      }
+      this->written_ = this->taken_;
+      write_end = monotonic_nsec();
+      MDC2250_TRACE_END("serial_write", count);
+    }
+
+    // Update the statistics
+    WriterStatistics &stats = this->stats_;
+    for (size_t i = 0; i < count; ++i) {
+      uint64_t latency = write_end - stamps[i];
+      stats.messages++;
+      stats.latency_mean +=
+        ((double)latency - stats.latency_mean) / (double)stats.messages;
+      if (latency > stats.latency_max) {
+        stats.latency_max = latency;
+      }
+    }
+    uint64_t write_time = write_end - write_start;
+    stats.writes++;
+    stats.bytes += batch_length;
+    stats.write_mean +=
+      ((double)write_time - stats.write_mean) / (double)stats.writes;
+    if (write_time > stats.write_max) {
+      stats.write_max = write_time;
+    }
+    if (depth > stats.queue_depth_max) {
+      stats.queue_depth_max = depth;
+    }
+    stats.rejected = this->rejected_;
+    this->statistics_.store(stats);
+  }
+}
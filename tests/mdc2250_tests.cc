@@ -1,11 +1,2047 @@
 #include "gtest/gtest.h"
 
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <boost/bind.hpp>
+
+#if defined(__linux__)
+# include <pty.h>
+# include <poll.h>
+# include <pthread.h>
+# include <sched.h>
+# include <termios.h>
+# include <unistd.h>
+# include <netinet/in.h>
+# include <sys/socket.h>
+#endif
+
 #include "mdc2250/mdc2250.h"
+#include "mdc2250/aggregate.h"
+#include "mdc2250/bandwidth.h"
+#include "mdc2250/clock.h"
+#include "mdc2250/config.h"
+#include "mdc2250/daemon.h"
+#include "mdc2250/decode.h"
+#include "mdc2250/group.h"
+#include "mdc2250/model.h"
+#include "mdc2250/odometry.h"
+#include "mdc2250/control_loop.h"
+#include "mdc2250/realtime.h"
+#include "mdc2250/setpoint.h"
+#include "mdc2250/shared_telemetry.h"
+#include "mdc2250/telemetry_health.h"
+#include "mdc2250/transport.h"
 using namespace mdc2250;
 
+/***** Allocation Counting *****/
+
+// Counts heap allocations while enabled, except on threads which opt out
+boost::atomic<bool> count_allocations(false);
+boost::atomic<size_t> allocation_count(0);
+__thread bool ignore_allocations = false;
+
+void * operator new(size_t size) {
+  if (count_allocations && !ignore_allocations) {
+    allocation_count++;
+  }
+  void *p = std::malloc(size ? size : 1);
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void * operator new[](size_t size) {
+  return ::operator new(size);
+}
+
+void * operator new(size_t size, const std::nothrow_t &) throw() {
+  try {
+    return ::operator new(size);
+  } catch (...) {
+    return NULL;
+  }
+}
+
+void * operator new[](size_t size, const std::nothrow_t &) throw() {
+  return ::operator new(size, std::nothrow);
+}
+
+void operator delete(void *p) throw() {
+  std::free(p);
+}
+
+void operator delete[](void *p) throw() {
+  std::free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) throw() {
+  std::free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) throw() {
+  std::free(p);
+}
+
+#if defined(__cpp_sized_deallocation)
+// Used instead of the unsized forms when the size is known
+void operator delete(void *p, std::size_t) throw() {
+  ::operator delete(p);
+}
+
+void operator delete[](void *p, std::size_t) throw() {
+  ::operator delete[](p);
+}
+#endif
+
 namespace {
 
+#if defined(__linux__)
+
+/*
+ * Simulates an MDC2250 on a pseudo terminal, or behind a stand-in for a 
+ * TCP serial gateway listening on the loopback interface.
+ * 
+ * Echoes commands, acknowledges runtime and configuration commands, answers
+ * the queries the library makes and replays the query history at the rate 
+ * given by "# <period>".  Its thread does not count towards allocations.
+ */
+class SimulatedMDC2250 {
+public:
+  explicit SimulatedMDC2250(bool tcp = false)
+  : running_(true), master_(-1), slave_(-1), server_(-1), echo_(true),
+    fault_flags_(0), history_period_ms_(0), history_position_(0),
+    history_sent_(0), drop_every_(0), duplicate_every_(0),
+    corrupt_every_(0), counts_(0), identity_queries_(0)
+  {
+    config_["ALIM"].push_back(750);
+    config_["ALIM"].push_back(750);
+    config_["MXRPM"].push_back(3000);
+    config_["MXRPM"].push_back(3000);
+    config_["PWMF"].push_back(180);
+    // One per digital input
+    for (long i = 0; i < 6; ++i) {
+      config_["DINA"].push_back(i);
+    }
+    if (tcp) {
+      // Accept one connection at a time on an ephemeral port
+      struct sockaddr_in addr;
+      socklen_t length = sizeof(addr);
+      std::memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      server_ = socket(AF_INET, SOCK_STREAM, 0);
+      bind(server_, (struct sockaddr *)&addr, sizeof(addr));
+      listen(server_, 1);
+      getsockname(server_, (struct sockaddr *)&addr, &length);
+      std::stringstream ss;
+      ss << "tcp://127.0.0.1:" << ntohs(addr.sin_port);
+      port_ = ss.str();
+    } else {
+      char name[256];
+      openpty(&master_, &slave_, name, NULL, NULL);
+      struct termios tio;
+      tcgetattr(slave_, &tio);
+      cfmakeraw(&tio);
+      tcsetattr(slave_, TCSANOW, &tio);
+      port_ = name;
+    }
+    thread_ = boost::thread(boost::bind(&SimulatedMDC2250::run, this));
+  }
+
+  ~SimulatedMDC2250() {
+    running_ = false;
+    thread_.join();
+    int fds[] = {master_, slave_, server_};
+    for (size_t i = 0; i < 3; ++i) {
+      if (fds[i] >= 0) {
+        close(fds[i]);
+      }
+    }
+  }
+
+  const std::string & port() const {
+    return port_;
+  }
+
+  size_t identityQueries() const {
+    return identity_queries_;
+  }
+
+  // Drops, repeats or garbles every n-th line of the history, 0 for never
+  void setHistoryFaults(size_t drop_every, size_t duplicate_every,
+                        size_t corrupt_every)
+  {
+    drop_every_ = drop_every;
+    duplicate_every_ = duplicate_every;
+    corrupt_every_ = corrupt_every;
+  }
+
+private:
+  // Sends the data after any echo still held back
+  void send(const std::string &data) {
+    std::string out;
+    out.swap(echo_pending_);
+    out += data;
+    if (master_ < 0 || out.empty()) {
+      return;
+    }
+    if (server_ >= 0) {
+      ::send(master_, out.data(), out.length(), MSG_NOSIGNAL);
+    } else if (write(master_, out.data(), out.length()) < 0) {
+      return;
+    }
+  }
+
+  std::string respond(const std::string &query) {
+    std::stringstream ss;
+    ss << query << "=";
+    if (query == "C") {
+      ss << counts_ << ":" << -counts_;
+    } else if (query == "CR") {
+      ss << "10:-10";
+    } else if (query == "FF") {
+      ss << fault_flags_;
+    } else if (query == "FS") {
+      ss << 1;
+    } else if (query == "V") {
+      ss << "135:240:5000";
+    } else if (query == "A") {
+      ss << "12:-3";
+    } else {
+      ss << "0";
+    }
+    ss << "\r";
+    return ss.str();
+  }
+
+  // Echoes a character as it is read, maintenance commands once complete
+  // so that resets are not echoed.  The echo is held back until the next
+  // send so the stream is not split into a segment per character.
+  void echo(const std::string &line, char c) {
+    if (!echo_) {
+      return;
+    }
+    if (line.compare(0, 1, "%") != 0) {
+      echo_pending_ += c;
+    } else if ((c == '\r' || c == '_') &&
+               line.compare(0, 6, "%RESET") != 0) {
+      echo_pending_ += line + c;
+    }
+  }
+
+  void execute(const std::string &line) {
+    bool reset = (line.compare(0, 6, "%RESET") == 0);
+    if (reset) {
+      echo_ = true;
+      history_.clear();
+      history_period_ms_ = 0;
+      send("FID=Roboteq v1.2 MDC2250 05/03/2011\r");
+    } else if (line.compare(0, 7, "^ECHOF ") == 0) {
+      echo_ = (line[7] == '0');
+      send("+\r");
+    } else if (line == "~ECHOF") {
+      send(echo_ ? "ECHOF=0\r" : "ECHOF=1\r");
+    } else if (line == "?$1E") {
+      identity_queries_++;
+      send("$1E=Roboteq v1.2 MDC2250 05/03/2011\r");
+    } else if (line == "?TRN") {
+      send("TRN=DC:MDC2250\r");
+    } else if (line == "# C") {
+      history_.clear();
+      history_period_ms_ = 0;
+    } else if (line.compare(0, 2, "# ") == 0) {
+      history_period_ms_ = atoi(line.c_str() + 2);
+      history_position_ = 0;
+      next_history_ns_ = monotonic_nsec();
+    } else if (line[0] == '?' &&
+               line.find_first_not_of("$ 0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ",
+                                      1) != std::string::npos) {
+      // Not a query the controller knows
+      send("-\r");
+    } else if (line[0] == '?') {
+      history_.push_back(line.substr(1));
+      send(respond(line.substr(1)));
+    } else if (line == "!EX") {
+      fault_flags_ |= 16;
+      send("+\r");
+    } else if (line == "!MG") {
+      fault_flags_ &= ~16;
+      send("+\r");
+    } else if (line[0] == '~' && config_.count(line.substr(1))) {
+      std::stringstream ss;
+      const std::vector<long> &values = config_[line.substr(1)];
+      ss << line.substr(1) << "=";
+      for (size_t i = 0; i < values.size(); ++i) {
+        ss << (i == 0 ? "" : ":") << values[i];
+      }
+      send(ss.str() + "\r");
+    } else if (line[0] == '^' && line.find(' ') != std::string::npos &&
+               config_.count(line.substr(1, line.find(' ') - 1))) {
+      std::vector<long> &values = config_[line.substr(1, line.find(' ') - 1)];
+      std::stringstream ss(line.substr(line.find(' ')));
+      long channel = 1, value;
+      ss >> value;
+      if (ss >> channel) {
+        std::swap(channel, value);
+      }
+      values[channel - 1] = value;
+      send("+\r");
+    } else if (line[0] == '!' || line[0] == '^') {
+      send("+\r");
+    } else {
+      send("-\r");
+    }
+  }
+
+  void run() {
+    ignore_allocations = true;
+    std::string line;
+    char data[256];
+    while (running_) {
+      if (master_ < 0) {
+        struct pollfd pfd = {server_, POLLIN, 0};
+        if (poll(&pfd, 1, 1) > 0) {
+          master_ = accept(server_, NULL, NULL);
+        }
+        continue;
+      }
+      struct pollfd pfd = {master_, POLLIN, 0};
+      if (poll(&pfd, 1, 1) > 0 && (pfd.revents & (POLLIN | POLLHUP))) {
+        ssize_t length = read(master_, data, sizeof(data));
+        if (server_ >= 0 && length <= 0) {
+          // The client went away, wait for the next one
+          close(master_);
+          master_ = -1;
+          echo_pending_.clear();
+          line.clear();
+          continue;
+        }
+        for (ssize_t i = 0; i < length; ++i) {
+          if (data[i] == '\x05') {
+            send("\x06");
+          } else if (data[i] == '\r' || data[i] == '_') {
+            // Like the controller, '_' ends a command as '\r' does, and 
+            // each command runs before the rest of the line is echoed
+            echo(line, data[i]);
+            if (!line.empty()) {
+              execute(line);
+            }
+            line.clear();
+          } else {
+            line += data[i];
+            echo(line, data[i]);
+          }
+        }
+        send("");
+      }
+      if (history_period_ms_ > 0 && !history_.empty() &&
+          monotonic_nsec() >= next_history_ns_) {
+        counts_ += 7;
+        std::string response =
+          respond(history_[history_position_++ % history_.size()]);
+        size_t sent = ++history_sent_;
+        if (corrupt_every_ != 0 && sent % corrupt_every_ == 0) {
+          // Alternate noise in the name and in the values
+          if ((sent / corrupt_every_) % 2 == 0) {
+            response[0] = '\x01';
+          } else {
+            response.insert(response.length() - 1, "\x7f");
+          }
+        }
+        if (drop_every_ == 0 || sent % drop_every_ != 0) {
+          send(response);
+          if (duplicate_every_ != 0 && sent % duplicate_every_ == 0) {
+            send(response);
+          }
+        }
+        next_history_ns_ += (uint64_t)history_period_ms_ * 1000000ULL;
+      }
+    }
+  }
+
+  boost::atomic<bool> running_;
+  int master_, slave_, server_;
+  std::string port_;
+  boost::thread thread_;
+
+  bool echo_;
+  std::string echo_pending_;
+  long fault_flags_;
+  std::vector<std::string> history_;
+  long history_period_ms_;
+  size_t history_position_;
+  uint64_t next_history_ns_;
+  size_t history_sent_;
+  boost::atomic<size_t> drop_every_, duplicate_every_, corrupt_every_;
+  long counts_;
+  boost::atomic<size_t> identity_queries_;
+  std::map<std::string, std::vector<long> > config_;
+};
+
+void countTelemetry(boost::atomic<size_t> *count, const std::string &) {
+  (*count)++;
+}
+
+void collectTokens(boost::mutex *mutex, std::vector<std::string> *tokens,
+                   const std::string &token)
+{
+  boost::mutex::scoped_lock lock(*mutex);
+  tokens->push_back(token);
+}
+
+void slowTelemetry(boost::atomic<size_t> *count, const std::string &) {
+  usleep(20000);
+  (*count)++;
+}
+
+#endif
+
+void countingStep(size_t *calls, const TelemetrySnapshot &telemetry,
+                  MotorCommand &command)
+{
+  (*calls)++;
+  command.motor1_effort = 100;
+  command.send = (telemetry.samples == 0);
+}
+
+TEST(DecodeTests, DecodeChannelsInPlace) {
+  long values[4];
+  std::string raw = "CR=12:-4";
+  ASSERT_EQ(2u, decode_channels(raw.data(), raw.length(), values, 4));
+  EXPECT_EQ(12, values[0]);
+  EXPECT_EQ(-4, values[1]);
+  raw = "V=135:240:5000";
+  ASSERT_EQ(2u, decode_channels(raw.data(), raw.length(), values, 2));
+  EXPECT_EQ(240, values[1]);
+  raw = "C=12:x";
+  EXPECT_EQ(0u, decode_channels(raw.data(), raw.length(), values, 4));
+  raw = "+";
+  EXPECT_EQ(0u, decode_channels(raw.data(), raw.length(), values, 4));
+}
+
+TEST(BandwidthTests, EstimatesTelemetryBandwidth) {
+  // "CR=" plus two 11 character values, a ':' and the carriage return
+  EXPECT_EQ(27u, response_length(queries::encoder_count_relative));
+  EXPECT_EQ(20u, response_length(queries::volts));
+  std::vector<std::string> telemetry;
+  EXPECT_EQ(0.0, telemetry_bandwidth(telemetry, 10));
+  telemetry.push_back("CR");
+  telemetry.push_back("CR");
+  EXPECT_DOUBLE_EQ(2700.0, telemetry_bandwidth(telemetry, 10));
+  EXPECT_EQ(0.0, telemetry_bandwidth(telemetry, 0));
+}
+
+void collectRecord(std::vector<std::string> *records,
+                   const LogRecord &record) {
+  records->push_back(format_log_record(record));
+}
+
+void logRepeatedly(Logger *logger, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    logger->log(log_levels::info, "test", "message");
+  }
+}
+
+TEST(LogTests, EmitsRecordsFromBackgroundThread) {
+  std::vector<std::string> records;
+  Logger logger(1024);
+  logger.setSink(boost::bind(collectRecord, &records, _1));
+  // Without the thread records are emitted directly
+  EXPECT_TRUE(logger.log(log_levels::warning, "direct", "now"));
+  ASSERT_EQ(1u, records.size());
+  EXPECT_EQ("[warning] direct: now", records[0]);
+  EXPECT_FALSE(logger.log(log_levels::debug, "hidden", "not logged"));
+  logger.start(1);
+  boost::thread_group threads;
+  for (size_t i = 0; i < 4; ++i) {
+    threads.create_thread(boost::bind(logRepeatedly, &logger, 100));
+  }
+  threads.join_all();
+  logger.stop();
+  EXPECT_EQ(401u, records.size() + logger.dropped());
+  EXPECT_EQ("[info] test: message", records.back());
+}
+
+void collectRecordAlone(std::vector<std::string> *records,
+                        boost::atomic<int> *inside, bool *overlapped,
+                        const LogRecord &record) {
+  if (++(*inside) > 1) {
+    *overlapped = true;
+  }
+  records->push_back(format_log_record(record));
+  --(*inside);
+}
+
+TEST(LogTests, EmitsEveryRecordOnceAcrossRestarts) {
+  std::vector<std::string> records;
+  boost::atomic<int> inside(0);
+  bool overlapped = false;
+  Logger logger(1024);
+  logger.setSink(boost::bind(collectRecordAlone, &records, &inside,
+                             &overlapped, _1));
+  boost::thread_group threads;
+  for (size_t i = 0; i < 4; ++i) {
+    threads.create_thread(boost::bind(logRepeatedly, &logger, 2000));
+  }
+  // Records are emitted directly and from the thread in turns
+  for (size_t i = 0; i < 50; ++i) {
+    logger.start(1);
+    boost::this_thread::yield();
+    logger.stop();
+  }
+  threads.join_all();
+  EXPECT_FALSE(overlapped);
+  EXPECT_EQ(8000u, records.size() + logger.dropped());
+  // Nothing was left queued to be emitted by the next start
+  logger.start(1);
+  logger.stop();
+  EXPECT_EQ(8000u, records.size() + logger.dropped());
+}
+
+TEST(OdometryTests, RelativeCountsIntegrate) {
+  OdometryIntegrator odom;
+  odom.configure(OdometryIntegrator::relative_counts, 100.0, 50.0);
+  long counts[2] = {10, -5};
+  odom.update(counts, 2, 1000000);
+  odom.update(counts, 2, 1100000);
+  OdometrySnapshot snap = odom.getSnapshot();
+  EXPECT_EQ(20, snap.counts[0]);
+  EXPECT_EQ(-10, snap.counts[1]);
+  EXPECT_DOUBLE_EQ(0.2, snap.position[0]);
+  EXPECT_DOUBLE_EQ(-0.2, snap.position[1]);
+  EXPECT_DOUBLE_EQ(1.0, snap.velocity[0]);
+  EXPECT_DOUBLE_EQ(-1.0, snap.velocity[1]);
+  EXPECT_EQ(1100000u, snap.stamp_us);
+  EXPECT_EQ(2u, snap.samples);
+}
+
+TEST(OdometryTests, AbsoluteCountsWrapAround) {
+  OdometryIntegrator odom;
+  odom.configure(OdometryIntegrator::absolute_counts, 1.0, 1.0);
+  long counts[2] = {2147483600L, -2147483600L};
+  odom.update(counts, 2, 0);
+  // Both counters wrap past the 32 bit limits
+  counts[0] = -2147483596L;
+  counts[1] = 2147483596L;
+  odom.update(counts, 2, 1000);
+  OdometrySnapshot snap = odom.getSnapshot();
+  EXPECT_EQ(2147483700LL, snap.counts[0]);
+  EXPECT_EQ(-2147483700LL, snap.counts[1]);
+  EXPECT_DOUBLE_EQ(100000.0, snap.velocity[0]);
+  odom.reset();
+  EXPECT_EQ(0, odom.getSnapshot().counts[0]);
+}
+
+TEST(OdometryTests, RejectsZeroCountsPerUnit) {
+  OdometryIntegrator odom;
+  EXPECT_THROW(odom.configure(OdometryIntegrator::relative_counts, 0.0, 1.0),
+               std::invalid_argument);
+}
+
+TEST(ControlLoopTests, RunsAtFixedPeriod) {
+  MDC2250 mdc2250;
+  size_t calls = 0;
+  ControlLoop loop(mdc2250, boost::bind(countingStep, &calls, _1, _2));
+  EXPECT_THROW(loop.start(0), std::invalid_argument);
+  loop.start(2000);
+  EXPECT_TRUE(loop.isRunning());
+  boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  loop.stop();
+  EXPECT_FALSE(loop.isRunning());
+  ControlLoopStatistics stats = loop.getStatistics();
+  EXPECT_EQ(calls, stats.cycles);
+  EXPECT_GT(stats.cycles, 10u);
+  // Not connected, so every command fails
+  EXPECT_EQ(stats.cycles, stats.send_failures);
+  EXPECT_GE(stats.jitter_min, 0);
+  EXPECT_GT(stats.cycle_mean, 1000000.0);
+  EXPECT_LT(stats.cycle_mean, 4000000.0);
+}
+
+#if defined(__linux__)
+
+void recordCpu(boost::atomic<int> *cpu) {
+  *cpu = sched_getcpu();
+}
+
+TEST(RealtimeTests, AppliesOptionsOnTheNewThread) {
+  cpu_set_t before, after;
+  pthread_getaffinity_np(pthread_self(), sizeof(before), &before);
+  int cpu = 0;
+  while (!CPU_ISSET(cpu, &before)) {
+    ++cpu;
+  }
+  boost::atomic<int> ran_on(-1);
+  boost::thread thread = startThread(ThreadOptions(0, cpu),
+                                     boost::bind(recordCpu, &ran_on));
+  thread.join();
+  EXPECT_EQ(cpu, ran_on);
+  // The calling thread is never touched
+  pthread_getaffinity_np(pthread_self(), sizeof(after), &after);
+  EXPECT_TRUE(CPU_EQUAL(&before, &after));
+  // Options which can not be applied are reported, the function never runs
+  boost::atomic<int> never(-1);
+  EXPECT_THROW(startThread(ThreadOptions(0, CPU_SETSIZE - 1),
+                           boost::bind(recordCpu, &never)),
+               std::runtime_error);
+  EXPECT_EQ(-1, never);
+}
+
+TEST(MDC2250Tests, ConnectsToSimulatedController) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  EXPECT_TRUE(mdc2250.ping());
+  EXPECT_FALSE(mdc2250.isEstopped());
+  mdc2250.estop();
+  EXPECT_TRUE(mdc2250.isEstopped());
+  mdc2250.clearEstop();
+  EXPECT_FALSE(mdc2250.isEstopped());
+  EXPECT_NO_THROW(mdc2250.commandMotors(500, -500));
+  EXPECT_THROW(mdc2250.commandMotor(3, 0), std::invalid_argument);
+  std::string response, failure_reason;
+  EXPECT_TRUE(mdc2250.issueQuery("?V", Listener::startsWith("V="),
+                                 response, failure_reason));
+  EXPECT_EQ("V=135:240:5000", response);
+  EXPECT_FALSE(mdc2250.issueCommand("BOGUS", failure_reason));
+  mdc2250.disconnect();
+}
+
+void commandRepeatedly(MDC2250 *mdc2250, size_t count, size_t *failures) {
+  for (size_t i = 0; i < count; ++i) {
+    try {
+      mdc2250->commandMotors(100, -100);
+    } catch (std::exception &e) {
+      ++(*failures);
+    }
+  }
+}
+
+TEST(MDC2250Tests, ConcurrentCommandsShareTheWriter) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  size_t failures[4] = {0, 0, 0, 0};
+  boost::thread_group threads;
+  for (size_t i = 0; i < 4; ++i) {
+    threads.create_thread(boost::bind(commandRepeatedly, &mdc2250, 25,
+                                      &failures[i]));
+  }
+  threads.join_all();
+  for (size_t i = 0; i < 4; ++i) {
+    EXPECT_EQ(0u, failures[i]);
+  }
+  WriterStatistics statistics = mdc2250.getWriterStatistics();
+  EXPECT_GE(statistics.messages, 100u);
+  EXPECT_LE(statistics.writes, statistics.messages);
+  EXPECT_EQ(0u, statistics.rejected);
+  EXPECT_EQ(0u, mdc2250.getWriteQueueDepth());
+  mdc2250.disconnect();
+}
+
+void recordEstop(boost::atomic<int> *state, bool estopped) {
+  *state = estopped ? 1 : 0;
+}
+
+TEST(MDC2250Tests, EstopIsWrittenAheadOfQueuedCommands) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  boost::atomic<int> confirmed(-1);
+  mdc2250.setEstopHandler(boost::bind(recordEstop, &confirmed, _1));
+  size_t failures[2] = {0, 0};
+  boost::thread_group threads;
+  for (size_t i = 0; i < 2; ++i) {
+    threads.create_thread(boost::bind(commandRepeatedly, &mdc2250, 25,
+                                      &failures[i]));
+  }
+  boost::this_thread::sleep(boost::posix_time::milliseconds(2));
+  mdc2250.estop();
+  EXPECT_TRUE(mdc2250.isEstopped());
+  threads.join_all();
+  // The estop's acknowledgement must not be taken for a command's
+  EXPECT_EQ(0u, failures[0]);
+  EXPECT_EQ(0u, failures[1]);
+  for (size_t i = 0; i < 100 && confirmed == -1; ++i) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+  EXPECT_EQ(1, confirmed);
+  WriterStatistics statistics = mdc2250.getWriterStatistics();
+  EXPECT_EQ(1u, statistics.urgent_messages);
+  EXPECT_EQ(4u, statistics.urgent_bytes);
+  EXPECT_GT(statistics.urgent_latency_max, 0u);
+  mdc2250.disconnect();
+}
+
+TEST(MDC2250Tests, EstopAcknowledgementWithoutEcho) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  mdc2250.setEcho(false);
+  // Nothing in flight, the estop's '+' must not answer the next command
+  mdc2250.estop();
+  std::string failure_reason;
+  EXPECT_FALSE(mdc2250.issueCommand("BOGUS", failure_reason));
+  EXPECT_TRUE(mdc2250.issueCommand("!MG", failure_reason));
+  // Commands in flight keep their own acknowledgements
+  size_t failures[2] = {0, 0};
+  boost::thread_group threads;
+  for (size_t i = 0; i < 2; ++i) {
+    threads.create_thread(boost::bind(commandRepeatedly, &mdc2250, 25,
+                                      &failures[i]));
+  }
+  boost::this_thread::sleep(boost::posix_time::milliseconds(2));
+  mdc2250.estop();
+  threads.join_all();
+  EXPECT_EQ(0u, failures[0]);
+  EXPECT_EQ(0u, failures[1]);
+  EXPECT_FALSE(mdc2250.issueCommand("BOGUS", failure_reason));
+  EXPECT_TRUE(mdc2250.issueCommand("!MG", failure_reason));
+  // Back to back estops, each with its own acknowledgement
+  for (size_t i = 0; i < 2; ++i) {
+    failures[i] = 0;
+    threads.create_thread(boost::bind(commandRepeatedly, &mdc2250, 25,
+                                      &failures[i]));
+  }
+  boost::this_thread::sleep(boost::posix_time::milliseconds(2));
+  mdc2250.estop();
+  mdc2250.estop();
+  threads.join_all();
+  EXPECT_EQ(0u, failures[0]);
+  EXPECT_EQ(0u, failures[1]);
+  EXPECT_FALSE(mdc2250.issueCommand("BOGUS", failure_reason));
+  EXPECT_TRUE(mdc2250.issueCommand("!MG", failure_reason));
+  mdc2250.disconnect();
+}
+
+TEST(MDC2250Tests, FailedUrgentWriteDoesNotThrow) {
+  std::pair<TransportPtr, TransportPtr> pair =
+    LoopbackTransport::createPair();
+  pair.first->open();
+  // The default exception handler rethrows, writeUrgent must not call it
+  Writer writer;
+  writer.start(*pair.first);
+  pair.second->close();
+  bool written = true;
+  EXPECT_NO_THROW(written = writer.writeUrgent("!EX\r", 4));
+  EXPECT_FALSE(written);
+  writer.stop();
+}
+
+TEST(SetpointTests, CoalescesFastUpdates) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port(), 200));
+  SetpointStreamer setpoints(mdc2250);
+  EXPECT_THROW(setpoints.setMotor(3, 0), std::invalid_argument);
+  EXPECT_THROW(setpoints.set(0, 1001), std::invalid_argument);
+  setpoints.start(20);
+  // 1 kHz updates for half a second
+  for (long i = 0; i < 500; ++i) {
+    setpoints.set(i, -i);
+    boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+  }
+  // Then hold the setpoint long enough to need watchdog refreshes
+  boost::this_thread::sleep(boost::posix_time::milliseconds(400));
+  setpoints.stop();
+  SetpointStatistics statistics = setpoints.getStatistics();
+  EXPECT_EQ(500u, statistics.updates);
+  EXPECT_LE(statistics.sent, 20u);
+  EXPECT_GE(statistics.coalesced, 450u);
+  EXPECT_GE(statistics.refreshes, 2u);
+  EXPECT_EQ(0u, statistics.send_failures);
+  mdc2250.disconnect();
+}
+
+TEST(MDC2250Tests, RejectsTelemetryOverLinkBudget) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  boost::atomic<size_t> count(0);
+  mdc2250.setLinkBudget(0.5, true);
+  // 27 bytes every millisecond is more than twice what 115200 baud carries
+  EXPECT_THROW(mdc2250.setTelemetry("CR", 1,
+                                    boost::bind(countTelemetry, &count, _1)),
+               CommandFailedException);
+  EXPECT_NO_THROW(mdc2250.setTelemetry("CR", 10,
+                                       boost::bind(countTelemetry, &count,
+                                                   _1)));
+  LinkUtilization link = mdc2250.getLinkUtilization();
+  EXPECT_DOUBLE_EQ(11520.0, link.capacity);
+  EXPECT_DOUBLE_EQ(2700.0, link.telemetry);
+  EXPECT_GT(link.receive_utilization, 0.2);
+  EXPECT_LT(link.receive_utilization, 0.5);
+  boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+  link = mdc2250.getLinkUtilization();
+  EXPECT_GT(link.received, 0.0);
+  mdc2250.disconnect();
+}
+
+TEST(MDC2250Tests, TryFunctionsReturnResultCodes) {
+  MDC2250 disconnected;
+  EXPECT_EQ(results::not_connected, disconnected.tryCommandMotors(0, 0).code);
+  EXPECT_EQ(results::invalid_argument,
+            disconnected.tryCommandMotors(1001, 0).code);
+  EXPECT_EQ(results::invalid_argument,
+            disconnected.tryCommandMotor(3, 0).code);
+
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  Result result = mdc2250.tryCommandMotors(10, -10);
+  EXPECT_TRUE(result.ok());
+  EXPECT_STREQ("!M 10 -10", result.command);
+  result = mdc2250.tryIssueCommand("BOGUS");
+  EXPECT_EQ(results::nak, result.code);
+  EXPECT_EQ("Command BOGUS: received a non-acknowledgement ('-').",
+            result.message());
+  std::string response;
+  result = mdc2250.tryIssueQuery("?V", Listener::startsWith("NEVER="),
+                                 response);
+  EXPECT_EQ(results::response_timeout, result.code);
+  EXPECT_TRUE(mdc2250.trySetWatchdog(500).ok());
+  EXPECT_EQ(500u, mdc2250.getWatchdog());
+  mdc2250.disconnect();
+
+  // what() must stay valid for the lifetime of the exception
+  CommandFailedException e("commandMotors", result);
+  const char *what = e.what();
+  std::string other(64, 'x');
+  EXPECT_STREQ("Command commandMotors failed: Command ?V: timed out "
+               "waiting for a response.", what);
+  EXPECT_EQ((int)results::response_timeout, e.error_type());
+}
+
+struct AsyncOutcome {
+  AsyncOutcome() : done(false) {}
+  boost::atomic<bool> done;
+  Result result;
+  std::string response;
+};
+
+void recordAsync(AsyncOutcome *outcome, const Result &result,
+                 const char *response, size_t length)
+{
+  outcome->result = result;
+  outcome->response.assign(response == NULL ? "" : response, length);
+  outcome->done = true;
+}
+
+bool waitForAsync(const AsyncOutcome &outcome) {
+  for (size_t i = 0; i < 200 && !outcome.done; ++i) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(5));
+  }
+  return outcome.done;
+}
+
+TEST(MDC2250Tests, AsyncRequestsCompleteFromListener) {
+  MDC2250 disconnected;
+  AsyncOutcome refused;
+  disconnected.asyncQuery("?V", boost::bind(recordAsync, &refused, _1, _2,
+                                            _3));
+  ASSERT_TRUE(refused.done);
+  EXPECT_EQ(results::not_connected, refused.result.code);
+
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  AsyncOutcome query, command, bogus;
+  mdc2250.asyncQuery("?V", boost::bind(recordAsync, &query, _1, _2, _3));
+  mdc2250.asyncCommand("!G 1 500",
+                       boost::bind(recordAsync, &command, _1, _2, _3));
+  mdc2250.asyncCommand("BOGUS", boost::bind(recordAsync, &bogus, _1, _2, _3));
+  ASSERT_TRUE(waitForAsync(query));
+  ASSERT_TRUE(waitForAsync(command));
+  ASSERT_TRUE(waitForAsync(bogus));
+  EXPECT_TRUE(query.result.ok());
+  EXPECT_EQ("V=135:240:5000", query.response);
+  EXPECT_TRUE(command.result.ok());
+  EXPECT_STREQ("!G 1 500", command.result.command);
+  EXPECT_EQ(results::nak, bogus.result.code);
+
+  AsyncOutcome timeout;
+  mdc2250.asyncNextTelemetry(queries::encoder_count_relative,
+                             boost::bind(recordAsync, &timeout, _1, _2, _3),
+                             50);
+  ASSERT_TRUE(waitForAsync(timeout));
+  EXPECT_EQ(results::response_timeout, timeout.result.code);
+
+  boost::atomic<size_t> count(0);
+  mdc2250.setTelemetry("CR", 10, boost::bind(countTelemetry, &count, _1));
+  AsyncOutcome telemetry;
+  mdc2250.asyncNextTelemetry(queries::encoder_count_relative,
+                             boost::bind(recordAsync, &telemetry, _1, _2,
+                                         _3));
+  ASSERT_TRUE(waitForAsync(telemetry));
+  EXPECT_TRUE(telemetry.result.ok());
+  EXPECT_EQ("CR=10:-10", telemetry.response);
+  EXPECT_EQ(0u, mdc2250.getPendingRequests());
+  mdc2250.disconnect();
+}
+
+#if defined(MDC2250_HAS_COROUTINES)
+
+// Starts eagerly and is never awaited, the test polls its outcome
+struct DetachedCoroutine {
+  struct promise_type {
+    DetachedCoroutine get_return_object() {
+      return DetachedCoroutine();
+    }
+    std::suspend_never initial_suspend() noexcept {
+      return std::suspend_never();
+    }
+    std::suspend_never final_suspend() noexcept {
+      return std::suspend_never();
+    }
+    void return_void() {}
+    void unhandled_exception() {
+      std::terminate();
+    }
+  };
+};
+
+struct CoroutineOutcome {
+  CoroutineOutcome() : done(false) {}
+  boost::atomic<bool> done;
+  AsyncResponse query;
+  AsyncResponse command;
+  boost::thread::id query_thread;
+  boost::thread::id command_thread;
+};
+
+DetachedCoroutine awaitQueryAndCommand(MDC2250 *mdc2250,
+                                       CoroutineOutcome *outcome)
+{
+  outcome->query = co_await mdc2250->query("?V");
+  outcome->query_thread = boost::this_thread::get_id();
+  outcome->command = co_await mdc2250->command("!G 1 500");
+  outcome->command_thread = boost::this_thread::get_id();
+  outcome->done = true;
+}
+
+void recordThread(AsyncOutcome *outcome, boost::thread::id *thread,
+                  const Result &result, const char *response, size_t length)
+{
+  *thread = boost::this_thread::get_id();
+  recordAsync(outcome, result, response, length);
+}
+
+TEST(CoroutineTests, AwaitsQueriesAndCommands) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  // Asynchronous requests complete on the read thread
+  AsyncOutcome ping;
+  boost::thread::id read_thread;
+  mdc2250.asyncQuery("?V", boost::bind(recordThread, &ping, &read_thread,
+                                       _1, _2, _3));
+  ASSERT_TRUE(waitForAsync(ping));
+  EXPECT_NE(boost::this_thread::get_id(), read_thread);
+  CoroutineOutcome outcome;
+  awaitQueryAndCommand(&mdc2250, &outcome);
+  for (size_t i = 0; i < 200 && !outcome.done; ++i) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(5));
+  }
+  ASSERT_TRUE(outcome.done);
+  EXPECT_TRUE(outcome.query.ok());
+  EXPECT_EQ("V=135:240:5000", outcome.query.response);
+  EXPECT_TRUE(outcome.command.ok());
+  EXPECT_STREQ("!G 1 500", outcome.command.result.command);
+  // Resumed on the read thread, unless the response arrived before the
+  // query was handed off, in which case it continued without suspending
+  EXPECT_TRUE(outcome.query_thread == read_thread ||
+              outcome.query_thread == boost::this_thread::get_id());
+  EXPECT_TRUE(outcome.command_thread == read_thread ||
+              outcome.command_thread == outcome.query_thread);
+  mdc2250.disconnect();
+}
+
+DetachedCoroutine awaitWhileDisconnected(MDC2250 *mdc2250, size_t count,
+                                         CoroutineOutcome *outcome)
+{
+  for (size_t i = 0; i < count; ++i) {
+    outcome->query = co_await mdc2250->query("?V");
+    outcome->command = co_await mdc2250->command("!G 1 500");
+  }
+  outcome->done = true;
+}
+
+TEST(CoroutineTests, CompletesSynchronousFailuresWithoutNesting) {
+  MDC2250 mdc2250;
+  CoroutineOutcome outcome;
+  // Each failure continues the coroutine in place rather than resuming it
+  // from the callback, which would overflow the stack
+  awaitWhileDisconnected(&mdc2250, 500000, &outcome);
+  ASSERT_TRUE(outcome.done);
+  EXPECT_EQ(results::not_connected, outcome.query.result.code);
+  EXPECT_EQ(results::not_connected, outcome.command.result.code);
+}
+
+#endif
+
+TEST(ConfigTests, DiffsSnapshots) {
+  ConfigSnapshot current, desired;
+  current.parameters["ALIM"].push_back(750);
+  current.parameters["ALIM"].push_back(750);
+  desired.parameters["ALIM"].push_back(750);
+  desired.parameters["ALIM"].push_back(500);
+  desired.parameters["PWMF"].push_back(160);
+  std::vector<ConfigChange> changes = diff_configuration(current, desired);
+  ASSERT_EQ(2u, changes.size());
+  EXPECT_EQ("^ALIM 2 500", format_config_command(changes[0]));
+  EXPECT_EQ("^PWMF 160", format_config_command(changes[1]));
+  EXPECT_TRUE(diff_configuration(desired, desired).empty());
+}
+
+TEST(ConfigTests, RestoresSnapshotAndCachesIdentity) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  EXPECT_EQ("MDC2250", mdc2250.getControllerModel());
+  Configurator configurator(mdc2250, 4);
+  std::vector<std::string> names;
+  names.push_back("ALIM");
+  names.push_back("MXRPM");
+  names.push_back("PWMF");
+  ConfigSnapshot saved = configurator.read(names);
+  ASSERT_EQ(2u, saved.parameters["ALIM"].size());
+  EXPECT_EQ(3000, saved.parameters["MXRPM"][1]);
+  EXPECT_EQ(180, saved.parameters["PWMF"][0]);
+  // Parameters with more channels than the motors are read whole
+  std::vector<std::string> inputs(1, "DINA");
+  ConfigSnapshot input_modes = configurator.read(inputs);
+  ASSERT_EQ(6u, input_modes.parameters["DINA"].size());
+  EXPECT_EQ(5, input_modes.parameters["DINA"][5]);
+
+  ConfigSnapshot changed = saved;
+  changed.parameters["ALIM"][1] = 400;
+  changed.parameters["PWMF"][0] = 160;
+  EXPECT_EQ(2u, configurator.restore(changed));
+  EXPECT_TRUE(diff_configuration(configurator.read(names),
+                                 changed).empty());
+  EXPECT_EQ(2u, configurator.restore(saved));
+  EXPECT_EQ(0u, configurator.restore(saved));
+
+  std::vector<std::string> unknown(1, "NOPE");
+  ConfigSnapshot ignored;
+  EXPECT_EQ(results::response_timeout,
+            configurator.tryRead(unknown, ignored).code);
+  mdc2250.disconnect();
+
+  // Reconnecting to the same controller doesn't query its identity again
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  EXPECT_EQ(1u, simulated.identityQueries());
+  EXPECT_EQ("DC", mdc2250.getControlUnit());
+  mdc2250.disconnect();
+}
+
+TEST(SharedTelemetryTests, SubscriberSeesEverySample) {
+  std::stringstream name;
+  name << "/mdc2250_tests_" << getpid();
+  TelemetrySubscriber missing;
+  EXPECT_THROW(missing.open(name.str()), std::runtime_error);
+
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  ASSERT_NO_THROW(mdc2250.enableSharedTelemetry(name.str()));
+  TelemetrySubscriber subscriber;
+  ASSERT_NO_THROW(subscriber.open(name.str()));
+  EXPECT_TRUE(subscriber.isPublishing());
+  mdc2250.commandMotors(250, -250);
+  SharedCommandState commands = subscriber.commands();
+  EXPECT_EQ(250, commands.efforts[0]);
+  EXPECT_EQ(-250, commands.efforts[1]);
+  EXPECT_EQ(1u, commands.commands);
+  EXPECT_EQ(0u, commands.estopped);
+
+  boost::atomic<size_t> count(0);
+  mdc2250.setTelemetry("CR,V", 5, boost::bind(countTelemetry, &count, _1));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+  SharedSample sample;
+  size_t samples = 0, volts = 0;
+  uint64_t previous = 0;
+  while (subscriber.next(sample)) {
+    if (samples > 0) {
+      EXPECT_EQ(previous + 1, sample.sequence);
+    }
+    previous = sample.sequence;
+    if (sample.type == queries::volts) {
+      ASSERT_EQ(3u, sample.value.count);
+      EXPECT_EQ(5000, sample.value.values[2]);
+      ++volts;
+    }
+    ++samples;
+  }
+  EXPECT_GT(samples, 10u);
+  EXPECT_GT(volts, 0u);
+  EXPECT_EQ(0u, subscriber.lost());
+  TelemetrySnapshot latest = subscriber.latest();
+  EXPECT_EQ(10, latest.fields[queries::encoder_count_relative].values[0]);
+
+  mdc2250.disableSharedTelemetry();
+  EXPECT_FALSE(subscriber.isPublishing());
+  mdc2250.disconnect();
+}
+
+void collectTelemetry(boost::mutex *mutex, std::vector<std::string> *tokens,
+                      const char *text, size_t length)
+{
+  boost::mutex::scoped_lock lock(*mutex);
+  tokens->push_back(std::string(text, length));
+}
+
+TEST(DaemonTests, SharesControllerAmongClients) {
+  std::stringstream path;
+  path << "/tmp/mdc2250_tests_" << getpid() << ".sock";
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  Daemon daemon(mdc2250);
+  ASSERT_NO_THROW(daemon.start(path.str()));
+
+  DaemonClient planner, teleop;
+  ASSERT_NO_THROW(planner.connect(path.str()));
+  ASSERT_NO_THROW(teleop.connect(path.str()));
+  std::string response;
+  EXPECT_TRUE(planner.query("?V", response).ok());
+  EXPECT_EQ("V=135:240:5000", response);
+  EXPECT_TRUE(teleop.command("!G 1 100").ok());
+  EXPECT_EQ(results::nak, teleop.command("BOGUS").code);
+
+  // The higher priority teleop preempts the planner until it releases
+  EXPECT_TRUE(planner.commandMotors(100, 100, 1).ok());
+  EXPECT_TRUE(teleop.commandMotors(0, 0, 5).ok());
+  EXPECT_EQ(results::busy, planner.commandMotors(200, 200, 1).code);
+  EXPECT_EQ(results::invalid_argument,
+            teleop.commandMotors(2000, 0, 5).code);
+  EXPECT_TRUE(teleop.releaseMotors().ok());
+  EXPECT_TRUE(planner.commandMotors(200, 200, 1).ok());
+
+  // Both subscriptions are merged into one query history
+  boost::mutex mutex;
+  std::vector<std::string> planner_tokens, teleop_tokens;
+  planner.setTelemetryHandler(
+    boost::bind(collectTelemetry, &mutex, &planner_tokens, _1, _2));
+  teleop.setTelemetryHandler(
+    boost::bind(collectTelemetry, &mutex, &teleop_tokens, _1, _2));
+  EXPECT_TRUE(planner.subscribe("CR", 20).ok());
+  EXPECT_TRUE(teleop.subscribe("V", 40).ok());
+  // Only query names go into the merged history
+  EXPECT_EQ(results::invalid_argument, teleop.subscribe("CR,V", 40).code);
+  EXPECT_EQ(results::invalid_argument, teleop.subscribe(" V", 40).code);
+  EXPECT_EQ(results::invalid_argument, teleop.subscribe("V\r", 40).code);
+  EXPECT_EQ(results::invalid_argument, teleop.subscribe("XYZ", 40).code);
+  DaemonStatistics statistics = daemon.getStatistics();
+  EXPECT_EQ("CR,V", statistics.schedule);
+  EXPECT_EQ(10u, statistics.schedule_period_ms);
+  EXPECT_EQ(2u, statistics.clients);
+  boost::this_thread::sleep(boost::posix_time::milliseconds(400));
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    EXPECT_GT(planner_tokens.size(), 5u);
+    EXPECT_GT(teleop_tokens.size(), 3u);
+    for (size_t i = 0; i < planner_tokens.size(); ++i) {
+      EXPECT_EQ("CR=10:-10", planner_tokens[i]);
+    }
+    for (size_t i = 0; i < teleop_tokens.size(); ++i) {
+      EXPECT_EQ("V=135:240:5000", teleop_tokens[i]);
+    }
+  }
+  // The latency the daemon adds to the telemetry, generous since this is 
+  // not an optimized build
+  statistics = daemon.getStatistics();
+  std::cout << "The daemon added " << statistics.telemetry_latency_mean_us;
+  std::cout << " us to the telemetry on average, at most ";
+  std::cout << statistics.telemetry_latency_max_us << " us." << std::endl;
+  EXPECT_GT(statistics.telemetry_sent, 8u);
+  EXPECT_LT(statistics.telemetry_latency_mean_us, 1000.0);
+
+  // A client going away drops its subscriptions
+  teleop.disconnect();
+  for (size_t i = 0; i < 100 && daemon.getStatistics().clients != 1; ++i) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+  EXPECT_TRUE(planner.unsubscribe("CR").ok());
+  statistics = daemon.getStatistics();
+  EXPECT_EQ("", statistics.schedule);
+  EXPECT_EQ(1u, statistics.preempted);
+  planner.disconnect();
+  daemon.stop();
+  mdc2250.disconnect();
+}
+
+TEST(FlagTests, ReportsEachTransition) {
+  FlagMonitor monitor;
+  // Nothing set in the first response, so nothing to report
+  EXPECT_EQ(0u, monitor.update(queries::fault_flag, 0, 1));
+  // Bits, not digits: 17 is overheat and emergency stop
+  EXPECT_EQ(2u, monitor.update(queries::fault_flag, 17, 2));
+  EXPECT_EQ(1u, monitor.update(queries::fault_flag, 1, 3));
+  EXPECT_EQ(0u, monitor.update(queries::fault_flag, 1, 4));
+  EXPECT_EQ(1u, monitor.faults());
+  EXPECT_EQ(0u, monitor.update(queries::volts, 5, 5));
+  EXPECT_STREQ("emergency_stop",
+               fault_flag_to_string(fault_flags::emergency_stop));
+  EXPECT_STREQ("stall_detected",
+               status_flag_to_string(status_flags::stall_detected));
+}
+
+void collectFlag(boost::mutex *mutex, std::vector<FlagEvent> *events,
+                 const FlagEvent &event)
+{
+  boost::mutex::scoped_lock lock(*mutex);
+  events->push_back(event);
+}
+
+TEST(FlagTests, MonitorsFlagsInTelemetry) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  boost::mutex mutex;
+  std::vector<FlagEvent> events;
+  mdc2250.setFlagHandler(boost::bind(collectFlag, &mutex, &events, _1));
+  mdc2250.setFlagMonitoring(true);
+  boost::atomic<size_t> count(0);
+  mdc2250.setTelemetry("CR", 5, boost::bind(countTelemetry, &count, _1));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  EXPECT_EQ((uint32_t)status_flags::serial_mode, mdc2250.getStatusFlags());
+  // Estop behind the library's back, only the telemetry can tell
+  std::string failure_reason;
+  EXPECT_TRUE(mdc2250.issueCommand("!EX", failure_reason));
+  mdc2250.setTelemetry("CR", 5, boost::bind(countTelemetry, &count, _1));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  EXPECT_TRUE(mdc2250.isEstopped());
+  EXPECT_EQ((uint32_t)fault_flags::emergency_stop, mdc2250.getFaultFlags());
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    ASSERT_EQ(2u, events.size());
+    EXPECT_EQ(queries::status_flag, events[0].type);
+    EXPECT_EQ((uint32_t)status_flags::serial_mode, events[0].flag);
+    EXPECT_EQ(queries::fault_flag, events[1].type);
+    EXPECT_EQ((uint32_t)fault_flags::emergency_stop, events[1].flag);
+    EXPECT_TRUE(events[1].set);
+    EXPECT_GT(events[1].stamp_us, events[0].stamp_us);
+  }
+  // The flags added for the monitor do not reach the telemetry callback
+  boost::mutex tokens_mutex;
+  std::vector<std::string> tokens;
+  mdc2250.setTelemetry("CR", 5, boost::bind(collectTokens, &tokens_mutex,
+                                            &tokens, _1));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  {
+    boost::mutex::scoped_lock lock(tokens_mutex);
+    EXPECT_GT(tokens.size(), 5u);
+    for (size_t i = 0; i < tokens.size(); ++i) {
+      EXPECT_EQ(0u, tokens[i].find("CR="));
+    }
+  }
+  // Unless the caller asked for them too
+  mdc2250.setTelemetry("CR,FF", 5, boost::bind(collectTokens, &tokens_mutex,
+                                               &tokens, _1));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  {
+    boost::mutex::scoped_lock lock(tokens_mutex);
+    EXPECT_NE(tokens.end(), std::find(tokens.begin(), tokens.end(), "FF=16"));
+    for (size_t i = 0; i < tokens.size(); ++i) {
+      EXPECT_NE(0u, tokens[i].find("FS="));
+    }
+  }
+  mdc2250.disconnect();
+}
+
+TEST(RttTests, EstimatesLikeTcp) {
+  RttEstimator rtt(10000, 100000, 50000);
+  EXPECT_EQ(50000u, rtt.estimate(rtt_kinds::query).timeout_us);
+  // First sample: SRTT = R, RTTVAR = R / 2, RTO = SRTT + 4 RTTVAR
+  rtt.sample(rtt_kinds::query, 4000);
+  RttEstimate estimate = rtt.estimate(rtt_kinds::query);
+  EXPECT_EQ(4000u, estimate.srtt_us);
+  EXPECT_EQ(2000u, estimate.rttvar_us);
+  EXPECT_EQ(12000u, estimate.timeout_us);
+  EXPECT_EQ(12, rtt.timeoutMs(rtt_kinds::query));
+  rtt.sample(rtt_kinds::query, 12000);
+  estimate = rtt.estimate(rtt_kinds::query);
+  EXPECT_EQ(5000u, estimate.srtt_us);
+  EXPECT_EQ(3500u, estimate.rttvar_us);
+  EXPECT_EQ(19000u, estimate.timeout_us);
+  // Steady round trips converge down to the minimum
+  for (size_t i = 0; i < 50; ++i) {
+    rtt.sample(rtt_kinds::query, 1000);
+  }
+  EXPECT_EQ(10000u, rtt.estimate(rtt_kinds::query).timeout_us);
+  // Timeouts back off up to the maximum
+  for (size_t i = 0; i < 5; ++i) {
+    rtt.timedOut(rtt_kinds::query);
+  }
+  estimate = rtt.estimate(rtt_kinds::query);
+  EXPECT_EQ(100000u, estimate.timeout_us);
+  EXPECT_EQ(5u, estimate.timeouts);
+  // Other kinds are independent
+  EXPECT_EQ(50000u, rtt.estimate(rtt_kinds::command).timeout_us);
+  EXPECT_THROW(rtt.setBounds(0, 10), std::invalid_argument);
+  EXPECT_EQ(rtt_kinds::configuration, rtt_kind_of("^ECHOF 1", 8));
+}
+
+TEST(MDC2250Tests, TimeoutsAdaptToTheLink) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  for (size_t i = 0; i < 20; ++i) {
+    mdc2250.commandMotors(0, 0);
+  }
+  RttEstimate estimate = mdc2250.getRttEstimate(rtt_kinds::command);
+  EXPECT_GE(estimate.samples, 20u);
+  EXPECT_LT(estimate.timeout_us, 200000u);
+  EXPECT_GT(mdc2250.getRttEstimate(rtt_kinds::echo).samples, 20u);
+  // A response which never comes is given up on well before 200 ms
+  mdc2250.setTimeoutBounds(20, 1000);
+  for (size_t i = 0; i < 5; ++i) {
+    std::string response;
+    mdc2250.tryIssueQuery("?V", Listener::startsWith("V="), response);
+  }
+  std::string response;
+  uint64_t start = monotonic_nsec();
+  Result result = mdc2250.tryIssueQuery("?V", Listener::startsWith("NEVER="),
+                                        response);
+  uint64_t elapsed_ms = (monotonic_nsec() - start) / 1000000;
+  EXPECT_EQ(results::response_timeout, result.code);
+  EXPECT_LT(elapsed_ms, 150u);
+  EXPECT_EQ(1u, mdc2250.getRttEstimate(rtt_kinds::query).timeouts);
+  EXPECT_THROW(mdc2250.setTimeoutBounds(50, 10), std::invalid_argument);
+  mdc2250.disconnect();
+}
+
+TEST(MDC2250Tests, SlowCallbacksDoNotDelayCommands) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  boost::atomic<size_t> telemetry_count(0);
+  EXPECT_THROW(mdc2250.setCallbackExecutor(callback_executors::thread_pool,
+                                           0),
+               std::invalid_argument);
+  mdc2250.setCallbackExecutor(callback_executors::thread_pool, 2);
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  mdc2250.setTelemetry("C,V", 5,
+                       boost::bind(slowTelemetry, &telemetry_count, _1));
+  usleep(100000);
+  // The callbacks fall behind, but commands are still acknowledged
+  for (size_t i = 0; i < 20; ++i) {
+    EXPECT_TRUE(mdc2250.tryCommandMotors(0, 0).ok());
+  }
+  CallbackStatistics statistics = mdc2250.getCallbackStatistics();
+  EXPECT_GT(statistics.executed, 0u);
+  EXPECT_GE(statistics.duration_max_us, 20000u);
+  EXPECT_GE(statistics.duration_total_us, statistics.duration_max_us);
+  EXPECT_GT(statistics.max_queue_depth, 1u);
+  mdc2250.disconnect();
+  EXPECT_GT((size_t)telemetry_count, 0u);
+}
+
+TEST(TransportTests, LoopbackPairCarriesBytes) {
+  std::pair<TransportPtr, TransportPtr> pair =
+    LoopbackTransport::createPair(4, 11520.0, 5);
+  TransportPtr a = pair.first, b = pair.second;
+  ASSERT_NO_THROW(a->open());
+  uint8_t buffer[16];
+  // Nothing to read, so the read times out
+  EXPECT_EQ(0u, b->read(buffer, sizeof(buffer)));
+  a->write((const uint8_t *)"ab", 2);
+  ASSERT_EQ(2u, b->read(buffer, sizeof(buffer)));
+  EXPECT_EQ(0, std::memcmp(buffer, "ab", 2));
+  // A write larger than the ring blocks until the other end reads it
+  boost::thread writer(boost::bind(&Transport::write, b.get(),
+                                   (const uint8_t *)"0123456789", 10));
+  std::string received;
+  while (received.size() < 10) {
+    size_t length = a->read(buffer, sizeof(buffer));
+    received.append((const char *)buffer, length);
+  }
+  writer.join();
+  EXPECT_EQ("0123456789", received);
+  EXPECT_EQ("loopback:a", a->name());
+  EXPECT_EQ(11520.0, a->bytesPerSecond());
+  b->close();
+  EXPECT_FALSE(a->isOpen());
+  EXPECT_THROW(a->write((const uint8_t *)"x", 1), TransportException);
+  EXPECT_THROW(a->open(), TransportException);
+}
+
+TEST(MDC2250Tests, FailedConnectLeavesNothingRunning) {
+  // Nothing answers on the other end, so the ping fails
+  std::pair<TransportPtr, TransportPtr> pair =
+    LoopbackTransport::createPair();
+  MDC2250 mdc2250;
+  EXPECT_THROW(mdc2250.connect(pair.first), ConnectionFailedException);
+  EXPECT_FALSE(pair.first->isOpen());
+  EXPECT_EQ(results::not_connected, mdc2250.tryIssueCommand("!MG").code);
+  // The writer and listener were stopped, so they start on the new port
+  SimulatedMDC2250 simulated;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  EXPECT_TRUE(mdc2250.ping());
+  mdc2250.disconnect();
+}
+
+TEST(TransportTests, CreatesTransportsFromPortNames) {
+  EXPECT_EQ("/dev/ttyUSB0", createTransport("/dev/ttyUSB0")->name());
+  TransportPtr tcp = createTransport("tcp://gateway.local:4001");
+  EXPECT_EQ("tcp://gateway.local:4001", tcp->name());
+  EXPECT_EQ(11520.0, tcp->bytesPerSecond());
+  EXPECT_FALSE(tcp->isOpen());
+  EXPECT_THROW(createTransport("tcp://gateway.local"), TransportException);
+  EXPECT_THROW(createTransport("tcp://:4001"), TransportException);
+  EXPECT_THROW(createTransport("tcp://gateway.local:99999"),
+               TransportException);
+  // The baud rate and read timeout come from the caller
+  ReadLatencyProfile profile;
+  profile.read_timeout_ms = 50;
+  tcp = createTransport("tcp://gateway.local:4001", profile, 9600);
+  EXPECT_EQ(960.0, tcp->bytesPerSecond());
+  EXPECT_EQ(50u, tcp->readTimeoutMs());
+  TransportPtr serial = createTransport("/dev/ttyUSB0", profile, 9600);
+  EXPECT_EQ(960.0, serial->bytesPerSecond());
+  // Failures of the serial library surface as transport failures
+  serial = createTransport("/nonexistent/mdc2250", profile);
+  EXPECT_THROW(serial->open(), TransportException);
+}
+
+namespace {
+
+void readUntilClosed(TransportPtr transport, bool *returned) {
+  uint8_t buffer[64];
+  try {
+    transport->read(buffer, sizeof(buffer));
+  } catch (TransportException &) {}
+  *returned = true;
+}
+
+}
+
+TEST(TransportTests, ClosesTcpWhileReading) {
+  SimulatedMDC2250 simulated(true);
+  ReadLatencyProfile profile;
+  profile.read_timeout_ms = 10000;
+  TransportPtr tcp = createTransport(simulated.port(), profile);
+  ASSERT_NO_THROW(tcp->open());
+  bool returned = false;
+  boost::thread reader(boost::bind(readUntilClosed, tcp, &returned));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+  // The blocked read is woken, rather than left polling a closed descriptor
+  uint64_t start = monotonic_nsec();
+  tcp->close();
+  reader.join();
+  EXPECT_TRUE(returned);
+  EXPECT_LT(monotonic_nsec() - start, 1000000000ULL);
+  EXPECT_FALSE(tcp->isOpen());
+}
+
+TEST(TransportTests, ProbesReadLatencyProfiles) {
+  EXPECT_TRUE(read_latency_profile(latency_profiles::lowest_latency)
+                .low_latency);
+  EXPECT_EQ(1u, read_latency_profile(latency_profiles::balanced)
+                  .min_read_bytes);
+  MDC2250 unconnected;
+  EXPECT_THROW(unconnected.measureReadLatency(), CommandFailedException);
+  SimulatedMDC2250 simulated;
+  std::vector<ReadLatencyProfile> profiles;
+  profiles.push_back(read_latency_profile(latency_profiles::lowest_latency));
+  profiles.push_back(read_latency_profile(latency_profiles::balanced));
+  profiles.push_back(read_latency_profile(latency_profiles::fewest_wakeups));
+  std::vector<ReadLatencyMeasurement> measurements =
+    probeReadLatency(simulated.port(), profiles, 50);
+  ASSERT_EQ(3u, measurements.size());
+  const char *names[] = {"lowest latency", "balanced", "fewest wakeups"};
+  for (size_t i = 0; i < measurements.size(); ++i) {
+    const ReadLatencyMeasurement &measurement = measurements[i];
+    EXPECT_EQ(50u, measurement.samples);
+    // A pseudo terminal has no serial driver to make low latency
+    EXPECT_FALSE(measurement.low_latency);
+    EXPECT_LE(measurement.min_us, measurement.p99_us);
+    EXPECT_LE(measurement.p99_us, measurement.max_us);
+    EXPECT_GE(measurement.wakeups_per_ping, 1.0);
+    std::cout << "Read latency with " << names[i] << ": ";
+    std::cout << measurement.mean_us << " us mean, " << measurement.p99_us;
+    std::cout << " us p99, " << measurement.wakeups_per_second;
+    std::cout << " wakeups per second." << std::endl;
+  }
+  // Waiting for more bytes delays a lone reply by the inter byte timeout
+  EXPECT_GT(measurements[2].mean_us, measurements[1].mean_us);
+}
+
+TEST(MDC2250Tests, ConnectsThroughTcpGateway) {
+  SimulatedMDC2250 simulated(true);
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  EXPECT_EQ("MDC2250", mdc2250.getControllerModel());
+  EXPECT_TRUE(mdc2250.tryCommandMotors(10, -10).ok());
+  std::string response;
+  EXPECT_TRUE(mdc2250.tryIssueQuery("?V", Listener::startsWith("V="),
+                                    response).ok());
+  EXPECT_EQ("V=135:240:5000", response);
+  EXPECT_EQ(11520.0, mdc2250.getLinkUtilization().capacity);
+  mdc2250.disconnect();
+  // The gateway accepts the reconnect, and the identity is cached
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  EXPECT_EQ(1u, simulated.identityQueries());
+  mdc2250.disconnect();
+  // Nothing listens on the port once the gateway is gone
+  MDC2250 refused;
+  EXPECT_THROW(refused.connect("tcp://127.0.0.1:1"),
+               ConnectionFailedException);
+}
+
+TEST(ModelTests, DecodesFixedSizeReadings) {
+  typedef Controller<MDC2250Traits> Dual;
+  typedef Controller<SDC2130Traits> Single;
+  size_t dual_amps = QueryValues<MDC2250Traits, queries::motor_amps>::count;
+  size_t single_temperatures =
+    QueryValues<SDC2130Traits, queries::temperature>::count;
+  EXPECT_EQ(2u, dual_amps);
+  EXPECT_EQ(2u, single_temperatures);
+  EXPECT_TRUE((SupportsQuery<MDC2250Traits, queries::volts>::value));
+  EXPECT_FALSE((SupportsQuery<MDC2250Traits,
+                              queries::brushless_motor_speed_rpm>::value));
+
+  Dual::Reading<queries::volts> volts;
+  EXPECT_TRUE(Dual::decode(std::string("V=135:240:5000").c_str(), 14, volts));
+  EXPECT_TRUE(volts.valid);
+  EXPECT_EQ(240, volts.values[1]);
+  EXPECT_EQ(5000, volts.values[2]);
+  Dual::Reading<queries::motor_amps> dual;
+  EXPECT_TRUE(Dual::decode("A=12:-3", 7, dual));
+  EXPECT_EQ(-3, dual.values[1]);
+  // Too few or too many values, or another query, are rejected
+  EXPECT_FALSE(Dual::decode("A=12", 4, dual));
+  EXPECT_FALSE(dual.valid);
+  EXPECT_FALSE(Dual::decode("A=1:2:3", 7, dual));
+  EXPECT_FALSE(Dual::decode("BA=1:2", 6, dual));
+  Single::Reading<queries::motor_amps> single;
+  EXPECT_TRUE(Single::decode("A=12", 4, single));
+  EXPECT_EQ(12, single.values[0]);
+  EXPECT_FALSE(Single::decode("A=12:-3", 7, single));
+}
+
+TEST(ModelTests, CommandsAndReadsTypedChannels) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  boost::atomic<size_t> telemetry_count(0);
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  Controller<MDC2250Traits> dual(mdc2250);
+  EXPECT_TRUE(dual.command<2>(300).ok());
+  EXPECT_EQ(results::invalid_argument, dual.command<1>(2000).code);
+  Controller<MDC2250Traits>::Efforts efforts = {{100, -100}};
+  EXPECT_TRUE(dual.commandAll(efforts).ok());
+  Controller<MDC2250Traits>::Reading<queries::volts> volts;
+  EXPECT_TRUE(dual.query(volts).ok());
+  EXPECT_TRUE(volts.valid);
+  EXPECT_EQ(135, volts.values[0]);
+  EXPECT_GT(volts.stamp_us, 0u);
+  // The simulated controller has two channels
+  Controller<SDC2130Traits> single(mdc2250);
+  Controller<SDC2130Traits>::Reading<queries::motor_amps> amps;
+  EXPECT_EQ(results::invalid_response, single.query(amps).code);
+  Controller<SDC2130Traits>::Efforts effort = {{250}};
+  EXPECT_TRUE(single.commandAll(effort).ok());
+  mdc2250.setTelemetry("A", 5,
+                       boost::bind(countTelemetry, &telemetry_count, _1));
+  usleep(100000);
+  Controller<MDC2250Traits>::Reading<queries::motor_amps> latest =
+    dual.latest<queries::motor_amps>();
+  EXPECT_TRUE(latest.valid);
+  EXPECT_EQ(12, latest.values[0]);
+  EXPECT_EQ(-3, latest.values[1]);
+  mdc2250.disconnect();
+}
+
+size_t countOccurrences(const std::string &text, const std::string &what) {
+  size_t count = 0;
+  for (size_t i = text.find(what); i != std::string::npos;
+       i = text.find(what, i + 1)) {
+    count++;
+  }
+  return count;
+}
+
+TEST(TraceTests, RecordsTheProtocolPath) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  enableTracing();
+  clearTrace();
+  for (size_t i = 0; i < 10; ++i) {
+    mdc2250.commandMotors(10, -10);
+  }
+  disableTracing();
+  mdc2250.commandMotors(0, 0);
+  std::stringstream ss;
+  EXPECT_GT(writeChromeTrace(ss), 0u);
+  std::string trace = ss.str();
+  EXPECT_EQ(0u, trace.find("{\"traceEvents\":["));
+  // Each command begins and ends on the calling thread
+  EXPECT_EQ(10u, countOccurrences(trace, "\"name\":\"command\""
+                                         ",\"cat\":\"mdc2250\",\"ph\":\"B\""));
+  EXPECT_EQ(10u, countOccurrences(trace, "\"name\":\"command\""
+                                         ",\"cat\":\"mdc2250\",\"ph\":\"E\""));
+  EXPECT_GE(countOccurrences(trace, "\"name\":\"serial_write\""), 10u);
+  EXPECT_GE(countOccurrences(trace, "\"name\":\"serial_read\""), 1u);
+  EXPECT_GE(countOccurrences(trace, "\"name\":\"filter_matched\""), 20u);
+  EXPECT_GE(countOccurrences(trace, "\"name\":\"filter_wait\""), 40u);
+  EXPECT_NE(std::string::npos, trace.find("\"name\":\"mdc2250_read\""));
+  EXPECT_NE(std::string::npos, trace.find("\"name\":\"mdc2250_writer\""));
+  mdc2250.disconnect();
+  clearTrace();
+}
+
+void recordTraceEvents(size_t events, uint64_t *per_event) {
+  uint64_t start = monotonic_nsec();
+  for (size_t i = 0; i < events; ++i) {
+    MDC2250_TRACE_INSTANT("benchmark", i);
+  }
+  *per_event = (monotonic_nsec() - start) / events;
+}
+
+TEST(TraceTests, RecordingIsCheap) {
+  // A new thread, so it gets a buffer of the given size
+  enableTracing(1024);
+  uint64_t per_event = 0;
+  boost::thread thread(boost::bind(recordTraceEvents, 1000000, &per_event));
+  thread.join();
+  disableTracing();
+  std::cout << "Recording a trace event took " << per_event << " ns.";
+  std::cout << std::endl;
+  // Generous, this is not an optimized build
+  EXPECT_LT(per_event, 250u);
+  // Only the newest events of the ring are kept
+  std::stringstream ss;
+  EXPECT_EQ(1024u, writeChromeTrace(ss));
+  clearTrace();
+  std::stringstream empty;
+  EXPECT_EQ(0u, writeChromeTrace(empty));
+}
+
+TEST(TraceTests, ReusesTheBuffersOfExitedThreads) {
+  enableTracing(1024);
+  clearTrace();
+  uint64_t per_event = 0;
+  for (size_t i = 0; i < 20; ++i) {
+    boost::thread thread(boost::bind(recordTraceEvents, 1, &per_event));
+    thread.join();
+  }
+  disableTracing();
+  // Each thread took over the buffer of the one before, and cleared it
+  std::stringstream ss;
+  EXPECT_EQ(1u, writeChromeTrace(ss));
+  EXPECT_LE(countOccurrences(ss.str(), "\"thread_name\""), 2u);
+  clearTrace();
+}
+
+void storeBroadcast(boost::mutex *mutex, boost::condition_variable *condition,
+                    BroadcastResult *stored, const BroadcastResult &result)
+{
+  boost::mutex::scoped_lock lock(*mutex);
+  *stored = result;
+  condition->notify_all();
+}
+
+TEST(GroupTests, BroadcastsToEveryController) {
+  SimulatedMDC2250 front_simulated, rear_simulated;
+  MDC2250 front, rear;
+  ASSERT_NO_THROW(front.connect(front_simulated.port()));
+  ASSERT_NO_THROW(rear.connect(rear_simulated.port(), 1000, false));
+  broadcast_modes::BroadcastMode modes[] = {broadcast_modes::back_to_back,
+                                            broadcast_modes::parallel};
+  for (size_t m = 0; m < 2; ++m) {
+    ControllerGroup group(modes[m]);
+    EXPECT_EQ(0u, group.add(front));
+    EXPECT_EQ(1u, group.add(rear));
+    std::vector<MotorEfforts> efforts(2, MotorEfforts(100, -100));
+    for (size_t i = 0; i < 10; ++i) {
+      BroadcastResult result = group.broadcast(efforts);
+      ASSERT_EQ(2u, result.results.size());
+      EXPECT_TRUE(result.ok());
+      EXPECT_LT(result.skew_ns, result.ack_ns);
+    }
+    BroadcastStatistics statistics = group.getStatistics();
+    EXPECT_EQ(10u, statistics.broadcasts);
+    EXPECT_EQ(0u, statistics.failures);
+    EXPECT_GE(statistics.skew_max_ns, statistics.skew_last_ns);
+    std::cout << "Mean skew of " << (m == 0 ? "back to back" : "parallel");
+    std::cout << " broadcasts: " << statistics.skew_mean_ns << " ns.";
+    std::cout << std::endl;
+
+    // An invalid effort only fails its own controller
+    efforts[1].motor2 = 5000;
+    BroadcastResult result = group.broadcast(efforts);
+    EXPECT_FALSE(result.ok());
+    EXPECT_TRUE(result.results[0].ok());
+    EXPECT_EQ(results::invalid_argument, result.results[1].code);
+    EXPECT_EQ(1u, group.getStatistics().failures);
+    EXPECT_THROW(group.broadcast(std::vector<MotorEfforts>(1)),
+                 std::invalid_argument);
+
+    // The asynchronous version calls back once both acknowledged
+    boost::mutex mutex;
+    boost::condition_variable condition;
+    BroadcastResult stored;
+    group.broadcastAsync(std::vector<MotorEfforts>(2),
+                         boost::bind(storeBroadcast, &mutex, &condition,
+                                     &stored, _1));
+    boost::mutex::scoped_lock lock(mutex);
+    while (stored.results.empty()) {
+      condition.wait(lock);
+    }
+    EXPECT_TRUE(stored.ok());
+  }
+  front.disconnect();
+  rear.disconnect();
+}
+
+TEST(TelemetryHealthTests, FollowsTheCycle) {
+  TelemetryHealthMonitor monitor;
+  std::vector<queries::QueryType> cycle;
+  cycle.push_back(queries::encoder_count_absolute);
+  cycle.push_back(queries::volts);
+  cycle.push_back(queries::motor_amps);
+  EXPECT_EQ(0u, monitor.update(queries::volts, true, true, 0));
+  monitor.start(cycle, 10);
+  EXPECT_EQ(1u, monitor.update(queries::encoder_count_absolute, true, true,
+                               0));
+  EXPECT_EQ(2u, monitor.update(queries::volts, true, true, 10000));
+  EXPECT_EQ(3u, monitor.update(queries::motor_amps, true, true, 20000));
+  EXPECT_EQ(4u, monitor.update(queries::encoder_count_absolute, true, true,
+                               30000));
+  // The volts were lost, then the amps arrive twice
+  EXPECT_EQ(6u, monitor.update(queries::motor_amps, true, true, 50000));
+  EXPECT_EQ(6u, monitor.update(queries::motor_amps, true, true, 50100));
+  EXPECT_EQ(7u, monitor.update(queries::encoder_count_absolute, true, true,
+                               60000));
+  // Garbled beyond recognition, in place of the volts
+  EXPECT_EQ(8u, monitor.update(queries::unknown, false, false, 70000));
+  EXPECT_EQ(9u, monitor.update(queries::motor_amps, true, true, 80000));
+  // Neither part of the cycle nor garbled
+  EXPECT_EQ(0u, monitor.update(queries::fault_flag, true, true, 81000));
+  EXPECT_EQ(0u, monitor.update(queries::unknown, false, true, 82000));
+  EXPECT_EQ(10u, monitor.update(queries::encoder_count_absolute, true, true,
+                                120000));
+  monitor.stop();
+  EXPECT_EQ(0u, monitor.update(queries::volts, true, true, 130000));
+
+  TelemetryHealth health = monitor.health();
+  EXPECT_EQ(3u, health.cycle_length);
+  EXPECT_EQ(8u, health.received);
+  EXPECT_EQ(1u, health.lost);
+  EXPECT_EQ(1u, health.duplicated);
+  EXPECT_EQ(1u, health.corrupted);
+  EXPECT_DOUBLE_EQ(0.2, health.loss_rate);
+  EXPECT_EQ(3u, health.cycles);
+  EXPECT_EQ(1u, health.gaps);
+  EXPECT_EQ(40000u, health.longest_gap_us);
+  EXPECT_EQ(8u, health.interval.samples);
+  EXPECT_EQ(40000u, health.interval.max_us);
+  ASSERT_EQ(3u, health.fields.size());
+  EXPECT_EQ(queries::encoder_count_absolute, health.fields[0].type);
+  EXPECT_EQ(4u, health.fields[0].received);
+  EXPECT_DOUBLE_EQ(0.0, health.fields[0].loss_rate);
+  EXPECT_DOUBLE_EQ(40000.0, health.fields[0].interval.mean_us);
+  EXPECT_EQ(60000u, health.fields[0].interval.max_us);
+  EXPECT_GT(health.fields[0].interval.jitter_us, 0.0);
+  EXPECT_EQ(1u, health.fields[1].lost);
+  EXPECT_EQ(1u, health.fields[1].corrupted);
+  EXPECT_DOUBLE_EQ(2.0 / 3.0, health.fields[1].loss_rate);
+  EXPECT_EQ(1u, health.fields[2].duplicated);
+}
+
+TEST(TelemetryHealthTests, DetectsFaultsOnTheLink) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  boost::atomic<size_t> count(0);
+  simulated.setHistoryFaults(7, 11, 13);
+  mdc2250.setTelemetry("C,V,A", 5, boost::bind(countTelemetry, &count, _1));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(600));
+  TelemetryHealth health = mdc2250.getTelemetryHealth();
+  EXPECT_EQ(3u, health.fields.size());
+  EXPECT_GT(health.lost, 0u);
+  EXPECT_GT(health.duplicated, 0u);
+  EXPECT_GT(health.corrupted, 0u);
+  // One in 7 dropped and one in 13 garbled
+  EXPECT_GT(health.loss_rate, 0.1);
+  EXPECT_LT(health.loss_rate, 0.4);
+  EXPECT_GT(health.interval.mean_us, 2500.0);
+  TelemetrySnapshot telemetry = mdc2250.getTelemetry();
+  EXPECT_GT(telemetry.fields[queries::volts].sequence, 0u);
+  EXPECT_EQ(135, telemetry.fields[queries::volts].values[0]);
+
+  // Reconfiguring starts over
+  simulated.setHistoryFaults(0, 0, 0);
+  mdc2250.setTelemetry("C,V,A", 5, boost::bind(countTelemetry, &count, _1));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+  health = mdc2250.getTelemetryHealth();
+  EXPECT_GT(health.received, 0u);
+  EXPECT_EQ(0u, health.lost);
+  EXPECT_EQ(0u, health.duplicated);
+  EXPECT_EQ(0u, health.corrupted);
+  mdc2250.disconnect();
+}
+
+void stampTelemetry(boost::mutex *mutex, std::vector<uint64_t> *stamps,
+                    const std::string &)
+{
+  boost::mutex::scoped_lock lock(*mutex);
+  stamps->push_back(monotonic_usec());
+}
+
+TEST(MDC2250Tests, BatchesCommandsOnOneLine) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  std::vector<std::string> commands;
+  commands.push_back("!G 1 100");
+  commands.push_back("^ALIM 1 600");
+  commands.push_back("%NOPE");
+  commands.push_back("!G 2 -100");
+  std::vector<Result> command_results;
+  Result result = mdc2250.tryIssueCommands(commands, command_results);
+  EXPECT_EQ(results::nak, result.code);
+  EXPECT_STREQ("%NOPE", result.command);
+  ASSERT_EQ(4u, command_results.size());
+  EXPECT_TRUE(command_results[0].ok());
+  EXPECT_TRUE(command_results[1].ok());
+  EXPECT_EQ(results::nak, command_results[2].code);
+  EXPECT_TRUE(command_results[3].ok());
+  std::string response, failure_reason;
+  EXPECT_TRUE(mdc2250.issueQuery("~ALIM", Listener::startsWith("ALIM="),
+                                 response, failure_reason));
+  EXPECT_EQ("ALIM=600:750", response);
+
+  // More than fits on one line, each command counts toward the link budget
+  uint64_t start = monotonic_usec();
+  mdc2250.getLinkUtilization();
+  boost::this_thread::sleep(boost::posix_time::milliseconds(110));
+  commands.assign(20, "!G 1 100");
+  EXPECT_TRUE(mdc2250.tryIssueCommands(commands, command_results).ok());
+  EXPECT_EQ(20u, command_results.size());
+  EXPECT_TRUE(mdc2250.tryIssueCommand("!G 1 0").ok());
+  boost::this_thread::sleep(boost::posix_time::milliseconds(110));
+  LinkUtilization link = mdc2250.getLinkUtilization();
+  EXPECT_GE(link.commands, 21e6 / (double)(monotonic_usec() - start));
+
+  // Without the echo only the acknowledgements come back
+  mdc2250.setEcho(false);
+  commands.assign(3, "!G 1 100");
+  commands[1] = "%NOPE";
+  EXPECT_EQ(results::nak,
+            mdc2250.tryIssueCommands(commands, command_results).code);
+  EXPECT_TRUE(command_results[0].ok());
+  EXPECT_EQ(results::nak, command_results[1].code);
+  EXPECT_TRUE(command_results[2].ok());
+  EXPECT_TRUE(mdc2250.tryIssueCommand("!G 1 0").ok());
+  mdc2250.setEcho(true);
+
+  commands.assign(1, "?A");
+  EXPECT_EQ(results::invalid_argument,
+            mdc2250.tryIssueCommands(commands, command_results).code);
+  commands.assign(1, "!G 1 1_!G 2 1");
+  EXPECT_EQ(results::invalid_argument,
+            mdc2250.tryIssueCommands(commands, command_results).code);
+  commands.assign(max_batch_commands + 1, "!G 1 1");
+  EXPECT_EQ(results::invalid_argument,
+            mdc2250.tryIssueCommands(commands, command_results).code);
+  mdc2250.disconnect();
+}
+
+TEST(MDC2250Tests, ReconfiguresTelemetryQuickly) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  boost::mutex mutex;
+  std::vector<uint64_t> stamps;
+  mdc2250.setTelemetry("C,V,CR,A", 5,
+                       boost::bind(stampTelemetry, &mutex, &stamps, _1));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  uint64_t start = monotonic_usec();
+  mdc2250.setTelemetry("A,V,C,CR", 5,
+                       boost::bind(stampTelemetry, &mutex, &stamps, _1));
+  uint64_t elapsed = monotonic_usec() - start;
+  boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  TelemetrySwitch telemetry_switch = mdc2250.getTelemetrySwitch();
+  EXPECT_EQ(4u, telemetry_switch.queries);
+  EXPECT_GT(telemetry_switch.stopped_us, telemetry_switch.probe_us);
+  EXPECT_LE(telemetry_switch.stopped_us, elapsed);
+  EXPECT_EQ(telemetry_switch.stopped_us + 10000,
+            telemetry_switch.gap_estimate_us);
+  uint64_t longest = 0;
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    for (size_t i = 1; i < stamps.size(); ++i) {
+      longest = std::max(longest, stamps[i] - stamps[i - 1]);
+    }
+  }
+  // The callbacks run on another thread, allow for its scheduling
+  EXPECT_LT(longest, telemetry_switch.gap_estimate_us + 20000);
+  EXPECT_LT(elapsed, 100000u);
+  std::cout << "Switching four fields stopped the telemetry for ";
+  std::cout << telemetry_switch.stopped_us << " us, the longest gap was ";
+  std::cout << longest << " us." << std::endl;
+
+  // A rejected query leaves the previous telemetry running
+  boost::atomic<size_t> count(0);
+  EXPECT_THROW(mdc2250.setTelemetry("C,bogus", 5,
+                                    boost::bind(countTelemetry, &count, _1)),
+               CommandFailedException);
+  size_t before;
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    before = stamps.size();
+  }
+  boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    EXPECT_GT(stamps.size(), before + 4);
+  }
+  EXPECT_EQ(4u, mdc2250.getTelemetryHealth().cycle_length);
+
+  // Without echo, old telemetry still in flight must not answer the probe
+  mdc2250.setEcho(false);
+  mdc2250.setTelemetry("CR", 1, boost::bind(countTelemetry, &count, _1));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+  EXPECT_NO_THROW(mdc2250.setTelemetry("CR,V", 5,
+                                       boost::bind(countTelemetry, &count,
+                                                   _1)));
+  EXPECT_EQ(2u, mdc2250.getTelemetrySwitch().queries);
+  EXPECT_EQ(2u, mdc2250.getTelemetryHealth().cycle_length);
+  mdc2250.disconnect();
+}
+
+TEST(AggregateTests, KeepsRollingWindows) {
+  TelemetryAggregator aggregator;
+  EXPECT_THROW(aggregator.addSignal(queries::unknown, 0),
+               std::invalid_argument);
+  EXPECT_EQ(0u, aggregator.addSignal(queries::motor_amps, 1));
+  EXPECT_EQ(1u, aggregator.addSignal(queries::temperature, 0));
+  EXPECT_THROW(aggregator.getSnapshot(2), std::invalid_argument);
+  // A ramp of one per sample, a sample every 10 ms
+  double sum_squares = 0.0;
+  for (long i = 0; i < 200; ++i) {
+    long values[2] = {-i, i};
+    aggregator.update(queries::motor_amps, values, 2, 1000000 + i * 10000);
+    sum_squares += (double)(i * i);
+  }
+  // Too few channels for the signal
+  long values[1] = {1000};
+  aggregator.update(queries::motor_amps, values, 1, 3000000);
+  AggregateSnapshot amps = aggregator.getSnapshot(0, 2990000);
+  EXPECT_EQ(queries::motor_amps, amps.type);
+  EXPECT_EQ(1u, amps.channel);
+  EXPECT_EQ(200u, amps.samples);
+  EXPECT_DOUBLE_EQ(199.0, amps.latest);
+  // Ten full buckets and the one being filled
+  const WindowStatistics &short_window =
+    amps.windows[aggregate_windows::milliseconds_100];
+  EXPECT_EQ(11u, short_window.samples);
+  EXPECT_DOUBLE_EQ(189.0, short_window.min);
+  EXPECT_DOUBLE_EQ(199.0, short_window.max);
+  EXPECT_DOUBLE_EQ(194.0, short_window.mean);
+  EXPECT_NEAR(100.0, short_window.rate, 1e-9);
+  const WindowStatistics &second = amps.windows[aggregate_windows::seconds_1];
+  EXPECT_EQ(110u, second.samples);
+  EXPECT_DOUBLE_EQ(90.0, second.min);
+  const WindowStatistics &long_window =
+    amps.windows[aggregate_windows::seconds_10];
+  EXPECT_EQ(200u, long_window.samples);
+  EXPECT_DOUBLE_EQ(0.0, long_window.min);
+  EXPECT_DOUBLE_EQ(99.5, long_window.mean);
+  EXPECT_NEAR(std::sqrt(sum_squares / 200.0), long_window.rms, 1e-9);
+  EXPECT_NEAR(100.0, long_window.rate, 1e-9);
+  // Without new samples the windows age out, the latest value stays
+  amps = aggregator.getSnapshot(0, 3990000);
+  EXPECT_EQ(0u, amps.windows[aggregate_windows::milliseconds_100].samples);
+  EXPECT_DOUBLE_EQ(0.0, amps.windows[aggregate_windows::milliseconds_100].max);
+  EXPECT_EQ(10u, amps.windows[aggregate_windows::seconds_1].samples);
+  EXPECT_DOUBLE_EQ(190.0, amps.windows[aggregate_windows::seconds_1].min);
+  EXPECT_EQ(200u, amps.windows[aggregate_windows::seconds_10].samples);
+  amps = aggregator.getSnapshot(0, 14000000);
+  EXPECT_EQ(0u, amps.windows[aggregate_windows::seconds_10].samples);
+  EXPECT_EQ(200u, amps.samples);
+  EXPECT_DOUBLE_EQ(199.0, amps.latest);
+  EXPECT_EQ(2990000u, amps.stamp_us);
+  // Nothing received for the other signal
+  EXPECT_EQ(0u, aggregator.getSnapshot(1).samples);
+  for (size_t i = 2; i < max_aggregate_signals; ++i) {
+    aggregator.addSignal(queries::volts, 0);
+  }
+  EXPECT_THROW(aggregator.addSignal(queries::volts, 0),
+               std::invalid_argument);
+  aggregator.clear();
+  EXPECT_EQ(0u, aggregator.size());
+}
+
+TEST(AggregateTests, AggregatesDecodedTelemetry) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  ASSERT_NO_THROW(mdc2250.connect(simulated.port()));
+  size_t amps = mdc2250.aggregateTelemetry(queries::motor_amps);
+  size_t volts = mdc2250.aggregateTelemetry(queries::volts, 1);
+  boost::atomic<size_t> count(0);
+  mdc2250.setTelemetry("A,V", 5, boost::bind(countTelemetry, &count, _1));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(300));
+  AggregateSnapshot aggregate = mdc2250.getAggregate(amps);
+  const WindowStatistics &window =
+    aggregate.windows[aggregate_windows::milliseconds_100];
+  EXPECT_GT(window.samples, 2u);
+  EXPECT_DOUBLE_EQ(12.0, window.min);
+  EXPECT_DOUBLE_EQ(12.0, window.max);
+  EXPECT_DOUBLE_EQ(12.0, window.rms);
+  EXPECT_DOUBLE_EQ(0.0, window.rate);
+  aggregate = mdc2250.getAggregate(volts);
+  EXPECT_DOUBLE_EQ(240.0,
+                   aggregate.windows[aggregate_windows::seconds_1].mean);
+  EXPECT_GE(aggregate.windows[aggregate_windows::seconds_10].samples,
+            aggregate.windows[aggregate_windows::seconds_1].samples);
+  mdc2250.disconnect();
+}
+
+TEST(MDC2250Tests, SteadyStateDoesNotAllocate) {
+  SimulatedMDC2250 simulated;
+  MDC2250 mdc2250;
+  boost::atomic<size_t> telemetry_count(0);
+  mdc2250.connect(simulated.port());
+  mdc2250.enableOdometry(OdometryIntegrator::absolute_counts, 100.0, 100.0);
+  mdc2250.setTelemetry("C,V,CR,A", 5,
+                       boost::bind(countTelemetry, &telemetry_count, _1));
+  // Warm up every path once before counting
+  mdc2250.commandMotors(0, 0);
+  mdc2250.commandMotor(1, 0);
+  usleep(100000);
+  size_t telemetry_before = telemetry_count;
+  uint64_t samples_before = mdc2250.getOdometry().samples;
+
+  allocation_count = 0;
+  count_allocations = true;
+  uint64_t end = monotonic_nsec() + 10000000000ULL;
+  long effort = 0;
+  while (monotonic_nsec() < end) {
+    effort = (effort + 17) % 1000;
+    mdc2250.commandMotors(effort, -effort);
+    mdc2250.commandMotor(2, effort);
+    TelemetrySnapshot telemetry = mdc2250.getTelemetry();
+    OdometrySnapshot odometry = mdc2250.getOdometry();
+    (void)telemetry;
+    (void)odometry;
+    usleep(5000);
+  }
+  count_allocations = false;
+
+  EXPECT_EQ(0u, (size_t)allocation_count);
+  EXPECT_GT((size_t)telemetry_count, telemetry_before + 500);
+  EXPECT_GT(mdc2250.getOdometry().samples, samples_before + 100);
+  mdc2250.disconnect();
+}
 
+#endif
 
 }  // namespace
 